@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "wfs_ioctl.h"
+
+/*
+  wfs-add-disk : adds disk images to a mounted wfs
+  usage : ./wfs-add-disk <file in the mount> <disk image>...
+  any file in the mount will do, the ioctl goes to the volume
+  images must be blank (e.g. from create_disk.sh) and as large as the other disks
+  the volume stays usable while the new disk is filled in the background,
+  a RAID0 volume takes one disk at a time (the next one once its reshape is done)
+*/
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        printf("usage: %s <file in the mount> <disk image>...\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    int cnt_failed = 0;
+    for (int i = 2; i < argc; i++)
+    {
+        // the file system resolves the path from its own working directory
+        struct wfs_add_disk add;
+        memset(&add, 0, sizeof(add));
+        char image_path[PATH_MAX];
+        if (realpath(argv[i], image_path) == NULL || strlen(image_path) >= WFS_PATH_MAX)
+        {
+            printf("Error: bad image path %s\n", argv[i]);
+            cnt_failed++;
+            continue;
+        }
+        strncpy(add.path, image_path, WFS_PATH_MAX - 1);
+
+        if (ioctl(fd, WFS_IOC_ADD_DISK, &add) < 0)
+        {
+            perror(argv[i]);
+            cnt_failed++;
+            continue;
+        }
+        printf("%s: added as disk %d\n", argv[i], add.disk_order);
+    }
+    close(fd);
+    return (cnt_failed > 0) ? 1 : 0;
+}
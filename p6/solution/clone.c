@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "wfs_ioctl.h"
+
+/*
+  wfs-clone : server-side copy of a file inside a mounted wfs
+  usage : ./wfs-clone <mount point> <source> <destination>
+  source and destination are paths inside the mount, e.g. /a/f or /.snapshots/s1/a/f
+  whole blocks are shared with the source instead of being copied
+*/
+
+int main(int argc, char *argv[])
+{
+    if (argc != 4)
+    {
+        printf("usage: %s <mount point> <source> <destination>\n", argv[0]);
+        return 1;
+    }
+
+    struct wfs_clone_range range;
+    memset(&range, 0, sizeof(range));
+    if (strlen(argv[2]) >= WFS_PATH_MAX)
+    {
+        printf("Error: source path too long\n");
+        return 1;
+    }
+    strncpy(range.src_path, argv[2], WFS_PATH_MAX - 1);
+
+    char dst_path[4096];
+    snprintf(dst_path, sizeof(dst_path), "%s/%s", argv[1], argv[3]);
+    int fd = open(dst_path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        perror(dst_path);
+        return 1;
+    }
+
+    int res = ioctl(fd, WFS_IOC_CLONE_RANGE, &range);
+    if (res < 0)
+    {
+        perror("WFS_IOC_CLONE_RANGE");
+        close(fd);
+        return 1;
+    }
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,174 @@
+#include <stdint.h>
+#include <string.h>
+#include "compress.h"
+
+#define LZ_MIN_MATCH  (4)
+#define LZ_HASH_BITS  (12)
+#define LZ_MAX_OFFSET (65535)
+#define LZ_LAST_LITERALS (5)   // the format ends every block with at least 5 literals
+#define LZ_MF_LIMIT   (12)     // no match starts in the last 12 bytes
+
+// hash of the 4 bytes at p
+static unsigned int lz_hash(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// writes the 255-continued tail of a length field, returns -1 if dst is full
+static int lz_put_length(unsigned char **op, unsigned char *oend, int len)
+{
+    while (len >= 255)
+    {
+        if (*op >= oend)
+            return -1;
+        *(*op)++ = 255;
+        len -= 255;
+    }
+    if (*op >= oend)
+        return -1;
+    *(*op)++ = len;
+    return 0;
+}
+
+/****************************************
+writes one sequence: literals from anchor, then a match (match_len 0 : last literals only)
+returns -1 if dst is full
+*****************************************/
+static int lz_put_sequence(unsigned char **op, unsigned char *oend, const unsigned char *anchor, int lit_len, int offset, int match_len)
+{
+    if (*op >= oend)
+        return -1;
+
+    int ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+    unsigned char *token = (*op)++;
+    *token = ((lit_len < 15) ? lit_len : 15) << 4;
+    if (lit_len >= 15 && lz_put_length(op, oend, lit_len - 15) == -1)
+        return -1;
+
+    if (oend - *op < lit_len)
+        return -1;
+    memcpy(*op, anchor, lit_len);
+    *op += lit_len;
+
+    if (match_len == 0)
+        return 0;
+
+    if (oend - *op < 2)
+        return -1;
+    *(*op)++ = offset & 0xff;
+    *(*op)++ = offset >> 8;
+    *token |= (ml < 15) ? ml : 15;
+    if (ml >= 15 && lz_put_length(op, oend, ml - 15) == -1)
+        return -1;
+    return 0;
+}
+
+int wfs_lz_compress(const char *src, int src_len, char *dst, int dst_cap)
+{
+    const unsigned char *base = (const unsigned char *)src;
+    const unsigned char *ip = base;
+    const unsigned char *anchor = base;
+    const unsigned char *iend = base + src_len;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *oend = op + dst_cap;
+
+    int table[1 << LZ_HASH_BITS];
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++)
+        table[i] = -1;
+
+    while (src_len > LZ_MF_LIMIT && ip < iend - LZ_MF_LIMIT)
+    {
+        unsigned int h = lz_hash(ip);
+        int ref = table[h];
+        table[h] = ip - base;
+
+        const unsigned char *match = base + ref;
+        if (ref < 0 || ip - match > LZ_MAX_OFFSET || memcmp(match, ip, LZ_MIN_MATCH) != 0)
+        {
+            ip++;
+            continue;
+        }
+
+        // extend : the match as far as the last literals allow
+        int match_len = LZ_MIN_MATCH;
+        while (ip + match_len < iend - LZ_LAST_LITERALS && match[match_len] == ip[match_len])
+            match_len++;
+
+        if (lz_put_sequence(&op, oend, anchor, ip - anchor, ip - match, match_len) == -1)
+            return 0;
+        ip += match_len;
+        anchor = ip;
+    }
+
+    if (lz_put_sequence(&op, oend, anchor, iend - anchor, 0, 0) == -1)
+        return 0;
+    return op - (unsigned char *)dst;
+}
+
+int wfs_lz_decompress(const char *src, int src_len, char *dst, int dst_cap)
+{
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *iend = ip + src_len;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *oend = op + dst_cap;
+
+    while (ip < iend)
+    {
+        unsigned int token = *ip++;
+
+        // literals
+        int lit_len = token >> 4;
+        if (lit_len == 15)
+        {
+            unsigned int b = 255;
+            while (b == 255)
+            {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                lit_len += b;
+            }
+        }
+        if (lit_len > iend - ip || lit_len > oend - op)
+            return -1;
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+
+        // check : the last sequence has no match
+        if (ip == iend)
+            break;
+
+        // match
+        if (iend - ip < 2)
+            return -1;
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - (unsigned char *)dst)
+            return -1;
+
+        int match_len = token & 15;
+        if (match_len == 15)
+        {
+            unsigned int b = 255;
+            while (b == 255)
+            {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                match_len += b;
+            }
+        }
+        match_len += LZ_MIN_MATCH;
+        if (match_len > oend - op)
+            return -1;
+
+        // copy : byte by byte, the match may overlap the output
+        const unsigned char *match = op - offset;
+        while (match_len-- > 0)
+            *op++ = *match++;
+    }
+    return op - (unsigned char *)dst;
+}
@@ -0,0 +1,17 @@
+#ifndef WFS_COMPRESS_H
+#define WFS_COMPRESS_H
+
+/*
+  Block compressor for wfs compressed extents.
+  The output is the LZ4 block format (token, literals, 16-bit offset,
+  match length), produced by a single-pass greedy matcher. It is built in
+  so wfs keeps building without extra libraries.
+*/
+
+// returns the compressed size, 0 if the result would not fit in dst_cap bytes
+int wfs_lz_compress(const char *src, int src_len, char *dst, int dst_cap);
+
+// returns the decompressed size, -1 if src is malformed or does not fit in dst_cap bytes
+int wfs_lz_decompress(const char *src, int src_len, char *dst, int dst_cap);
+
+#endif
@@ -0,0 +1,975 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "wfs.h"
+
+/*
+  wfs-convert : converts an unmounted wfs between RAID0, RAID1 and RAID1v in place
+  usage : ./wfs-convert [-j threads] -r <0|1|1v> <disk image>...
+          ./wfs-convert -u <disk image>...
+  every disk of the volume is needed, the disks stay the same
+  mirrors -> RAID0 : every disk holds every block already, only the data bitmaps are rebuilt
+  RAID0 -> mirrors : each block keeps its index when no other disk uses it, the others move
+  to an index free on every disk, then every block is copied to every disk
+  RAID1v copies that lose the vote are repaired first
+  progress is kept in <disk 0 image>.convert, running the same command again resumes a cut short run
+  -u upgrades a volume of the original layout (no superblock magic) so wfs mounts it, see upgrade()
+*/
+
+// ############################################ Global Variables #####################################
+
+// disks in disk_order
+int cnt_disks = 0;
+void *disk_ptr[MAX_DISKS] = {NULL};
+off_t disk_size[MAX_DISKS] = {0};
+char *disk_path[MAX_DISKS] = {NULL};
+
+// superblock of disk 0
+struct wfs_sb *sb = NULL;
+
+int cnt_threads = 1;
+
+// placement of the layout being walked : striped over stripe_cnt disks (0 : mirrors, all on disk 0)
+int stripe_cnt = 0;
+int stripe_meta = 0;
+int inode_copies = 0;
+
+#define CONVERT_MAGIC (0x77666363)
+
+// phases, each one can be run again after a crash
+#define PH_REPAIR    (1)   // RAID1v : copies that lose the vote are rewritten
+#define PH_MOVE      (2)   // RAID0 -> mirrors : blocks whose index is taken are copied to their new index
+#define PH_REMAP     (3)   // RAID0 -> mirrors : block pointers are switched to the new indices
+#define PH_REPLICATE (4)   // RAID0 -> mirrors : every block and inode is copied to every disk
+#define PH_SUPER     (5)   // bitmaps and superblocks are rewritten
+#define PH_DONE      (6)
+
+// units of work done between two checkpoints
+#define BATCH (8192)
+
+// progress file
+struct convert_checkpoint
+{
+    int magic;
+    int from_mode;
+    int to_mode;
+    int cnt_meta_disks;  // placement of the RAID0 source
+    int inode_copies;
+    int phase;
+    int cursor;          // units of the phase done
+    int cnt_moves;       // struct convert_move entries following
+};
+
+// a block of a RAID0 disk given a new index
+struct convert_move
+{
+    int disk_num;
+    int from;
+    int to;
+};
+
+struct convert_checkpoint ckpt;
+struct convert_move *moves = NULL;
+char ckpt_path[4096];
+
+// owner of each index once the disks are mirrors, OWNER_META : the same block on every disk already
+#define OWNER_FREE (-1)
+#define OWNER_META (-2)
+int *owner = NULL;
+
+// ############################################ Disk access #####################################
+
+char *get_block(int disk_num, int d_block_index)
+{
+    struct wfs_sb *disk_sb = (struct wfs_sb *)disk_ptr[disk_num];
+    return (char *)disk_ptr[disk_num] + disk_sb->d_blocks_ptr + (off_t)d_block_index * BLOCK_SIZE;
+}
+
+__u_int *get_bitmap(int disk_num, off_t ptr)
+{
+    return (__u_int *)((char *)disk_ptr[disk_num] + ptr);
+}
+
+int is_inode_allocated(int inode_num)
+{
+    return (get_bitmap(0, sb->i_bitmap_ptr)[inode_num / 32] >> (inode_num % 32)) & 1;
+}
+
+// disk holding copy `copy` of an inode in the layout being walked
+int inode_copy_disk(int inode_num, int copy)
+{
+    if (stripe_cnt == 0 || stripe_meta > 0 || inode_copies == cnt_disks)
+        return copy;
+    return (inode_num + copy) % cnt_disks;
+}
+
+struct wfs_inode *get_inode(int disk_num, int inode_num)
+{
+    struct wfs_sb *disk_sb = (struct wfs_sb *)disk_ptr[disk_num];
+    return (struct wfs_inode *)((char *)disk_ptr[disk_num] + disk_sb->i_blocks_ptr + (off_t)inode_num * BLOCK_SIZE);
+}
+
+void sync_disks()
+{
+    for (int i = 0; i < cnt_disks; i++)
+        msync(disk_ptr[i], disk_size[i], MS_SYNC);
+}
+
+// ############################################ Placement #####################################
+
+/*
+  The same rules as wfs for a volume of disks of one size: RAID0 stripes
+  block i of a file over the disks (over the data disks with metadata
+  disks), directories and indirect blocks over the metadata disks if
+  there are any. Mirrors keep everything at one index, read from disk 0.
+*/
+
+int data_disk(int index_in_blocks)
+{
+    if (stripe_cnt == 0)
+        return 0;
+    if (stripe_meta == 0)
+        return index_in_blocks % stripe_cnt;
+    return stripe_meta + index_in_blocks % (stripe_cnt - stripe_meta);
+}
+
+int ind_disk()
+{
+    if (stripe_cnt == 0)
+        return 0;
+    return IND_BLOCK % ((stripe_meta > 0) ? stripe_meta : stripe_cnt);
+}
+
+int block_disk(struct wfs_inode *inode_ptr, int index_in_blocks)
+{
+    if (stripe_cnt > 0 && stripe_meta > 0 && S_ISDIR(inode_ptr->mode))
+        return index_in_blocks % stripe_meta;
+    return data_disk(index_in_blocks);
+}
+
+// walks the RAID0 source layout
+void use_source_layout()
+{
+    stripe_cnt = (ckpt.from_mode == 0) ? cnt_disks : 0;
+    stripe_meta = ckpt.cnt_meta_disks;
+    inode_copies = ckpt.inode_copies;
+}
+
+// ############################################ Block maps #####################################
+
+/****************************************
+calls visit on every block pointer of a block map with the disk the block is on
+the indirect block pointer is visited first, its entries are read from where it points afterwards
+*****************************************/
+void walk_block_map(struct wfs_inode *inode_ptr, void (*visit)(off_t *block_ptr, int disk_num))
+{
+    for (int i = 0; i < IND_BLOCK; i++)
+    {
+        if (inode_ptr->blocks[i] >= 0)
+            visit(&inode_ptr->blocks[i], block_disk(inode_ptr, i));
+    }
+    if (inode_ptr->blocks[IND_BLOCK] < 0)
+        return;
+
+    visit(&inode_ptr->blocks[IND_BLOCK], ind_disk());
+    off_t *indirect_block_ptr = (off_t *)get_block(ind_disk(), inode_ptr->blocks[IND_BLOCK]);
+    for (int k = 0; k < BLOCK_SIZE / sizeof(off_t); k++)
+    {
+        if (indirect_block_ptr[k] >= 0)
+            visit(&indirect_block_ptr[k], data_disk(k + IND_BLOCK));
+    }
+}
+
+/****************************************
+walks the block map of every allocated inode and of every snapshot copy
+all_copies : every copy of an inode and every disk's snapshot tables, else the first copy only
+*****************************************/
+void walk_volume(void (*visit)(off_t *block_ptr, int disk_num), int all_copies)
+{
+    for (int i = 0; i < sb->num_inodes; i++)
+    {
+        if (!is_inode_allocated(i))
+            continue;
+        int cnt_copies = (stripe_cnt == 0) ? cnt_disks : (stripe_meta > 0 ? stripe_meta : inode_copies);
+        for (int copy = 0; copy < (all_copies ? cnt_copies : 1); copy++)
+            walk_block_map(get_inode(inode_copy_disk(i, copy), i), visit);
+    }
+
+    for (int disk_num = 0; disk_num < (all_copies ? cnt_disks : 1); disk_num++)
+    {
+        for (off_t header = sb->snap_head; header != -1;)
+        {
+            struct wfs_snap *hdr = (struct wfs_snap *)get_block(disk_num, header);
+            int cnt = 0;
+            for (off_t table = hdr->table; table != -1 && cnt < hdr->cnt_inodes;)
+            {
+                struct wfs_snap_table *table_ptr = (struct wfs_snap_table *)get_block(disk_num, table);
+                for (int i = 0; i < SNAP_INODES_PER_BLOCK && cnt < hdr->cnt_inodes; i++, cnt++)
+                    walk_block_map(&table_ptr->inodes[i], visit);
+                table = table_ptr->next;
+            }
+            header = hdr->next;
+        }
+    }
+}
+
+// marks the data blocks of a region a grow relocated into the data blocks
+void mark_meta_region(off_t ptr, size_t len)
+{
+    if (ptr < sb->d_blocks_ptr)
+        return;
+    int first = (ptr - sb->d_blocks_ptr) / BLOCK_SIZE;
+    for (int i = first; i < first + (len + BLOCK_SIZE - 1) / BLOCK_SIZE; i++)
+        owner[i] = OWNER_META;
+}
+
+// marks the blocks held at the same index on every disk : snapshot blocks and relocated regions
+void mark_meta_blocks()
+{
+    for (off_t header = sb->snap_head; header != -1;)
+    {
+        struct wfs_snap *hdr = (struct wfs_snap *)get_block(0, header);
+        owner[header] = OWNER_META;
+        for (off_t table = hdr->table; table != -1;)
+        {
+            owner[table] = OWNER_META;
+            table = ((struct wfs_snap_table *)get_block(0, table))->next;
+        }
+        header = hdr->next;
+    }
+    mark_meta_region(sb->i_bitmap_ptr, sb->num_inodes / 8);
+    mark_meta_region(sb->d_bitmap_ptr, sb->num_data_blocks / 8);
+    mark_meta_region(sb->i_blocks_ptr, sb->num_inodes * BLOCK_SIZE);
+}
+
+// ############################################ Visitors #####################################
+
+// per disk and index, 1 if a block map uses it
+unsigned char *used = NULL;
+
+// per disk and index, the new index of a moved block, -1 if it stays
+int *remap = NULL;
+
+int cnt_conflicts = 0;
+
+void visit_mark_used(off_t *block_ptr, int disk_num)
+{
+    used[(size_t)disk_num * sb->num_data_blocks + *block_ptr] = 1;
+}
+
+void visit_remap(off_t *block_ptr, int disk_num)
+{
+    int to = remap[(size_t)disk_num * sb->num_data_blocks + *block_ptr];
+    if (to >= 0)
+        *block_ptr = to;
+}
+
+void visit_set_owner(off_t *block_ptr, int disk_num)
+{
+    if (owner[*block_ptr] != OWNER_FREE && owner[*block_ptr] != disk_num)
+        cnt_conflicts++;
+    owner[*block_ptr] = disk_num;
+}
+
+// ############################################ Checkpoint #####################################
+
+int save_checkpoint()
+{
+    char tmp_path[4200];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", ckpt_path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    if (write(fd, &ckpt, sizeof(ckpt)) != sizeof(ckpt) ||
+        write(fd, moves, ckpt.cnt_moves * sizeof(struct convert_move)) != ckpt.cnt_moves * sizeof(struct convert_move) ||
+        fsync(fd) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return rename(tmp_path, ckpt_path);
+}
+
+// returns 1 if a checkpoint was loaded, 0 if there is none, -1 if it is unreadable
+int load_checkpoint()
+{
+    int fd = open(ckpt_path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    if (read(fd, &ckpt, sizeof(ckpt)) != sizeof(ckpt) || ckpt.magic != CONVERT_MAGIC || ckpt.cnt_moves < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    moves = malloc((ckpt.cnt_moves + 1) * sizeof(struct convert_move));
+    if (read(fd, moves, ckpt.cnt_moves * sizeof(struct convert_move)) != ckpt.cnt_moves * sizeof(struct convert_move))
+    {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 1;
+}
+
+// ############################################ Parallel copies #####################################
+
+struct span
+{
+    int from;
+    int to;
+    void (*work)(int unit);
+};
+
+void *run_span(void *arg)
+{
+    struct span *span = (struct span *)arg;
+    for (int unit = span->from; unit < span->to; unit++)
+        span->work(unit);
+    return NULL;
+}
+
+/****************************************
+runs work on every unit from cursor up to cnt_units, split over the threads
+the disks are synced and the cursor saved after every batch
+*****************************************/
+int run_phase(void (*work)(int unit), int cnt_units)
+{
+    pthread_t tids[64];
+    struct span spans[64];
+    int started[64];
+
+    while (ckpt.cursor < cnt_units)
+    {
+        int end = (ckpt.cursor + BATCH < cnt_units) ? ckpt.cursor + BATCH : cnt_units;
+        int per_thread = (end - ckpt.cursor + cnt_threads - 1) / cnt_threads;
+        for (int t = 0; t < cnt_threads; t++)
+        {
+            spans[t].from = ckpt.cursor + t * per_thread;
+            spans[t].to = (spans[t].from + per_thread < end) ? spans[t].from + per_thread : end;
+            spans[t].work = work;
+            started[t] = 0;
+            if (spans[t].from >= spans[t].to)
+                continue;
+            // check : no thread, the batch still gets done
+            if (pthread_create(&tids[t], NULL, run_span, &spans[t]) == 0)
+                started[t] = 1;
+            else
+                run_span(&spans[t]);
+        }
+        for (int t = 0; t < cnt_threads; t++)
+        {
+            if (started[t])
+                pthread_join(tids[t], NULL);
+        }
+
+        sync_disks();
+        ckpt.cursor = end;
+        if (save_checkpoint() != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// RAID1v : rewrites the copies of one index that lose the vote, free blocks too so the mirrors end up equal
+void repair_block(int d_block_index)
+{
+    int max_count = 0;
+    int winner = 0;
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        int count = 0;
+        for (int j = 0; j < cnt_disks; j++)
+        {
+            if (memcmp(get_block(i, d_block_index), get_block(j, d_block_index), BLOCK_SIZE) == 0)
+                count++;
+        }
+        if (count > max_count)
+        {
+            max_count = count;
+            winner = i;
+        }
+    }
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        if (memcmp(get_block(winner, d_block_index), get_block(i, d_block_index), BLOCK_SIZE) != 0)
+            memcpy(get_block(i, d_block_index), get_block(winner, d_block_index), BLOCK_SIZE);
+    }
+}
+
+// copies a moved block to its new index on its own disk, the old one stays until replication
+void move_block(int move_num)
+{
+    struct convert_move *move = &moves[move_num];
+    memcpy(get_block(move->disk_num, move->to), get_block(move->disk_num, move->from), BLOCK_SIZE);
+}
+
+// copies one index from the disk owning it to every other disk, a free one from disk 0
+void replicate_block(int d_block_index)
+{
+    int src = owner[d_block_index];
+    if (src == OWNER_META)
+        return;
+    if (src == OWNER_FREE)
+        src = 0;
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        if (i != src)
+            memcpy(get_block(i, d_block_index), get_block(src, d_block_index), BLOCK_SIZE);
+    }
+}
+
+// copies an inode slot from its first copy to every disk
+void replicate_inode(int inode_num)
+{
+    int src = inode_copy_disk(inode_num, 0);
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        if (i != src)
+            memcpy(get_inode(i, inode_num), get_inode(src, inode_num), BLOCK_SIZE);
+    }
+}
+
+// ############################################ Conversion #####################################
+
+/****************************************
+RAID0 -> mirrors : picks the final index of every block
+disk 0 keeps its blocks, the other disks keep theirs when no earlier disk took the index
+the rest go to indices no disk uses
+returns 0, or -1 if there are not enough free indices
+*****************************************/
+int plan_moves()
+{
+    size_t cnt_blocks = sb->num_data_blocks;
+    used = calloc(cnt_disks * cnt_blocks, 1);
+    for (int i = 0; i < cnt_blocks; i++)
+        owner[i] = OWNER_FREE;
+    mark_meta_blocks();
+    use_source_layout();
+    walk_volume(visit_mark_used, 0);
+
+    moves = malloc((cnt_disks * cnt_blocks + 1) * sizeof(struct convert_move));
+    ckpt.cnt_moves = 0;
+    for (int d = 0; d < cnt_disks; d++)
+    {
+        for (int i = 0; i < cnt_blocks; i++)
+        {
+            if (!used[d * cnt_blocks + i])
+                continue;
+            if (owner[i] == OWNER_FREE)
+                owner[i] = d;
+            else
+                moves[ckpt.cnt_moves++] = (struct convert_move){d, i, -1};
+        }
+    }
+
+    // new indices : used by no disk and no metadata
+    int next = 0;
+    for (int m = 0; m < ckpt.cnt_moves; m++)
+    {
+        for (;; next++)
+        {
+            if (next == cnt_blocks)
+                return -1;
+            int in_use = (owner[next] != OWNER_FREE);
+            for (int d = 0; d < cnt_disks && !in_use; d++)
+                in_use = used[d * cnt_blocks + next];
+            if (!in_use)
+                break;
+        }
+        moves[m].to = next;
+        owner[next] = moves[m].disk_num;
+        next++;
+    }
+    return 0;
+}
+
+/****************************************
+rewrites the data bitmaps and superblocks of every disk for the target mode
+mirrors share one bitmap, RAID0 disks mark the blocks placed on them
+*****************************************/
+void write_superblocks()
+{
+    size_t cnt_blocks = sb->num_data_blocks;
+    memset(used, 0, cnt_disks * cnt_blocks);
+
+    // the target layout : pointers are final by now
+    stripe_cnt = (ckpt.to_mode == 0) ? cnt_disks : 0;
+    stripe_meta = 0;
+    inode_copies = cnt_disks;
+    walk_volume(visit_mark_used, 0);
+    for (int i = 0; i < cnt_blocks; i++)
+        owner[i] = OWNER_FREE;
+    mark_meta_blocks();
+
+    for (int d = 0; d < cnt_disks; d++)
+    {
+        struct wfs_sb *disk_sb = (struct wfs_sb *)disk_ptr[d];
+        __u_int *d_bitmap = get_bitmap(d, disk_sb->d_bitmap_ptr);
+        size_t cnt_used = 0;
+        memset(d_bitmap, 0, cnt_blocks / 8);
+        for (int i = 0; i < cnt_blocks; i++)
+        {
+            int is_used = (owner[i] == OWNER_META);
+            for (int j = 0; j < cnt_disks && !is_used; j++)
+                is_used = used[j * cnt_blocks + i] && (ckpt.to_mode != 0 || j == d);
+            if (is_used)
+            {
+                d_bitmap[i / 32] |= 1u << (i % 32);
+                cnt_used++;
+            }
+        }
+
+        disk_sb->raid_mode = ckpt.to_mode;
+        disk_sb->disk_order = d;
+        disk_sb->total_disks = cnt_disks;
+        disk_sb->free_data_blocks = cnt_blocks - cnt_used;
+        disk_sb->inode_copies = 0;
+        disk_sb->cnt_meta_disks = 0;
+        disk_sb->missing_disks = 0;
+        memset(disk_sb->wi_bitmap, 0, sizeof(disk_sb->wi_bitmap));
+        disk_sb->reshape_old_disks = 0;
+        disk_sb->reshape_inode = 0;
+        disk_sb->disk_blocks = 0;
+    }
+}
+
+/****************************************
+runs the conversion in ckpt from its current phase to the end
+returns 0 or -1
+*****************************************/
+int convert()
+{
+    size_t cnt_blocks = sb->num_data_blocks;
+    if (used == NULL)
+        used = calloc(cnt_disks * cnt_blocks, 1);
+
+    while (ckpt.phase != PH_DONE)
+    {
+        int res = 0;
+        switch (ckpt.phase)
+        {
+        case PH_REPAIR:
+            res = run_phase(repair_block, cnt_blocks);
+            break;
+        case PH_MOVE:
+            res = run_phase(move_block, ckpt.cnt_moves);
+            break;
+        case PH_REMAP:
+            remap = malloc(cnt_disks * cnt_blocks * sizeof(int));
+            memset(remap, -1, cnt_disks * cnt_blocks * sizeof(int));
+            for (int m = 0; m < ckpt.cnt_moves; m++)
+                remap[moves[m].disk_num * cnt_blocks + moves[m].from] = moves[m].to;
+            use_source_layout();
+            walk_volume(visit_remap, 1);
+            sync_disks();
+            break;
+        case PH_REPLICATE:
+            for (int i = 0; i < cnt_blocks; i++)
+                owner[i] = OWNER_FREE;
+            mark_meta_blocks();
+            use_source_layout();
+            cnt_conflicts = 0;
+            walk_volume(visit_set_owner, 0);
+            if (cnt_conflicts > 0)
+            {
+                printf("Error: %d blocks are claimed by two disks.\n", cnt_conflicts);
+                return -1;
+            }
+            for (int i = 0; i < sb->num_inodes; i++)
+                replicate_inode(i);
+            res = run_phase(replicate_block, cnt_blocks);
+            break;
+        case PH_SUPER:
+            write_superblocks();
+            sync_disks();
+            break;
+        }
+        if (res != 0)
+            return -1;
+
+        // next phase : the RAID0 source moves and replicates, repaired mirrors go straight to the superblocks
+        if (ckpt.phase == PH_REPAIR)
+            ckpt.phase = (ckpt.from_mode == 0) ? PH_MOVE : PH_SUPER;
+        else
+            ckpt.phase++;
+        ckpt.cursor = 0;
+        if (ckpt.phase != PH_DONE && save_checkpoint() != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// ############################################ Upgrade #####################################
+
+/*
+  The original superblock ends at BASELINE_SB_SIZE and the inode bitmap
+  starts there, where the extended superblock now sits. An upgrade moves
+  both bitmaps right after the extended superblock when they still fit
+  before the inode table, else into a run of data blocks free at the
+  same index on every disk, where wfs also finds regions a grow moved.
+  The inode table and data blocks stay put. The original bitmaps are
+  saved in <disk 0 image>.upgrade before any disk is written and the
+  magic word is set last, so running -u again after a crash finishes it.
+*/
+
+// size of the original superblock, num_inodes to total_disks and padding
+#define BASELINE_SB_SIZE (64)
+
+// bytes of a region rounded up to whole blocks
+size_t block_round(size_t len)
+{
+    return (len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
+
+// returns 1 if bit i of a bitmap is set
+int bit_set(const char *bitmap, int i)
+{
+    return (((const __u_int *)bitmap)[i / 32] >> (i % 32)) & 1;
+}
+
+// returns the first of cnt data blocks free on every disk, -1 if there is no such run
+int find_common_run(const char *saved, size_t disk_len, size_t i_len, int cnt)
+{
+    int run = 0;
+    for (int i = 0; i < sb->num_data_blocks; i++)
+    {
+        int is_free = 1;
+        for (int d = 0; d < cnt_disks && is_free; d++)
+            is_free = !bit_set(saved + d * disk_len + i_len, i);
+        run = is_free ? run + 1 : 0;
+        if (run == cnt)
+            return i - cnt + 1;
+    }
+    return -1;
+}
+
+// writes len bytes to a new file and syncs it, returns 0 or -1
+int write_file(const char *path, const char *buf, size_t len)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    if (write(fd, buf, len) != len || fsync(fd) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+/****************************************
+upgrades a volume of the original layout in place, or finishes an upgrade cut short
+returns 0 or -1
+*****************************************/
+int upgrade()
+{
+    size_t i_len = sb->num_inodes / 8;
+    size_t d_len = sb->num_data_blocks / 8;
+    size_t disk_len = i_len + d_len;
+    char *saved = malloc(cnt_disks * disk_len);
+    char path[4200];
+    snprintf(path, sizeof(path), "%s.upgrade", disk_path[0]);
+
+    // the original bitmaps : saved by a run cut short, or read from the disks and saved
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0)
+    {
+        int ok = read(fd, saved, cnt_disks * disk_len) == cnt_disks * disk_len;
+        close(fd);
+        if (!ok)
+        {
+            printf("Error: %s is unreadable.\n", path);
+            return -1;
+        }
+        printf("resuming the upgrade\n");
+    }
+    else
+    {
+        for (int d = 0; d < cnt_disks; d++)
+        {
+            struct wfs_sb *disk_sb = (struct wfs_sb *)disk_ptr[d];
+            if (disk_sb->magic == WFS_MAGIC)
+            {
+                printf("already upgraded\n");
+                return 0;
+            }
+            // check : the original layout, the bitmaps right after its superblock
+            if (disk_sb->magic != 0 || disk_sb->i_bitmap_ptr != BASELINE_SB_SIZE ||
+                disk_sb->d_bitmap_ptr != BASELINE_SB_SIZE + i_len || disk_sb->i_blocks_ptr < disk_sb->d_bitmap_ptr + d_len ||
+                disk_sb->i_blocks_ptr < sizeof(struct wfs_sb))
+            {
+                printf("Error: %s does not have the original wfs layout.\n", disk_path[d]);
+                return -1;
+            }
+            memcpy(saved + d * disk_len, (char *)disk_ptr[d] + disk_sb->i_bitmap_ptr, i_len);
+            memcpy(saved + d * disk_len + i_len, (char *)disk_ptr[d] + disk_sb->d_bitmap_ptr, d_len);
+        }
+        if (write_file(path, saved, cnt_disks * disk_len) != 0)
+        {
+            perror(path);
+            return -1;
+        }
+    }
+
+    // the new place of the bitmaps, the data bitmap on a block of its own when they move into the data blocks
+    off_t i_bitmap_ptr = sizeof(struct wfs_sb);
+    off_t d_bitmap_ptr = i_bitmap_ptr + i_len;
+    int first = -1;
+    int cnt_moved = 0;
+    if (d_bitmap_ptr + d_len > sb->i_blocks_ptr)
+    {
+        cnt_moved = (block_round(i_len) + block_round(d_len)) / BLOCK_SIZE;
+        first = find_common_run(saved, disk_len, i_len, cnt_moved);
+        if (first == -1)
+        {
+            printf("Error: the bitmaps need %d data blocks free on every disk.\n", cnt_moved);
+            return -1;
+        }
+        i_bitmap_ptr = sb->d_blocks_ptr + (off_t)first * BLOCK_SIZE;
+        d_bitmap_ptr = i_bitmap_ptr + block_round(i_len);
+    }
+
+    for (int d = 0; d < cnt_disks; d++)
+    {
+        char *base = (char *)disk_ptr[d];
+        struct wfs_sb *disk_sb = (struct wfs_sb *)base;
+        char *i_bitmap = saved + d * disk_len;
+        char *d_bitmap = i_bitmap + i_len;
+        for (int i = first; i < first + cnt_moved; i++)
+            ((__u_int *)d_bitmap)[i / 32] |= 1u << (i % 32);
+
+        // the extended superblock over the old bitmaps, whatever a cut short run left there is cleared
+        memset(base + offsetof(struct wfs_sb, magic), 0, sb->i_blocks_ptr - offsetof(struct wfs_sb, magic));
+        if (first != -1)
+            memset(base + i_bitmap_ptr, 0, cnt_moved * BLOCK_SIZE);
+        memcpy(base + i_bitmap_ptr, i_bitmap, i_len);
+        memcpy(base + d_bitmap_ptr, d_bitmap, d_len);
+
+        size_t used_inodes = 0;
+        size_t used_blocks = 0;
+        for (int i = 0; i < sb->num_inodes; i++)
+            used_inodes += bit_set(i_bitmap, i);
+        for (int i = 0; i < sb->num_data_blocks; i++)
+            used_blocks += bit_set(d_bitmap, i);
+        disk_sb->i_bitmap_ptr = i_bitmap_ptr;
+        disk_sb->d_bitmap_ptr = d_bitmap_ptr;
+        disk_sb->free_inodes = sb->num_inodes - used_inodes;
+        disk_sb->free_data_blocks = sb->num_data_blocks - used_blocks;
+        disk_sb->snap_head = -1;
+        disk_sb->cnt_groups = 1;
+    }
+    sync_disks();
+
+    // the magic word last : until it is set the volume only mounts after another -u
+    for (int d = 0; d < cnt_disks; d++)
+    {
+        ((struct wfs_sb *)disk_ptr[d])->magic = WFS_MAGIC;
+        ((struct wfs_sb *)disk_ptr[d])->version = WFS_VERSION;
+    }
+    sync_disks();
+    unlink(path);
+
+    if (first == -1)
+        printf("upgraded, bitmaps moved to offset %ld\n", (long)i_bitmap_ptr);
+    else
+        printf("upgraded, bitmaps moved to data blocks %d-%d\n", first, first + cnt_moved - 1);
+    return 0;
+}
+
+// ############################################ main #####################################
+
+int parse_mode(const char *str)
+{
+    if (strcmp(str, "0") == 0)
+        return 0;
+    if (strcmp(str, "1") == 0)
+        return 1;
+    if (strcmp(str, "1v") == 0)
+        return 2;
+    return -1;
+}
+
+const char *mode_name(int mode)
+{
+    return (mode == 0) ? "0" : (mode == 1) ? "1" : "1v";
+}
+
+int main(int argc, char *argv[])
+{
+    int to_mode = -1;
+    int upgrade_only = 0;
+    cnt_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:r:u")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            cnt_threads = atoi(optarg);
+            break;
+        case 'r':
+            to_mode = parse_mode(optarg);
+            break;
+        case 'u':
+            upgrade_only = 1;
+            break;
+        default:
+            printf("usage: %s [-j threads] -r <0|1|1v> <disk image>...\n       %s -u <disk image>...\n", argv[0], argv[0]);
+            return 1;
+        }
+    }
+    if ((to_mode == -1 && !upgrade_only) || (to_mode != -1 && upgrade_only) || argc - optind < 2)
+    {
+        printf("usage: %s [-j threads] -r <0|1|1v> <disk image>...\n       %s -u <disk image>...\n", argv[0], argv[0]);
+        return 1;
+    }
+    if (argc - optind > MAX_DISKS)
+    {
+        printf("Error: too many disks.\n");
+        return 1;
+    }
+    if (cnt_threads < 1)
+        cnt_threads = 1;
+    if (cnt_threads > 64)
+        cnt_threads = 64;
+
+    // ---------------------------- map the disks in disk order ----------------------------
+    cnt_disks = argc - optind;
+    for (int i = optind; i < argc; i++)
+    {
+        int fd = open(argv[i], O_RDWR);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < sizeof(struct wfs_sb))
+        {
+            perror(argv[i]);
+            return 1;
+        }
+        void *ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (ptr == MAP_FAILED)
+        {
+            perror(argv[i]);
+            return 1;
+        }
+
+        // check : one volume, every disk once, each image holds the whole layout
+        struct wfs_sb *disk_sb = (struct wfs_sb *)ptr;
+        if (disk_sb->total_disks != cnt_disks || disk_sb->disk_order < 0 || disk_sb->disk_order >= cnt_disks ||
+            disk_ptr[disk_sb->disk_order] != NULL ||
+            st.st_size < disk_sb->d_blocks_ptr + disk_sb->num_data_blocks * BLOCK_SIZE)
+        {
+            printf("Error: %s is not one of %d disks of a volume.\n", argv[i], cnt_disks);
+            return 1;
+        }
+        disk_ptr[disk_sb->disk_order] = ptr;
+        disk_size[disk_sb->disk_order] = st.st_size;
+        disk_path[disk_sb->disk_order] = argv[i];
+    }
+    sb = (struct wfs_sb *)disk_ptr[0];
+    for (int i = 1; i < cnt_disks; i++)
+    {
+        struct wfs_sb *disk_sb = (struct wfs_sb *)disk_ptr[i];
+        if (disk_sb->num_inodes != sb->num_inodes || disk_sb->num_data_blocks != sb->num_data_blocks)
+        {
+            printf("Error: the disks are not one volume.\n");
+            return 1;
+        }
+    }
+    if (upgrade_only)
+        return (upgrade() == 0) ? 0 : 1;
+
+    // check : the extended superblock, its fields are read from here on
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        struct wfs_sb *disk_sb = (struct wfs_sb *)disk_ptr[i];
+        if (disk_sb->magic != WFS_MAGIC || disk_sb->version != WFS_VERSION)
+        {
+            printf("Error: %s has an older layout, upgrade it with -u first.\n", disk_path[i]);
+            return 1;
+        }
+    }
+    snprintf(ckpt_path, sizeof(ckpt_path), "%s.convert", disk_path[0]);
+    owner = malloc(sb->num_data_blocks * sizeof(int));
+
+    // ---------------------------- resume or plan ----------------------------
+    int loaded = load_checkpoint();
+    if (loaded == -1)
+    {
+        printf("Error: %s is unreadable.\n", ckpt_path);
+        return 1;
+    }
+    if (loaded == 1 && ckpt.to_mode != to_mode)
+    {
+        printf("Error: a conversion to RAID%s is unfinished, run it with -r %s.\n", mode_name(ckpt.to_mode), mode_name(ckpt.to_mode));
+        return 1;
+    }
+    if (loaded == 1)
+    {
+        printf("resuming RAID%s -> RAID%s\n", mode_name(ckpt.from_mode), mode_name(ckpt.to_mode));
+    }
+    else
+    {
+        if (sb->raid_mode == to_mode)
+        {
+            printf("already RAID%s\n", mode_name(to_mode));
+            return 0;
+        }
+
+        // check : a volume at rest, no disk set change pending
+        for (int i = 0; i < cnt_disks; i++)
+        {
+            struct wfs_sb *disk_sb = (struct wfs_sb *)disk_ptr[i];
+            if (disk_sb->missing_disks != 0 || disk_sb->reshape_old_disks != 0 || disk_sb->raid_mode != sb->raid_mode)
+            {
+                printf("Error: the volume is degraded, resyncing or reshaping, mount it until that is done.\n");
+                return 1;
+            }
+            if (disk_sb->disk_blocks != 0)
+            {
+                printf("Error: RAID0 disks of different sizes cannot be mirrored.\n");
+                return 1;
+            }
+        }
+
+        memset(&ckpt, 0, sizeof(ckpt));
+        ckpt.magic = CONVERT_MAGIC;
+        ckpt.from_mode = sb->raid_mode;
+        ckpt.to_mode = to_mode;
+        ckpt.cnt_meta_disks = (sb->raid_mode == 0) ? sb->cnt_meta_disks : 0;
+        ckpt.inode_copies = (sb->raid_mode == 0 && sb->inode_copies > 0) ? sb->inode_copies : cnt_disks;
+        if (ckpt.cnt_meta_disks > 0)
+            ckpt.inode_copies = ckpt.cnt_meta_disks;
+        ckpt.phase = (sb->raid_mode == 2) ? PH_REPAIR : (sb->raid_mode == 0) ? PH_MOVE : PH_SUPER;
+
+        if (ckpt.from_mode == 0 && plan_moves() != 0)
+        {
+            printf("Error: not enough free data blocks to mirror the volume.\n");
+            return 1;
+        }
+        if (save_checkpoint() != 0)
+        {
+            perror(ckpt_path);
+            return 1;
+        }
+    }
+
+    if (convert() != 0)
+    {
+        perror(ckpt_path);
+        return 1;
+    }
+    unlink(ckpt_path);
+
+    printf("converted RAID%s -> RAID%s, %d blocks moved\n", mode_name(ckpt.from_mode), mode_name(ckpt.to_mode), ckpt.cnt_moves);
+    return 0;
+}
@@ -0,0 +1,89 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/ioctl.h>
+#include "wfs_ioctl.h"
+
+/*
+  wfs-defrag : reports and repairs the fragmentation of files in a mounted wfs
+  usage : ./wfs-defrag [-n] <path>...
+  paths are files or directories on the mount, directories are walked
+  -n only reports, nothing is moved
+  the file system stays mounted and usable while blocks are moved
+*/
+
+int report_only = 0;
+int cnt_failed = 0;
+
+int defrag_path(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    // skip : the read-only snapshot tree
+    if (type == FTW_D && strcmp(path + ftw->base, ".snapshots") == 0)
+        return FTW_SKIP_SUBTREE;
+    if (type != FTW_F)
+        return FTW_CONTINUE;
+
+    int fd = open(path, report_only ? O_RDONLY : O_RDWR);
+    if (fd < 0)
+    {
+        perror(path);
+        cnt_failed++;
+        return FTW_CONTINUE;
+    }
+
+    struct wfs_defrag defrag;
+    memset(&defrag, 0, sizeof(defrag));
+    defrag.flags = report_only ? WFS_DEFRAG_REPORT : 0;
+    if (ioctl(fd, WFS_IOC_DEFRAG, &defrag) < 0)
+    {
+        perror(path);
+        cnt_failed++;
+        close(fd);
+        return FTW_CONTINUE;
+    }
+    close(fd);
+
+    if (report_only)
+        printf("%s: %d blocks, %d extents, score %d\n", path, defrag.cnt_blocks, defrag.cnt_extents, defrag.score);
+    else
+        printf("%s: %d blocks, %d -> %d extents, score %d -> %d, %d blocks moved\n", path, defrag.cnt_blocks,
+               defrag.cnt_extents, defrag.new_cnt_extents, defrag.score, defrag.new_score, defrag.cnt_moved);
+    return FTW_CONTINUE;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            report_only = 1;
+            break;
+        default:
+            printf("usage: %s [-n] <path>...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc)
+    {
+        printf("usage: %s [-n] <path>...\n", argv[0]);
+        return 1;
+    }
+
+    for (int i = optind; i < argc; i++)
+    {
+        if (nftw(argv[i], defrag_path, 16, FTW_PHYS | FTW_ACTIONRETVAL) != 0)
+        {
+            perror(argv[i]);
+            cnt_failed++;
+        }
+    }
+    return (cnt_failed > 0) ? 1 : 0;
+}
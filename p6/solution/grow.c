@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "wfs_ioctl.h"
+
+/*
+  wfs-grow : grows a mounted wfs after its disk images were enlarged
+  usage : ./wfs-grow [-i inodes] [-b blocks] <file in the mount>
+  -i and -b give the new totals (blocks per disk), rounded up to a multiple of 32
+  enlarge every image first, e.g. truncate -s 4M disk1 disk2
+  new inodes need room in the new data blocks for the relocated inode table
+*/
+
+int main(int argc, char *argv[])
+{
+    struct wfs_grow grow;
+    memset(&grow, 0, sizeof(grow));
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:b:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            grow.num_inodes = atol(optarg);
+            break;
+        case 'b':
+            grow.num_data_blocks = atol(optarg);
+            break;
+        default:
+            printf("usage: %s [-i inodes] [-b blocks] <file in the mount>\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || (grow.num_inodes == 0 && grow.num_data_blocks == 0))
+    {
+        printf("usage: %s [-i inodes] [-b blocks] <file in the mount>\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd < 0)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (ioctl(fd, WFS_IOC_GROW, &grow) < 0)
+    {
+        perror(argv[optind]);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    printf("%zu inodes, %zu data blocks per disk\n", grow.num_inodes, grow.num_data_blocks);
+    return 0;
+}
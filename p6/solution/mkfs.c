@@ -11,7 +11,7 @@
 #include "wfs.h"
 
 // function to get mmap array pointer
-void create_disk_mmap(char **disk_name, int disk_cnt, void **disk_ptr, int disk_size, int disk_fd[])
+void create_disk_mmap(char **disk_name, int disk_cnt, void **disk_ptr, long disk_size[], int disk_fd[])
 {
     // printf("test 1 \n");
     // open files & create mmap pointers
@@ -20,24 +20,33 @@ void create_disk_mmap(char **disk_name, int disk_cnt, void **disk_ptr, int disk_
         // printf("does he know\n");
         int fd = open(disk_name[i], O_RDWR, 0777);
         disk_fd[i] = fd;
-        disk_ptr[i] = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        disk_ptr[i] = mmap(NULL, disk_size[i], PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     }
 }
 
 /*
 Function to free memory maps & close file pointers
 */
-void remove_disk_mmap(int disk_cnt, int disk_size, int disk_fd[], void **mmap_pointers)
+void remove_disk_mmap(int disk_cnt, long disk_size[], int disk_fd[], void **mmap_pointers)
 {
     for (int i = 0; i < disk_cnt; i++)
     {
         // munmap
-        munmap(mmap_pointers[i], disk_size);
+        munmap(mmap_pointers[i], disk_size[i]);
         // free the file-descriptors
         close(disk_fd[i]);
     }
 }
 
+// offset of the data blocks for the given counts, the inode table starts on a block boundary
+long get_d_blocks_ptr(int cnt_inodes, int cnt_data_blocks)
+{
+    long size = sizeof(struct wfs_sb) + cnt_inodes / 8 + cnt_data_blocks / 8;
+    if (size % BLOCK_SIZE != 0)
+        size += BLOCK_SIZE - (size % BLOCK_SIZE);
+    return size + (long)cnt_inodes * BLOCK_SIZE;
+}
+
 int main(int argc, char *argv[])
 {
 
@@ -54,6 +63,9 @@ int main(int argc, char *argv[])
     int cnt_data_blocks = 0;
     int cnt_inodes = 0;
     int cnt_disks = 0;
+    int cnt_groups = 0;
+    int cnt_inode_copies = 0;
+    int cnt_meta_disks = 0;
     char *disk_name[10] = {NULL};
     void *mmap_pointers[10] = {NULL};
     int disk_fd[10] = {0};
@@ -106,6 +118,24 @@ int main(int argc, char *argv[])
         {
             cnt_data_blocks = atoi(argv[i + 1]);
         }
+
+        // ---------------- allocation groups ----------------
+        if (strcmp(argv[i], "-g") == 0)
+        {
+            cnt_groups = atoi(argv[i + 1]);
+        }
+
+        // ---------------- RAID0 inode copies ----------------
+        if (strcmp(argv[i], "-m") == 0)
+        {
+            cnt_inode_copies = atoi(argv[i + 1]);
+        }
+
+        // ---------------- RAID0 metadata disks ----------------
+        if (strcmp(argv[i], "-M") == 0)
+        {
+            cnt_meta_disks = atoi(argv[i + 1]);
+        }
     }
 
     // ############### validate command line arguments ###############
@@ -152,27 +182,72 @@ int main(int argc, char *argv[])
         // printf("Number of inodes = %d\n", cnt_inodes);
     }
 
-    struct stat file_stat;
-    long disk_size = 0;
-    if (stat(disk_name[0], &file_stat) == 0)
+    // default : one group per 128 inodes, at most 16
+    if (cnt_groups == 0)
     {
-        disk_size = file_stat.st_size;
+        cnt_groups = cnt_inodes / 128;
+        if (cnt_groups > 16)
+            cnt_groups = 16;
+        if (cnt_groups > cnt_data_blocks / 32)
+            cnt_groups = cnt_data_blocks / 32;
+        if (cnt_groups < 1)
+            cnt_groups = 1;
     }
-    else
+
+    // every group needs a bitmap word of inodes and of data blocks
+    if (cnt_groups < 1 || cnt_groups > cnt_inodes / 32 || cnt_groups > cnt_data_blocks / 32)
     {
-        perror("stat");
+        printf("Error: Too many allocation groups specified.\n");
+        return -1;
+    }
+
+    // metadata disks : the first disks, at least one data disk left, they hold the inodes
+    if (cnt_meta_disks < 0 || cnt_meta_disks >= cnt_disks || (raid_mode != 0 && cnt_meta_disks != 0) ||
+        (cnt_meta_disks > 0 && cnt_inode_copies != 0 && cnt_inode_copies != cnt_meta_disks))
+    {
+        printf("Error: Invalid number of metadata disks specified.\n");
+        return -1;
+    }
+    if (cnt_meta_disks > 0)
+        cnt_inode_copies = cnt_meta_disks;
+
+    // default : every disk holds every inode, mirrors always do
+    if (cnt_inode_copies == 0)
+        cnt_inode_copies = cnt_disks;
+    if (cnt_inode_copies < 1 || cnt_inode_copies > cnt_disks || (raid_mode != 0 && cnt_inode_copies != cnt_disks))
+    {
+        printf("Error: Invalid number of inode copies specified.\n");
+        return -1;
+    }
+
+    // the disks can differ in size, the requested blocks must fit on the smallest one
+    struct stat file_stat;
+    long disk_size[10] = {0};
+    long min_disk_size = 0;
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        if (stat(disk_name[i], &file_stat) == 0)
+        {
+            disk_size[i] = file_stat.st_size;
+        }
+        else
+        {
+            perror("stat");
+        }
+        if (i == 0 || disk_size[i] < min_disk_size)
+            min_disk_size = disk_size[i];
     }
 
     // ####################### Too many blocks Reqeusted #######################
 
     if (raid_mode == 0 &&
-        disk_size < sizeof(struct wfs_sb) + (cnt_data_blocks + cnt_inodes) / 8 + (cnt_data_blocks + cnt_inodes) * 512)
+        min_disk_size < sizeof(struct wfs_sb) + (cnt_data_blocks + cnt_inodes) / 8 + (cnt_data_blocks + cnt_inodes) * 512)
     {
         return -1;
     }
 
     // for RAID1 & RAID1v
-    if (disk_size < sizeof(struct wfs_sb) + (cnt_data_blocks + cnt_inodes) / 8 + (cnt_data_blocks + cnt_inodes) * 512)
+    if (min_disk_size < sizeof(struct wfs_sb) + (cnt_data_blocks + cnt_inodes) / 8 + (cnt_data_blocks + cnt_inodes) * 512)
     {
         // todo : add the size of supernode & bitmaps to the RHS of this if condtion
         // printf("Not enough disk size\n");
@@ -187,6 +262,44 @@ int main(int argc, char *argv[])
     // printf("disk size = %d\n", (int)disk_size);
     // printf("blocks = %d\n", (cnt_data_blocks+cnt_inodes)*512);
 
+    // ####################### Data blocks per disk #######################
+
+    // mirrors hold the same blocks on every disk : the smallest disk decides
+    // RAID0 gives each disk blocks in proportion to its size, the smallest disk gets the requested count
+    // the layout is sized for the largest disk, so a bigger bitmap can trim the others
+    int disk_blocks[10] = {0};
+    int max_blocks = cnt_data_blocks;
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        disk_blocks[i] = cnt_data_blocks;
+        if (raid_mode == 0 && disk_size[i] > min_disk_size)
+            disk_blocks[i] = (long)cnt_data_blocks * disk_size[i] / min_disk_size / 32 * 32;
+        if (disk_blocks[i] > max_blocks)
+            max_blocks = disk_blocks[i];
+    }
+    int trimmed = (max_blocks > cnt_data_blocks);
+    while (trimmed)
+    {
+        trimmed = 0;
+        long d_blocks_ptr = get_d_blocks_ptr(cnt_inodes, max_blocks);
+        int new_max_blocks = cnt_data_blocks;
+        for (int i = 0; i < cnt_disks; i++)
+        {
+            int fit = (disk_size[i] - d_blocks_ptr) / BLOCK_SIZE / 32 * 32;
+            if (disk_blocks[i] > fit)
+            {
+                disk_blocks[i] = fit;
+                trimmed = 1;
+            }
+            // check : the smallest disk still holds the requested blocks
+            if (disk_blocks[i] < cnt_data_blocks)
+                return -1;
+            if (disk_blocks[i] > new_max_blocks)
+                new_max_blocks = disk_blocks[i];
+        }
+        max_blocks = new_max_blocks;
+    }
+
     // ####################### Open Disk Files & Mmap #######################
     create_disk_mmap(disk_name, cnt_disks, mmap_pointers, disk_size, disk_fd);
 
@@ -208,10 +321,21 @@ int main(int argc, char *argv[])
         struct wfs_sb *sb = (struct wfs_sb *)mmap_pointers[i];
 
         sb->num_inodes = cnt_inodes;
-        sb->num_data_blocks = cnt_data_blocks;
+        sb->num_data_blocks = max_blocks;
         sb->raid_mode = raid_mode;
         sb->disk_order = i;
         sb->total_disks = cnt_disks;
+        sb->magic = WFS_MAGIC;
+        sb->version = WFS_VERSION;
+        sb->free_inodes = cnt_inodes - 1; // root inode
+        sb->free_data_blocks = disk_blocks[i];
+        sb->snap_head = -1;
+        sb->cnt_groups = cnt_groups;
+        sb->inode_copies = (cnt_inode_copies == cnt_disks) ? 0 : cnt_inode_copies;
+        sb->cnt_meta_disks = cnt_meta_disks;
+        sb->missing_disks = 0;
+        memset(sb->wi_bitmap, 0, sizeof(sb->wi_bitmap));
+        sb->disk_blocks = (disk_blocks[i] == max_blocks) ? 0 : disk_blocks[i];
 
         // superblock bitmap pointers
         sb->i_bitmap_ptr = sizeof(struct wfs_sb);
@@ -219,7 +343,7 @@ int main(int argc, char *argv[])
 
         // offset to the next block
         // every inode always starts at the location divisible by 512
-        int size = sb->d_bitmap_ptr + (cnt_data_blocks) / 8;
+        int size = sb->d_bitmap_ptr + (max_blocks) / 8;
         int offset = 0;
         if (size % 512 != 0)
         {
@@ -237,7 +361,15 @@ int main(int argc, char *argv[])
         __u_int *i_bitmap = (__u_int *)(base + sb->i_bitmap_ptr);
         i_bitmap[0] = 1; // 1 inode for the root
 
+        // blocks past the end of a smaller disk stay marked used
+        __u_int *d_bitmap = (__u_int *)(base + sb->d_bitmap_ptr);
+        for (int j = disk_blocks[i]; j < max_blocks; j++)
+            d_bitmap[j / 32] |= 1u << (j % 32);
+
         // ----------- write the inodes -----------
+        // root is inode 0, its copies are on the first cnt_inode_copies disks
+        if (i >= cnt_inode_copies)
+            continue;
         struct wfs_inode *root_inode = (struct wfs_inode *)(base + sb->i_blocks_ptr);
         root_inode->num = 0;
         root_inode->mode = S_IFDIR | 0755;
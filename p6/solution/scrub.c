@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include "wfs_ioctl.h"
+
+/*
+  wfs-scrub : reports the background scrub of a mounted mirror
+  usage : ./wfs-scrub [-s] <file in the mount>
+  -s starts a pass now instead of waiting for the next one
+  the rate is set at mount with --scrub-rate=N (KiB/s)
+*/
+
+int main(int argc, char *argv[])
+{
+    struct wfs_scrub scrub;
+    memset(&scrub, 0, sizeof(scrub));
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            scrub.flags |= WFS_SCRUB_START;
+            break;
+        default:
+            printf("usage: %s [-s] <file in the mount>\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        printf("usage: %s [-s] <file in the mount>\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd < 0)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (ioctl(fd, WFS_IOC_SCRUB, &scrub) < 0)
+    {
+        perror(argv[optind]);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    printf("%s, %d KiB/s, %zu of %zu positions\n", scrub.running ? "scrubbing" : "idle", scrub.rate, scrub.cursor, scrub.total);
+    printf("%d passes, %zu scrubbed, %zu repaired, %zu without majority\n", scrub.cnt_passes, scrub.cnt_scrubbed,
+           scrub.cnt_repaired, scrub.cnt_conflicts);
+    if (scrub.last_pass != 0)
+        printf("last pass ended %s", ctime(&scrub.last_pass));
+    return 0;
+}
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "trace.h"
+
+// ############################################ Ring Buffer #####################################
+
+/*
+  Each slot is guarded by its own sequence number:
+  0 while a writer owns the slot, ticket + 1 once the record is complete.
+  Writers claim a ticket with a single fetch_add, so logging never blocks.
+*/
+struct trace_rec
+{
+    _Atomic unsigned long seq;
+    struct timespec ts;
+    unsigned int subsys;
+    char msg[TRACE_MSG_LEN];
+};
+
+_Atomic unsigned int trace_mask = 0;
+
+static struct trace_rec trace_ring[TRACE_RING_SLOTS];
+static _Atomic unsigned long trace_head = 0;
+
+void trace_log(unsigned int subsys, const char *fmt, ...)
+{
+    unsigned long ticket = atomic_fetch_add_explicit(&trace_head, 1, memory_order_relaxed);
+    struct trace_rec *rec = &trace_ring[ticket & (TRACE_RING_SLOTS - 1)];
+
+    atomic_store_explicit(&rec->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    clock_gettime(CLOCK_MONOTONIC, &rec->ts);
+    rec->subsys = subsys;
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(rec->msg, TRACE_MSG_LEN, fmt, args);
+    va_end(args);
+
+    atomic_store_explicit(&rec->seq, ticket + 1, memory_order_release);
+}
+
+static const char *trace_subsys_name(unsigned int subsys)
+{
+    switch (subsys)
+    {
+    case TR_ALLOC:
+        return "alloc";
+    case TR_LOOKUP:
+        return "lookup";
+    case TR_RAID:
+        return "raid";
+    case TR_IO:
+        return "io";
+    default:
+        return "?";
+    }
+}
+
+/****************************************
+writes every complete record still in the ring to fd, oldest first
+records overwritten while being copied are skipped
+*****************************************/
+void trace_dump(int fd)
+{
+    unsigned long head = atomic_load_explicit(&trace_head, memory_order_acquire);
+    unsigned long start = (head > TRACE_RING_SLOTS) ? head - TRACE_RING_SLOTS : 0;
+
+    for (unsigned long ticket = start; ticket < head; ticket++)
+    {
+        struct trace_rec *rec = &trace_ring[ticket & (TRACE_RING_SLOTS - 1)];
+        struct trace_rec copy;
+
+        if (atomic_load_explicit(&rec->seq, memory_order_acquire) != ticket + 1)
+            continue;
+        copy.ts = rec->ts;
+        copy.subsys = rec->subsys;
+        memcpy(copy.msg, rec->msg, TRACE_MSG_LEN);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&rec->seq, memory_order_relaxed) != ticket + 1)
+            continue;
+
+        copy.msg[TRACE_MSG_LEN - 1] = '\0';
+        char line[TRACE_MSG_LEN + 64];
+        int len = snprintf(line, sizeof(line), "[%ld.%06ld] %-6s %s\n",
+                           (long)copy.ts.tv_sec, copy.ts.tv_nsec / 1000,
+                           trace_subsys_name(copy.subsys), copy.msg);
+        if (len > (int)sizeof(line) - 1)
+            len = sizeof(line) - 1;
+        if (write(fd, line, len) < 0)
+            return;
+    }
+}
+
+/****************************************
+parses a comma separated list of subsystem names
+returns the matching trace mask
+*****************************************/
+unsigned int trace_parse_mask(const char *spec)
+{
+    unsigned int mask = 0;
+    if (spec == NULL)
+        return mask;
+
+    char *copy = strdup(spec);
+    for (char *token = strtok(copy, ","); token != NULL; token = strtok(NULL, ","))
+    {
+        if (strcmp(token, "alloc") == 0)
+            mask |= TR_ALLOC;
+        else if (strcmp(token, "lookup") == 0)
+            mask |= TR_LOOKUP;
+        else if (strcmp(token, "raid") == 0)
+            mask |= TR_RAID;
+        else if (strcmp(token, "io") == 0)
+            mask |= TR_IO;
+        else if (strcmp(token, "all") == 0)
+            mask |= TR_ALL;
+    }
+    free(copy);
+    return mask;
+}
+
+// ############################################ Dump on demand #####################################
+
+// waits for SIGUSR1 and dumps the ring, runs on its own thread
+static void *trace_dumper(void *arg)
+{
+    sigset_t *set = (sigset_t *)arg;
+    int sig;
+
+    while (sigwait(set, &sig) == 0)
+    {
+        const char *path = getenv("WFS_TRACE_FILE");
+        int fd = STDERR_FILENO;
+        if (path != NULL)
+            fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0)
+            continue;
+        trace_dump(fd);
+        if (fd != STDERR_FILENO)
+            close(fd);
+    }
+    return NULL;
+}
+
+static sigset_t trace_dump_set;
+
+/****************************************
+reads the runtime mask from WFS_TRACE and blocks SIGUSR1
+called from main before FUSE starts any thread so every thread inherits the mask
+*****************************************/
+void trace_init(void)
+{
+    atomic_store(&trace_mask, trace_parse_mask(getenv("WFS_TRACE")));
+
+    sigemptyset(&trace_dump_set);
+    sigaddset(&trace_dump_set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &trace_dump_set, NULL);
+}
+
+/****************************************
+starts the SIGUSR1 dump thread
+must be called after FUSE has daemonized (from the init callback)
+*****************************************/
+void trace_start_dumper(void)
+{
+    pthread_t tid;
+
+    if (pthread_create(&tid, NULL, trace_dumper, &trace_dump_set) == 0)
+        pthread_detach(tid);
+}
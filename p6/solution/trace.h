@@ -0,0 +1,66 @@
+#ifndef WFS_TRACE_H
+#define WFS_TRACE_H
+
+#include <stdatomic.h>
+
+/*
+  Tracing for wfs.
+
+  Trace points are compiled in according to WFS_TRACE_LEVEL:
+    0 : every trace point is compiled out
+    1 : per-operation events (callbacks, allocations, RAID decisions)
+    2 : also per-dentry / per-block events on the hot paths
+
+  Compiled-in trace points only log when their subsystem is enabled in
+  trace_mask at runtime (WFS_TRACE=alloc,lookup,raid,io,all at mount).
+  Records go to an in-memory ring buffer, never to stdout; the ring is
+  dumped on SIGUSR1 to stderr or to the file named by WFS_TRACE_FILE.
+*/
+
+#ifndef WFS_TRACE_LEVEL
+#define WFS_TRACE_LEVEL 1
+#endif
+
+// trace subsystems, one bit each in trace_mask
+#define TR_ALLOC  (1u << 0)
+#define TR_LOOKUP (1u << 1)
+#define TR_RAID   (1u << 2)
+#define TR_IO     (1u << 3)
+#define TR_ALL    (TR_ALLOC | TR_LOOKUP | TR_RAID | TR_IO)
+
+// ring geometry, slot count must be a power of 2
+#define TRACE_RING_SLOTS (4096)
+#define TRACE_MSG_LEN    (112)
+
+extern _Atomic unsigned int trace_mask;
+
+void trace_log(unsigned int subsys, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+unsigned int trace_parse_mask(const char *spec);
+void trace_dump(int fd);
+void trace_init(void);
+void trace_start_dumper(void);
+
+#if WFS_TRACE_LEVEL >= 1
+#define TRACE(subsys, ...)                                                          \
+    do                                                                              \
+    {                                                                               \
+        if (atomic_load_explicit(&trace_mask, memory_order_relaxed) & (subsys))     \
+            trace_log((subsys), __VA_ARGS__);                                       \
+    } while (0)
+#else
+#define TRACE(subsys, ...) \
+    do                     \
+    {                      \
+    } while (0)
+#endif
+
+#if WFS_TRACE_LEVEL >= 2
+#define TRACE_V(subsys, ...) TRACE(subsys, __VA_ARGS__)
+#else
+#define TRACE_V(subsys, ...) \
+    do                       \
+    {                        \
+    } while (0)
+#endif
+
+#endif
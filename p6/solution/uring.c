@@ -0,0 +1,610 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+
+#define URING_MAX_CACHES (32)          // wfs MAX_DISKS
+#define URING_CHUNK      (128 * 1024)  // most bytes one request moves
+
+// per page flags
+#define PAGE_RESIDENT (1)  // read from the image (or written whole) since it was last dropped
+#define PAGE_DIRTY    (2)  // marked written since the last flush
+#define PAGE_REF      (4)  // used since the clock hand last passed
+#define PAGE_PINNED   (8)  // metadata : never dropped, written back in the second round
+
+// one disk image and the pages of it held in memory
+struct uring_cache {
+    char *base;               // reserved address range with the image's layout, only resident pages hold data
+    char *shadow;             // same layout, a pinned page as it was last written back
+    off_t size;               // image bytes
+    size_t len;               // bytes reserved, size rounded up to pages
+    int fd;                   // the image as wfs opened it
+    int direct_fd;            // the image opened again with O_DIRECT, fd if the file system refuses
+    unsigned char *flags;     // PAGE_* per page
+};
+
+// one read, write or fsync
+struct uring_req {
+    struct uring_cache *cache;
+    int op;                   // IORING_OP_READ, IORING_OP_WRITE or IORING_OP_FSYNC
+    int fd;
+    char *buf;
+    size_t len;
+    off_t off;
+};
+
+// the submission and completion rings shared with the kernel
+struct uring {
+    int fd;
+    unsigned int entries;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+
+static struct uring ring = {.fd = -1};
+static struct uring_cache *caches[URING_MAX_CACHES];
+static long page_size = 0;
+
+// bytes of pages outside the pinned metadata that stay resident, and those pages resident and dirty now
+static size_t cache_bytes = URING_CACHE_SIZE;
+static size_t cnt_resident = 0;
+static size_t cnt_dirty = 0;
+
+// clock hand : cache and page the next trim looks at first
+static int hand_cache = 0;
+static size_t hand_page = 0;
+
+// ###################################### Ring ######################################
+
+// sets the ring up on first use, returns 0 or -errno
+static int uring_setup(void)
+{
+    if (ring.fd >= 0)
+        return 0;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+    if (fd < 0)
+        return -errno;
+
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) && cq_len > sq_len)
+        sq_len = cq_len;
+
+    char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+        cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *sqes = MAP_FAILED;
+    if (sq != MAP_FAILED && cq != MAP_FAILED)
+        sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        // the ring lives as long as wfs, a failed setup only leaks its mappings
+        close(fd);
+        return -ENOMEM;
+    }
+
+    ring.entries = params.sq_entries;
+    ring.sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring.sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring.cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring.cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring.cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring.sqes = sqes;
+    ring.fd = fd;
+    return 0;
+}
+/****************************************
+runs cnt requests, at most ring.entries in flight, and waits for all of them
+short transfers are continued, a direct request the file system refuses is retried buffered
+returns 0 or the first error as -errno
+*****************************************/
+static int uring_run(struct uring_req *reqs, int cnt)
+{
+    int res = 0;
+    if (cnt == 0)
+        return res;
+
+    // indices of the requests to submit, a circular queue: each request is queued or in flight, never both
+    int *queue = malloc(cnt * sizeof(int));
+    if (queue == NULL)
+    {
+        res = -ENOMEM;
+        return res;
+    }
+    for (int i = 0; i < cnt; i++)
+        queue[i] = i;
+    int q_head = 0;
+    int q_len = cnt;
+    unsigned int in_flight = 0;
+
+    while (q_len > 0 || in_flight > 0)
+    {
+        unsigned int tail = *ring.sq_tail;
+        unsigned int submit = 0;
+        while (q_len > 0 && in_flight + submit < ring.entries)
+        {
+            struct uring_req *req = &reqs[queue[q_head]];
+            unsigned int slot = tail & *ring.sq_mask;
+            struct io_uring_sqe *sqe = &ring.sqes[slot];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = req->op;
+            sqe->fd = req->fd;
+            if (req->op != IORING_OP_FSYNC)
+            {
+                sqe->addr = (uintptr_t)req->buf;
+                sqe->len = req->len;
+                sqe->off = req->off;
+            }
+            sqe->user_data = queue[q_head];
+            ring.sq_array[slot] = slot;
+            tail++;
+            submit++;
+            q_head = (q_head + 1) % cnt;
+            q_len--;
+        }
+        __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+        int ret = syscall(__NR_io_uring_enter, ring.fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        unsigned int taken = (ret < 0) ? 0 : ret;
+        if (taken < submit)
+        {
+            // hand back what the kernel did not take, it goes out with the next call
+            __atomic_store_n(ring.sq_tail, tail - (submit - taken), __ATOMIC_RELEASE);
+            q_head = (q_head + cnt - (submit - taken)) % cnt;
+            q_len += submit - taken;
+        }
+        in_flight += taken;
+        if (ret < 0 && errno != EINTR && res == 0)
+            res = -errno;
+
+        unsigned int head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            int index = cqe->user_data;
+            struct uring_req *req = &reqs[index];
+            int done = cqe->res;
+            head++;
+            in_flight--;
+
+            // the file system does not take this request unbuffered, use the buffered fd from now on
+            if (done == -EINVAL && req->fd != req->cache->fd)
+            {
+                if (req->cache->direct_fd != req->cache->fd)
+                    close(req->cache->direct_fd);
+                req->cache->direct_fd = req->cache->fd;
+                req->fd = req->cache->fd;
+                queue[(q_head + q_len++) % cnt] = index;
+                continue;
+            }
+            if (done < 0)
+            {
+                if (res == 0)
+                    res = done;
+                continue;
+            }
+            if (req->op == IORING_OP_FSYNC || done == req->len)
+                continue;
+            if (done == 0)
+            {
+                if (res == 0)
+                    res = -EIO;
+                continue;
+            }
+
+            // check : the rest of a short transfer is no longer aligned, continue it buffered
+            req->buf += done;
+            req->len -= done;
+            req->off += done;
+            req->fd = req->cache->fd;
+            queue[(q_head + q_len++) % cnt] = index;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        // check : stop queueing after an error, only reap what is in flight
+        if (res != 0)
+            q_len = 0;
+    }
+    free(queue);
+    return res;
+}
+
+// ###################################### Pages ######################################
+
+// returns the cache holding addr, NULL if none does
+static struct uring_cache *uring_find_cache(char *addr)
+{
+    for (int i = 0; i < URING_MAX_CACHES; i++)
+    {
+        struct uring_cache *cache = caches[i];
+        if (cache != NULL && addr >= cache->base && addr < cache->base + cache->len)
+            return cache;
+    }
+    return NULL;
+}
+
+/****************************************
+adds a read or write of the page at off to reqs (cnt used, cap allocated)
+a page following the previous request of the same kind extends it up to URING_CHUNK bytes
+returns 0 or -ENOMEM
+*****************************************/
+static int uring_add_req(struct uring_req **reqs, int *cnt, int *cap, struct uring_cache *cache, int op, off_t off)
+{
+    int res = 0;
+    size_t len = page_size;
+    if (off + len > cache->size)
+        len = cache->size - off;
+
+    // check : extend the previous request when this page follows it
+    struct uring_req *prev = (*cnt > 0) ? &(*reqs)[*cnt - 1] : NULL;
+    if (prev != NULL && prev->cache == cache && prev->op == op && prev->off + prev->len == off &&
+        prev->len + len <= URING_CHUNK && prev->len % page_size == 0)
+    {
+        prev->len += len;
+        if (len % page_size != 0)
+            prev->fd = cache->fd;
+        return res;
+    }
+    if (*cnt == *cap)
+    {
+        int grown_cap = (*cap == 0) ? 64 : *cap * 2;
+        struct uring_req *grown = realloc(*reqs, grown_cap * sizeof(struct uring_req));
+        if (grown == NULL)
+        {
+            res = -ENOMEM;
+            return res;
+        }
+        *reqs = grown;
+        *cap = grown_cap;
+    }
+    struct uring_req *req = &(*reqs)[(*cnt)++];
+    req->cache = cache;
+    req->op = op;
+    req->fd = (len % page_size == 0) ? cache->direct_fd : cache->fd;
+    req->buf = cache->base + off;
+    req->len = len;
+    req->off = off;
+    return res;
+}
+
+int uring_load(void *addr, size_t len)
+{
+    int res = 0;
+    struct uring_cache *cache = uring_find_cache(addr);
+    if (cache == NULL || len == 0)
+        return res;
+
+    size_t first = ((char *)addr - cache->base) / page_size;
+    size_t last = ((char *)addr + len - 1 - cache->base) / page_size;
+    size_t cnt_pages = cache->len / page_size;
+    int missing = 0;
+    for (size_t page = first; page <= last; page++)
+    {
+        cache->flags[page] |= PAGE_REF;
+        if (!(cache->flags[page] & PAGE_RESIDENT))
+            missing = 1;
+    }
+    if (!missing)
+        return res;
+
+    int cnt = 0;
+    int cap = 0;
+    struct uring_req *reqs = NULL;
+    for (size_t page = first; res == 0 && page <= last; page++)
+    {
+        if (!(cache->flags[page] & PAGE_RESIDENT))
+            res = uring_add_req(&reqs, &cnt, &cap, cache, IORING_OP_READ, page * page_size);
+    }
+
+    // readahead : a miss on the last page reads on up to a chunk, the pages read ahead start unreferenced
+    size_t ahead = last + 1;
+    if (!(cache->flags[last] & PAGE_RESIDENT))
+    {
+        while (res == 0 && ahead < cnt_pages && ahead - last < URING_CHUNK / page_size &&
+               !(cache->flags[ahead] & PAGE_RESIDENT))
+            res = uring_add_req(&reqs, &cnt, &cap, cache, IORING_OP_READ, (ahead++) * page_size);
+    }
+
+    if (res == 0)
+        res = uring_run(reqs, cnt);
+    free(reqs);
+    if (res != 0)
+        return res;
+
+    for (size_t page = first; page < ahead; page++)
+    {
+        if (!(cache->flags[page] & PAGE_RESIDENT))
+        {
+            cache->flags[page] |= PAGE_RESIDENT;
+            cnt_resident++;
+        }
+    }
+    return res;
+}
+
+int uring_mark_dirty(void *addr, size_t len)
+{
+    int res = uring_load(addr, len);
+    struct uring_cache *cache = uring_find_cache(addr);
+    if (res != 0 || cache == NULL || len == 0)
+        return res;
+
+    size_t first = ((char *)addr - cache->base) / page_size;
+    size_t last = ((char *)addr + len - 1 - cache->base) / page_size;
+    for (size_t page = first; page <= last; page++)
+    {
+        if (cache->flags[page] & PAGE_DIRTY)
+            continue;
+        cache->flags[page] |= PAGE_DIRTY;
+        if (!(cache->flags[page] & PAGE_PINNED))
+            cnt_dirty++;
+    }
+    return res;
+}
+
+int uring_trim(void)
+{
+    if (page_size == 0)
+        return 0;
+    size_t limit = cache_bytes / page_size;
+
+    // the clock : a clean page used since the hand last passed gets another turn, the others are dropped
+    if (cnt_resident > limit && cnt_resident > cnt_dirty)
+    {
+        size_t target = limit - limit / 8;
+        size_t cnt_pages = 0;
+        for (int i = 0; i < URING_MAX_CACHES; i++)
+            cnt_pages += (caches[i] != NULL) ? caches[i]->len / page_size : 0;
+
+        // at most two turns : the first may only clear the reference bits
+        size_t visited = 0;
+        while (visited < 2 * cnt_pages && cnt_resident > target)
+        {
+            struct uring_cache *cache = caches[hand_cache];
+            if (cache == NULL || hand_page >= cache->len / page_size)
+            {
+                hand_cache = (hand_cache + 1) % URING_MAX_CACHES;
+                hand_page = 0;
+                continue;
+            }
+            unsigned char *flags = &cache->flags[hand_page];
+            if ((*flags & (PAGE_RESIDENT | PAGE_DIRTY | PAGE_PINNED)) == PAGE_RESIDENT)
+            {
+                if (*flags & PAGE_REF)
+                {
+                    *flags &= ~PAGE_REF;
+                }
+                else
+                {
+                    madvise(cache->base + hand_page * page_size, page_size, MADV_DONTNEED);
+                    *flags = 0;
+                    cnt_resident--;
+                }
+            }
+            hand_page++;
+            visited++;
+        }
+    }
+    return (cnt_dirty > 0 && cnt_dirty >= limit / 2) ? 1 : 0;
+}
+
+void uring_set_cache_size(size_t bytes)
+{
+    cache_bytes = bytes;
+}
+
+// ###################################### Write-back ######################################
+
+/****************************************
+writes the pages of one round and fsyncs the images written
+round 0 : the dirty pages outside the metadata
+round 1 : the pinned pages marked dirty or changed since their shadow
+runs of pages become one request up to URING_CHUNK bytes, the pages are clean once written
+returns 0 or -errno, the pages stay dirty on an error
+*****************************************/
+static int uring_flush_round(int meta)
+{
+    int res = 0;
+    int cnt = 0;
+    int cap = 0;
+    struct uring_req *reqs = NULL;
+    struct uring_cache *written[URING_MAX_CACHES];
+    int cnt_written = 0;
+
+    for (int i = 0; res == 0 && i < URING_MAX_CACHES; i++)
+    {
+        struct uring_cache *cache = caches[i];
+        if (cache == NULL)
+            continue;
+
+        int first = cnt;
+        size_t cnt_pages = cache->len / page_size;
+        for (size_t page = 0; res == 0 && page < cnt_pages; page++)
+        {
+            off_t off = page * page_size;
+            unsigned char flags = cache->flags[page];
+            if (((flags & PAGE_PINNED) != 0) != meta)
+                continue;
+            if (!(flags & PAGE_DIRTY) && (!meta || memcmp(cache->base + off, cache->shadow + off, page_size) == 0))
+                continue;
+            res = uring_add_req(&reqs, &cnt, &cap, cache, IORING_OP_WRITE, off);
+        }
+        if (cnt > first)
+            written[cnt_written++] = cache;
+    }
+
+    if (res == 0)
+        res = uring_run(reqs, cnt);
+    for (int i = 0; res == 0 && i < cnt; i++)
+    {
+        struct uring_cache *cache = reqs[i].cache;
+        size_t first = reqs[i].off / page_size;
+        size_t last = (reqs[i].off + reqs[i].len - 1) / page_size;
+        for (size_t page = first; page <= last; page++)
+        {
+            if (meta)
+                memcpy(cache->shadow + page * page_size, cache->base + page * page_size, page_size);
+            if (!(cache->flags[page] & PAGE_DIRTY))
+                continue;
+            cache->flags[page] &= ~PAGE_DIRTY;
+            if (!meta)
+                cnt_dirty--;
+        }
+    }
+    free(reqs);
+    if (res != 0 || cnt_written == 0)
+        return res;
+
+    // the round is durable before the next one starts
+    struct uring_req syncs[URING_MAX_CACHES];
+    for (int i = 0; i < cnt_written; i++)
+    {
+        memset(&syncs[i], 0, sizeof(syncs[i]));
+        syncs[i].cache = written[i];
+        syncs[i].op = IORING_OP_FSYNC;
+        syncs[i].fd = written[i]->fd;
+    }
+    res = uring_run(syncs, cnt_written);
+    return res;
+}
+
+int uring_flush(void)
+{
+    int res = uring_flush_round(0);
+    if (res == 0)
+        res = uring_flush_round(1);
+    return res;
+}
+
+// ###################################### Caches ######################################
+
+void *uring_map_disk(int fd, off_t size)
+{
+    int slot = 0;
+    while (slot < URING_MAX_CACHES && caches[slot] != NULL)
+        slot++;
+    int res = uring_setup();
+    if (res == 0 && slot == URING_MAX_CACHES)
+        res = -EMFILE;
+    if (res != 0)
+    {
+        errno = -res;
+        return NULL;
+    }
+    if (page_size == 0)
+        page_size = sysconf(_SC_PAGESIZE);
+
+    struct uring_cache *cache = calloc(1, sizeof(struct uring_cache));
+    if (cache == NULL)
+        return NULL;
+    cache->fd = fd;
+    cache->size = size;
+    cache->len = (size + page_size - 1) / page_size * page_size;
+    cache->flags = calloc(cache->len / page_size + 1, 1);
+
+    // address space only : a page takes memory once it is loaded
+    int prot = PROT_READ | PROT_WRITE;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    cache->base = mmap(NULL, cache->len, prot, flags, -1, 0);
+    cache->shadow = mmap(NULL, cache->len, prot, flags, -1, 0);
+    if (cache->flags == NULL || cache->base == MAP_FAILED || cache->shadow == MAP_FAILED)
+    {
+        if (cache->base != MAP_FAILED)
+            munmap(cache->base, cache->len);
+        if (cache->shadow != MAP_FAILED)
+            munmap(cache->shadow, cache->len);
+        free(cache->flags);
+        free(cache);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // the same file again without the page cache, reopened through /proc as wfs only has the fd
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    cache->direct_fd = open(path, O_RDWR | O_DIRECT);
+    if (cache->direct_fd < 0)
+        cache->direct_fd = fd;
+
+    caches[slot] = cache;
+    return cache->base;
+}
+
+int uring_add_meta(void *cache_ptr, off_t off, off_t len)
+{
+    int res = 0;
+    struct uring_cache *cache = uring_find_cache(cache_ptr);
+    if (cache == NULL || off < 0)
+    {
+        res = -EINVAL;
+        return res;
+    }
+    if (off + len > cache->size)
+        len = cache->size - off;
+    if (len <= 0)
+        return res;
+
+    res = uring_load(cache->base + off, len);
+    if (res != 0)
+        return res;
+
+    for (size_t page = off / page_size; page <= (off + len - 1) / page_size; page++)
+    {
+        if (cache->flags[page] & PAGE_PINNED)
+            continue;
+        cache->flags[page] |= PAGE_PINNED;
+        cnt_resident--;
+        if (cache->flags[page] & PAGE_DIRTY)
+            cnt_dirty--;
+        memcpy(cache->shadow + page * page_size, cache->base + page * page_size, page_size);
+    }
+    return res;
+}
+
+void uring_unmap_disk(void *cache_ptr)
+{
+    for (int i = 0; i < URING_MAX_CACHES; i++)
+    {
+        struct uring_cache *cache = caches[i];
+        if (cache == NULL || cache->base != cache_ptr)
+            continue;
+        caches[i] = NULL;
+        for (size_t page = 0; page < cache->len / page_size; page++)
+        {
+            if (cache->flags[page] & PAGE_PINNED)
+                continue;
+            if (cache->flags[page] & PAGE_RESIDENT)
+                cnt_resident--;
+            if (cache->flags[page] & PAGE_DIRTY)
+                cnt_dirty--;
+        }
+        if (cache->direct_fd != cache->fd)
+            close(cache->direct_fd);
+        munmap(cache->base, cache->len);
+        munmap(cache->shadow, cache->len);
+        free(cache->flags);
+        free(cache);
+        return;
+    }
+}
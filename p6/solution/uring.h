@@ -0,0 +1,55 @@
+#ifndef WFS_URING_H
+#define WFS_URING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+  io_uring disk backend for wfs (--io-uring).
+  Each disk image gets an address range with the same layout, so blocks
+  keep the addresses get_d_block_ptr and get_inode_ptr compute, but a
+  page only holds data once it is loaded: uring_load reads the pages a
+  block lives on (and a chunk ahead) before wfs touches it, and
+  uring_mark_dirty records a block wfs stored to. The metadata ranges are
+  loaded at mount and pinned; a shadow copy of each pinned page tells
+  which ones changed. uring_trim drops clean data pages on a clock once
+  more than the cache size is resident.
+  uring_flush writes back with O_DIRECT, up to URING_DEPTH requests in
+  flight over all the images, in two rounds each closed by an fsync: the
+  dirty data pages first, then the metadata. A dirty page stays resident
+  until it is written back, whatever the cache size.
+  Built on the raw system calls so wfs keeps building without liburing.
+*/
+
+// requests in flight at once, shared by all the images
+#define URING_DEPTH (64)
+
+// default bytes of data pages kept resident over all the images
+#define URING_CACHE_SIZE (64 * 1024 * 1024)
+
+// reserves the address range for an open image (size bytes) without reading it, returns it or NULL with errno set
+void *uring_map_disk(int fd, off_t size);
+
+// loads and pins len bytes at off as metadata, returns 0 or -errno
+int uring_add_meta(void *cache, off_t off, off_t len);
+
+// reads the pages of len bytes at addr not resident yet, returns 0 or -errno (a no-op outside the caches)
+int uring_load(void *addr, size_t len);
+
+// loads len bytes at addr and marks them to be written back, returns 0 or -errno
+int uring_mark_dirty(void *addr, size_t len);
+
+// drops clean data pages past the cache size, returns 1 once the dirty ones fill half of it
+int uring_trim(void);
+
+// bytes of data pages kept resident, set before the first image is mapped
+void uring_set_cache_size(size_t bytes);
+
+// writes every dirty page of every cache back, returns 0 or -errno
+// nothing may store to the caches while it runs
+int uring_flush(void);
+
+// drops a cache without writing it back, the image fd stays open
+void uring_unmap_disk(void *cache);
+
+#endif
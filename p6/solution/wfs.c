@@ -9,24 +9,48 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/statvfs.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
 #include "wfs.h"
+#include "trace.h"
+#include "wfs_ioctl.h"
+#include "compress.h"
+#include "uring.h"
 
 // ############################################ Global Variables #####################################
 
-// array of pointers to disk memory maps in the mkfs order
-void *ordered_disk_mmap_ptr[10] = {NULL};
+// array of pointers to disk memory maps in the mkfs order, grown as disks are added
+void **ordered_disk_mmap_ptr = NULL;
+
+// per disk in the same order, the open image file and the length mapped
+int *ordered_disk_fd = NULL;
+off_t *ordered_disk_size = NULL;
 
 // global variable to store number of disks in wfs
 int cnt_disks = 0;
 
 int raid_mode = -1;
 
+// disks each inode is stored on (sb->inode_copies, every disk unless RAID0 says fewer)
+int cnt_inode_copies = 0;
+
+// RAID0 : leading disks that hold only metadata (sb->cnt_meta_disks), 0 : none
+int cnt_meta_disks = 0;
+
+// per inode, bumped whenever the inode's block map changes (invalidates handle caches)
+unsigned long *block_map_gen = NULL;
+
+// set by the --io-uring mount option : the disks are cached in memory and written back through io_uring
+int use_io_uring = 0;
+
 // ######################################### memory map functions #########################################
 
-// function to populate array mmap pointers
-void create_disk_mmap(char **disk_name, int disk_cnt, void **disk_mmap_ptr, int disk_size, int disk_fd[])
+// function to populate array mmap pointers, each disk is mapped whole and its size stored
+// with --io-uring the disk gets a cache instead with only its superblock read, NULL if that fails
+void create_disk_mmap(char **disk_name, int disk_cnt, void **disk_mmap_ptr, off_t disk_size[], int disk_fd[])
 {
     // printf("test 1 \n");
     // open files & create mmap pointers
@@ -34,20 +58,60 @@ void create_disk_mmap(char **disk_name, int disk_cnt, void **disk_mmap_ptr, int
     {
         // printf("does he know\n");
         int fd = open(disk_name[i], O_RDWR, 0777);
+        struct stat st;
         disk_fd[i] = fd;
-        disk_mmap_ptr[i] = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        disk_size[i] = (fstat(fd, &st) == 0) ? st.st_size : 0;
+        if (use_io_uring)
+        {
+            disk_mmap_ptr[i] = (fd < 0) ? NULL : uring_map_disk(fd, disk_size[i]);
+            int res = (disk_mmap_ptr[i] == NULL) ? 0 : uring_add_meta(disk_mmap_ptr[i], 0, sizeof(struct wfs_sb));
+            if (res != 0)
+            {
+                uring_unmap_disk(disk_mmap_ptr[i]);
+                disk_mmap_ptr[i] = NULL;
+                errno = -res;
+            }
+        }
+        else
+            disk_mmap_ptr[i] = mmap(NULL, disk_size[i], PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     }
 }
 
+/****************************************
+--io-uring : reads and pins the metadata of a disk laid out as sb says
+the superblock, bitmaps and inode table stay in memory and are written
+back after the data blocks they point to
+returns 0 or -errno
+*****************************************/
+int pin_disk_metadata(void *disk, struct wfs_sb *sb)
+{
+    int res = 0;
+    if (!use_io_uring)
+        return res;
+
+    // everything ahead of the data blocks, and the regions a grow or an upgrade moved into them
+    res = uring_add_meta(disk, 0, sb->d_blocks_ptr);
+    if (res == 0)
+        res = uring_add_meta(disk, sb->i_bitmap_ptr, (sb->num_inodes + 7) / 8);
+    if (res == 0)
+        res = uring_add_meta(disk, sb->d_bitmap_ptr, (sb->num_data_blocks + 7) / 8);
+    if (res == 0)
+        res = uring_add_meta(disk, sb->i_blocks_ptr, sb->num_inodes * BLOCK_SIZE);
+    return res;
+}
+
 /************************************************
 Function to free memory maps & close file pointers
 *************************************************/
-void remove_disk_mmap(int disk_cnt, int disk_size, int disk_fd[], void **mmap_pointers)
+void remove_disk_mmap(int disk_cnt, off_t disk_size[], int disk_fd[], void **mmap_pointers)
 {
     for (int i = 0; i < disk_cnt; i++)
     {
         // munmap
-        munmap(mmap_pointers[i], disk_size);
+        if (use_io_uring)
+            uring_unmap_disk(mmap_pointers[i]);
+        else
+            munmap(mmap_pointers[i], disk_size[i]);
         // free the file-descriptors
         close(disk_fd[i]);
     }
@@ -61,7 +125,7 @@ void reorder_disk_mmap(int disk_cnt, void **disk_mmap_ptr, void **ordered_disk_m
         struct wfs_sb *sb = (struct wfs_sb *)disk_mmap_ptr[i];
         ordered_disk_mmap_ptr[sb->disk_order] = disk_mmap_ptr[i];
     }
-    printf("reorder disk map done\n");
+    TRACE(TR_RAID, "disk order established for %d disks", disk_cnt);
 }
 
 // ########################################### Helper functions ##########################################
@@ -70,7 +134,7 @@ void reorder_disk_mmap(int disk_cnt, void **disk_mmap_ptr, void **ordered_disk_m
 int get_raid_mode(void *disk_mmap_ptr)
 {
     struct wfs_sb *sb = (struct wfs_sb *)disk_mmap_ptr;
-    printf("RAID%d\n", sb->raid_mode);
+    TRACE(TR_RAID, "RAID mode %d", sb->raid_mode);
     return sb->raid_mode;
 }
 
@@ -78,7 +142,6 @@ int get_raid_mode(void *disk_mmap_ptr)
 // populates array of tokens using strdup()
 int path_parse(char *str, char **arg_arr, char *delims)
 {
-    printf("path parse called\n");
     int arg_cnt = 0; // cnt of the number of tokens
     // using strtok()
     // Returns pointer to first token
@@ -94,10 +157,21 @@ int path_parse(char *str, char **arg_arr, char *delims)
         token = strtok(NULL, delims);
     }
 
-    printf("tokens found = %d\n", arg_cnt);
+    TRACE_V(TR_LOOKUP, "path_parse: %d tokens", arg_cnt);
     return arg_cnt;
 }
 
+// returns 1 if len bytes are all zero
+int is_zero_range(const char *data, int len)
+{
+    for (int i = 0; i < len; i++)
+    {
+        if (data[i] != 0)
+            return 0;
+    }
+    return 1;
+}
+
 char *get_name_from_path(const char *path)
 {
     char *copy_path = strdup(path);
@@ -113,6 +187,7 @@ char *get_name_from_path(const char *path)
 checks the inode bitmap of the given disk
 returns the next empty inode index
 else returns -1
+the caller claims it with set_inode_index()
 ****************************************/
 
 int get_next_inode_index(int disk_num)
@@ -133,9 +208,6 @@ int get_next_inode_index(int disk_num)
         {
             if ((i_bitmap[i] & mask) == 0)
             {
-                // set the inode bitmap
-                i_bitmap[i] |= mask;
-
                 // return the inode number
                 inode_number = i * 32 + j;
                 return inode_number;
@@ -149,6 +221,7 @@ int get_next_inode_index(int disk_num)
 /****************************************
 sets the inode bitmap index for all disk
 can set or reset based on the arguments passed
+keeps sb->free_inodes in step with the bitmap
 *****************************************/
 void set_inode_index(int inode_number, uint32_t given_mask)
 {
@@ -171,19 +244,38 @@ void set_inode_index(int inode_number, uint32_t given_mask)
         }
         // set the inode bitmap
         if (given_mask == 1) // on given_mask=0 bit-wise OR won't work to reset the i-bitmap
+        {
+            if ((i_bitmap[row] & mask) == 0)
+                sb->free_inodes--;
             i_bitmap[row] |= mask;
+        }
         else
+        {
+            if ((i_bitmap[row] & mask) != 0)
+                sb->free_inodes++;
             i_bitmap[row] &= ~mask;
+        }
     }
 }
 
+// disk holding copy `copy` of an inode, copy 0 is the home disk
+int inode_copy_disk(int inode_num, int copy)
+{
+    // metadata disks all hold every inode
+    if (cnt_meta_disks > 0 || cnt_inode_copies == cnt_disks)
+        return copy;
+    return (inode_num + copy) % cnt_disks;
+}
+
 /*************************************
 // Returns pointer to inode based on
 // 1. given inode_num
-// 2. given disk
+// 2. given copy, 0 .. cnt_inode_copies - 1
+// every copy holds the same inode, readers use copy 0
 **************************************/
-struct wfs_inode *get_inode_ptr(int inode_num, int disk_num)
+struct wfs_inode *get_inode_ptr(int inode_num, int copy)
 {
+    int disk_num = inode_copy_disk(inode_num, copy);
     struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[disk_num];
     char *base = (void *)ordered_disk_mmap_ptr[disk_num];
 
@@ -191,66 +283,215 @@ struct wfs_inode *get_inode_ptr(int inode_num, int disk_num)
     return curr_inode;
 }
 
-// ################################################ d-block helpers ################################################
+// ################################################ Disk placement ################################################
 
-// function to return the next free d-block index if available
-int get_free_d_block_index(int disk_num)
+/*
+  RAID0 stripes block i of every file and directory over the disks
+  (i % cnt_disks) and keeps the indirect block on disk IND_BLOCK % cnt_disks;
+  mirrors keep every block at the same index on every disk. With metadata
+  disks (mkfs -M) the first cnt_meta_disks disks hold the inodes, the
+  directory blocks and the indirect blocks, striped over those disks,
+  and file data is striped over the remaining disks only.
+  While a RAID0 volume is reshaped onto an added disk, the inodes the
+  reshape has not reached yet stay striped over the old disk count.
+  RAID0 disks of different sizes get file blocks in proportion to their
+  data blocks: the stripe then follows a fixed pattern per disk count,
+  a smooth weighted round robin over the data disks.
+*/
+
+// RAID0 reshape checkpoint, copies of sb->reshape_old_disks and sb->reshape_inode
+int reshape_old_disks = 0;
+int reshape_inode = 0;
+
+// longest weighted stripe pattern, larger weights are scaled down to fit
+#define STRIPE_PERIOD_MAX (2 * MAX_DISKS + 64)
+
+// per count of disks striped over, the weighted pattern and its length, 0 : plain round robin
+int stripe_pattern[MAX_DISKS + 1][STRIPE_PERIOD_MAX];
+int stripe_period[MAX_DISKS + 1];
+
+// data blocks a disk holds, smaller RAID0 disks hold fewer
+size_t disk_data_blocks(int disk_num)
 {
     struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[disk_num];
+    return (sb->disk_blocks > 0) ? sb->disk_blocks : sb->num_data_blocks;
+}
 
-    // check sb->i_bitmap for empty spot
-    // Change type of pointer to char to make it byte addressable
-    char *base = (void *)ordered_disk_mmap_ptr[disk_num];
+// greatest common divisor, gcd(0, b) is b
+int gcd(int a, int b)
+{
+    while (b != 0)
+    {
+        int r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
 
-    int data_block_number = -1;
-    __u_int *d_bitmap = (__u_int *)(base + sb->d_bitmap_ptr);
+/****************************************
+builds the weighted stripe pattern for every disk count up to cnt_disks
+disks of one size keep the plain round robin
+called at mount and whenever a disk is added
+*****************************************/
+void build_stripe_patterns()
+{
+    memset(stripe_period, 0, sizeof(stripe_period));
+    if (raid_mode != 0)
+        return;
 
-    for (int i = 0; i < sb->num_data_blocks / 32; i++)
+    for (int cnt_stripe = cnt_meta_disks + 1; cnt_stripe <= cnt_disks; cnt_stripe++)
     {
-        uint32_t mask = 1;
-        for (int j = 0; j < 32; j++)
+        int weight[MAX_DISKS] = {0};
+        int current[MAX_DISKS] = {0};
+        int total = 0;
+        int common = 0;
+        int same_size = 1;
+        for (int i = cnt_meta_disks; i < cnt_stripe; i++)
         {
-            if ((d_bitmap[i] & mask) == 0)
+            weight[i] = disk_data_blocks(i) / 32;
+            common = gcd(common, weight[i]);
+            if (weight[i] != weight[cnt_meta_disks])
+                same_size = 0;
+        }
+        if (same_size)
+            continue;
+
+        for (int i = cnt_meta_disks; i < cnt_stripe; i++)
+        {
+            weight[i] /= common;
+            total += weight[i];
+        }
+        // check : the pattern stays short, the smallest disk keeps a slot
+        if (total > STRIPE_PERIOD_MAX - MAX_DISKS)
+        {
+            int scaled = 0;
+            for (int i = cnt_meta_disks; i < cnt_stripe; i++)
             {
-                // set the inode bitmap
-                // d_bitmap[i] |= mask;
+                weight[i] = weight[i] * (STRIPE_PERIOD_MAX - MAX_DISKS) / total;
+                if (weight[i] == 0)
+                    weight[i] = 1;
+                scaled += weight[i];
+            }
+            total = scaled;
+        }
 
-                // return the inode number
-                data_block_number = i * 32 + j;
-                return data_block_number;
+        // each slot goes to the disk furthest behind its share
+        for (int slot = 0; slot < total; slot++)
+        {
+            int pick = cnt_meta_disks;
+            for (int i = cnt_meta_disks; i < cnt_stripe; i++)
+            {
+                current[i] += weight[i];
+                if (current[i] > current[pick])
+                    pick = i;
             }
-            mask = mask << 1;
+            current[pick] -= total;
+            stripe_pattern[cnt_stripe][slot] = pick;
         }
+        stripe_period[cnt_stripe] = total;
+        TRACE(TR_RAID, "weighted stripe over %d disks, period %d", cnt_stripe, total);
     }
-    return data_block_number;
 }
 
-/*****************
-sets the given data bitmap index to the given mask for all disks
-****************/
-void set_data_bmp_index(int data_block_number, uint32_t given_mask, int disk_num)
+// disks the blocks of an inode are striped over
+int stripe_disks(int inode_num)
 {
-    // for (int i = 0; i < cnt_disks; i++)
-    // {
-    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[disk_num];
-    char *base = (void *)sb;
-    __u_int *d_bitmap = (__u_int *)(base + sb->d_bitmap_ptr);
+    if (reshape_old_disks > 0 && inode_num >= reshape_inode)
+        return reshape_old_disks;
+    return cnt_disks;
+}
 
-    int row = data_block_number / 32;
-    int col = data_block_number % 32;
+// disk holding data block index_in_blocks of a file striped over cnt_stripe disks
+int stripe_data_disk(int cnt_stripe, int index_in_blocks)
+{
+    if (stripe_period[cnt_stripe] > 0)
+        return stripe_pattern[cnt_stripe][index_in_blocks % stripe_period[cnt_stripe]];
+    if (cnt_meta_disks == 0)
+        return index_in_blocks % cnt_stripe;
+    return cnt_meta_disks + index_in_blocks % (cnt_stripe - cnt_meta_disks);
+}
 
-    __u_int mask = mask = 1;
+// disk holding the indirect block of a file striped over cnt_stripe disks
+int stripe_ind_disk(int cnt_stripe)
+{
+    if (cnt_meta_disks == 0)
+        return IND_BLOCK % cnt_stripe;
+    return IND_BLOCK % cnt_meta_disks;
+}
 
-    for (int i = 0; i < col; i++)
-    {
-        mask = mask << 1;
-    }
-    // set the inode bitmap
-    if (given_mask == 1) // on given_mask=0 bit-wise OR won't work to reset the i-bitmap
-        d_bitmap[row] |= mask;
-    else
-        d_bitmap[row] &= ~mask;
-    // }
+// disk holding blocks[index_in_blocks] of an inode striped over cnt_stripe disks, file or directory
+int stripe_block_disk(int cnt_stripe, struct wfs_inode *inode_ptr, int index_in_blocks)
+{
+    if (cnt_meta_disks > 0 && S_ISDIR(inode_ptr->mode))
+        return index_in_blocks % cnt_meta_disks;
+    return stripe_data_disk(cnt_stripe, index_in_blocks);
+}
+
+// disk holding data block index_in_blocks of a file
+int data_disk(int inode_num, int index_in_blocks)
+{
+    return stripe_data_disk(stripe_disks(inode_num), index_in_blocks);
+}
+
+// disk holding the indirect block of a file
+int ind_disk(int inode_num)
+{
+    return stripe_ind_disk(stripe_disks(inode_num));
+}
+
+// disk holding blocks[index_in_blocks] of an inode, file or directory
+int block_disk(struct wfs_inode *inode_ptr, int index_in_blocks)
+{
+    return stripe_block_disk(stripe_disks(inode_ptr->num), inode_ptr, index_in_blocks);
+}
+
+// ################################################ Write-intent bitmap ################################################
+
+/*
+  A mirror (RAID1 / 1v) can mount with disks missing. The disks present
+  record the missing ones in sb->missing_disks and, while degraded, set
+  the sb->wi_bitmap bit of every data region they write. A disk that
+  comes back gets the metadata (bitmaps and inode table) copied whole at
+  mount and the dirty regions copied by a background thread; until that
+  thread has passed a dirty region the returning disk's blocks in it are
+  served from the source disk. A blank image in place of a missing disk
+  gets every region marked dirty.
+*/
+
+// mounted without every mirror, writes mark their region
+int degraded = 0;
+
+// ordered index of the disk a resync copies from, -1 : no resync running
+int resync_source = -1;
+
+// ordered indices of the disks being resynced
+int *resync_stale = NULL;
+
+// regions below the cursor are copied already
+int resync_cursor = 0;
+
+// data blocks per write-intent region
+int wi_region_blocks()
+{
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+    return (sb->num_data_blocks + WI_REGIONS - 1) / WI_REGIONS;
+}
+
+// returns 1 if a region was written while a disk was missing
+int wi_region_dirty(int region)
+{
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[(resync_source != -1) ? resync_source : 0];
+    return (sb->wi_bitmap[region / 32] >> (region % 32)) & 1;
+}
+
+// returns 1 if a disk's copy of a d-block is stale and must come from the resync source
+int is_stale_block(int d_block_index, int disk_num)
+{
+    if (resync_source == -1 || !resync_stale[disk_num])
+        return 0;
+    int region = d_block_index / wi_region_blocks();
+    return region >= resync_cursor && wi_region_dirty(region);
 }
 
 /*****************************************
@@ -258,6 +499,7 @@ void set_data_bmp_index(int data_block_number, uint32_t given_mask, int disk_num
  index of d_block based on data bitmap;
  RAID;
  pointer to set;
+ --io-uring : NULL if the block could not be read from the image
  *****************************************/
 void *get_d_block_ptr(int d_block_index, int disk_num)
 {
@@ -268,6 +510,10 @@ void *get_d_block_ptr(int d_block_index, int disk_num)
     //     disk_num = d_block_index % cnt_disks;
     // }
 
+    // resync : a stale region of a returning mirror is served from the source disk
+    if (is_stale_block(d_block_index, disk_num))
+        disk_num = resync_source;
+
     // point to the sb of the correct disk (matters for RAID 0)
     struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[disk_num];
     char *base = (void *)sb;
@@ -282,369 +528,5228 @@ void *get_d_block_ptr(int d_block_index, int disk_num)
     // all blocks present in the each disks
     d_block_ptr = (void *)(base + sb->d_blocks_ptr + d_block_index * BLOCK_SIZE);
     // }
+
+    // --io-uring : the block is read from the image on first use, a page that was never read is not handed out
+    if (use_io_uring && uring_load(d_block_ptr, BLOCK_SIZE) != 0)
+    {
+        TRACE(TR_IO, "disk %d: d-block %d could not be read", disk_num, d_block_index);
+        return NULL;
+    }
     return d_block_ptr;
 }
 
-/**************************
-returns 1 if new data block should be allocated to an inode
-only for the direct blocks
-*****************************/
-int alloc_d_block_to_dir(int inode_num)
+/****************************************
+marks a d-block written, before or after the store
+RAID0 : on disk_num, -1 : on every disk (mirrors always are)
+--io-uring : its pages are written back with the next flush
+degraded : its region is logged on every disk present
+returns 0, or -EIO if the block could not be read (nothing may be stored to it then)
+a block marked stays loaded until the lock is dropped, get_d_block_ptr() on it cannot fail
+*****************************************/
+int mark_block_written(int d_block_index, int disk_num)
 {
-    struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, 0);
+    int res = 0;
+    if (d_block_index < 0)
+        return res;
 
-    // loop over all indexes in blocks
-    int cnt_allocated_blocks = 0;
-    for (int i = 0; i < 7; i++)
+    for (int i = 0; use_io_uring && i < cnt_disks; i++)
     {
-        if (inode_ptr->blocks[i] != -1)
-            cnt_allocated_blocks++;
+        if (raid_mode == 0 && disk_num != -1 && i != disk_num)
+            continue;
+        void *d_block_ptr = get_d_block_ptr(d_block_index, i);
+        if (d_block_ptr == NULL || uring_mark_dirty(d_block_ptr, BLOCK_SIZE) != 0)
+        {
+            res = -EIO;
+            return res;
+        }
     }
+    if (!degraded)
+        return res;
 
-    // if(!(inode_ptr->size < (cnt_allocated_blocks*BLOCK_SIZE)))
-    // {
-    //     return 1;
-    // }
-
-    if (((inode_ptr->size == 0) && (inode_ptr->blocks[0] == -1)) ||
-        ((inode_ptr->size % BLOCK_SIZE == 0) && (inode_ptr->size / BLOCK_SIZE != 7)) ||
-        (!(inode_ptr->size < (cnt_allocated_blocks * BLOCK_SIZE))))
-    {
-        return 1;
-    }
-    // else if(inode_ptr->size/BLOCK_SIZE == 7){
-    //     return -1;
-    // }
-    else
+    int region = d_block_index / wi_region_blocks();
+    for (int i = 0; i < cnt_disks; i++)
     {
-        return 0;
+        struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[i];
+        sb->wi_bitmap[region / 32] |= 1u << (region % 32);
     }
+    return res;
 }
 
-/*************
-allocates a new data-block to the given inode
-updates the inode blocks array on all disks
-argument disk_num included to add raid0 support later
-*************** */
-int allocate_direct_block(int inode_num, int blocks_index, int disk_num)
+// ################################################ d-block helpers ################################################
+
+// function to return the next free d-block index if available
+int get_free_d_block_index(int disk_num)
 {
-    int d_block_index = get_free_d_block_index(disk_num);
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[disk_num];
 
-    // check : data bitmap full
-    if (d_block_index == -1)
-    {
-        return -1;
-    }
+    // check sb->i_bitmap for empty spot
+    // Change type of pointer to char to make it byte addressable
+    char *base = (void *)ordered_disk_mmap_ptr[disk_num];
 
-    // set the data bitmap
+    int data_block_number = -1;
+    __u_int *d_bitmap = (__u_int *)(base + sb->d_bitmap_ptr);
 
-    if (raid_mode == 0)
+    for (int i = 0; i < sb->num_data_blocks / 32; i++)
     {
-        set_data_bmp_index(d_block_index, 1, disk_num);
-
-        // update the inode
-        if (blocks_index <= 6)
+        uint32_t mask = 1;
+        for (int j = 0; j < 32; j++)
         {
-            for (int i = 0; i < cnt_disks; i++)
+            if ((d_bitmap[i] & mask) == 0)
             {
-                struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, i);
-                inode_ptr->blocks[blocks_index] = d_block_index;
-                // increment size, reason : new d-block allocated
-                // inode_ptr->size += BLOCK_SIZE;
-            }
-        }
-        else
-        {
-            struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, disk_num);
-            int indirect_block_index = inode_ptr->blocks[7];
-            int indirect_block_disk = 7 % cnt_disks; // disk that holds the indirect block
-            off_t *indirect_block_ptr = (off_t *)get_d_block_ptr(indirect_block_index, indirect_block_disk);
-            int index_in_indirect_block = blocks_index - 7;
-            indirect_block_ptr[index_in_indirect_block] = d_block_index;
-        }
-    }
-
-    // raid1
-    else
-    {
-        for (int i = 0; i < cnt_disks; i++)
-        {
-            set_data_bmp_index(d_block_index, 1, i);
-
-            struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, i);
-            // put the newly allocated data-block into blocks array
-            if (blocks_index <= 6)
-                inode_ptr->blocks[blocks_index] = d_block_index;
+                // set the inode bitmap
+                // d_bitmap[i] |= mask;
 
-            else
-            {
-                int indirect_block_index = inode_ptr->blocks[7];
-                off_t *indirect_block_ptr = (off_t *)get_d_block_ptr(indirect_block_index, i);
-                int index_in_indirect_block = blocks_index - 7;
-                indirect_block_ptr[index_in_indirect_block] = d_block_index;
+                // return the inode number
+                data_block_number = i * 32 + j;
+                return data_block_number;
             }
-            // increment size, reason : new d-block allocated
-            // inode_ptr->size += BLOCK_SIZE;
+            mask = mask << 1;
         }
     }
-    return d_block_index;
+    return data_block_number;
 }
 
-int allocate_indirect_block(int inode_num, int disk_num)
+/*****************
+sets the given data bitmap index to the given mask for all disks
+keeps sb->free_data_blocks of that disk in step with the bitmap
+****************/
+void set_data_bmp_index(int data_block_number, uint32_t given_mask, int disk_num)
 {
-    int d_block_index = get_free_d_block_index(disk_num);
+    // check : unallocated block pointer (-1)
+    if (data_block_number < 0)
+        return;
 
-    // check : data bitmap full
-    if (d_block_index == -1)
-    {
-        return -1;
-    }
+    // for (int i = 0; i < cnt_disks; i++)
+    // {
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[disk_num];
+    char *base = (void *)sb;
+    __u_int *d_bitmap = (__u_int *)(base + sb->d_bitmap_ptr);
 
-    if (raid_mode == 0)
-    {
-        set_data_bmp_index(d_block_index, 1, disk_num);
-        memset(get_d_block_ptr(d_block_index, disk_num), -1, BLOCK_SIZE * (sizeof(char)));
-        for (int i = 0; i < cnt_disks; i++)
-        {
-            // set_data_bmp_index(d_block_index, 1, i);
+    int row = data_block_number / 32;
+    int col = data_block_number % 32;
 
-            struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, i);
-            // put the newly allocated data-block into blocks array
-            inode_ptr->blocks[7] = d_block_index;
+    __u_int mask = mask = 1;
 
-            // increment size, reason : new d-block allocated
-            // inode_ptr->size += BLOCK_SIZE;
-        }
+    for (int i = 0; i < col; i++)
+    {
+        mask = mask << 1;
+    }
+    // set the inode bitmap
+    if (given_mask == 1) // on given_mask=0 bit-wise OR won't work to reset the i-bitmap
+    {
+        if ((d_bitmap[row] & mask) == 0)
+            sb->free_data_blocks--;
+        d_bitmap[row] |= mask;
+        // a failed mark leaves the block unloaded, the store to it then fails in get_d_block_ptr()
+        mark_block_written(data_block_number, disk_num);
     }
-
-    // set the data bitmap
-    // raid1
     else
     {
-        for (int i = 0; i < cnt_disks; i++)
+        if ((d_bitmap[row] & mask) != 0)
+            sb->free_data_blocks++;
+        d_bitmap[row] &= ~mask;
+    }
+    // }
+}
+
+/****************************************
+recounts both bitmaps of every disk once at mount
+and repairs the free counters in the superblocks if they drifted
+*****************************************/
+void verify_free_counters()
+{
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[i];
+        char *base = (void *)sb;
+        __u_int *i_bitmap = (__u_int *)(base + sb->i_bitmap_ptr);
+        __u_int *d_bitmap = (__u_int *)(base + sb->d_bitmap_ptr);
+
+        size_t used_inodes = 0;
+        for (int j = 0; j < sb->num_inodes / 32; j++)
+            used_inodes += __builtin_popcount(i_bitmap[j]);
+
+        size_t used_data_blocks = 0;
+        for (int j = 0; j < sb->num_data_blocks / 32; j++)
+            used_data_blocks += __builtin_popcount(d_bitmap[j]);
+
+        if (sb->free_inodes != sb->num_inodes - used_inodes ||
+            sb->free_data_blocks != sb->num_data_blocks - used_data_blocks)
         {
-            set_data_bmp_index(d_block_index, 1, i);
+            TRACE(TR_ALLOC, "disk %d: free counters repaired (inodes %zu -> %zu, blocks %zu -> %zu)", i,
+                  sb->free_inodes, sb->num_inodes - used_inodes,
+                  sb->free_data_blocks, sb->num_data_blocks - used_data_blocks);
+            sb->free_inodes = sb->num_inodes - used_inodes;
+            sb->free_data_blocks = sb->num_data_blocks - used_data_blocks;
+        }
+    }
+}
 
-            struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, i);
-            // put the newly allocated data-block into blocks array
-            inode_ptr->blocks[7] = d_block_index;
-            memset(get_d_block_ptr(d_block_index, i), -1, BLOCK_SIZE * (sizeof(char)));
-            // inode_ptr->size += BLOCK_SIZE;
+// ###################################### Allocation groups ######################################
 
-            // increment size, reason : new d-block allocated
-            // inode_ptr->size += BLOCK_SIZE;
+/*
+  The inode and data bitmaps are split into sb->cnt_groups allocation
+  groups (mkfs -g), each a run of whole bitmap words together with the
+  inodes and data blocks those words cover; the on-disk layout itself is
+  unchanged. A file's inode goes into its parent's group and its blocks
+  into its inode's group, so a directory's files and their data sit
+  together. New directories are spread Orlov-style: top-level ones go to
+  the emptiest group, deeper ones stay with their parent unless its
+  group is emptier than average. Searches start in the goal group and
+  move on to the next groups when it is full.
+*/
+
+// sb->cnt_groups once mounted, at least 1
+int cnt_groups = 1;
+
+// per disk, d-blocks held by preallocation windows (mirrors only use disk 0)
+__u_int **pa_reserved = NULL;
+
+// first inode of a group, group cnt_groups gives the end of the table
+int group_first_inode(int group)
+{
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+    int cnt_words = sb->num_inodes / 32;
+    return (group * cnt_words / cnt_groups) * 32;
+}
+
+// first data block of a group, group cnt_groups gives the end of the data region
+int group_first_block(int group)
+{
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+    int cnt_words = sb->num_data_blocks / 32;
+    return (group * cnt_words / cnt_groups) * 32;
+}
+
+int inode_group(int inode_num)
+{
+    int group = 0;
+    while (group + 1 < cnt_groups && inode_num >= group_first_inode(group + 1))
+        group++;
+    return group;
+}
+
+__u_int *get_i_bitmap(int disk_num)
+{
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[disk_num];
+    return (__u_int *)((char *)sb + sb->i_bitmap_ptr);
+}
+
+__u_int *get_d_bitmap(int disk_num)
+{
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[disk_num];
+    return (__u_int *)((char *)sb + sb->d_bitmap_ptr);
+}
+
+// returns the first bit in [from, to) clear in bitmap and in reserved (NULL : none), -1 if there is none
+int find_clear_bit(__u_int *bitmap, __u_int *reserved, int from, int to)
+{
+    for (int i = from; i < to; i++)
+    {
+        __u_int word = bitmap[i / 32] | ((reserved != NULL) ? reserved[i / 32] : 0);
+
+        // skip : full words
+        if (i % 32 == 0 && word == 0xffffffffu)
+        {
+            i += 31;
+            continue;
         }
+        if ((word & (1u << (i % 32))) == 0)
+            return i;
     }
-    return d_block_index;
+    return -1;
 }
 
-/*********************
-return dentry pointer to the next empty slot or the the last filled slot
-based on value of dcr
-***********************/
-struct wfs_dentry *get_dentry_ptr(int inode_num, int disk_num, int dcr)
+// clear bits in [from, to), both multiples of 32
+int count_clear_bits(__u_int *bitmap, int from, int to)
+{
+    int cnt = 0;
+    for (int i = from / 32; i < to / 32; i++)
+        cnt += 32 - __builtin_popcount(bitmap[i]);
+    return cnt;
+}
+
+int group_free_inodes(int group)
+{
+    return count_clear_bits(get_i_bitmap(0), group_first_inode(group), group_first_inode(group + 1));
+}
+
+// free data blocks of a group over every disk
+int group_free_blocks(int group)
+{
+    int cnt = 0;
+    for (int i = 0; i < ((raid_mode == 0) ? cnt_disks : 1); i++)
+        cnt += count_clear_bits(get_d_bitmap(i), group_first_block(group), group_first_block(group + 1));
+    return cnt;
+}
+
+/****************************************
+picks the group a new inode goes into (Orlov)
+files : the parent's group
+top-level directories : the group with the most free inodes among those with average free blocks or more
+deeper directories : the parent's group, unless it is below average in free inodes or free blocks
+*****************************************/
+int pick_inode_group(int parent_inode_num, int is_dir)
+{
+    int parent_group = (parent_inode_num > 0) ? inode_group(parent_inode_num) : 0;
+    if (!is_dir || cnt_groups == 1)
+        return parent_group;
+
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+    int avg_free_inodes = sb->free_inodes / cnt_groups;
+    int avg_free_blocks = 0;
+    for (int group = 0; group < cnt_groups; group++)
+        avg_free_blocks += group_free_blocks(group);
+    avg_free_blocks /= cnt_groups;
+
+    if (parent_inode_num > 0 && group_free_inodes(parent_group) >= avg_free_inodes &&
+        group_free_blocks(parent_group) >= avg_free_blocks)
+        return parent_group;
+
+    // spread : the emptiest group, searched from the parent's group on
+    int best_group = parent_group;
+    int best_free = -1;
+    for (int k = 0; k < cnt_groups; k++)
+    {
+        int group = (parent_group + k) % cnt_groups;
+        int free_inodes = group_free_inodes(group);
+        if (group_free_blocks(group) >= avg_free_blocks && free_inodes > best_free)
+        {
+            best_group = group;
+            best_free = free_inodes;
+        }
+    }
+    TRACE(TR_ALLOC, "orlov: directory under inode %d placed in group %d", parent_inode_num, best_group);
+    return best_group;
+}
+
+/****************************************
+returns a free inode index for a new file or directory under the given parent
+searched from the group pick_inode_group() chose, -1 if the table is full
+the caller claims it with set_inode_index()
+*****************************************/
+int get_next_inode_near(int parent_inode_num, int is_dir)
+{
+    int goal = pick_inode_group(parent_inode_num, is_dir);
+    for (int k = 0; k < cnt_groups; k++)
+    {
+        int group = (goal + k) % cnt_groups;
+        int inode_num = find_clear_bit(get_i_bitmap(0), NULL, group_first_inode(group), group_first_inode(group + 1));
+        if (inode_num != -1)
+            return inode_num;
+    }
+    return -1;
+}
+
+/****************************************
+returns a free d-block of a disk for a block of the given inode
+searched from the inode's group on, blocks held by preallocation windows last
+-1 if the disk is full
+*****************************************/
+int get_free_d_block_near(int disk_num, int inode_num)
+{
+    int goal = inode_group(inode_num);
+    __u_int *reserved = pa_reserved[(raid_mode == 0) ? disk_num : 0];
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int k = 0; k < cnt_groups; k++)
+        {
+            int group = (goal + k) % cnt_groups;
+            int d_block_index = find_clear_bit(get_d_bitmap(disk_num), (pass == 0) ? reserved : NULL,
+                                               group_first_block(group), group_first_block(group + 1));
+            if (d_block_index != -1)
+                return d_block_index;
+        }
+    }
+    return -1;
+}
+
+/****************************************
+returns the first index of cnt consecutive free d-blocks for the given inode
+searched from the start of the inode's group to the end of the disk, then from block 0
+runs over blocks held by preallocation windows are only taken if there is no other
+-1 if there is no such run
+*****************************************/
+int get_free_d_block_run(int disk_num, int cnt, int inode_num)
+{
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[disk_num];
+    __u_int *d_bitmap = get_d_bitmap(disk_num);
+    __u_int *reserved = pa_reserved[(raid_mode == 0) ? disk_num : 0];
+    int start = group_first_block(inode_group(inode_num));
+    int end = (sb->num_data_blocks / 32) * 32;
+
+    for (int pass = 0; pass < 4; pass++)
+    {
+        int from = (pass % 2 == 0) ? start : 0;
+        int to = (pass % 2 == 0) ? end : start;
+        int run_start = from;
+        int run_len = 0;
+        for (int i = from; i < to; i++)
+        {
+            __u_int word = d_bitmap[i / 32] | ((pass < 2) ? reserved[i / 32] : 0);
+            if (word & (1u << (i % 32)))
+            {
+                run_start = i + 1;
+                run_len = 0;
+                continue;
+            }
+            if (++run_len == cnt)
+                return run_start;
+        }
+    }
+    return -1;
+}
+
+// ###################################### Preallocation windows ######################################
+
+/*
+  An inode that keeps allocating forward (a streaming append) gets a
+  preallocation window per disk: a run of free blocks right after its
+  last block that is held for it in memory, so concurrent writers each
+  fill their own run instead of interleaving block by block. The window
+  doubles every time a stream refills it, from PREALLOC_MIN_BLOCKS up to
+  PREALLOC_MAX_BLOCKS, and is given back on close, unlink and truncate.
+  Windows live in pa_reserved only, nothing is written to disk for them;
+  when a disk is otherwise full its reserved blocks are handed out to
+  anyone and the windows that held them are dropped.
+*/
+
+#define PREALLOC_MIN_BLOCKS (8)
+#define PREALLOC_MAX_BLOCKS (64)
+
+struct prealloc_window
+{
+    int start;      // first reserved d-block
+    int len;        // 0 : no window
+};
+
+struct prealloc
+{
+    int last_index;                     // highest file block allocated so far, -1 if none
+    int cnt_streaming;                  // forward allocations in a row
+    int window_size;                    // blocks the next window reserves
+    int last_d_block[MAX_DISKS];               // per disk, the last d-block handed out, -1 if none
+    struct prealloc_window window[MAX_DISKS];  // per disk (mirrors only use disk 0)
+};
+
+// per inode, NULL until the inode allocates
+struct prealloc **preallocs = NULL;
+
+// disk whose window and reservation bits cover blocks of disk_num
+int pa_disk(int disk_num)
+{
+    return (raid_mode == 0) ? disk_num : 0;
+}
+
+void set_pa_reserved(int pa_disk_num, int start, int len, int reserved)
+{
+    for (int i = start; i < start + len; i++)
+    {
+        if (reserved)
+            pa_reserved[pa_disk_num][i / 32] |= 1u << (i % 32);
+        else
+            pa_reserved[pa_disk_num][i / 32] &= ~(1u << (i % 32));
+    }
+}
+
+// returns 1 if [start, start + len) is free on the disk and held by no window
+int is_free_run(int disk_num, int start, int len)
 {
-    struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, disk_num);
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[disk_num];
+    if (start < 0 || start + len > sb->num_data_blocks)
+        return 0;
+
+    __u_int *d_bitmap = get_d_bitmap(disk_num);
+    __u_int *reserved = pa_reserved[pa_disk(disk_num)];
+    for (int i = start; i < start + len; i++)
+    {
+        if ((d_bitmap[i / 32] | reserved[i / 32]) & (1u << (i % 32)))
+            return 0;
+    }
+    return 1;
+}
 
-    int index_in_blocks = inode_ptr->size / BLOCK_SIZE;
-    int offset = inode_ptr->size % BLOCK_SIZE;
+// gives back every window of an inode
+void pa_release(int inode_num)
+{
+    struct prealloc *pa = preallocs[inode_num];
+    if (pa == NULL)
+        return;
 
-    int d_block_index = inode_ptr->blocks[index_in_blocks];
-    char *dentry_ptr = (char *)get_d_block_ptr(d_block_index, disk_num);
-    return (struct wfs_dentry *)(dentry_ptr + offset - (dcr * sizeof(struct wfs_dentry)));
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        if (pa->window[i].len > 0)
+            TRACE(TR_ALLOC, "inode %d: %d preallocated blocks released on disk %d", inode_num, pa->window[i].len, i);
+        set_pa_reserved(i, pa->window[i].start, pa->window[i].len, 0);
+    }
+    free(pa);
+    preallocs[inode_num] = NULL;
 }
 
-void remove_dentry_block(int inode_num)
+/****************************************
+returns the first of cnt contiguous free d-blocks for file block index_in_blocks (onwards) of an inode
+taken from the inode's window, or from a new window if the inode is streaming
+the caller claims the blocks
+-1 if the allocation is not part of a stream (the caller searches the group)
+*****************************************/
+int pa_alloc(int inode_num, int index_in_blocks, int disk_num, int cnt)
 {
+    // check : directories are never released by a close, they get no window
+    if (!S_ISREG(get_inode_ptr(inode_num, 0)->mode))
+        return -1;
+
+    struct prealloc *pa = preallocs[inode_num];
+    if (pa == NULL)
+    {
+        pa = calloc(1, sizeof(struct prealloc));
+        if (pa == NULL)
+            return -1;
+        pa->last_index = -1;
+        pa->window_size = PREALLOC_MIN_BLOCKS;
+        memset(pa->last_d_block, -1, sizeof(pa->last_d_block));
+        preallocs[inode_num] = pa;
+    }
+
+    // streaming : the file only grows forward
+    if (index_in_blocks > pa->last_index)
+        pa->cnt_streaming++;
+    else
+        pa->cnt_streaming = 0;
+    if (index_in_blocks > pa->last_index)
+        pa->last_index = index_in_blocks;
+
+    int pa_disk_num = pa_disk(disk_num);
+    struct prealloc_window *window = &pa->window[pa_disk_num];
     int d_block_index = -1;
-    int index_in_blocks = -1;
+
+    // window : still free (a full disk may have handed it out)
+    if (window->len >= cnt)
+    {
+        set_pa_reserved(pa_disk_num, window->start, window->len, 0);
+        if (is_free_run(disk_num, window->start, cnt))
+        {
+            d_block_index = window->start;
+            window->start += cnt;
+            window->len -= cnt;
+            set_pa_reserved(pa_disk_num, window->start, window->len, 1);
+            pa->last_d_block[pa_disk_num] = d_block_index + cnt - 1;
+            return d_block_index;
+        }
+        window->len = 0;
+    }
+
+    // drop : a window too short for this allocation
+    set_pa_reserved(pa_disk_num, window->start, window->len, 0);
+    window->len = 0;
+
+    if (pa->cnt_streaming < 2)
+        return -1;
+
+    // new window : right after the last block if possible, growing with the stream
+    int want = cnt + pa->window_size;
+    while (want > cnt)
+    {
+        int goal = pa->last_d_block[pa_disk_num] + 1;
+        if (pa->last_d_block[pa_disk_num] != -1 && is_free_run(disk_num, goal, want))
+            d_block_index = goal;
+        else
+            d_block_index = get_free_d_block_run(disk_num, want, inode_num);
+        if (d_block_index != -1)
+            break;
+        want /= 2;
+    }
+    if (d_block_index == -1)
+        return -1;
+
+    window->start = d_block_index + cnt;
+    window->len = want - cnt;
+    set_pa_reserved(pa_disk_num, window->start, window->len, 1);
+    if (pa->window_size < PREALLOC_MAX_BLOCKS)
+        pa->window_size *= 2;
+    pa->last_d_block[pa_disk_num] = d_block_index + cnt - 1;
+    TRACE(TR_ALLOC, "inode %d: %d blocks preallocated at d-block %d on disk %d", inode_num, window->len, window->start, disk_num);
+    return d_block_index;
+}
+
+// ###################################### Decompressed cluster cache ######################################
+
+/*
+  Compressed clusters are decompressed into a small LRU cache keyed by
+  the first d-block of their extent. Extents are never rewritten in
+  place, so an entry stays valid until that block is freed.
+*/
+
+#define CLUSTER_BLOCKS      (4)
+#define CLUSTER_CACHE_SLOTS (8)
+
+struct cluster_cache_entry
+{
+    int valid;
+    int d_block_index;      // first block of the compressed extent
+    int disk_num;           // disk holding that block, 0 for mirrors
+    unsigned long last_use;
+    char data[CLUSTER_BLOCKS * BLOCK_SIZE];
+};
+
+struct cluster_cache_entry cluster_cache[CLUSTER_CACHE_SLOTS];
+unsigned long cluster_cache_clock = 0;
+
+// returns the cached contents of an extent, NULL on a miss
+struct cluster_cache_entry *find_cached_cluster(int d_block_index, int disk_num)
+{
+    if (raid_mode != 0)
+        disk_num = 0;
+    for (int i = 0; i < CLUSTER_CACHE_SLOTS; i++)
+    {
+        struct cluster_cache_entry *entry = &cluster_cache[i];
+        if (entry->valid && entry->d_block_index == d_block_index && entry->disk_num == disk_num)
+        {
+            entry->last_use = ++cluster_cache_clock;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// evicts the least recently used entry and hands it to the given extent
+struct cluster_cache_entry *claim_cached_cluster(int d_block_index, int disk_num)
+{
+    struct cluster_cache_entry *victim = &cluster_cache[0];
+    for (int i = 1; i < CLUSTER_CACHE_SLOTS && victim->valid; i++)
+    {
+        if (!cluster_cache[i].valid || cluster_cache[i].last_use < victim->last_use)
+            victim = &cluster_cache[i];
+    }
+    victim->valid = 1;
+    victim->d_block_index = d_block_index;
+    victim->disk_num = (raid_mode != 0) ? 0 : disk_num;
+    victim->last_use = ++cluster_cache_clock;
+    return victim;
+}
+
+// forgets a freed d-block if it starts a cached extent
+void drop_cached_cluster(int d_block_index, int disk_num)
+{
+    struct cluster_cache_entry *entry = find_cached_cluster(d_block_index, disk_num);
+    if (entry != NULL)
+        entry->valid = 0;
+}
+
+// ###################################### Shared blocks ######################################
+
+/*
+  Data blocks can be shared between the live tree and snapshots.
+  block_refs counts the block maps (inode or indirect block) pointing at
+  each data block; an indirect block's entries are counted once per
+  indirect block, not once per inode sharing it. The counts live in
+  memory only and are rebuilt from the inode table and the snapshots at
+  mount. The live tree copies a block with more than one reference
+  before writing to it.
+*/
+
+#define MAX_FILE_BLOCKS (IND_BLOCK + BLOCK_SIZE / sizeof(off_t))
+
+// per disk reference counts indexed by d-block, mirrors only use disk 0's
+// (clones can point every slot of every file at one block, 16 bits would wrap)
+unsigned int **block_refs = NULL;
+
+// returns the reference count of a d-block placed on the given disk
+unsigned int *block_ref(int d_block_index, int disk_num)
+{
+    return &block_refs[(raid_mode == 0) ? disk_num : 0][d_block_index];
+}
+
+/****************************************
+marks a free d-block allocated with one reference
+RAID0 : only the given disk, mirrors : every disk
+*****************************************/
+void claim_data_block(int d_block_index, int disk_num)
+{
+    if (raid_mode == 0)
+    {
+        set_data_bmp_index(d_block_index, 1, disk_num);
+    }
+    else
+    {
+        for (int i = 0; i < cnt_disks; i++)
+            set_data_bmp_index(d_block_index, 1, i);
+    }
+    *block_ref(d_block_index, disk_num) = 1;
+}
+
+/****************************************
+drops one reference to a d-block
+the block is freed once nothing points at it
+*****************************************/
+void put_block(int d_block_index, int disk_num)
+{
+    // check : unallocated block pointer (-1)
+    if (d_block_index < 0)
+        return;
+
+    unsigned int *ref = block_ref(d_block_index, disk_num);
+    if (*ref > 1)
+    {
+        (*ref)--;
+        return;
+    }
+    *ref = 0;
+    drop_cached_cluster(d_block_index, disk_num);
+
+    if (raid_mode == 0)
+    {
+        set_data_bmp_index(d_block_index, 0, disk_num);
+    }
+    else
+    {
+        for (int i = 0; i < cnt_disks; i++)
+            set_data_bmp_index(d_block_index, 0, i);
+    }
+}
+
+// same as put_block() for an indirect block, its entries lose a reference when it is freed
+void put_indirect_block(int inode_num, int d_block_index)
+{
+    if (d_block_index < 0)
+        return;
+
+    int disk_num = ind_disk(inode_num);
+    if (*block_ref(d_block_index, disk_num) == 1)
+    {
+        off_t *indirect_block_ptr = (off_t *)get_d_block_ptr(d_block_index, disk_num);
+        // check : unreadable, its entries stay allocated rather than freeing blocks it may not point at
+        if (indirect_block_ptr == NULL)
+            TRACE(TR_ALLOC, "inode %d: indirect block %d unreadable, its entries are leaked", inode_num, d_block_index);
+        for (int k = 0; indirect_block_ptr != NULL && k < BLOCK_SIZE / sizeof(off_t); k++)
+            put_block(indirect_block_ptr[k], data_disk(inode_num, k + IND_BLOCK));
+    }
+    put_block(d_block_index, disk_num);
+}
+
+/****************************************
+copies a d-block into a newly claimed block on the same disk, in the group of its inode
+returns the new d-block index, -1 if the disk is full, -EIO if either block could not be read
+*****************************************/
+int copy_data_block(int d_block_index, int disk_num, int inode_num)
+{
+    int new_d_block_index = get_free_d_block_near(disk_num, inode_num);
+    if (new_d_block_index == -1)
+        return -1;
+
+    claim_data_block(new_d_block_index, disk_num);
     for (int i = 0; i < cnt_disks; i++)
     {
-        struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, i);
-        // for(int j=1; j<7; j++)
-        for (int j = 1; j < 7; j++)
-        {
-            if (inode_ptr->blocks[j] == -1)
-            {
-                index_in_blocks = j - 1;
-                if (index_in_blocks != 0)
-                {
-                    d_block_index = inode_ptr->blocks[index_in_blocks];
-                    inode_ptr->blocks[index_in_blocks] = -1;
-                }
-                break;
-            }
-        }
+        if (raid_mode == 0 && i != disk_num)
+            continue;
+        char *dst = (char *)get_d_block_ptr(new_d_block_index, i);
+        char *src = (char *)get_d_block_ptr(d_block_index, i);
+        if (dst == NULL || src == NULL)
+        {
+            put_block(new_d_block_index, disk_num);
+            return -EIO;
+        }
+        memcpy(dst, src, BLOCK_SIZE);
+    }
+    return new_d_block_index;
+}
+
+/****************************************
+returns the d-block index holding block index_in_blocks of a file
+-1 if that block is not allocated, -EIO if the indirect block could not be read
+works on live inodes and on snapshot copies alike
+*****************************************/
+int get_file_block(struct wfs_inode *inode_ptr, int index_in_blocks)
+{
+    if (index_in_blocks >= MAX_FILE_BLOCKS)
+        return -1;
+
+    if (index_in_blocks < IND_BLOCK)
+        return inode_ptr->blocks[index_in_blocks];
+
+    // check : indirect block is allocated
+    if (inode_ptr->blocks[IND_BLOCK] == -1)
+        return -1;
+    off_t *indirect_block_ptr = (off_t *)get_d_block_ptr(inode_ptr->blocks[IND_BLOCK], ind_disk(inode_ptr->num));
+    if (indirect_block_ptr == NULL)
+        return -EIO;
+    return indirect_block_ptr[index_in_blocks - IND_BLOCK];
+}
+
+/****************************************
+makes the indirect block of a live file private
+a shared one is copied, every entry gains the reference of the copy
+returns the d-block index of the indirect block, -1 if no block is free, -EIO if it could not be read
+*****************************************/
+int cow_indirect_block(int inode_num)
+{
+    int disk_num = ind_disk(inode_num);
+    int indirect_block_index = get_inode_ptr(inode_num, 0)->blocks[IND_BLOCK];
+    if (*block_ref(indirect_block_index, disk_num) == 1)
+        return indirect_block_index;
+
+    int new_indirect_block_index = copy_data_block(indirect_block_index, disk_num, inode_num);
+    if (new_indirect_block_index < 0)
+        return new_indirect_block_index;
+
+    // loaded : the copy just stored to it
+    off_t *indirect_block_ptr = (off_t *)get_d_block_ptr(new_indirect_block_index, disk_num);
+    for (int k = 0; k < BLOCK_SIZE / sizeof(off_t); k++)
+    {
+        if (indirect_block_ptr[k] >= 0)
+            (*block_ref(indirect_block_ptr[k], data_disk(inode_num, k + IND_BLOCK)))++;
+    }
+    (*block_ref(indirect_block_index, disk_num))--;
+
+    for (int i = 0; i < cnt_inode_copies; i++)
+        get_inode_ptr(inode_num, i)->blocks[IND_BLOCK] = new_indirect_block_index;
+    block_map_gen[inode_num]++;
+    TRACE(TR_ALLOC, "inode %d: indirect block %d copied to %d", inode_num, indirect_block_index, new_indirect_block_index);
+    return new_indirect_block_index;
+}
+
+/****************************************
+points block index_in_blocks of a live file at the given d-block on every disk
+a shared indirect block is copied first
+returns 0, -1 if that copy found no free block, or -EIO if the indirect block could not be read
+*****************************************/
+int set_file_block(int inode_num, int index_in_blocks, int d_block_index)
+{
+    if (index_in_blocks < IND_BLOCK)
+    {
+        for (int i = 0; i < cnt_inode_copies; i++)
+            get_inode_ptr(inode_num, i)->blocks[index_in_blocks] = d_block_index;
+    }
+    else
+    {
+        int indirect_block_index = cow_indirect_block(inode_num);
+        if (indirect_block_index < 0)
+            return indirect_block_index;
+
+        int res = mark_block_written(indirect_block_index, ind_disk(inode_num));
+        if (res != 0)
+            return res;
+
+        // RAID0 : the disk holding the indirect block, mirrors : every disk
+        for (int i = 0; i < cnt_disks; i++)
+        {
+            if (raid_mode == 0 && i != ind_disk(inode_num))
+                continue;
+            off_t *indirect_block_ptr = (off_t *)get_d_block_ptr(indirect_block_index, i);
+            indirect_block_ptr[index_in_blocks - IND_BLOCK] = d_block_index;
+        }
+    }
+    block_map_gen[inode_num]++;
+    return 0;
+}
+
+/****************************************
+makes block index_in_blocks of a live file private before it is modified
+a block shared with a snapshot is copied and the file repointed at the copy
+returns the d-block index to write to, -1 if no block is free, -EIO if a block could not be read
+*****************************************/
+int cow_file_block(int inode_num, int index_in_blocks)
+{
+    // the entries of a shared indirect block are shared too, a private copy gives them their own reference
+    if (index_in_blocks >= IND_BLOCK && get_inode_ptr(inode_num, 0)->blocks[IND_BLOCK] != -1)
+    {
+        int res = cow_indirect_block(inode_num);
+        if (res < 0)
+            return res;
+    }
+
+    int disk_num = block_disk(get_inode_ptr(inode_num, 0), index_in_blocks);
+    int d_block_index = get_file_block(get_inode_ptr(inode_num, 0), index_in_blocks);
+    if (d_block_index < 0 || *block_ref(d_block_index, disk_num) == 1)
+        return d_block_index;
+
+    int new_d_block_index = copy_data_block(d_block_index, disk_num, inode_num);
+    if (new_d_block_index < 0)
+        return new_d_block_index;
+    int res = set_file_block(inode_num, index_in_blocks, new_d_block_index);
+    if (res < 0)
+    {
+        put_block(new_d_block_index, disk_num);
+        return res;
+    }
+    (*block_ref(d_block_index, disk_num))--;
+    TRACE(TR_ALLOC, "inode %d: blocks[%d] d-block %d copied to %d", inode_num, index_in_blocks, d_block_index, new_d_block_index);
+    return new_d_block_index;
+}
+
+/****************************************
+drops every block-map reference of a live inode and clears its blocks array
+blocks still shared with a snapshot stay allocated
+*****************************************/
+void release_inode_blocks(int inode_num)
+{
+    struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, 0);
+    for (int i = 0; i < IND_BLOCK; i++)
+        put_block(inode_ptr->blocks[i], block_disk(inode_ptr, i));
+    put_indirect_block(inode_num, inode_ptr->blocks[IND_BLOCK]);
+
+    for (int i = 0; i < cnt_inode_copies; i++)
+        memset(get_inode_ptr(inode_num, i)->blocks, -1, N_BLOCKS * (sizeof(off_t)));
+    block_map_gen[inode_num]++;
+}
+
+/****************************************
+counts the references held by one block map (live inode or snapshot copy)
+an indirect block's entries are counted the first time it is seen
+returns 0, or -EIO if the indirect block could not be read
+*****************************************/
+int count_block_refs(struct wfs_inode *inode_ptr)
+{
+    int res = 0;
+    for (int i = 0; i < IND_BLOCK; i++)
+    {
+        if (inode_ptr->blocks[i] >= 0)
+            (*block_ref(inode_ptr->blocks[i], block_disk(inode_ptr, i)))++;
+    }
+
+    int indirect_block_index = inode_ptr->blocks[IND_BLOCK];
+    if (indirect_block_index == -1)
+        return res;
+    if ((*block_ref(indirect_block_index, ind_disk(inode_ptr->num)))++ != 0)
+        return res;
+
+    off_t *indirect_block_ptr = (off_t *)get_d_block_ptr(indirect_block_index, ind_disk(inode_ptr->num));
+    if (indirect_block_ptr == NULL)
+    {
+        res = -EIO;
+        return res;
+    }
+    for (int k = 0; k < BLOCK_SIZE / sizeof(off_t); k++)
+    {
+        if (indirect_block_ptr[k] >= 0)
+            (*block_ref(indirect_block_ptr[k], data_disk(inode_ptr->num, k + IND_BLOCK)))++;
+    }
+    return res;
+}
+
+/*************
+allocates a new data-block to the given inode
+updates the inode blocks array on all disks
+argument disk_num included to add raid0 support later
+*************** */
+int allocate_direct_block(int inode_num, int blocks_index, int disk_num)
+{
+    // streaming appends come out of the inode's preallocation window
+    int d_block_index = pa_alloc(inode_num, blocks_index, disk_num, 1);
+    if (d_block_index == -1)
+        d_block_index = get_free_d_block_near(disk_num, inode_num);
+
+    // check : data bitmap full
+    if (d_block_index == -1)
+    {
+        return -1;
+    }
+
+    // set the data bitmap, then put the newly allocated data-block into the blocks array
+    claim_data_block(d_block_index, disk_num);
+    int res = set_file_block(inode_num, blocks_index, d_block_index);
+    if (res < 0)
+    {
+        put_block(d_block_index, disk_num);
+        return res;
+    }
+    TRACE(TR_ALLOC, "inode %d: blocks[%d] -> d-block %d on disk %d", inode_num, blocks_index, d_block_index, disk_num);
+    return d_block_index;
+}
+
+int allocate_indirect_block(int inode_num, int disk_num)
+{
+    int d_block_index = get_free_d_block_near(disk_num, inode_num);
+
+    // check : data bitmap full
+    if (d_block_index == -1)
+    {
+        return -1;
+    }
+
+    // check : the block can be read before it is claimed, the memsets below cannot fail then
+    if (mark_block_written(d_block_index, disk_num) != 0)
+        return -EIO;
+
+    if (raid_mode == 0)
+    {
+        set_data_bmp_index(d_block_index, 1, disk_num);
+        memset(get_d_block_ptr(d_block_index, disk_num), -1, BLOCK_SIZE * (sizeof(char)));
+        for (int i = 0; i < cnt_inode_copies; i++)
+        {
+            // set_data_bmp_index(d_block_index, 1, i);
+
+            struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, i);
+            // put the newly allocated data-block into blocks array
+            inode_ptr->blocks[7] = d_block_index;
+
+            // increment size, reason : new d-block allocated
+            // inode_ptr->size += BLOCK_SIZE;
+        }
+    }
+
+    // set the data bitmap
+    // raid1
+    else
+    {
+        for (int i = 0; i < cnt_disks; i++)
+        {
+            set_data_bmp_index(d_block_index, 1, i);
+
+            struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, i);
+            // put the newly allocated data-block into blocks array
+            inode_ptr->blocks[7] = d_block_index;
+            memset(get_d_block_ptr(d_block_index, i), -1, BLOCK_SIZE * (sizeof(char)));
+            // inode_ptr->size += BLOCK_SIZE;
+
+            // increment size, reason : new d-block allocated
+            // inode_ptr->size += BLOCK_SIZE;
+        }
+    }
+    *block_ref(d_block_index, disk_num) = 1;
+    block_map_gen[inode_num]++;
+    TRACE(TR_ALLOC, "inode %d: indirect block -> d-block %d on disk %d", inode_num, d_block_index, disk_num);
+    return d_block_index;
+}
+
+/******************
+// ONLY called in read for RAID1V
+returns the disk which has the data-block with the correct data
+only the disks set in voters (one bit per ordered disk) take part
+***********************/
+int get_correct_disk_num(int d_block_index, int read_size, unsigned int voters)
+{
+    int maxcount = 0;
+    int disk_num_having_max_freq = 0;
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        if (!(voters & (1u << i)))
+            continue;
+        int count = 0;
+        char *curr_disk_d_block_ptr = (char *)get_d_block_ptr(d_block_index, i);
+        // check : a copy that could not be read does not vote
+        if (curr_disk_d_block_ptr == NULL)
+            continue;
+        for (int j = 0; j < cnt_disks; j++)
+        {
+            if (!(voters & (1u << j)))
+                continue;
+            char *next_disk_d_block_ptr = (char *)get_d_block_ptr(d_block_index, j);
+            if (next_disk_d_block_ptr != NULL && memcmp(curr_disk_d_block_ptr, next_disk_d_block_ptr, read_size) == 0)
+                count++;
+        }
+
+        if (count > maxcount)
+        {
+            maxcount = count;
+            disk_num_having_max_freq = i;
+        }
+    }
+    TRACE(TR_RAID, "d-block %d: disk %d wins vote with %d of %d copies", d_block_index, disk_num_having_max_freq, maxcount, cnt_disks);
+    return disk_num_having_max_freq;
+}
+
+// ###################################### Directory slot maps ######################################
+
+/*
+  A directory is an array of dentry slots in its direct blocks.
+  Deleting an entry tombstones its slot (name[0] == '\0') instead of
+  compacting, so create and delete each touch exactly one slot.
+  dir->size covers every slot up to the high-water mark, tombstones included.
+
+  The free slots below the high-water mark are tracked in memory per
+  directory, built from the tombstones the first time the directory is
+  modified. Sparse directories are compacted by a background thread.
+*/
+
+#define DENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(struct wfs_dentry))
+#define MAX_DIR_SLOTS      (IND_BLOCK * DENTRIES_PER_BLOCK)
+#define DIR_MAP_WORDS      ((MAX_DIR_SLOTS + 63) / 64)
+
+struct dir_slot_map
+{
+    uint64_t free[DIR_MAP_WORDS]; // bit set : tombstoned slot below hwm
+    int live;                     // slots holding an entry
+    int hwm;                      // slots in use, live + tombstoned
+};
+
+// slot maps indexed by inode number, NULL until first use
+struct dir_slot_map **dir_maps = NULL;
+
+// serializes FUSE callbacks with the background threads
+pthread_mutex_t wfs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// wakes the compaction thread early when a directory turns sparse
+pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER;
+
+// set with compact_cond, a signal sent while the thread is scanning starts another scan
+int compact_wanted = 0;
+
+// wakes the io_uring flush thread early when the disk caches fill with dirty blocks, and at unmount
+pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+
+// readdir handles per directory inode, open directories are not compacted
+int *dir_open_cnt = NULL;
+
+// open handles per live file inode, an unlinked file is freed at its last close
+int *file_open_cnt = NULL;
+
+// set by destroy, background threads stop touching the disks
+int shutting_down = 0;
+
+// disk holding the dentry block of the given slot (always 0 for mirrors)
+int dentry_disk(int inode_num, int slot)
+{
+    if (raid_mode != 0)
+        return 0;
+    if (cnt_meta_disks > 0)
+        return (slot / DENTRIES_PER_BLOCK) % cnt_meta_disks;
+    return data_disk(inode_num, slot / DENTRIES_PER_BLOCK);
+}
+
+// returns pointer to the given dentry slot of a directory on the given disk, NULL if its block could not be read
+struct wfs_dentry *get_dentry_slot_ptr(int inode_num, int slot, int disk_num)
+{
+    struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, 0);
+    int d_block_index = inode_ptr->blocks[slot / DENTRIES_PER_BLOCK];
+    struct wfs_dentry *dentry_ptr = (struct wfs_dentry *)get_d_block_ptr(d_block_index, disk_num);
+    if (dentry_ptr == NULL)
+        return NULL;
+    return dentry_ptr + slot % DENTRIES_PER_BLOCK;
+}
+
+// marks the dentry block of the given slot written on every disk holding it, 0 or -EIO
+int mark_dentry_block(int inode_num, int slot)
+{
+    int disk_num = (raid_mode == 0) ? dentry_disk(inode_num, slot) : 0;
+    return mark_block_written(get_inode_ptr(inode_num, 0)->blocks[slot / DENTRIES_PER_BLOCK], disk_num);
+}
+
+/****************************************
+writes one dentry slot
+RAID0 : only the disk holding the block, mirrors : every disk
+name == NULL writes a tombstone
+a dentry block shared with a snapshot is copied first
+returns 0, -ENOSPC or -EIO
+*****************************************/
+int write_dentry_slot(int inode_num, int slot, const char *name, int num)
+{
+    int res = cow_file_block(inode_num, slot / DENTRIES_PER_BLOCK);
+    if (res < 0)
+    {
+        res = (res == -1) ? -ENOSPC : res;
+        return res;
+    }
+    res = mark_dentry_block(inode_num, slot);
+    if (res != 0)
+        return res;
+
+    int first = (raid_mode == 0) ? dentry_disk(inode_num, slot) : 0;
+    int last = (raid_mode == 0) ? first : cnt_disks - 1;
+
+    // loaded : the mark above read the block on every disk written here
+    for (int i = first; i <= last; i++)
+    {
+        struct wfs_dentry *dentry = get_dentry_slot_ptr(inode_num, slot, i);
+        memset(dentry, 0, sizeof(struct wfs_dentry));
+        if (name != NULL)
+        {
+            strncpy(dentry->name, name, MAX_NAME - 1);
+            dentry->num = num;
+        }
+    }
+    return 0;
+}
+
+/****************************************
+returns the slot map of a directory
+built by one pass over its slots on first use
+NULL if a dentry block could not be read or there is no memory for the map
+*****************************************/
+struct dir_slot_map *get_dir_slot_map(int inode_num)
+{
+    if (dir_maps[inode_num] != NULL)
+        return dir_maps[inode_num];
+
+    struct dir_slot_map *map = calloc(1, sizeof(struct dir_slot_map));
+    if (map == NULL)
+        return NULL;
+    struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, 0);
+    map->hwm = inode_ptr->size / sizeof(struct wfs_dentry);
+
+    for (int slot = 0; slot < map->hwm; slot++)
+    {
+        struct wfs_dentry *dentry = get_dentry_slot_ptr(inode_num, slot, dentry_disk(inode_num, slot));
+        if (dentry == NULL)
+        {
+            free(map);
+            return NULL;
+        }
+        if (dentry->name[0] == '\0')
+            map->free[slot / 64] |= (uint64_t)1 << (slot % 64);
+        else
+            map->live++;
+    }
+
+    // trim : a crash may have left tombstones at the end
+    while (map->hwm > 0 && (map->free[(map->hwm - 1) / 64] & ((uint64_t)1 << ((map->hwm - 1) % 64))))
+    {
+        map->hwm--;
+        map->free[map->hwm / 64] &= ~((uint64_t)1 << (map->hwm % 64));
+    }
+    dir_maps[inode_num] = map;
+    TRACE(TR_ALLOC, "dir %d: slot map built, %d live of %d slots", inode_num, map->live, map->hwm);
+    return map;
+}
+
+// forgets the slot map of a directory that is being removed
+void drop_dir_slot_map(int inode_num)
+{
+    free(dir_maps[inode_num]);
+    dir_maps[inode_num] = NULL;
+}
+
+// returns the lowest tombstoned slot, -1 if there is none
+int get_free_dentry_slot(struct dir_slot_map *map)
+{
+    for (int i = 0; i < DIR_MAP_WORDS; i++)
+    {
+        if (map->free[i] != 0)
+            return i * 64 + __builtin_ctzll(map->free[i]);
+    }
+    return -1;
+}
+
+// sets dir->size from the high-water mark on every copy of the inode
+void set_dir_size(int inode_num, int hwm)
+{
+    for (int i = 0; i < cnt_inode_copies; i++)
+    {
+        struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, i);
+        inode_ptr->size = hwm * sizeof(struct wfs_dentry);
+    }
+}
+
+/****************************************
+adds a dentry to a directory
+reuses the lowest tombstone, else appends at the high-water mark
+allocates a dentry block only when appending crosses into a new block
+returns 0, -ENOSPC or -EIO
+*****************************************/
+int add_dentry(int parent_inode_num, const char *name, int child_inode_num)
+{
+    int res = 0;
+    struct dir_slot_map *map = get_dir_slot_map(parent_inode_num);
+    if (map == NULL)
+    {
+        res = -EIO;
+        return res;
+    }
+
+    int slot = get_free_dentry_slot(map);
+    if (slot == -1)
+    {
+        // check : Parent data blocks full
+        if (map->hwm == MAX_DIR_SLOTS)
+            return -ENOSPC;
+
+        slot = map->hwm;
+        int blocks_index = slot / DENTRIES_PER_BLOCK;
+        struct wfs_inode *parent_inode = get_inode_ptr(parent_inode_num, 0);
+        if (parent_inode->blocks[blocks_index] == -1)
+        {
+            res = allocate_direct_block(parent_inode_num, blocks_index, dentry_disk(parent_inode_num, slot));
+            // check : data bitmap full
+            if (res < 0)
+            {
+                res = (res == -1) ? -ENOSPC : res;
+                return res;
+            }
+        }
+
+    }
+
+    res = write_dentry_slot(parent_inode_num, slot, name, child_inode_num);
+    if (res != 0)
+        return res;
+
+    if (slot == map->hwm)
+    {
+        map->hwm++;
+        set_dir_size(parent_inode_num, map->hwm);
+    }
+    else
+    {
+        map->free[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+    }
+    map->live++;
+    TRACE(TR_ALLOC, "dir %d: %s -> inode %d in slot %d", parent_inode_num, name, child_inode_num, slot);
+    return 0;
+}
+
+// number of dentry blocks that hold the given number of slots
+int dir_blocks_needed(int slots)
+{
+    return (slots + DENTRIES_PER_BLOCK - 1) / DENTRIES_PER_BLOCK;
+}
+
+// number of dentry blocks allocated to a directory
+int dir_blocks_allocated(int inode_num)
+{
+    struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, 0);
+    int cnt = 0;
+    for (int i = 0; i < IND_BLOCK; i++)
+    {
+        if (inode_ptr->blocks[i] != -1)
+            cnt++;
+    }
+    return cnt;
+}
+
+/****************************************
+returns 1 if compaction would free dentry blocks of a directory
+the first dentry block is always kept
+*****************************************/
+int dir_needs_compaction(int inode_num, struct dir_slot_map *map)
+{
+    int keep = dir_blocks_needed(map->live);
+    if (keep < 1)
+        keep = 1;
+    if (dir_blocks_allocated(inode_num) <= keep)
+        return 0;
+    return (2 * map->live <= map->hwm) || (dir_blocks_needed(map->hwm) < dir_blocks_allocated(inode_num));
+}
+
+/****************************************
+removes the dentry pointing to the given inode from a directory
+tombstones its slot, trailing tombstones lower the high-water mark
+returns 0, -ENOENT, -ENOSPC or -EIO
+*****************************************/
+int remove_dentry(int parent_inode_num, int child_inode_num)
+{
+    int res = 0;
+    struct dir_slot_map *map = get_dir_slot_map(parent_inode_num);
+    if (map == NULL)
+    {
+        res = -EIO;
+        return res;
+    }
+
+    int slot = 0;
+    for (slot = 0; slot < map->hwm; slot++)
+    {
+        struct wfs_dentry *dentry = get_dentry_slot_ptr(parent_inode_num, slot, dentry_disk(parent_inode_num, slot));
+        if (dentry == NULL)
+        {
+            res = -EIO;
+            return res;
+        }
+        if (dentry->name[0] != '\0' && dentry->num == child_inode_num)
+            break;
+    }
+    if (slot == map->hwm)
+        return -ENOENT;
+
+    res = write_dentry_slot(parent_inode_num, slot, NULL, 0);
+    if (res != 0)
+        return res;
+    map->free[slot / 64] |= (uint64_t)1 << (slot % 64);
+    map->live--;
+
+    // trim : tombstones at the end no longer count towards the size
+    int hwm = map->hwm;
+    while (hwm > 0 && (map->free[(hwm - 1) / 64] & ((uint64_t)1 << ((hwm - 1) % 64))))
+    {
+        hwm--;
+        map->free[hwm / 64] &= ~((uint64_t)1 << (hwm % 64));
+    }
+    if (hwm != map->hwm)
+    {
+        map->hwm = hwm;
+        set_dir_size(parent_inode_num, hwm);
+    }
+
+    TRACE(TR_ALLOC, "dir %d: slot %d tombstoned, %d live of %d slots", parent_inode_num, slot, map->live, map->hwm);
+    if (dir_needs_compaction(parent_inode_num, map))
+    {
+        compact_wanted = 1;
+        pthread_cond_signal(&compact_cond);
+    }
+    return 0;
+}
+
+/****************************************
+frees the dentry blocks of a directory starting at blocks[first]
+blocks shared with a snapshot only lose a reference
+updates the blocks array on every disk
+*****************************************/
+void free_dir_blocks(int inode_num, int first)
+{
+    for (int i = first; i < IND_BLOCK; i++)
+    {
+        int d_block_index = get_inode_ptr(inode_num, 0)->blocks[i];
+        if (d_block_index == -1)
+            continue;
+
+        put_block(d_block_index, dentry_disk(inode_num, i * DENTRIES_PER_BLOCK));
+        for (int j = 0; j < cnt_inode_copies; j++)
+            get_inode_ptr(inode_num, j)->blocks[i] = -1;
+    }
+    block_map_gen[inode_num]++;
+}
+
+/****************************************
+moves the live entries of a directory into its lowest slots
+then frees the dentry blocks past the new high-water mark
+*****************************************/
+void compact_directory(int inode_num)
+{
+    struct dir_slot_map *map = dir_maps[inode_num];
+
+    // fill the lowest hole with the highest live entry until no hole is left below hwm
+    int hole = get_free_dentry_slot(map);
+    while (hole != -1 && hole < map->live)
+    {
+        int last = map->hwm - 1;
+
+        // copy and load : shared dentry blocks up front, the move below must not fail halfway
+        if (cow_file_block(inode_num, hole / DENTRIES_PER_BLOCK) < 0 ||
+            cow_file_block(inode_num, last / DENTRIES_PER_BLOCK) < 0 ||
+            mark_dentry_block(inode_num, hole) != 0 || mark_dentry_block(inode_num, last) != 0)
+            break;
+
+        struct wfs_dentry *src = get_dentry_slot_ptr(inode_num, last, dentry_disk(inode_num, last));
+        char name[MAX_NAME];
+        memcpy(name, src->name, MAX_NAME);
+        write_dentry_slot(inode_num, hole, name, src->num);
+        write_dentry_slot(inode_num, last, NULL, 0);
+        map->free[hole / 64] &= ~((uint64_t)1 << (hole % 64));
+
+        // drop the moved slot and any tombstones exposed below it
+        map->hwm--;
+        while (map->hwm > 0 && (map->free[(map->hwm - 1) / 64] & ((uint64_t)1 << ((map->hwm - 1) % 64))))
+        {
+            map->hwm--;
+            map->free[map->hwm / 64] &= ~((uint64_t)1 << (map->hwm % 64));
+        }
+        hole = get_free_dentry_slot(map);
+    }
+    set_dir_size(inode_num, map->hwm);
+
+    int keep = dir_blocks_needed(map->hwm);
+    if (keep < 1)
+        keep = 1;
+    free_dir_blocks(inode_num, keep);
+    TRACE(TR_ALLOC, "dir %d: compacted to %d slots in %d blocks", inode_num, map->hwm, keep);
+}
+
+// ###################################### I/O scheduling ######################################
+
+/*
+  FUSE callbacks and the background threads share the disks through
+  wfs_lock, so the lock is where I/O is scheduled. Callbacks are the
+  foreground class: they count themselves in qos_fg_waiting while they
+  wait for the lock, and their latency (arrival to unlock) feeds a
+  moving average. Background work comes in classes (rebuild : resync
+  and reshape, scrub, directory compaction and the io_uring write-back),
+  each with a token bucket of bytes per second.
+  A background thread takes the lock only when no callback is waiting
+  and its bucket is not in debt, and pays for the bytes it moved when
+  it lets go. While the foreground average is above qos_target_us the
+  buckets are halved every QOS_ADAPT_MS down to 1/QOS_MIN_SHARE of their
+  configured rate, and they grow back by a sixteenth once it is below.
+  Every disk access is a copy in a shared mapping made under the one
+  lock, so there are no per-disk queues to order.
+*/
+
+#define QOS_REBUILD (0)
+#define QOS_SCRUB   (1)
+#define QOS_COMPACT (2)
+#define QOS_FLUSH   (3)
+#define QOS_CLASSES (4)
+
+// KiB/s of directory blocks the compaction thread rewrites
+#define QOS_COMPACT_RATE (4096)
+
+// a bucket holds at most this many seconds of its rate
+#define QOS_BURST_SEC (0.1)
+
+// how often the bucket rates follow the foreground latency
+#define QOS_ADAPT_MS (100)
+
+// a throttled bucket keeps at least 1/QOS_MIN_SHARE of its rate
+#define QOS_MIN_SHARE (64)
+
+struct qos_bucket {
+    double max_rate;            // bytes per second configured, 0 : unlimited
+    double rate;                // bytes per second allowed now
+    double tokens;              // bytes that may be moved, negative : in debt
+    struct timespec last;       // last refill
+};
+
+// set by the --rebuild-rate=N mount option (KiB/s), 0 : unlimited
+int rebuild_rate = 0;
+
+// set by the --qos-latency=N mount option (microseconds)
+int qos_target_us = 5000;
+
+pthread_mutex_t qos_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t qos_cond = PTHREAD_COND_INITIALIZER;
+
+struct qos_bucket qos_buckets[QOS_CLASSES];
+
+// callbacks waiting for wfs_lock
+int qos_fg_waiting = 0;
+
+// moving average of the callback latency in microseconds
+double qos_fg_latency_us = 0;
+
+// last time the bucket rates were adapted
+struct timespec qos_adapted;
+
+// seconds from a to b
+double qos_elapsed(struct timespec *a, struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+// sets the configured rate of a class in KiB/s, 0 : unlimited
+void qos_set_rate(int class, int kib_per_sec)
+{
+    struct qos_bucket *bucket = &qos_buckets[class];
+    bucket->max_rate = kib_per_sec * 1024.0;
+    bucket->rate = bucket->max_rate;
+    bucket->tokens = 0;
+    clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+}
+
+// adds the tokens earned since the last refill, called with qos_lock held
+void qos_refill(struct qos_bucket *bucket, struct timespec *now)
+{
+    bucket->tokens += bucket->rate * qos_elapsed(&bucket->last, now);
+    if (bucket->tokens > bucket->rate * QOS_BURST_SEC)
+        bucket->tokens = bucket->rate * QOS_BURST_SEC;
+    bucket->last = *now;
+}
+
+// follows the foreground latency with the bucket rates, called with qos_lock held
+void qos_adapt(struct timespec *now)
+{
+    if (qos_elapsed(&qos_adapted, now) * 1000 < QOS_ADAPT_MS)
+        return;
+    qos_adapted = *now;
+
+    for (int class = 0; class < QOS_CLASSES; class++)
+    {
+        struct qos_bucket *bucket = &qos_buckets[class];
+        if (bucket->max_rate == 0)
+            continue;
+        qos_refill(bucket, now);
+        if (qos_fg_latency_us > qos_target_us)
+            bucket->rate /= 2;
+        else
+            bucket->rate += bucket->max_rate / 16;
+        if (bucket->rate < bucket->max_rate / QOS_MIN_SHARE)
+            bucket->rate = bucket->max_rate / QOS_MIN_SHARE;
+        if (bucket->rate > bucket->max_rate)
+            bucket->rate = bucket->max_rate;
+    }
+    TRACE_V(TR_IO, "qos: foreground %.0f us, rebuild %.0f B/s, scrub %.0f B/s", qos_fg_latency_us,
+            qos_buckets[QOS_REBUILD].rate, qos_buckets[QOS_SCRUB].rate);
+}
+
+// takes wfs_lock for a FUSE callback, returns its arrival time for fg_unlock
+struct timespec fg_lock()
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_mutex_lock(&qos_lock);
+    qos_fg_waiting++;
+    pthread_mutex_unlock(&qos_lock);
+
+    pthread_mutex_lock(&wfs_lock);
+
+    pthread_mutex_lock(&qos_lock);
+    qos_fg_waiting--;
+    if (qos_fg_waiting == 0)
+        pthread_cond_broadcast(&qos_cond);
+    pthread_mutex_unlock(&qos_lock);
+    return start;
+}
+
+// lets go of wfs_lock after a FUSE callback and records its latency
+void fg_unlock(struct timespec start)
+{
+    // --io-uring : the cache drops clean blocks past its size
+    if (use_io_uring && uring_trim() > 0)
+        pthread_cond_signal(&flush_cond);
+    pthread_mutex_unlock(&wfs_lock);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&qos_lock);
+    qos_fg_latency_us += (qos_elapsed(&start, &now) * 1e6 - qos_fg_latency_us) / 16;
+    qos_adapt(&now);
+    pthread_mutex_unlock(&qos_lock);
+}
+
+/****************************************
+takes wfs_lock for a batch of background work of a class
+waits until no callback is waiting for the lock and the class is out of debt
+*****************************************/
+void bg_lock(int class)
+{
+    struct qos_bucket *bucket = &qos_buckets[class];
+
+    pthread_mutex_lock(&qos_lock);
+    while (!shutting_down)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        qos_adapt(&now);
+        if (bucket->max_rate > 0)
+            qos_refill(bucket, &now);
+        if (qos_fg_waiting == 0 && (bucket->max_rate == 0 || bucket->tokens >= 0))
+            break;
+
+        // wait : for the debt to be paid off, or for the callbacks (at most one adapt period)
+        double wait = QOS_ADAPT_MS / 1000.0;
+        if (qos_fg_waiting == 0 && -bucket->tokens / bucket->rate < wait)
+            wait = -bucket->tokens / bucket->rate;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)(wait * 1e9);
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&qos_cond, &qos_lock, &deadline);
+    }
+    pthread_mutex_unlock(&qos_lock);
+
+    pthread_mutex_lock(&wfs_lock);
+}
+
+// lets go of wfs_lock after a batch of background work, the class pays for the bytes it moved
+void bg_unlock(int class, double bytes)
+{
+    if (use_io_uring && uring_trim() > 0)
+        pthread_cond_signal(&flush_cond);
+    pthread_mutex_unlock(&wfs_lock);
+
+    pthread_mutex_lock(&qos_lock);
+    if (qos_buckets[class].max_rate > 0)
+        qos_buckets[class].tokens -= bytes;
+    pthread_mutex_unlock(&qos_lock);
+}
+
+/****************************************
+background thread, compacts sparse directories every few seconds or when signalled
+takes the lock once per directory, so callbacks get in between
+*****************************************/
+void *compaction_worker(void *arg)
+{
+    pthread_mutex_lock(&wfs_lock);
+    while (!shutting_down)
+    {
+        if (!compact_wanted)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 5;
+            pthread_cond_timedwait(&compact_cond, &wfs_lock, &deadline);
+        }
+        compact_wanted = 0;
+        pthread_mutex_unlock(&wfs_lock);
+
+        int i = 0;
+        while (1)
+        {
+            bg_lock(QOS_COMPACT);
+            if (shutting_down)
+                break;
+
+            // the disks are mapped again when the volume grows
+            struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+            while (i < sb->num_inodes && !(dir_maps[i] != NULL && dir_open_cnt[i] == 0 && dir_needs_compaction(i, dir_maps[i])))
+                i++;
+            if (i == sb->num_inodes)
+                break;
+
+            // the class pays for the dentry blocks the compaction rewrote
+            double bytes = get_inode_ptr(i, 0)->size;
+            compact_directory(i);
+            bg_unlock(QOS_COMPACT, bytes);
+            i++;
+        }
+    }
+    pthread_mutex_unlock(&wfs_lock);
+    return NULL;
+}
+
+// ###################################### Mirror fan-out ######################################
+
+/*
+  A large write to a mirror copies its blocks to disk 0 on the calling
+  thread and to every other disk on that disk's own worker thread, so the
+  copies run side by side instead of one disk after the other. Each disk
+  keeps a FIFO of jobs, so the copies to one disk land in write order.
+
+  The write returns once mirror_quorum disks (disk 0 among them) hold the
+  data; the other copies finish in the background, reading disk 0. A
+  later large write to the same bytes queues its own copy behind them,
+  while a small write or a copy-on-write of the block waits for them,
+  since it copies to every disk on the calling thread. RAID1v
+  never settles for less than a majority. Every job takes the next
+  sequence number, which is recorded per d-block and per disk once the
+  disk's copy is done, so a disk is current for a block when it has done
+  the block's last job. Reads only use, and RAID1v only votes among, the
+  disks current for the block. Anything else that reads, moves or frees
+  data blocks on the other disks waits for the queues to drain.
+
+  The queued copies are logged on disk the way a degraded mount logs
+  writes: the disks behind are set in sb->missing_disks and the regions
+  written in sb->wi_bitmap, and both are cleared once the queues drain.
+  After a crash the next mount resyncs those regions from disk 0.
+*/
+
+// writes smaller than this copy to the mirrors inline
+#define MIRROR_FANOUT_MIN (16 * BLOCK_SIZE)
+
+// --mirror-quorum=majority
+#define MIRROR_QUORUM_MAJORITY (-1)
+
+// set by the --mirror-quorum=N mount option, 0 : every disk
+int mirror_quorum = 0;
+
+// one block's worth of a write, dst[j] is where it lands on disk j
+struct mirror_seg {
+    int d_block_index;
+    const char *src;
+    int len;
+    char *dst[MAX_DISKS];
+};
+
+struct mirror_job {
+    unsigned int seq;                   // order of the job among all jobs
+    int cnt_segs;
+    int cnt_copied;                     // disks holding the data
+    int refs;                           // queued disks + the writer
+    struct mirror_job *next[MAX_DISKS]; // next job in each disk's queue
+    struct mirror_seg segs[MAX_FILE_BLOCKS + 1];
+};
+
+pthread_mutex_t mirror_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t mirror_work = PTHREAD_COND_INITIALIZER;
+pthread_cond_t mirror_done = PTHREAD_COND_INITIALIZER;
+
+struct mirror_job *mirror_head[MAX_DISKS];
+struct mirror_job *mirror_tail[MAX_DISKS];
+
+// disk copies queued and not yet done
+int mirror_pending = 0;
+
+// disk 0 is copied by the writer, workers are started for the others as they are needed
+int cnt_mirror_workers = 1;
+
+// last job sequence number given out, and per disk the last one copied
+unsigned int mirror_seq = 0;
+unsigned int mirror_done_seq[MAX_DISKS];
+
+// per d-block, the last job that wrote it (0 : none since the queues drained)
+unsigned int *mirror_block_seq = NULL;
+int mirror_seq_blocks = 0;
+
+// disk_order bits set in missing_disks for queued copies
+int mirror_logged = 0;
+
+// disks a mirror write must reach before it returns
+int mirror_quorum_disks()
+{
+    int majority = cnt_disks / 2 + 1;
+    if (raid_mode == 0 || mirror_quorum == 0)
+        return cnt_disks;
+
+    // RAID1v : a read needs a majority of current copies to vote
+    int quorum = mirror_quorum;
+    if (quorum == MIRROR_QUORUM_MAJORITY || (raid_mode == 2 && quorum < majority))
+        quorum = majority;
+    if (quorum > cnt_disks)
+        quorum = cnt_disks;
+    return quorum;
+}
+
+// returns 1 if a disk has done every queued copy of a d-block, called with mirror_lock held
+int mirror_block_current(int d_block_index, int disk_num)
+{
+    if (disk_num == 0 || mirror_block_seq == NULL || d_block_index >= mirror_seq_blocks)
+        return 1;
+    return (int)(mirror_done_seq[disk_num] - mirror_block_seq[d_block_index]) >= 0;
+}
+
+// waits until every disk has done the queued copies of a d-block, called before copying it on this thread
+void wait_mirror_block(int d_block_index)
+{
+    pthread_mutex_lock(&mirror_lock);
+    for (int j = 1; j < cnt_disks; j++)
+    {
+        // no sequence for the block : every queue has to drain
+        while (mirror_pending > 0 &&
+               (mirror_block_seq == NULL || d_block_index >= mirror_seq_blocks || !mirror_block_current(d_block_index, j)))
+            pthread_cond_wait(&mirror_done, &mirror_lock);
+    }
+    pthread_mutex_unlock(&mirror_lock);
+}
+
+// returns the disks current for a d-block, one bit per ordered disk
+unsigned int current_mirrors(int d_block_index)
+{
+    unsigned int current = 0;
+    pthread_mutex_lock(&mirror_lock);
+    for (int j = 0; j < cnt_disks; j++)
+    {
+        if (mirror_block_current(d_block_index, j))
+            current |= 1u << j;
+    }
+    pthread_mutex_unlock(&mirror_lock);
+    return current;
+}
+
+// drops one reference to a job, frees it with the last, called with mirror_lock held
+void put_mirror_job(struct mirror_job *job)
+{
+    job->refs--;
+    if (job->refs == 0)
+        free(job);
+}
+
+// background thread, copies the jobs queued for one mirror disk
+void *mirror_worker(void *arg)
+{
+    int disk = (int)(intptr_t)arg;
+
+    pthread_mutex_lock(&mirror_lock);
+    while (1)
+    {
+        while (mirror_head[disk] == NULL && !shutting_down)
+            pthread_cond_wait(&mirror_work, &mirror_lock);
+        if (mirror_head[disk] == NULL)
+            break;
+
+        struct mirror_job *job = mirror_head[disk];
+        pthread_mutex_unlock(&mirror_lock);
+
+        for (int i = 0; i < job->cnt_segs; i++)
+            memcpy(job->segs[i].dst[disk], job->segs[i].src, job->segs[i].len);
+
+        pthread_mutex_lock(&mirror_lock);
+        mirror_head[disk] = job->next[disk];
+        if (mirror_head[disk] == NULL)
+            mirror_tail[disk] = NULL;
+        mirror_done_seq[disk] = job->seq;
+        job->cnt_copied++;
+        mirror_pending--;
+        put_mirror_job(job);
+        pthread_cond_broadcast(&mirror_done);
+    }
+    pthread_mutex_unlock(&mirror_lock);
+    return NULL;
+}
+
+/****************************************
+pending-write log : marks the regions of a job and the disks it leaves behind
+on every disk present, before any copy is queued
+called with wfs_lock held
+*****************************************/
+void log_mirror_job(struct mirror_job *job)
+{
+    int region_blocks = wi_region_blocks();
+    int behind = 0;
+    for (int j = 1; j < cnt_disks; j++)
+        behind |= 1 << ((struct wfs_sb *)ordered_disk_mmap_ptr[j])->disk_order;
+
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[i];
+        for (int s = 0; s < job->cnt_segs; s++)
+        {
+            int region = job->segs[s].d_block_index / region_blocks;
+            sb->wi_bitmap[region / 32] |= 1u << (region % 32);
+        }
+        sb->missing_disks |= behind;
+    }
+    mirror_logged |= behind;
+}
+
+/****************************************
+clears the pending-write log of the disks whose queues are empty
+a disk a resync is still bringing back stays missing, the write-intent
+bitmap is cleared once no disk is
+called with wfs_lock and mirror_lock held
+*****************************************/
+void trim_mirror_log()
+{
+    if (mirror_logged == 0)
+        return;
+
+    int done = 0;
+    for (int j = 1; j < cnt_disks; j++)
+    {
+        int order = ((struct wfs_sb *)ordered_disk_mmap_ptr[j])->disk_order;
+        if ((mirror_logged & (1 << order)) && mirror_head[j] == NULL && (resync_source == -1 || !resync_stale[j]))
+            done |= 1 << order;
+    }
+    if (done == 0)
+        return;
+
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+    int missing = sb->missing_disks & ~done;
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        sb = (struct wfs_sb *)ordered_disk_mmap_ptr[i];
+        sb->missing_disks = missing;
+        if (missing == 0)
+            memset(sb->wi_bitmap, 0, sizeof(sb->wi_bitmap));
+    }
+    mirror_logged &= ~done;
+    TRACE(TR_RAID, "mirror log trimmed, missing disks 0x%x", missing);
+}
+
+/****************************************
+copies a job to every mirror disk, disk 0 on this thread
+returns once mirror_quorum_disks() disks hold it, the job is freed by whoever finishes last
+called with wfs_lock held
+*****************************************/
+void run_mirror_job(struct mirror_job *job)
+{
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+    int quorum = mirror_quorum_disks();
+
+    // the caller's buffer is gone once the write returns, copies left behind read disk 0
+    if (quorum < cnt_disks)
+    {
+        log_mirror_job(job);
+        for (int i = 0; i < job->cnt_segs; i++)
+        {
+            memcpy(job->segs[i].dst[0], job->segs[i].src, job->segs[i].len);
+            job->segs[i].src = job->segs[i].dst[0];
+        }
+    }
+
+    pthread_mutex_lock(&mirror_lock);
+
+    // the volume grew : every queue is empty, the sequence starts over
+    if (mirror_seq_blocks != sb->num_data_blocks)
+    {
+        while (mirror_pending > 0)
+            pthread_cond_wait(&mirror_done, &mirror_lock);
+        free(mirror_block_seq);
+        mirror_block_seq = calloc(sb->num_data_blocks, sizeof(unsigned int));
+        mirror_seq_blocks = (mirror_block_seq != NULL) ? sb->num_data_blocks : 0;
+        mirror_seq = 0;
+        memset(mirror_done_seq, 0, sizeof(mirror_done_seq));
+    }
+    while (cnt_mirror_workers < cnt_disks)
+    {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, mirror_worker, (void *)(intptr_t)cnt_mirror_workers) != 0)
+            break;
+        pthread_detach(tid);
+        mirror_done_seq[cnt_mirror_workers] = mirror_seq;
+        cnt_mirror_workers++;
+    }
+
+    job->seq = ++mirror_seq;
+    if (mirror_block_seq != NULL)
+    {
+        for (int i = 0; i < job->cnt_segs; i++)
+            mirror_block_seq[job->segs[i].d_block_index] = job->seq;
+    }
+
+    job->cnt_copied = (quorum < cnt_disks) ? 1 : 0;
+    job->refs = 1;
+    for (int j = 1; j < cnt_disks; j++)
+    {
+        // no worker : copy it here
+        if (j >= cnt_mirror_workers)
+        {
+            for (int i = 0; i < job->cnt_segs; i++)
+                memcpy(job->segs[i].dst[j], job->segs[i].src, job->segs[i].len);
+            mirror_done_seq[j] = job->seq;
+            job->cnt_copied++;
+            continue;
+        }
+        job->next[j] = NULL;
+        if (mirror_tail[j] != NULL)
+            mirror_tail[j]->next[j] = job;
+        else
+            mirror_head[j] = job;
+        mirror_tail[j] = job;
+        job->refs++;
+        mirror_pending++;
+    }
+    pthread_cond_broadcast(&mirror_work);
+    pthread_mutex_unlock(&mirror_lock);
+
+    if (quorum == cnt_disks)
+    {
+        for (int i = 0; i < job->cnt_segs; i++)
+            memcpy(job->segs[i].dst[0], job->segs[i].src, job->segs[i].len);
+    }
+
+    pthread_mutex_lock(&mirror_lock);
+    if (quorum == cnt_disks)
+        job->cnt_copied++;
+    while (job->cnt_copied < quorum)
+        pthread_cond_wait(&mirror_done, &mirror_lock);
+    TRACE_V(TR_IO, "mirror job %u: %d blocks on %d of %d disks, %d copies pending", job->seq, job->cnt_segs, job->cnt_copied, cnt_disks, mirror_pending);
+    put_mirror_job(job);
+    trim_mirror_log();
+    pthread_mutex_unlock(&mirror_lock);
+}
+
+// waits until every queued mirror copy is done, called before reading, moving or freeing blocks on the other disks
+void drain_mirror_writes()
+{
+    pthread_mutex_lock(&mirror_lock);
+    while (mirror_pending > 0)
+        pthread_cond_wait(&mirror_done, &mirror_lock);
+    trim_mirror_log();
+    pthread_mutex_unlock(&mirror_lock);
+}
+
+// ###################################### io_uring write-back ######################################
+
+/*
+  With --io-uring the disks are memory caches (uring.c) and stores only
+  reach the image files when the caches are written back: on fsync, at
+  unmount, every FLUSH_INTERVAL seconds and as soon as dirty blocks fill
+  half of --cache-size. A crash loses the writes of the last interval.
+  Every store to a d-block is marked with mark_block_written, the
+  metadata is pinned and compared. Queued mirror copies are drained
+  first so the mirrors are written back with the same contents.
+  A block whose read fails is never handed out: get_d_block_ptr returns
+  NULL, mark_block_written -EIO, and the callback fails with -EIO.
+*/
+
+// seconds between periodic write-backs
+#define FLUSH_INTERVAL (5)
+
+// writes the disk caches back (nothing to do on mmap), called with wfs_lock held, returns 0 or -errno
+int flush_disks()
+{
+    int res = 0;
+    if (!use_io_uring)
+        return res;
+    drain_mirror_writes();
+    res = uring_flush();
+    TRACE(TR_IO, "disk caches written back: %d", res);
+    return res;
+}
+
+/****************************************
+background thread, writes the disk caches back every FLUSH_INTERVAL seconds
+the write-back waits for the callbacks like any background class, it has no
+rate limit since a slower one would widen the window of writes a crash loses
+*****************************************/
+void *flush_worker(void *arg)
+{
+    pthread_mutex_lock(&wfs_lock);
+    while (!shutting_down)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += FLUSH_INTERVAL;
+        pthread_cond_timedwait(&flush_cond, &wfs_lock, &deadline);
+        if (shutting_down)
+            break;
+        pthread_mutex_unlock(&wfs_lock);
+
+        bg_lock(QOS_FLUSH);
+        if (!shutting_down)
+            flush_disks();
+        bg_unlock(QOS_FLUSH, 0);
+        pthread_mutex_lock(&wfs_lock);
+    }
+    pthread_mutex_unlock(&wfs_lock);
+    return NULL;
+}
+
+// ###################################### Mirror resync ######################################
+
+/****************************************
+copies the superblock, bitmaps and inode table of one disk onto another
+regions a grow relocated into the data blocks are copied too
+the destination keeps its disk order
+*****************************************/
+void resync_metadata(int src_disk_num, int dst_disk_num, int disk_order)
+{
+    struct wfs_sb *src_sb = (struct wfs_sb *)ordered_disk_mmap_ptr[src_disk_num];
+    struct wfs_sb *dst_sb = (struct wfs_sb *)ordered_disk_mmap_ptr[dst_disk_num];
+
+    // --io-uring : the destination takes the source's layout
+    if (pin_disk_metadata(dst_sb, src_sb) != 0)
+        TRACE(TR_RAID, "disk %d: metadata could not be read", disk_order);
+    memcpy(dst_sb, src_sb, src_sb->d_blocks_ptr);
+    memcpy((char *)dst_sb + src_sb->i_bitmap_ptr, (char *)src_sb + src_sb->i_bitmap_ptr, src_sb->num_inodes / 8);
+    memcpy((char *)dst_sb + src_sb->d_bitmap_ptr, (char *)src_sb + src_sb->d_bitmap_ptr, src_sb->num_data_blocks / 8);
+    memcpy((char *)dst_sb + src_sb->i_blocks_ptr, (char *)src_sb + src_sb->i_blocks_ptr, src_sb->num_inodes * BLOCK_SIZE);
+    dst_sb->disk_order = disk_order;
+    TRACE(TR_RAID, "disk %d: metadata copied from disk %d", disk_order, src_sb->disk_order);
+}
+
+// sets missing_disks on every disk present
+void set_missing_disks(int missing)
+{
+    for (int i = 0; i < cnt_disks; i++)
+        ((struct wfs_sb *)ordered_disk_mmap_ptr[i])->missing_disks = missing;
+}
+
+/****************************************
+ends a resync : the stale disks are up to date
+the write-intent bitmap is cleared unless a disk is still missing
+*****************************************/
+void finish_resync()
+{
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[resync_source];
+    int missing = sb->missing_disks;
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        if (resync_stale[i])
+            missing &= ~(1 << ((struct wfs_sb *)ordered_disk_mmap_ptr[i])->disk_order);
+        resync_stale[i] = 0;
+    }
+    set_missing_disks(missing);
+    if (missing == 0)
+    {
+        for (int i = 0; i < cnt_disks; i++)
+            memset(((struct wfs_sb *)ordered_disk_mmap_ptr[i])->wi_bitmap, 0, sizeof(sb->wi_bitmap));
+    }
+    resync_source = -1;
+    TRACE(TR_RAID, "resync done, missing disks 0x%x", missing);
+}
+
+// background thread, copies the dirty regions to the stale disks one region at a time
+void *resync_worker(void *arg)
+{
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+    int region_blocks = wi_region_blocks();
+    int cnt_copied = 0;
+
+    for (int region = 0; region < WI_REGIONS; region++)
+    {
+        bg_lock(QOS_REBUILD);
+        if (shutting_down)
+        {
+            pthread_mutex_unlock(&wfs_lock);
+            return NULL;
+        }
+        // the source disk may still be behind on queued mirror copies
+        drain_mirror_writes();
+
+        double bytes = 0;
+        int failed = 0;
+        int first = region * region_blocks;
+        int last = first + region_blocks;
+        if (last > sb->num_data_blocks)
+            last = sb->num_data_blocks;
+        if (first < last && wi_region_dirty(region))
+        {
+            size_t len = (size_t)(last - first) * BLOCK_SIZE;
+            char *src = (char *)ordered_disk_mmap_ptr[resync_source] + sb->d_blocks_ptr + (off_t)first * BLOCK_SIZE;
+            if (use_io_uring && uring_load(src, len) != 0)
+                failed = 1;
+            for (int i = 0; !failed && i < cnt_disks; i++)
+            {
+                if (!resync_stale[i])
+                    continue;
+                char *dst = (char *)ordered_disk_mmap_ptr[i] + sb->d_blocks_ptr + (off_t)first * BLOCK_SIZE;
+                if (use_io_uring && uring_mark_dirty(dst, len) != 0)
+                {
+                    failed = 1;
+                    break;
+                }
+                memcpy(dst, src, len);
+                bytes += (double)(last - first) * BLOCK_SIZE;
+            }
+            cnt_copied++;
+        }
+
+        // check : a region that could not be copied stays stale and is served from the source,
+        // the resync stops there and the next mount starts it again
+        if (failed)
+        {
+            TRACE(TR_RAID, "resync stopped at region %d, it could not be read", region);
+            bg_unlock(QOS_REBUILD, bytes);
+            return NULL;
+        }
+        resync_cursor = region + 1;
+        bg_unlock(QOS_REBUILD, bytes);
+    }
+
+    pthread_mutex_lock(&wfs_lock);
+    TRACE(TR_RAID, "resync copied %d of %d regions", cnt_copied, WI_REGIONS);
+    if (!shutting_down)
+        finish_resync();
+    pthread_mutex_unlock(&wfs_lock);
+    return NULL;
+}
+
+/****************************************
+orders the mirrors given at mount, fills cnt_disks with the disks present
+missing disks make the mount degraded, out of date disks start a resync
+a blank image takes the place of a missing disk
+returns 0, or -1 if the disks do not form one usable mirror set
+*****************************************/
+int assemble_mirrors(int disk_cnt, void **disk_mmap_ptr, off_t disk_size[])
+{
+    struct wfs_sb *ref = NULL;
+    void *by_order[MAX_DISKS] = {NULL};
+    void *blank[MAX_DISKS] = {NULL};
+    int cnt_blank = 0;
+
+    for (int i = 0; i < disk_cnt; i++)
+    {
+        struct wfs_sb *sb = (struct wfs_sb *)disk_mmap_ptr[i];
+        if (sb->total_disks == 0)
+        {
+            blank[cnt_blank++] = disk_mmap_ptr[i];
+            continue;
+        }
+        if (ref == NULL)
+            ref = sb;
+
+        // check : one mirror set, each disk once
+        if (sb->total_disks != ref->total_disks || sb->num_inodes != ref->num_inodes ||
+            sb->num_data_blocks != ref->num_data_blocks || sb->disk_order < 0 ||
+            sb->disk_order >= ref->total_disks || by_order[sb->disk_order] != NULL)
+        {
+            printf("Error: disks do not form one mirror set.\n");
+            return -1;
+        }
+        by_order[sb->disk_order] = disk_mmap_ptr[i];
+    }
+    if (ref == NULL || disk_cnt > ref->total_disks)
+    {
+        printf("Error: disks do not form one mirror set.\n");
+        return -1;
+    }
+
+    // check : every image holds the mirror, a blank one too
+    for (int i = 0; i < disk_cnt; i++)
+    {
+        if (ref->d_blocks_ptr + ref->num_data_blocks * BLOCK_SIZE > disk_size[i])
+        {
+            printf("Error: disks do not form one mirror set.\n");
+            return -1;
+        }
+    }
+
+    // source : a disk present that is not out of date itself
+    int source_order = -1;
+    int stale = 0;
+    for (int order = 0; order < ref->total_disks; order++)
+    {
+        struct wfs_sb *sb = (struct wfs_sb *)by_order[order];
+        if (sb == NULL || (sb->missing_disks & (1 << order)))
+            continue;
+        if (source_order == -1 || (sb->missing_disks != 0 && ((struct wfs_sb *)by_order[source_order])->missing_disks == 0))
+            source_order = order;
+    }
+    if (source_order == -1)
+    {
+        printf("Error: every disk present is out of date.\n");
+        return -1;
+    }
+    struct wfs_sb *source_sb = (struct wfs_sb *)by_order[source_order];
+    for (int order = 0; order < ref->total_disks; order++)
+    {
+        struct wfs_sb *sb = (struct wfs_sb *)by_order[order];
+        if (sb == NULL || !(source_sb->missing_disks & (1 << order)))
+            continue;
+
+        // check : a disk the source missed that was mounted without the source has diverged
+        if (sb->missing_disks != 0 && !(sb->missing_disks & (1 << order)))
+        {
+            printf("Error: disks %d and %d were mounted apart.\n", source_order, order);
+            return -1;
+        }
+        stale |= 1 << order;
+    }
+
+    // blank images replace missing disks, in order
+    int cnt_replaced = 0;
+    for (int order = 0; order < ref->total_disks && cnt_replaced < cnt_blank; order++)
+    {
+        if (by_order[order] != NULL)
+            continue;
+        by_order[order] = blank[cnt_replaced++];
+        stale |= 1 << order;
+    }
+
+    // the disks present, in order
+    int missing = source_sb->missing_disks;
+    cnt_disks = 0;
+    for (int order = 0; order < ref->total_disks; order++)
+    {
+        if (by_order[order] == NULL)
+        {
+            missing |= 1 << order;
+            continue;
+        }
+        if (order == source_order)
+            resync_source = cnt_disks;
+        resync_stale[cnt_disks] = (stale >> order) & 1;
+        ordered_disk_mmap_ptr[cnt_disks++] = by_order[order];
+    }
+    degraded = cnt_disks < ref->total_disks;
+
+    // stale disks : metadata now, data regions in the background
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        if (!resync_stale[i])
+            continue;
+        int order = 0;
+        while (by_order[order] != ordered_disk_mmap_ptr[i])
+            order++;
+        resync_metadata(resync_source, i, order);
+    }
+    set_missing_disks(missing | stale);
+
+    // a blank disk has nothing : every region is dirty, kept on disk in case the resync is cut short
+    if (cnt_replaced > 0)
+    {
+        for (int i = 0; i < cnt_disks; i++)
+            memset(((struct wfs_sb *)ordered_disk_mmap_ptr[i])->wi_bitmap, 0xff, sizeof(source_sb->wi_bitmap));
+    }
+    if (stale == 0)
+        resync_source = -1;
+
+    // flush : fuse_main daemonizes next, an unflushed buffer would go to /dev/null
+    if (degraded)
+    {
+        printf("Warning: mounting degraded, %d of %d disks present.\n", cnt_disks, ref->total_disks);
+        fflush(stdout);
+    }
+    TRACE(TR_RAID, "mirrors assembled : %d disks, missing 0x%x, stale 0x%x", cnt_disks, missing, stale);
+    return 0;
+}
+
+// ###################################### Scrubbing ######################################
+
+/*
+  A background thread scrubs the mirrors: it walks the allocated inodes
+  and the allocated data blocks (by disk 0's bitmaps) and compares the
+  copies on every disk. When a strict majority of the copies agree, the
+  others are rewritten from it; a block without one (two disks that
+  differ) is only counted. The copies are compared SCRUB_BATCH at a time
+  as the scrub class of the I/O scheduler, whose rate is scrub_rate
+  KiB/s, so requests get in between batches. A pass starts at mount and SCRUB_INTERVAL seconds
+  after the last one ended, or at once on WFS_IOC_SCRUB; a resync in
+  progress holds the scrub back. The ioctl reports the progress.
+*/
+
+// inodes or data blocks compared per hold of wfs_lock
+#define SCRUB_BATCH (64)
+
+// seconds between the end of a pass and the start of the next
+#define SCRUB_INTERVAL (24 * 3600)
+
+// set by the --scrub-rate=N mount option (KiB/s), 0 : no scrubbing
+int scrub_rate = 4096;
+
+pthread_cond_t scrub_cond = PTHREAD_COND_INITIALIZER;
+
+// WFS_IOC_SCRUB asked for a pass
+int scrub_requested = 0;
+
+// progress reported by WFS_IOC_SCRUB, the flags are unused
+struct wfs_scrub scrub_stats;
+
+/****************************************
+compares cnt copies of len bytes and rewrites the ones outside a strict majority
+returns the copies rewritten, or -1 if no copy has a majority
+*****************************************/
+int scrub_copies(char *copies[], int cnt, int len)
+{
+    int best = 0;
+    int best_count = 0;
+    for (int i = 0; i < cnt; i++)
+    {
+        int count = 0;
+        for (int j = 0; j < cnt; j++)
+        {
+            if (memcmp(copies[i], copies[j], len) == 0)
+                count++;
+        }
+        if (count > best_count)
+        {
+            best_count = count;
+            best = i;
+        }
+    }
+    if (best_count == cnt)
+        return 0;
+    if (best_count * 2 <= cnt)
+        return -1;
+
+    int cnt_rewritten = 0;
+    for (int i = 0; i < cnt; i++)
+    {
+        if (memcmp(copies[i], copies[best], len) != 0)
+        {
+            memcpy(copies[i], copies[best], len);
+            cnt_rewritten++;
+        }
+    }
+    return cnt_rewritten;
+}
+
+/****************************************
+scrubs the inode or data block at a position of the pass
+positions below num_inodes are inodes, the rest data blocks
+returns the bytes read, 0 for an unallocated position
+called with wfs_lock held
+*****************************************/
+int scrub_position(size_t pos)
+{
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+    char *base = (char *)ordered_disk_mmap_ptr[0];
+    char *copies[MAX_DISKS];
+    int len = 0;
+    int res = 0;
+
+    if (pos < sb->num_inodes)
+    {
+        int inode_num = pos;
+        __u_int *i_bitmap = (__u_int *)(base + sb->i_bitmap_ptr);
+        if (!(i_bitmap[inode_num / 32] & (1u << (inode_num % 32))))
+            return 0;
+        for (int j = 0; j < cnt_disks; j++)
+            copies[j] = (char *)get_inode_ptr(inode_num, j);
+        len = sizeof(struct wfs_inode);
+        res = scrub_copies(copies, cnt_disks, len);
+        if (res != 0)
+            TRACE(TR_RAID, "scrub: inode %d, %d copies rewritten (-1 : no majority)", inode_num, res);
+    }
+    else
+    {
+        int d_block_index = pos - sb->num_inodes;
+        __u_int *d_bitmap = (__u_int *)(base + sb->d_bitmap_ptr);
+        if (!(d_bitmap[d_block_index / 32] & (1u << (d_block_index % 32))))
+            return 0;
+        for (int j = 0; j < cnt_disks; j++)
+        {
+            copies[j] = (char *)get_d_block_ptr(d_block_index, j);
+            // check : a copy that could not be read is left for the next pass
+            if (copies[j] == NULL)
+            {
+                TRACE(TR_RAID, "scrub: d-block %d could not be read on disk %d", d_block_index, j);
+                return 0;
+            }
+        }
+        len = BLOCK_SIZE;
+        res = scrub_copies(copies, cnt_disks, len);
+        if (res > 0)
+            mark_block_written(d_block_index, -1);
+        if (res != 0)
+            TRACE(TR_RAID, "scrub: d-block %d, %d copies rewritten (-1 : no majority)", d_block_index, res);
+    }
+
+    scrub_stats.cnt_scrubbed++;
+    if (res > 0)
+        scrub_stats.cnt_repaired += res;
+    else if (res < 0)
+        scrub_stats.cnt_conflicts++;
+    return len * cnt_disks;
+}
+
+/****************************************
+one scrub pass over the inodes and data blocks, a batch per turn of the scrub class
+returns early on unmount
+*****************************************/
+void scrub_pass()
+{
+    pthread_mutex_lock(&wfs_lock);
+    scrub_requested = 0;
+    scrub_stats.running = 1;
+    scrub_stats.cursor = 0;
+    pthread_mutex_unlock(&wfs_lock);
+
+    while (scrub_stats.running)
+    {
+        bg_lock(QOS_SCRUB);
+        if (shutting_down)
+        {
+            pthread_mutex_unlock(&wfs_lock);
+            return;
+        }
+
+        // the disks are mapped again when the volume grows
+        struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+        scrub_stats.total = sb->num_inodes + sb->num_data_blocks;
+        double bytes_read = 0;
+        if (scrub_stats.cursor >= scrub_stats.total)
+        {
+            scrub_stats.running = 0;
+            scrub_stats.cnt_passes++;
+            scrub_stats.last_pass = time(NULL);
+            TRACE(TR_RAID, "scrub pass %d done : %zu scrubbed, %zu repaired, %zu without majority", scrub_stats.cnt_passes,
+                  scrub_stats.cnt_scrubbed, scrub_stats.cnt_repaired, scrub_stats.cnt_conflicts);
+        }
+        else if (resync_source != -1 || cnt_disks < 2)
+        {
+            // a disk being resynced is stale, not damaged
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&scrub_cond, &wfs_lock, &deadline);
+        }
+        else
+        {
+            // queued mirror copies would look like damage
+            drain_mirror_writes();
+            for (int i = 0; i < SCRUB_BATCH && scrub_stats.cursor < scrub_stats.total; i++)
+                bytes_read += scrub_position(scrub_stats.cursor++);
+        }
+        bg_unlock(QOS_SCRUB, bytes_read);
+    }
+}
+
+// background thread, scrubs the mirrors once per SCRUB_INTERVAL or when asked
+void *scrub_worker(void *arg)
+{
+    for (;;)
+    {
+        scrub_pass();
+
+        pthread_mutex_lock(&wfs_lock);
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += SCRUB_INTERVAL;
+        while (!shutting_down && !scrub_requested)
+        {
+            if (pthread_cond_timedwait(&scrub_cond, &wfs_lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+        if (shutting_down)
+        {
+            pthread_mutex_unlock(&wfs_lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&wfs_lock);
+    }
+}
+
+// ###################################### Traversal ######################################
+
+/********************************************************
+Function to find the inode number of the next element in path
+Takes in inode number of the parent directory & name of the
+directory to find
+return inode number of the directory if found, else -1
+-EIO if a dentry block of the directory could not be read
+**********************************************************/
+int get_child_inode_num(int inode_num, char *child_name)
+{
+    TRACE(TR_LOOKUP, "lookup %s in inode %d", child_name, inode_num);
+    // ---- step-1 : get the inode pointer ----
+    struct wfs_inode *curr_inode = get_inode_ptr(inode_num, 0);
+    int slots = curr_inode->size / sizeof(struct wfs_dentry);
+
+    // ---- step-2 : Search dirents up to the high-water mark, skipping tombstones ----
+    for (int slot = 0; slot < slots; slot++)
+    {
+        TRACE_V(TR_LOOKUP, "inode %d: slot %d", inode_num, slot);
+        struct wfs_dentry *dentry_ptr = get_dentry_slot_ptr(inode_num, slot, dentry_disk(inode_num, slot));
+        if (dentry_ptr == NULL)
+            return -EIO;
+        if (dentry_ptr->name[0] != '\0' && strcmp(child_name, dentry_ptr->name) == 0)
+        {
+            // if match, then return the next inode block index;
+            return dentry_ptr->num;
+        }
+    }
+    return -1;
+}
+
+/*
+Returns the inode_num of the last element in path
+-1 if there is none, -EIO if a directory on the way could not be read
+*/
+int path_traversal(const char *path, int token_cnt_dcr)
+{
+    char *copy_path = strdup(path);
+    char *token_arr[100]; // Assuming that path won't have more than 10 tokens
+    int token_cnt = 0;
+    token_cnt = path_parse(copy_path, token_arr, "/");
+
+    // Algorithm to determine inode
+    int inode_num = 0;
+    int next_inode_num = 0;
+    int i = 0;
+    for (i = 0; i < (token_cnt - token_cnt_dcr); i++)
+    {
+        // find the inode number of the child
+        next_inode_num = get_child_inode_num(inode_num, token_arr[i]);
+        if (next_inode_num < 0)
+        {
+            return next_inode_num;
+        }
+        else
+        {
+            inode_num = next_inode_num;
+        }
+    }
+    return inode_num;
+}
+
+// ###################################### Snapshots ######################################
+
+/*
+  mkdir /.snapshots/<name> takes a snapshot, rmdir drops it.
+  Taking one copies the allocated inodes into snapshot table blocks and
+  gives every block they point at one more reference, so it costs one
+  table block per SNAP_INODES_PER_BLOCK inodes and no data copies.
+  /.snapshots/<name> is a read-only view of the frozen tree.
+  The snapshots are kept in memory, newest first, in the on-disk chain order.
+*/
+
+#define SNAP_DIR "/.snapshots"
+
+struct snapshot
+{
+    char name[MAX_NAME];
+    time_t ctim;
+    off_t header;             // d-block of its wfs_snap header
+    struct wfs_inode *inodes; // frozen inodes by inode number, num == -1 if it was free
+    int open_cnt;             // open file handles, a snapshot in use is not dropped
+    struct snapshot *next;
+};
+
+struct snapshot *snapshots = NULL;
+
+// returns 1 if the path is /.snapshots or below it
+int is_snap_path(const char *path)
+{
+    int len = strlen(SNAP_DIR);
+    return strncmp(path, SNAP_DIR, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+struct snapshot *find_snapshot(const char *name)
+{
+    for (struct snapshot *snap = snapshots; snap != NULL; snap = snap->next)
+    {
+        if (strcmp(snap->name, name) == 0)
+            return snap;
+    }
+    return NULL;
+}
+
+/****************************************
+claims a d-block at the same index on every disk
+snapshot blocks are metadata and replicated like the inode table
+returns the d-block index, -1 if no index is free on all disks
+*****************************************/
+int alloc_meta_block()
+{
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+
+    for (int d_block_index = 0; d_block_index < sb->num_data_blocks; d_block_index++)
+    {
+        int i = 0;
+        for (i = 0; i < cnt_disks; i++)
+        {
+            struct wfs_sb *disk_sb = (struct wfs_sb *)ordered_disk_mmap_ptr[i];
+            __u_int *d_bitmap = (__u_int *)((char *)disk_sb + disk_sb->d_bitmap_ptr);
+            if (d_bitmap[d_block_index / 32] & (1u << (d_block_index % 32)))
+                break;
+        }
+        if (i < cnt_disks)
+            continue;
+
+        for (i = 0; i < cnt_disks; i++)
+            set_data_bmp_index(d_block_index, 1, i);
+        return d_block_index;
+    }
+    return -1;
+}
+
+void free_meta_block(int d_block_index)
+{
+    for (int i = 0; i < cnt_disks; i++)
+        set_data_bmp_index(d_block_index, 0, i);
+}
+
+// writes a metadata block on every disk, 0 or -EIO
+int write_meta_block(int d_block_index, const void *src, size_t len)
+{
+    int res = mark_block_written(d_block_index, -1);
+    if (res != 0)
+        return res;
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        char *d_block_ptr = (char *)get_d_block_ptr(d_block_index, i);
+        memset(d_block_ptr, 0, BLOCK_SIZE);
+        memcpy(d_block_ptr, src, len);
+    }
+    return res;
+}
+
+/****************************************
+reads a snapshot and its inode table from disk 0
+NULL if a block of it could not be read
+*****************************************/
+struct snapshot *read_snapshot(off_t header)
+{
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+    struct wfs_snap *hdr = (struct wfs_snap *)get_d_block_ptr(header, 0);
+    if (hdr == NULL)
+        return NULL;
+
+    struct snapshot *snap = calloc(1, sizeof(struct snapshot));
+    memcpy(snap->name, hdr->name, MAX_NAME);
+    snap->ctim = hdr->ctim;
+    snap->header = header;
+    snap->inodes = malloc(sb->num_inodes * sizeof(struct wfs_inode));
+    for (int i = 0; i < sb->num_inodes; i++)
+        snap->inodes[i].num = -1;
+
+    int cnt = 0;
+    for (off_t table = hdr->table; table != -1 && cnt < hdr->cnt_inodes;)
+    {
+        struct wfs_snap_table *table_ptr = (struct wfs_snap_table *)get_d_block_ptr(table, 0);
+        if (table_ptr == NULL)
+        {
+            free(snap->inodes);
+            free(snap);
+            return NULL;
+        }
+        for (int i = 0; i < SNAP_INODES_PER_BLOCK && cnt < hdr->cnt_inodes; i++, cnt++)
+            snap->inodes[table_ptr->inodes[i].num] = table_ptr->inodes[i];
+        table = table_ptr->next;
+    }
+    return snap;
+}
+
+/****************************************
+loads the snapshot chain at mount
+then counts the references to every data block
+returns 0, or -EIO if a snapshot or an indirect block could not be read
+*****************************************/
+int load_snapshots()
+{
+    int res = 0;
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+
+    struct snapshot **tail = &snapshots;
+    for (off_t header = sb->snap_head; header != -1;)
+    {
+        *tail = read_snapshot(header);
+        if (*tail == NULL)
+        {
+            res = -EIO;
+            return res;
+        }
+        // loaded : read_snapshot() just read the header
+        header = ((struct wfs_snap *)get_d_block_ptr(header, 0))->next;
+        tail = &(*tail)->next;
+    }
+
+    for (int i = 0; i < cnt_disks; i++)
+        block_refs[i] = calloc(sb->num_data_blocks, sizeof(unsigned int));
+
+    __u_int *i_bitmap = (__u_int *)((char *)sb + sb->i_bitmap_ptr);
+    for (int i = 0; res == 0 && i < sb->num_inodes; i++)
+    {
+        if (i_bitmap[i / 32] & (1u << (i % 32)))
+            res = count_block_refs(get_inode_ptr(i, 0));
+    }
+    for (struct snapshot *snap = snapshots; res == 0 && snap != NULL; snap = snap->next)
+    {
+        for (int i = 0; res == 0 && i < sb->num_inodes; i++)
+        {
+            if (snap->inodes[i].num != -1)
+                res = count_block_refs(&snap->inodes[i]);
+        }
+    }
+    return res;
+}
+
+/****************************************
+freezes the allocated inodes as a new snapshot
+returns 0, -EEXIST, -ENAMETOOLONG, -EBUSY, -ENOSPC or -EIO
+*****************************************/
+int create_snapshot(const char *name)
+{
+    TRACE(TR_ALLOC, "snapshot %s", name);
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+
+    if (strlen(name) >= MAX_NAME)
+        return -ENAMETOOLONG;
+    if (find_snapshot(name) != NULL)
+        return -EEXIST;
+
+    // check : a frozen block map must not mix the stripe widths of a reshape
+    if (reshape_old_disks > 0)
+        return -EBUSY;
+
+    struct snapshot *snap = calloc(1, sizeof(struct snapshot));
+    strncpy(snap->name, name, MAX_NAME - 1);
+    snap->ctim = time(NULL);
+    snap->inodes = malloc(sb->num_inodes * sizeof(struct wfs_inode));
+
+    // copy : allocated inodes, live inode bitmap of disk 0
+    __u_int *i_bitmap = (__u_int *)((char *)sb + sb->i_bitmap_ptr);
+    int cnt_inodes = 0;
+    for (int i = 0; i < sb->num_inodes; i++)
+    {
+        snap->inodes[i].num = -1;
+        if (i_bitmap[i / 32] & (1u << (i % 32)))
+        {
+            snap->inodes[i] = *get_inode_ptr(i, 0);
+            snap->inodes[i].num = i;
+            cnt_inodes++;
+        }
+    }
+
+    // claim : header + table blocks, all or nothing
+    int cnt_blocks = 1 + (cnt_inodes + SNAP_INODES_PER_BLOCK - 1) / SNAP_INODES_PER_BLOCK;
+    int *meta_blocks = malloc(cnt_blocks * sizeof(int));
+    for (int i = 0; i < cnt_blocks; i++)
+    {
+        meta_blocks[i] = alloc_meta_block();
+        if (meta_blocks[i] == -1)
+        {
+            for (int j = 0; j < i; j++)
+                free_meta_block(meta_blocks[j]);
+            free(meta_blocks);
+            free(snap->inodes);
+            free(snap);
+            return -ENOSPC;
+        }
+    }
+
+    // write : inode table
+    struct wfs_snap_table table;
+    int inode_num = 0;
+    int res = 0;
+    for (int b = 1; res == 0 && b < cnt_blocks; b++)
+    {
+        memset(&table, 0, sizeof(table));
+        for (int i = 0; i < SNAP_INODES_PER_BLOCK; i++)
+        {
+            while (inode_num < sb->num_inodes && snap->inodes[inode_num].num == -1)
+                inode_num++;
+            if (inode_num == sb->num_inodes)
+                break;
+            table.inodes[i] = snap->inodes[inode_num++];
+        }
+        table.next = (b + 1 < cnt_blocks) ? meta_blocks[b + 1] : -1;
+        res = write_meta_block(meta_blocks[b], &table, sizeof(table));
+    }
+
+    // write : header, then link it in front of the chain
+    struct wfs_snap hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.name, snap->name, MAX_NAME);
+    hdr.ctim = snap->ctim;
+    hdr.cnt_inodes = cnt_inodes;
+    hdr.table = (cnt_blocks > 1) ? meta_blocks[1] : -1;
+    hdr.next = sb->snap_head;
+    if (res == 0)
+        res = write_meta_block(meta_blocks[0], &hdr, sizeof(hdr));
+
+    // check : a block that could not be read, nothing is linked in yet
+    if (res != 0)
+    {
+        for (int i = 0; i < cnt_blocks; i++)
+            free_meta_block(meta_blocks[i]);
+        free(meta_blocks);
+        free(snap->inodes);
+        free(snap);
+        return res;
+    }
+
+    snap->header = meta_blocks[0];
+    for (int i = 0; i < cnt_disks; i++)
+        ((struct wfs_sb *)ordered_disk_mmap_ptr[i])->snap_head = snap->header;
+    free(meta_blocks);
+
+    // share : every block the frozen inodes point at
+    for (int i = 0; i < sb->num_inodes; i++)
+    {
+        if (snap->inodes[i].num == -1)
+            continue;
+        struct wfs_inode *inode_ptr = &snap->inodes[i];
+        for (int j = 0; j < IND_BLOCK; j++)
+        {
+            if (inode_ptr->blocks[j] >= 0)
+                (*block_ref(inode_ptr->blocks[j], block_disk(inode_ptr, j)))++;
+        }
+        if (inode_ptr->blocks[IND_BLOCK] != -1)
+            (*block_ref(inode_ptr->blocks[IND_BLOCK], ind_disk(inode_ptr->num)))++;
+    }
+
+    snap->next = snapshots;
+    snapshots = snap;
+    TRACE(TR_ALLOC, "snapshot %s: %d inodes in %d blocks", name, cnt_inodes, cnt_blocks);
+    return 0;
+}
+
+/****************************************
+drops a snapshot, frees the blocks only it still points at
+returns 0, -ENOENT, -EBUSY or -EIO
+*****************************************/
+int delete_snapshot(const char *name)
+{
+    TRACE(TR_ALLOC, "drop snapshot %s", name);
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+
+    struct snapshot *prev = NULL;
+    struct snapshot *snap = snapshots;
+    while (snap != NULL && strcmp(snap->name, name) != 0)
+    {
+        prev = snap;
+        snap = snap->next;
+    }
+    if (snap == NULL)
+        return -ENOENT;
+    if (snap->open_cnt != 0)
+        return -EBUSY;
+
+    // check : the chain blocks it touches can be read before any reference is dropped
+    struct wfs_snap *hdr = (struct wfs_snap *)get_d_block_ptr(snap->header, 0);
+    if (hdr == NULL || (prev != NULL && mark_block_written(prev->header, -1) != 0))
+        return -EIO;
+    for (off_t table = hdr->table; table != -1;)
+    {
+        struct wfs_snap_table *table_ptr = (struct wfs_snap_table *)get_d_block_ptr(table, 0);
+        if (table_ptr == NULL)
+            return -EIO;
+        table = table_ptr->next;
+    }
+
+    for (int i = 0; i < sb->num_inodes; i++)
+    {
+        struct wfs_inode *inode_ptr = &snap->inodes[i];
+        if (inode_ptr->num == -1)
+            continue;
+        for (int j = 0; j < IND_BLOCK; j++)
+            put_block(inode_ptr->blocks[j], block_disk(inode_ptr, j));
+        put_indirect_block(inode_ptr->num, inode_ptr->blocks[IND_BLOCK]);
+    }
+
+    // unlink : header from the on-disk chain (loaded and marked above)
+    off_t next = hdr->next;
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        if (prev == NULL)
+            ((struct wfs_sb *)ordered_disk_mmap_ptr[i])->snap_head = next;
+        else
+            ((struct wfs_snap *)get_d_block_ptr(prev->header, i))->next = next;
+    }
+
+    // free : table blocks and header
+    for (off_t table = hdr->table; table != -1;)
+    {
+        off_t next_table = ((struct wfs_snap_table *)get_d_block_ptr(table, 0))->next;
+        free_meta_block(table);
+        table = next_table;
+    }
+    free_meta_block(snap->header);
+
+    if (prev == NULL)
+        snapshots = snap->next;
+    else
+        prev->next = snap->next;
+    free(snap->inodes);
+    free(snap);
+    return 0;
+}
+
+// returns pointer to the given dentry slot of a frozen directory, NULL if its block could not be read
+struct wfs_dentry *get_snap_dentry_ptr(struct wfs_inode *dir_inode_ptr, int slot)
+{
+    struct wfs_dentry *dentry_ptr = (struct wfs_dentry *)get_d_block_ptr(dir_inode_ptr->blocks[slot / DENTRIES_PER_BLOCK], dentry_disk(dir_inode_ptr->num, slot));
+    if (dentry_ptr == NULL)
+        return NULL;
+    return dentry_ptr + slot % DENTRIES_PER_BLOCK;
+}
+
+/****************************************
+resolves a path below /.snapshots/<name>
+returns the frozen inode, NULL if there is none or a directory on the way could not be read
+*snap_out is set to the snapshot when the snapshot exists
+*****************************************/
+struct wfs_inode *snap_path_traversal(const char *path, struct snapshot **snap_out)
+{
+    char *copy_path = strdup(path);
+    char *token_arr[100];
+    int token_cnt = path_parse(copy_path, token_arr, "/");
+
+    if (snap_out != NULL)
+        *snap_out = NULL;
+    if (token_cnt < 2)
+        return NULL;
+
+    struct snapshot *snap = find_snapshot(token_arr[1]);
+    if (snap == NULL)
+        return NULL;
+    if (snap_out != NULL)
+        *snap_out = snap;
+
+    struct wfs_inode *inode_ptr = &snap->inodes[0];
+    for (int i = 2; i < token_cnt; i++)
+    {
+        int slots = inode_ptr->size / sizeof(struct wfs_dentry);
+        struct wfs_inode *child = NULL;
+        for (int slot = 0; slot < slots && child == NULL; slot++)
+        {
+            struct wfs_dentry *dentry_ptr = get_snap_dentry_ptr(inode_ptr, slot);
+            if (dentry_ptr == NULL)
+                return NULL;
+            if (dentry_ptr->name[0] != '\0' && strcmp(token_arr[i], dentry_ptr->name) == 0)
+                child = &snap->inodes[dentry_ptr->num];
+        }
+        if (child == NULL || child->num == -1)
+            return NULL;
+        inode_ptr = child;
+    }
+    return inode_ptr;
+}
+
+// returns the live or frozen inode a path names, NULL with *res_out set to -ENOENT or -EIO if there is none
+struct wfs_inode *resolve_inode(const char *path, int *res_out)
+{
+    *res_out = -ENOENT;
+    if (is_snap_path(path))
+        return snap_path_traversal(path, NULL);
+
+    int inode_num = path_traversal(path, 0);
+    if (inode_num < 0)
+    {
+        *res_out = (inode_num == -1) ? -ENOENT : inode_num;
+        return NULL;
+    }
+    return get_inode_ptr(inode_num, 0);
+}
+
+// number of components in a path below /.snapshots (1 : /.snapshots, 2 : a snapshot root)
+int snap_path_depth(const char *path)
+{
+    char *copy_path = strdup(path);
+    char *token_arr[100];
+    return path_parse(copy_path, token_arr, "/");
+}
+
+// ###################################### Open file handles ######################################
+
+/*
+  open/create resolve the path once and hang a wfs_handle off fi->fh.
+  read/write then go straight to the inode and translate file blocks
+  through the handle's block-map cache, filled lazily from the inode
+  and dropped whenever the inode's block_map_gen moves.
+*/
+
+#define MAP_UNKNOWN     (-2)
+
+struct wfs_handle
+{
+    int inode_num;
+    struct snapshot *snap;       // set for files opened in the snapshot view
+    unsigned long map_gen;       // block_map_gen[inode_num] the cache was filled at
+    int map[MAX_FILE_BLOCKS];    // file block -> d-block index, -1 hole, MAP_UNKNOWN not cached
+};
+
+// returns the handle stored by open/create, NULL for path based calls
+struct wfs_handle *get_handle(struct fuse_file_info *fi)
+{
+    if (fi == NULL || fi->fh == 0)
+        return NULL;
+    return (struct wfs_handle *)(uintptr_t)fi->fh;
+}
+
+// returns the inode an open handle refers to, live or frozen
+struct wfs_inode *get_handle_inode(struct wfs_handle *handle)
+{
+    if (handle->snap != NULL)
+        return &handle->snap->inodes[handle->inode_num];
+    return get_inode_ptr(handle->inode_num, 0);
+}
+
+/****************************************
+same as get_file_block() but served from the handle's cache when there is one
+snapshot files never change and are not cached
+*****************************************/
+int lookup_file_block(struct wfs_handle *handle, struct wfs_inode *inode_ptr, int index_in_blocks)
+{
+    if (handle == NULL || handle->snap != NULL || index_in_blocks >= MAX_FILE_BLOCKS)
+        return get_file_block(inode_ptr, index_in_blocks);
+
+    int inode_num = handle->inode_num;
+
+    // check : block map changed since the cache was filled
+    if (handle->map_gen != block_map_gen[inode_num])
+    {
+        for (int i = 0; i < MAX_FILE_BLOCKS; i++)
+            handle->map[i] = MAP_UNKNOWN;
+        handle->map_gen = block_map_gen[inode_num];
+    }
+    if (handle->map[index_in_blocks] == MAP_UNKNOWN)
+    {
+        int d_block_index = get_file_block(inode_ptr, index_in_blocks);
+        // an unreadable indirect block is not cached, the next lookup reads it again
+        if (d_block_index == -EIO)
+            return d_block_index;
+        handle->map[index_in_blocks] = d_block_index;
+    }
+    return handle->map[index_in_blocks];
+}
+
+/****************************************
+returns a d-block the live file can write block index_in_blocks to
+a block shared with a snapshot or another file is copied first, a missing one allocated
+-1 if no block is free, -EIO if a block could not be read
+the block returned is loaded on every disk it is written to
+*****************************************/
+int get_writable_block(struct wfs_handle *handle, int inode_num, int index_in_blocks)
+{
+    int d_block_index = lookup_file_block(handle, get_inode_ptr(inode_num, 0), index_in_blocks);
+
+    // shared : write to a private copy, blocks past the direct ones may be shared through the indirect block
+    if (d_block_index >= 0 && (index_in_blocks >= IND_BLOCK || *block_ref(d_block_index, data_disk(inode_num, index_in_blocks)) > 1))
+    {
+        // a copy reads every mirror, queued copies of the block have to land first
+        off_t indirect_block_index = get_inode_ptr(inode_num, 0)->blocks[IND_BLOCK];
+        if (raid_mode != 0 && (*block_ref(d_block_index, 0) > 1 ||
+                               (index_in_blocks >= IND_BLOCK && *block_ref(indirect_block_index, 0) > 1)))
+            wait_mirror_block(d_block_index);
+        d_block_index = cow_file_block(inode_num, index_in_blocks);
+        if (d_block_index < 0)
+            return d_block_index;
+    }
+    if (d_block_index >= 0)
+    {
+        int res = mark_block_written(d_block_index, data_disk(inode_num, index_in_blocks));
+        if (res != 0)
+            return res;
+        return d_block_index;
+    }
+    if (d_block_index == -EIO)
+        return d_block_index;
+
+    // blocks past the direct ones need the indirect block first
+    if (index_in_blocks >= IND_BLOCK && get_inode_ptr(inode_num, 0)->blocks[IND_BLOCK] == -1)
+    {
+        int res = allocate_indirect_block(inode_num, ind_disk(inode_num));
+        if (res < 0)
+            return res;
+    }
+
+    // allocate a page
+    int disk_num = data_disk(inode_num, index_in_blocks);
+    d_block_index = allocate_direct_block(inode_num, index_in_blocks, disk_num);
+
+    // check : the new block could not be read (its bitmap mark failed), it is given back
+    if (d_block_index >= 0 && mark_block_written(d_block_index, disk_num) != 0)
+    {
+        set_file_block(inode_num, index_in_blocks, -1);
+        put_block(d_block_index, disk_num);
+        return -EIO;
+    }
+    return d_block_index;
+}
+
+static int wfs_open(const char *path, struct fuse_file_info *fi)
+{
+    TRACE(TR_LOOKUP, "open %s", path);
+
+    struct snapshot *snap = NULL;
+    int inode_num = -1;
+    if (is_snap_path(path))
+    {
+        struct wfs_inode *inode_ptr = snap_path_traversal(path, &snap);
+        if (inode_ptr == NULL)
+            return -ENOENT;
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EROFS;
+        inode_num = inode_ptr->num;
+    }
+    else
+    {
+        inode_num = path_traversal(path, 0);
+        if (inode_num < 0)
+            return (inode_num == -1) ? -ENOENT : inode_num;
+    }
+
+    struct wfs_handle *handle = malloc(sizeof(struct wfs_handle));
+    if (handle == NULL)
+        return -ENOMEM;
+    handle->inode_num = inode_num;
+    handle->snap = snap;
+    if (snap != NULL)
+        snap->open_cnt++;
+    handle->map_gen = block_map_gen[inode_num] - 1; // empty cache
+    if (snap == NULL)
+        file_open_cnt[inode_num]++;
+    fi->fh = (uintptr_t)handle;
+    return 0;
+}
+
+// ###################################### Compressed clusters ######################################
+
+/*
+  With --compress, file data is written a cluster (CLUSTER_BLOCKS blocks)
+  at a time. A cluster that compresses into fewer blocks is stored as one
+  extent in its first blocks and its remaining block pointers hold
+  CMP_TAIL; one that does not shrink is stored raw. Compressed clusters
+  stay readable, and are rewritten raw, on mounts that do not compress.
+  Directories are never compressed.
+*/
+
+#define CMP_TAIL (-2)
+
+// set by the --compress mount option
+int compress_writes = 0;
+
+// number of block pointers in a cluster, the last cluster of a file is shorter
+int cluster_len(int cluster)
+{
+    int len = MAX_FILE_BLOCKS - cluster * CLUSTER_BLOCKS;
+    return (len < CLUSTER_BLOCKS) ? len : CLUSTER_BLOCKS;
+}
+
+// returns 1 if block index_in_blocks belongs to a compressed extent
+// a block map that could not be read counts as one, reading the extent then fails with -EIO
+int in_compressed_cluster(struct wfs_handle *handle, struct wfs_inode *inode_ptr, int index_in_blocks)
+{
+    int cluster = index_in_blocks / CLUSTER_BLOCKS;
+    for (int i = 0; i < cluster_len(cluster); i++)
+    {
+        int d_block_index = lookup_file_block(handle, inode_ptr, cluster * CLUSTER_BLOCKS + i);
+        if (d_block_index == CMP_TAIL || d_block_index == -EIO)
+            return 1;
+    }
+    return 0;
+}
+
+// disk a file block is read from, RAID1v : the copy that wins the vote
+int get_read_disk(int inode_num, int d_block_index, int index_in_blocks)
+{
+    // only the mirrors done with every queued copy of the block are read
+    if (raid_mode == 2)
+        return get_correct_disk_num(d_block_index, BLOCK_SIZE, current_mirrors(d_block_index));
+    int disk_num = data_disk(inode_num, index_in_blocks);
+    if (raid_mode == 1 && !(current_mirrors(d_block_index) & (1u << disk_num)))
+        return 0;
+    return disk_num;
+}
+
+/****************************************
+returns the decompressed contents of a compressed cluster
+served from the cluster cache, NULL if the extent is corrupt or could not be read
+*****************************************/
+char *get_compressed_cluster(struct wfs_handle *handle, struct wfs_inode *inode_ptr, int cluster)
+{
+    int first = cluster * CLUSTER_BLOCKS;
+    int d_block_index = lookup_file_block(handle, inode_ptr, first);
+    struct cluster_cache_entry *entry = find_cached_cluster(d_block_index, data_disk(inode_ptr->num, first));
+    if (entry != NULL)
+        return entry->data;
+
+    // gather : the blocks of the extent
+    char extent[CLUSTER_BLOCKS * BLOCK_SIZE];
+    int cnt_blocks = 0;
+    for (cnt_blocks = 0; cnt_blocks < cluster_len(cluster); cnt_blocks++)
+    {
+        int extent_block = lookup_file_block(handle, inode_ptr, first + cnt_blocks);
+        if (extent_block < 0)
+            break;
+        char *d_block_ptr = (char *)get_d_block_ptr(extent_block, get_read_disk(inode_ptr->num, extent_block, first + cnt_blocks));
+        if (d_block_ptr == NULL)
+            return NULL;
+        memcpy(extent + cnt_blocks * BLOCK_SIZE, d_block_ptr, BLOCK_SIZE);
+    }
+
+    struct wfs_cmp_extent *hdr = (struct wfs_cmp_extent *)extent;
+    if (cnt_blocks == 0 || hdr->magic != WFS_CMP_MAGIC || hdr->len > cnt_blocks * BLOCK_SIZE - sizeof(struct wfs_cmp_extent))
+        return NULL;
+
+    entry = claim_cached_cluster(d_block_index, data_disk(inode_ptr->num, first));
+    memset(entry->data, 0, sizeof(entry->data));
+    if (wfs_lz_decompress(extent + sizeof(struct wfs_cmp_extent), hdr->len, entry->data, sizeof(entry->data)) < 0)
+    {
+        entry->valid = 0;
+        return NULL;
+    }
+    TRACE_V(TR_IO, "cluster %d: %d compressed bytes in %d blocks decompressed", cluster, hdr->len, cnt_blocks);
+    return entry->data;
+}
+
+/****************************************
+copies the contents of a cluster (compressed, raw or holes) into data
+returns 0 or -EIO if the extent is corrupt or a block could not be read
+*****************************************/
+int load_cluster(struct wfs_handle *handle, struct wfs_inode *inode_ptr, int cluster, char *data)
+{
+    int first = cluster * CLUSTER_BLOCKS;
+    memset(data, 0, CLUSTER_BLOCKS * BLOCK_SIZE);
+
+    if (in_compressed_cluster(handle, inode_ptr, first))
+    {
+        char *cluster_data = get_compressed_cluster(handle, inode_ptr, cluster);
+        if (cluster_data == NULL)
+            return -EIO;
+        memcpy(data, cluster_data, CLUSTER_BLOCKS * BLOCK_SIZE);
+        return 0;
+    }
+
+    for (int i = 0; i < cluster_len(cluster); i++)
+    {
+        int d_block_index = lookup_file_block(handle, inode_ptr, first + i);
+        if (d_block_index == -EIO)
+            return -EIO;
+        if (d_block_index < 0)
+            continue;
+        char *d_block_ptr = (char *)get_d_block_ptr(d_block_index, get_read_disk(inode_ptr->num, d_block_index, first + i));
+        if (d_block_ptr == NULL)
+            return -EIO;
+        memcpy(data + i * BLOCK_SIZE, d_block_ptr, BLOCK_SIZE);
+    }
+    return 0;
+}
+
+/****************************************
+stores the first cnt_blocks blocks of data as a cluster of a live file
+compressed if the mount compresses and that saves a block, else raw
+a raw cluster that stays raw is written in place
+returns 0, -ENOSPC or -EIO
+*****************************************/
+int store_cluster(int inode_num, int cluster, const char *data, int cnt_blocks)
+{
+    int res = 0;
+    int first = cluster * CLUSTER_BLOCKS;
+    char extent[CLUSTER_BLOCKS * BLOCK_SIZE];
+
+    // blocks the cluster is stored in, none for an all-zero cluster (a hole)
+    int extent_blocks = cnt_blocks;
+    int is_hole = is_zero_range(data, cnt_blocks * BLOCK_SIZE);
+    if (is_hole)
+        extent_blocks = 0;
+    else if (compress_writes && cnt_blocks > 1)
+    {
+        struct wfs_cmp_extent *hdr = (struct wfs_cmp_extent *)extent;
+        int cap = (cnt_blocks - 1) * BLOCK_SIZE - sizeof(struct wfs_cmp_extent);
+        int len = wfs_lz_compress(data, cnt_blocks * BLOCK_SIZE, extent + sizeof(struct wfs_cmp_extent), cap);
+        if (len > 0)
+        {
+            hdr->magic = WFS_CMP_MAGIC;
+            hdr->len = len;
+            extent_blocks = (sizeof(struct wfs_cmp_extent) + len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        }
+    }
+    const char *src = (extent_blocks < cnt_blocks) ? extent : data;
+
+    // release : an extent is never rewritten in place
+    struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, 0);
+    if (extent_blocks < cnt_blocks || in_compressed_cluster(NULL, inode_ptr, first))
+    {
+        for (int i = first; i < first + cluster_len(cluster); i++)
+        {
+            int d_block_index = get_file_block(inode_ptr, i);
+            if (d_block_index == -EIO)
+                return d_block_index;
+            if (d_block_index == -1)
+                continue;
+            res = set_file_block(inode_num, i, -1);
+            if (res < 0)
+                return (res == -1) ? -ENOSPC : res;
+            put_block(d_block_index, data_disk(inode_num, i));
+        }
+    }
+
+    for (int i = 0; i < cnt_blocks; i++)
+    {
+        // mark : the tail of a compressed cluster
+        if (i >= extent_blocks)
+        {
+            if (is_hole)
+                continue;
+            if (first + i >= IND_BLOCK && get_inode_ptr(inode_num, 0)->blocks[IND_BLOCK] == -1)
+                res = allocate_indirect_block(inode_num, ind_disk(inode_num));
+            if (res >= 0)
+                res = set_file_block(inode_num, first + i, CMP_TAIL);
+            if (res < 0)
+                return (res == -1) ? -ENOSPC : res;
+            continue;
+        }
+
+        int d_block_index = get_writable_block(NULL, inode_num, first + i);
+        if (d_block_index < 0)
+            return (d_block_index == -1) ? -ENOSPC : d_block_index;
+        // loaded : get_writable_block() marked the block
+        for (int j = 0; j < cnt_disks; j++)
+        {
+            if (raid_mode == 0 && j != data_disk(inode_num, first + i))
+                continue;
+            memcpy(get_d_block_ptr(d_block_index, j), src + i * BLOCK_SIZE, BLOCK_SIZE);
+        }
+    }
+    TRACE_V(TR_IO, "inode %d: cluster %d stored in %d of %d blocks", inode_num, cluster, extent_blocks, cnt_blocks);
+    return 0;
+}
+
+// ###################################### File data ######################################
+
+/****************************************
+reads size bytes at offset of a file (live or frozen)
+returns the number of bytes read or -EIO
+*****************************************/
+int read_file_range(struct wfs_handle *handle, struct wfs_inode *inode_ptr, char *buf, size_t size, off_t offset)
+{
+    // check : offset is greater than size
+    if (offset >= inode_ptr->size)
+        return 0;
+
+    int size_to_read = inode_ptr->size - offset;
+    if (size < size_to_read)
+    {
+        size_to_read = size;
+    }
+
+    int read_bytes = size_to_read;
+
+    // determine : data block to be read
+    int index_in_blocks = offset / BLOCK_SIZE;
+    int offset_within_block = offset % BLOCK_SIZE;
+
+    // loop for number of pages to be read
+    while (size_to_read > 0)
+    {
+        int d_block_index = lookup_file_block(handle, inode_ptr, index_in_blocks);
+        if (d_block_index == -EIO)
+            return -EIO;
+
+        // the space in the chosen d-block given it has some data already on it
+        int space_in_d_block = BLOCK_SIZE - offset_within_block;
+        int read_size = (size_to_read > space_in_d_block) ? space_in_d_block : size_to_read;
+
+        const char *src = NULL;
+        if (d_block_index == CMP_TAIL || (d_block_index >= 0 && in_compressed_cluster(handle, inode_ptr, index_in_blocks)))
+        {
+            char *cluster_data = get_compressed_cluster(handle, inode_ptr, index_in_blocks / CLUSTER_BLOCKS);
+            if (cluster_data == NULL)
+                return -EIO;
+            src = cluster_data + (index_in_blocks % CLUSTER_BLOCKS) * BLOCK_SIZE;
+        }
+        else if (d_block_index == -1)
+        {
+            // hole : reads as zeros
+            memset(buf, 0, read_size);
+        }
+        else
+        {
+            // RAID0 : the disk holding the block, RAID1 : spread reads over the mirrors
+            src = (const char *)get_d_block_ptr(d_block_index, get_read_disk(inode_ptr->num, d_block_index, index_in_blocks));
+            if (src == NULL)
+                return -EIO;
+        }
+        if (src != NULL)
+            memcpy(buf, src + offset_within_block, read_size);
+
+        buf += read_size;
+        size_to_read = size_to_read - read_size;
+        index_in_blocks++;
+
+        // austin
+        offset_within_block = 0;
+    }
+
+    return read_bytes;
+}
+
+/****************************************
+writes size bytes at offset of a live file and updates its size
+compressed mounts and compressed clusters go through a read-modify-write of the cluster
+returns the number of bytes written, -EFBIG, -ENOSPC or -EIO
+*****************************************/
+int write_file_range(struct wfs_handle *handle, int inode_num, const char *buf, size_t size, off_t offset)
+{
+    int res = 0;
+    struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, 0);
+
+    // check : write past the last indirect entry
+    if ((offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE > MAX_FILE_BLOCKS)
+    {
+        res = -EFBIG;
+        return res;
+    }
+
+    // file size once this write is done, bounds the blocks a cluster stores
+    off_t end = (offset + (off_t)size > inode_ptr->size) ? offset + (off_t)size : inode_ptr->size;
+
+    // variable to store the number of bytes written to file in 1 function call
+    int total_bytes_written = 0;
+    off_t pos = offset;
+
+    // large mirror writes : the disk copies are gathered and run side by side
+    struct mirror_job *job = NULL;
+    if (raid_mode != 0 && cnt_disks > 1 && size >= MIRROR_FANOUT_MIN)
+    {
+        job = malloc(sizeof(struct mirror_job));
+        if (job != NULL)
+            job->cnt_segs = 0;
+    }
+
+    while (size > 0)
+    {
+        int index_in_blocks = pos / BLOCK_SIZE;
+        int offset_within_block = pos % BLOCK_SIZE;
+        int write_size = 0;
+
+        if (compress_writes || in_compressed_cluster(handle, inode_ptr, index_in_blocks))
+        {
+            // read-modify-write : the whole cluster
+            int cluster = index_in_blocks / CLUSTER_BLOCKS;
+            off_t cluster_start = (off_t)cluster * CLUSTER_BLOCKS * BLOCK_SIZE;
+            int within = pos - cluster_start;
+            write_size = cluster_len(cluster) * BLOCK_SIZE - within;
+            if (write_size > size)
+                write_size = size;
+
+            char data[CLUSTER_BLOCKS * BLOCK_SIZE];
+            res = load_cluster(handle, inode_ptr, cluster, data);
+            if (res != 0)
+                break;
+            memcpy(data + within, buf, write_size);
+
+            int cnt_blocks = (end - cluster_start + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            if (cnt_blocks > cluster_len(cluster))
+                cnt_blocks = cluster_len(cluster);
+            // the cluster may free and reuse blocks with mirror copies still queued
+            if (raid_mode != 0)
+                drain_mirror_writes();
+            res = store_cluster(inode_num, cluster, data, cnt_blocks);
+            if (res != 0)
+                break;
+        }
+        else
+        {
+            int d_block_index = get_writable_block(handle, inode_num, index_in_blocks);
+
+            // check : no space to allocate new data block, or it could not be read
+            if (d_block_index < 0)
+            {
+                res = (d_block_index == -1) ? -ENOSPC : d_block_index;
+                break;
+            }
+
+            // size to be written to the given d-block
+            int space_in_d_block = BLOCK_SIZE - offset_within_block;
+            write_size = (size > space_in_d_block) ? space_in_d_block : size;
+
+            // loaded : get_writable_block() marked the block on every disk written below
+
+            if (raid_mode == 0)
+            {
+                char *d_block_ptr = (char *)get_d_block_ptr(d_block_index, data_disk(inode_num, index_in_blocks));
+                memcpy(d_block_ptr + offset_within_block, buf, write_size);
+                TRACE_V(TR_IO, "inode %d: block %d copied to disk %d, %d bytes", inode_num, d_block_index, data_disk(inode_num, index_in_blocks), write_size);
+            }
+            else if (job != NULL)
+            {
+                struct mirror_seg *seg = &job->segs[job->cnt_segs++];
+                seg->d_block_index = d_block_index;
+                seg->src = buf;
+                seg->len = write_size;
+                for (int j = 0; j < cnt_disks; j++)
+                    seg->dst[j] = (char *)get_d_block_ptr(d_block_index, j) + offset_within_block;
+            }
+            else
+            {
+                // a queued copy of the block landing after this one would bring back older bytes
+                wait_mirror_block(d_block_index);
+                for (int j = 0; j < cnt_disks; j++)
+                {
+                    char *d_block_ptr = (char *)get_d_block_ptr(d_block_index, j);
+                    memcpy(d_block_ptr + offset_within_block, buf, write_size);
+                    TRACE_V(TR_IO, "inode %d: block %d copied to disk %d, %d bytes", inode_num, d_block_index, j, write_size);
+                }
+            }
+        }
+
+        buf += write_size;
+        size -= write_size;
+        pos += write_size;
+
+        total_bytes_written += write_size;
+    }
+
+    // the blocks gathered so far are written even when the write stopped early
+    if (job != NULL)
+    {
+        if (job->cnt_segs > 0)
+            run_mirror_job(job);
+        else
+            free(job);
+    }
+    if (res < 0)
+        return res;
+
+    // loop to change size within inode, a write past the end leaves a hole before it
+    for (int i = 0; i < cnt_inode_copies; i++)
+    {
+        inode_ptr = get_inode_ptr(inode_num, i);
+        if (total_bytes_written + offset > inode_ptr->size)
+        {
+            // spill case
+            inode_ptr->size = (total_bytes_written + offset);
+        }
+    }
+
+    res = total_bytes_written;
+    return res;
+}
+
+// ###################################### Write-back buffer ######################################
+
+/*
+  Writes through an open handle are buffered per inode and only get
+  d-blocks when the buffer is flushed: on fsync and release, once the
+  buffers outgrow WRITEBACK_MAX_BLOCKS, and before anything that needs
+  the block map on disk (snapshots, clones, unmount). The blocks a file
+  gains at flush time are taken as one contiguous run per disk, and a
+  file unlinked before it is flushed never allocates at all.
+  Buffered blocks without a d-block are reserved against the free
+  counter of the disk they will land on, a write that cannot reserve
+  goes straight to disk. So does a write to a block shared with a
+  snapshot or a clone, whose copy would be an allocation nobody
+  reserved. A flush that fails keeps the blocks it could not write
+  buffered, and the next flush (fsync, close, unmount) tries again.
+*/
+
+#define WRITEBACK_MAX_BLOCKS (256)
+
+struct writeback_buf
+{
+    off_t size;                     // file size including the buffered writes
+    int cnt_dirty;
+    int cnt_reserved;
+    char *blocks[MAX_FILE_BLOCKS];  // buffered contents, NULL if clean
+    char reserved[MAX_FILE_BLOCKS]; // 1 if the block had no d-block when buffered
+};
+
+// per inode, NULL if nothing is buffered
+struct writeback_buf **wb_bufs = NULL;
+
+// buffered blocks over all inodes
+int wb_dirty_blocks = 0;
+
+// per disk, buffered blocks reserved on it (mirrors only use disk 0)
+int *wb_reserved_blocks = NULL;
+
+// disk whose free counter block index_in_blocks of a file is reserved against
+int get_reserve_disk(int inode_num, int index_in_blocks)
+{
+    return (raid_mode == 0) ? data_disk(inode_num, index_in_blocks) : 0;
+}
+
+// free d-blocks of the file system less the reservations, RAID0 sums the disks, mirrors count one copy
+size_t free_data_blocks_unreserved()
+{
+    size_t free_blocks = 0;
+    for (int i = 0; i < ((raid_mode == 0) ? cnt_disks : 1); i++)
+    {
+        size_t disk_free = ((struct wfs_sb *)ordered_disk_mmap_ptr[i])->free_data_blocks;
+        if (disk_free > wb_reserved_blocks[i])
+            free_blocks += disk_free - wb_reserved_blocks[i];
+    }
+    return free_blocks;
+}
+
+// returns the buffer of a live inode, NULL if nothing is buffered
+struct writeback_buf *get_writeback(struct wfs_inode *inode_ptr)
+{
+    // check : snapshot copies are never buffered
+    if (inode_ptr != get_inode_ptr(inode_ptr->num, 0))
+        return NULL;
+    return wb_bufs[inode_ptr->num];
+}
+
+// drops one buffered block and gives back its share of the counters
+void drop_writeback_block(int inode_num, struct writeback_buf *wb, int index_in_blocks)
+{
+    if (wb->blocks[index_in_blocks] == NULL)
+        return;
+
+    wb_reserved_blocks[get_reserve_disk(inode_num, index_in_blocks)] -= wb->reserved[index_in_blocks];
+    wb->cnt_reserved -= wb->reserved[index_in_blocks];
+    wb->reserved[index_in_blocks] = 0;
+    free(wb->blocks[index_in_blocks]);
+    wb->blocks[index_in_blocks] = NULL;
+    wb->cnt_dirty--;
+    wb_dirty_blocks--;
+}
+
+// frees a buffer and gives back its share of the counters
+void free_writeback(int inode_num)
+{
+    struct writeback_buf *wb = wb_bufs[inode_num];
+    if (wb == NULL)
+        return;
+
+    for (int i = 0; i < MAX_FILE_BLOCKS; i++)
+        drop_writeback_block(inode_num, wb, i);
+    free(wb);
+    wb_bufs[inode_num] = NULL;
+}
+
+// 1 if writing block index_in_blocks of a live file needs a copy first (shared itself or through the indirect block)
+int file_block_shared(struct wfs_inode *inode_ptr, int index_in_blocks)
+{
+    int indirect_block_index = inode_ptr->blocks[IND_BLOCK];
+    if (index_in_blocks >= IND_BLOCK && indirect_block_index >= 0 &&
+        *block_ref(indirect_block_index, ind_disk(inode_ptr->num)) > 1)
+        return 1;
+
+    // an unreadable block map counts too, the write goes through and reports it
+    int d_block_index = get_file_block(inode_ptr, index_in_blocks);
+    if (d_block_index == -EIO)
+        return 1;
+    return d_block_index >= 0 && *block_ref(d_block_index, block_disk(inode_ptr, index_in_blocks)) > 1;
+}
+
+/****************************************
+gives the buffered blocks that have no d-block yet one contiguous run per disk
+(mirrors allocate the same index everywhere, so they need a single run)
+blocks no run is found for are left to write_file_range
+*****************************************/
+void allocate_writeback_runs(int inode_num, struct writeback_buf *wb)
+{
+    struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, 0);
+    int cnt_needed[MAX_DISKS] = {0};
+    int last_needed[MAX_DISKS] = {0};
+    int needs_indirect = 0;
+
+    for (int i = 0; i < MAX_FILE_BLOCKS; i++)
+    {
+        if (wb->blocks[i] == NULL || get_file_block(inode_ptr, i) != -1)
+            continue;
+        cnt_needed[(raid_mode == 0) ? data_disk(inode_num, i) : 0]++;
+        last_needed[(raid_mode == 0) ? data_disk(inode_num, i) : 0] = i;
+        if (i >= IND_BLOCK)
+            needs_indirect = 1;
+    }
+
+    // the indirect block first, so it does not split a run
+    if (needs_indirect && inode_ptr->blocks[IND_BLOCK] == -1 &&
+        allocate_indirect_block(inode_num, ind_disk(inode_num)) < 0)
+        return;
+
+    for (int disk_num = 0; disk_num < cnt_disks; disk_num++)
+    {
+        // check : a single block is placed just as well one at a time
+        if (cnt_needed[disk_num] < 2)
+            continue;
+        int d_block_index = pa_alloc(inode_num, last_needed[disk_num], disk_num, cnt_needed[disk_num]);
+        if (d_block_index == -1)
+            d_block_index = get_free_d_block_run(disk_num, cnt_needed[disk_num], inode_num);
+        if (d_block_index == -1)
+            continue;
+
+        for (int i = 0; i < MAX_FILE_BLOCKS; i++)
+        {
+            if (wb->blocks[i] == NULL || get_file_block(inode_ptr, i) != -1)
+                continue;
+            if (((raid_mode == 0) ? data_disk(inode_num, i) : 0) != disk_num)
+                continue;
+
+            claim_data_block(d_block_index, data_disk(inode_num, i));
+            if (set_file_block(inode_num, i, d_block_index) < 0)
+            {
+                put_block(d_block_index, data_disk(inode_num, i));
+                return;
+            }
+            d_block_index++;
+        }
+        TRACE(TR_ALLOC, "inode %d: %d buffered blocks allocated as a run on disk %d", inode_num, cnt_needed[disk_num], disk_num);
+    }
+}
+
+/****************************************
+writes the buffered blocks of an inode to disk and drops the buffer
+consecutive dirty blocks go down as one write_file_range
+a run that fails stays buffered with the ones after it
+returns 0, -ENOSPC, -EIO or -ENOMEM
+*****************************************/
+int flush_writeback(int inode_num)
+{
+    int res = 0;
+    struct writeback_buf *wb = wb_bufs[inode_num];
+    if (wb == NULL)
+        return res;
+
+    // compressed mounts lay blocks out per cluster as they are written
+    if (!compress_writes)
+        allocate_writeback_runs(inode_num, wb);
+
+    int cnt_dirty = wb->cnt_dirty;
+    int first = 0;
+    while (first < MAX_FILE_BLOCKS)
+    {
+        if (wb->blocks[first] == NULL)
+        {
+            first++;
+            continue;
+        }
+        int last = first;
+        while (last < MAX_FILE_BLOCKS && wb->blocks[last] != NULL)
+            last++;
+
+        off_t start = (off_t)first * BLOCK_SIZE;
+        off_t end = (off_t)last * BLOCK_SIZE;
+        if (end > wb->size)
+            end = wb->size;
+
+        char *run = malloc((last - first) * BLOCK_SIZE);
+        if (run == NULL)
+        {
+            res = -ENOMEM;
+            break;
+        }
+        for (int i = first; i < last; i++)
+            memcpy(run + (i - first) * BLOCK_SIZE, wb->blocks[i], BLOCK_SIZE);
+        res = write_file_range(NULL, inode_num, run, end - start, start);
+        free(run);
+        if (res < 0)
+            break;
+        for (int i = first; i < last; i++)
+            drop_writeback_block(inode_num, wb, i);
+        first = last;
+    }
+    TRACE(TR_IO, "inode %d: %d of %d buffered blocks flushed (%d)", inode_num, cnt_dirty - wb->cnt_dirty, cnt_dirty, res);
+
+    if (res < 0)
+        return res;
+    free_writeback(inode_num);
+    return 0;
+}
+
+// flushes every buffer, returns the first error
+int flush_all_writeback()
+{
+    int res = 0;
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+    for (int i = 0; i < sb->num_inodes; i++)
+    {
+        int err = flush_writeback(i);
+        if (res == 0)
+            res = err;
+    }
+    return res;
+}
+
+/****************************************
+buffers size bytes at offset of a live file
+a partial block starts from what the file already holds
+returns the number of bytes written, -EFBIG, -ENOMEM or an error of this inode's flush
+*****************************************/
+int buffer_write(struct wfs_handle *handle, int inode_num, const char *buf, size_t size, off_t offset)
+{
+    int res = 0;
+    struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, 0);
+
+    // check : write past the last indirect entry
+    if ((offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE > MAX_FILE_BLOCKS)
+    {
+        res = -EFBIG;
+        return res;
+    }
+
+    struct writeback_buf *wb = wb_bufs[inode_num];
+    if (wb == NULL)
+    {
+        wb = calloc(1, sizeof(struct writeback_buf));
+        if (wb == NULL)
+        {
+            res = -ENOMEM;
+            return res;
+        }
+        wb->size = inode_ptr->size;
+        wb_bufs[inode_num] = wb;
+    }
+
+    int total_bytes_written = 0;
+    off_t pos = offset;
+
+    while (size > 0)
+    {
+        int index_in_blocks = pos / BLOCK_SIZE;
+        int offset_within_block = pos % BLOCK_SIZE;
+        int space_in_d_block = BLOCK_SIZE - offset_within_block;
+        int write_size = (size > space_in_d_block) ? space_in_d_block : size;
+
+        if (wb->blocks[index_in_blocks] == NULL)
+        {
+            int unbacked = lookup_file_block(handle, inode_ptr, index_in_blocks) < 0;
+            int disk_num = get_reserve_disk(inode_num, index_in_blocks);
+            struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[disk_num];
+
+            // check : no block left to reserve (one spare for the indirect block) or a shared block, write through
+            if ((unbacked && wb_reserved_blocks[disk_num] + 2 > sb->free_data_blocks) ||
+                file_block_shared(inode_ptr, index_in_blocks))
+            {
+                res = flush_writeback(inode_num);
+                if (res == 0)
+                    res = write_file_range(handle, inode_num, buf, size, pos);
+                if (res < 0)
+                    return (total_bytes_written > 0) ? total_bytes_written : res;
+                return total_bytes_written + res;
+            }
+
+            char *block = calloc(1, BLOCK_SIZE);
+            if (block == NULL)
+            {
+                res = -ENOMEM;
+                return res;
+            }
+            if (write_size < BLOCK_SIZE)
+            {
+                res = read_file_range(handle, inode_ptr, block, BLOCK_SIZE, (off_t)index_in_blocks * BLOCK_SIZE);
+                if (res < 0)
+                {
+                    free(block);
+                    return res;
+                }
+            }
+            wb->blocks[index_in_blocks] = block;
+            wb->reserved[index_in_blocks] = unbacked;
+            wb->cnt_dirty++;
+            wb->cnt_reserved += unbacked;
+            wb_dirty_blocks++;
+            wb_reserved_blocks[disk_num] += unbacked;
+        }
+        memcpy(wb->blocks[index_in_blocks] + offset_within_block, buf, write_size);
+
+        buf += write_size;
+        size -= write_size;
+        pos += write_size;
+
+        total_bytes_written += write_size;
+    }
+
+    if (pos > wb->size)
+        wb->size = pos;
+
+    // memory pressure : write every buffer out, one that fails stays buffered for its own flush to report
+    if (wb_dirty_blocks > WRITEBACK_MAX_BLOCKS)
+        flush_all_writeback();
+
+    res = total_bytes_written;
+    return res;
+}
+
+/****************************************
+reads a live file that has buffered blocks
+buffered blocks win over the disk, holes read as zeros
+returns the number of bytes read or -EIO
+*****************************************/
+int read_buffered(struct wfs_handle *handle, struct wfs_inode *inode_ptr, struct writeback_buf *wb, char *buf, size_t size, off_t offset)
+{
+    int res = 0;
+
+    // check : offset is greater than size
+    if (offset >= wb->size)
+        return res;
+
+    int size_to_read = wb->size - offset;
+    if (size < size_to_read)
+    {
+        size_to_read = size;
+    }
+    int read_bytes = size_to_read;
+    memset(buf, 0, size_to_read);
+
+    off_t pos = offset;
+    while (size_to_read > 0)
+    {
+        int index_in_blocks = pos / BLOCK_SIZE;
+        int offset_within_block = pos % BLOCK_SIZE;
+        int space_in_d_block = BLOCK_SIZE - offset_within_block;
+        int read_size = (size_to_read > space_in_d_block) ? space_in_d_block : size_to_read;
+
+        if (wb->blocks[index_in_blocks] != NULL)
+            memcpy(buf, wb->blocks[index_in_blocks] + offset_within_block, read_size);
+        else
+        {
+            res = read_file_range(handle, inode_ptr, buf, read_size, pos);
+            if (res < 0)
+                return res;
+        }
+
+        buf += read_size;
+        size_to_read -= read_size;
+        pos += read_size;
+    }
+
+    res = read_bytes;
+    return res;
+}
+
+// ###################################### Sparse files ######################################
+
+/*
+  Blocks of a file that were never written are holes: their pointer
+  stays -1, they read as zeros and take no space. Writes past the end
+  and truncate leave holes, and a compressed mount stores an all-zero
+  cluster as one. SEEK_DATA / SEEK_HOLE walk the block map
+  (WFS_IOC_SEEK, FUSE 2 has no lseek callback) and st_blocks counts
+  only the blocks a file holds, which is what cp --sparse and du look at.
+*/
+
+// blocks a file (live or frozen) holds, its indirect block included
+int count_file_blocks(struct wfs_inode *inode_ptr)
+{
+    int cnt = (inode_ptr->blocks[IND_BLOCK] >= 0) ? 1 : 0;
+    for (int i = 0; i < MAX_FILE_BLOCKS; i++)
+    {
+        if (get_file_block(inode_ptr, i) >= 0)
+            cnt++;
+    }
+    return cnt;
+}
+
+/****************************************
+lseek SEEK_DATA / SEEK_HOLE on a file (live or frozen)
+compressed and buffered blocks are data, the end of the file is a hole
+returns the resulting offset or -ENXIO
+*****************************************/
+off_t seek_data_hole(struct wfs_handle *handle, struct wfs_inode *inode_ptr, off_t offset, int whence)
+{
+    struct writeback_buf *wb = get_writeback(inode_ptr);
+    off_t size = (wb != NULL) ? wb->size : inode_ptr->size;
+
+    // check : offset at or past the end
+    if (offset < 0 || offset >= size)
+        return -ENXIO;
+
+    for (int i = offset / BLOCK_SIZE; (off_t)i * BLOCK_SIZE < size; i++)
+    {
+        int has_data = (wb != NULL && wb->blocks[i] != NULL) || lookup_file_block(handle, inode_ptr, i) != -1;
+        if (has_data == (whence == SEEK_DATA))
+        {
+            off_t pos = (off_t)i * BLOCK_SIZE;
+            return (pos > offset) ? pos : offset;
+        }
+    }
+    return (whence == SEEK_DATA) ? -ENXIO : size;
+}
+
+/****************************************
+sets the size of a live file
+growing leaves a hole, shrinking frees the blocks past the new end
+and zeros the rest of the last block, so it reads back as zeros if the file grows again
+returns 0, -EISDIR, -EINVAL, -EFBIG, -ENOSPC or -EIO
+*****************************************/
+int truncate_file(int inode_num, off_t size)
+{
+    int res = 0;
+    struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, 0);
+
+    if (S_ISDIR(inode_ptr->mode))
+    {
+        res = -EISDIR;
+        return res;
+    }
+    if (size < 0)
+    {
+        res = -EINVAL;
+        return res;
+    }
+    if ((size + BLOCK_SIZE - 1) / BLOCK_SIZE > MAX_FILE_BLOCKS)
+    {
+        res = -EFBIG;
+        return res;
+    }
+
+    res = flush_writeback(inode_num);
+    if (res != 0)
+        return res;
+
+    if (size < inode_ptr->size)
+    {
+        off_t old_size = inode_ptr->size;
+
+        // blocks kept
+        int cnt_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int cluster = cnt_blocks / CLUSTER_BLOCKS;
+
+        // check : the block map past the new end can be read, nothing is changed otherwise
+        for (int i = (cnt_blocks > 0) ? cnt_blocks - 1 : 0; i < MAX_FILE_BLOCKS; i++)
+        {
+            if (get_file_block(inode_ptr, i) == -EIO)
+            {
+                res = -EIO;
+                return res;
+            }
+        }
+
+        pa_release(inode_num);
+
+        // the new size first, so rewriting the last cluster stores the kept blocks only
+        for (int i = 0; i < cnt_inode_copies; i++)
+            get_inode_ptr(inode_num, i)->size = size;
+
+        if (cnt_blocks % CLUSTER_BLOCKS != 0 && in_compressed_cluster(NULL, inode_ptr, cnt_blocks))
+        {
+            // a compressed cluster cut by the new end is stored again with its kept blocks only
+            char data[CLUSTER_BLOCKS * BLOCK_SIZE];
+            res = load_cluster(NULL, inode_ptr, cluster, data);
+            if (res == 0)
+            {
+                int within = size - (off_t)cluster * CLUSTER_BLOCKS * BLOCK_SIZE;
+                memset(data + within, 0, sizeof(data) - within);
+                res = store_cluster(inode_num, cluster, data, cnt_blocks % CLUSTER_BLOCKS);
+            }
+            if (res != 0)
+            {
+                // the cut cluster was not stored, the file keeps its old size
+                for (int i = 0; i < cnt_inode_copies; i++)
+                    get_inode_ptr(inode_num, i)->size = old_size;
+                return res;
+            }
+        }
+        else if (size % BLOCK_SIZE != 0 && get_file_block(inode_ptr, cnt_blocks - 1) != -1)
+        {
+            char zeros[BLOCK_SIZE] = {0};
+            res = write_file_range(NULL, inode_num, zeros, BLOCK_SIZE - size % BLOCK_SIZE, size);
+            if (res < 0)
+            {
+                // the tail of the last block was not cleared, the file keeps its old size
+                for (int i = 0; i < cnt_inode_copies; i++)
+                    get_inode_ptr(inode_num, i)->size = old_size;
+                return res;
+            }
+            res = 0;
+        }
+
+        // release : every block past the new end
+        for (int i = cnt_blocks; i < MAX_FILE_BLOCKS; i++)
+        {
+            int d_block_index = get_file_block(inode_ptr, i);
+            if (d_block_index == -EIO)
+            {
+                res = d_block_index;
+                return res;
+            }
+            if (d_block_index == -1)
+                continue;
+            res = set_file_block(inode_num, i, -1);
+            if (res < 0)
+            {
+                res = (res == -1) ? -ENOSPC : res;
+                return res;
+            }
+            put_block(d_block_index, data_disk(inode_num, i));
+        }
+
+        // the indirect block goes once no entry is left
+        if (cnt_blocks <= IND_BLOCK && inode_ptr->blocks[IND_BLOCK] != -1)
+        {
+            put_indirect_block(inode_num, inode_ptr->blocks[IND_BLOCK]);
+            for (int i = 0; i < cnt_inode_copies; i++)
+                get_inode_ptr(inode_num, i)->blocks[IND_BLOCK] = -1;
+            block_map_gen[inode_num]++;
+        }
+    }
+
+    for (int i = 0; i < cnt_inode_copies; i++)
+        get_inode_ptr(inode_num, i)->size = size;
+    TRACE(TR_ALLOC, "inode %d: truncated to %ld bytes", inode_num, (long)size);
+    return res;
+}
+
+// ###################################### Server-side copy ######################################
+
+/*
+  Copies between files never leave the disk mappings.
+  Whole blocks at the same position within a block are shared with the
+  source (a reflink): the destination points at the source block and
+  the block gains a reference, so later writes to either side copy it.
+  RAID0 can only share blocks that land on the same disk, and blocks of
+  compressed clusters are never shared. Everything else is copied through
+  a one block bounce buffer.
+*/
+
+/****************************************
+points destination block dst_index at source block src_index
+the replaced destination block loses its reference
+returns 0, -ENOSPC or -EIO
+*****************************************/
+int share_block(struct wfs_inode *src_inode_ptr, int src_index, int dst_inode_num, int dst_index)
+{
+    int res = 0;
+    int disk_num = data_disk(dst_inode_num, dst_index);
+    int src_d_block_index = get_file_block(src_inode_ptr, src_index);
+    int old_d_block_index = get_file_block(get_inode_ptr(dst_inode_num, 0), dst_index);
+    if (src_d_block_index == -EIO || old_d_block_index == -EIO)
+    {
+        res = -EIO;
+        return res;
+    }
+    if (src_d_block_index == old_d_block_index)
+        return res;
+
+    // blocks past the direct ones need the indirect block first
+    if (dst_index >= IND_BLOCK && get_inode_ptr(dst_inode_num, 0)->blocks[IND_BLOCK] == -1)
+    {
+        if (src_d_block_index == -1)
+            return res;
+        res = allocate_indirect_block(dst_inode_num, ind_disk(dst_inode_num));
+        if (res < 0)
+        {
+            res = (res == -1) ? -ENOSPC : res;
+            return res;
+        }
+    }
+
+    res = set_file_block(dst_inode_num, dst_index, src_d_block_index);
+    if (res < 0)
+    {
+        res = (res == -1) ? -ENOSPC : res;
+        return res;
+    }
+    if (src_d_block_index != -1)
+        (*block_ref(src_d_block_index, disk_num))++;
+    put_block(old_d_block_index, disk_num);
+    return res;
+}
+
+/****************************************
+clones length bytes of a file (live or frozen) into a live file
+length 0 or past the end of the source stops at the end of the source
+returns the number of bytes cloned, -EINVAL, -EFBIG, -ENOSPC or -EIO
+*****************************************/
+int clone_range(struct wfs_inode *src_inode_ptr, off_t src_offset, int dst_inode_num, off_t dst_offset, off_t length)
+{
+    int res = 0;
+
+    if (src_offset < 0 || dst_offset < 0 || length < 0 || !S_ISREG(src_inode_ptr->mode))
+    {
+        res = -EINVAL;
+        return res;
+    }
+    if (src_offset >= src_inode_ptr->size)
+        return res;
+    if (length == 0 || length > src_inode_ptr->size - src_offset)
+        length = src_inode_ptr->size - src_offset;
+
+    // check : overlapping ranges of the same file
+    if (src_inode_ptr == get_inode_ptr(dst_inode_num, 0) &&
+        src_offset < dst_offset + length && dst_offset < src_offset + length)
+    {
+        res = -EINVAL;
+        return res;
+    }
+    if ((dst_offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE > MAX_FILE_BLOCKS)
+    {
+        res = -EFBIG;
+        return res;
+    }
+
+    off_t done = 0;
+    while (done < length)
+    {
+        off_t src_pos = src_offset + done;
+        off_t dst_pos = dst_offset + done;
+        int chunk = BLOCK_SIZE - dst_pos % BLOCK_SIZE;
+        if (chunk > length - done)
+            chunk = length - done;
+
+        // share : a whole raw block at the same position (and on the same disk for RAID0)
+        int src_index = src_pos / BLOCK_SIZE;
+        int dst_index = dst_pos / BLOCK_SIZE;
+        int whole = chunk == BLOCK_SIZE && src_pos % BLOCK_SIZE == 0;
+        int same_disk = raid_mode != 0 || data_disk(src_inode_ptr->num, src_index) == data_disk(dst_inode_num, dst_index);
+        int raw = !in_compressed_cluster(NULL, src_inode_ptr, src_index) &&
+                  !in_compressed_cluster(NULL, get_inode_ptr(dst_inode_num, 0), dst_index);
+
+        if (whole && same_disk && raw)
+        {
+            res = share_block(src_inode_ptr, src_index, dst_inode_num, dst_index);
+            if (res != 0)
+                return res;
+        }
+        else
+        {
+            // holes in the source read as zeros
+            char bounce[BLOCK_SIZE] = {0};
+            res = read_file_range(NULL, src_inode_ptr, bounce, chunk, src_pos);
+            if (res < 0)
+                return res;
+            res = write_file_range(NULL, dst_inode_num, bounce, chunk, dst_pos);
+            if (res < 0)
+                return res;
+        }
+        done += chunk;
+    }
+
+    // update : destination size
+    for (int i = 0; i < cnt_inode_copies; i++)
+    {
+        struct wfs_inode *inode_ptr = get_inode_ptr(dst_inode_num, i);
+        if (dst_offset + length > inode_ptr->size)
+            inode_ptr->size = dst_offset + length;
+    }
+    TRACE(TR_IO, "cloned %ld bytes into inode %d", (long)length, dst_inode_num);
+
+    res = length;
+    return res;
+}
+
+// ###################################### Defragmentation ######################################
+
+/*
+  A file's blocks on one disk are fragmented when consecutive file blocks
+  placed there are not in consecutive d-blocks. WFS_IOC_DEFRAG reports
+  the runs (extents) a file is split into and a score from 0 (one run
+  per disk) to 100 (no two blocks adjacent), then moves the file's blocks
+  on each fragmented disk into one free run of the right length. Data is
+  copied first, then the block map is repointed and the old blocks freed,
+  all under wfs_lock, so readers see either the old or the new map.
+  Blocks shared with a snapshot or a clone and compressed clusters stay
+  where they are; a disk holding any of them is left alone.
+*/
+
+// disk whose d-blocks hold block index_in_blocks of a file (mirrors : 0)
+int file_block_disk(int inode_num, int index_in_blocks)
+{
+    return (raid_mode == 0) ? data_disk(inode_num, index_in_blocks) : 0;
+}
+
+/****************************************
+counts the blocks and extents of a file (live or frozen) per disk
+returns the fragmentation score, 0 .. 100
+*****************************************/
+int frag_score(struct wfs_inode *inode_ptr, int *cnt_blocks_out, int *cnt_extents_out)
+{
+    int last_d_block[MAX_DISKS];
+    int cnt_blocks = 0;
+    int cnt_extents = 0;
+    int cnt_used_disks = 0;
+    memset(last_d_block, -1, sizeof(last_d_block));
+
+    int cnt_file_blocks = (inode_ptr->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (int i = 0; i < cnt_file_blocks && i < MAX_FILE_BLOCKS; i++)
+    {
+        int d_block_index = get_file_block(inode_ptr, i);
+        if (d_block_index < 0)
+            continue;
+
+        int disk_num = file_block_disk(inode_ptr->num, i);
+        if (last_d_block[disk_num] == -1)
+            cnt_used_disks++;
+        if (last_d_block[disk_num] == -1 || d_block_index != last_d_block[disk_num] + 1)
+            cnt_extents++;
+        last_d_block[disk_num] = d_block_index;
+        cnt_blocks++;
+    }
+
+    *cnt_blocks_out = cnt_blocks;
+    *cnt_extents_out = cnt_extents;
+    if (cnt_blocks <= cnt_used_disks)
+        return 0;
+    return (cnt_extents - cnt_used_disks) * 100 / (cnt_blocks - cnt_used_disks);
+}
+
+/****************************************
+moves the blocks a live file holds on one disk into a single free run
+returns the number of blocks moved, 0 if the disk is already one run
+or holds blocks that cannot move, -ENOSPC if the indirect block could not be made private,
+-EIO if a block could not be read (the blocks moved before it stay moved)
+*****************************************/
+int defrag_disk(int inode_num, int disk_num)
+{
+    struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, 0);
+    int cnt_file_blocks = (inode_ptr->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int cnt_blocks = 0;
+    int cnt_extents = 0;
+    int last_d_block = -1;
+
+    for (int i = 0; i < cnt_file_blocks && i < MAX_FILE_BLOCKS; i++)
+    {
+        if (file_block_disk(inode_num, i) != disk_num)
+            continue;
+        int d_block_index = get_file_block(inode_ptr, i);
+        if (d_block_index == -EIO)
+            return d_block_index;
+        if (d_block_index < 0)
+            continue;
+
+        // check : shared or compressed blocks keep their place
+        if (*block_ref(d_block_index, disk_num) != 1 || in_compressed_cluster(NULL, inode_ptr, i))
+            return 0;
+        if (last_d_block == -1 || d_block_index != last_d_block + 1)
+            cnt_extents++;
+        last_d_block = d_block_index;
+        cnt_blocks++;
+    }
+    if (cnt_extents <= 1)
+        return 0;
+
+    // the indirect block is repointed below, a shared one is copied before the run is picked
+    if (cnt_file_blocks > IND_BLOCK && inode_ptr->blocks[IND_BLOCK] != -1)
+    {
+        int res = cow_indirect_block(inode_num);
+        if (res < 0)
+            return (res == -1) ? -ENOSPC : res;
+    }
+
+    int run_start = get_free_d_block_run(disk_num, cnt_blocks, inode_num);
+    if (run_start == -1)
+    {
+        TRACE(TR_ALLOC, "inode %d: no run of %d blocks on disk %d to defragment into", inode_num, cnt_blocks, disk_num);
+        return 0;
+    }
+    for (int k = 0; k < cnt_blocks; k++)
+        claim_data_block(run_start + k, disk_num);
+
+    int cnt_moved = 0;
+    for (int i = 0; i < cnt_file_blocks && i < MAX_FILE_BLOCKS; i++)
+    {
+        if (file_block_disk(inode_num, i) != disk_num)
+            continue;
+        int d_block_index = get_file_block(inode_ptr, i);
+        if (d_block_index < 0)
+            continue;
+
+        int new_d_block_index = run_start + cnt_moved;
+        int readable = 1;
+        for (int j = 0; j < cnt_disks; j++)
+        {
+            if (raid_mode == 0 && j != disk_num)
+                continue;
+            if (get_d_block_ptr(new_d_block_index, j) == NULL || get_d_block_ptr(d_block_index, j) == NULL)
+                readable = 0;
+        }
+
+        // check : a block that could not be read stays where it is, the rest of the run is given back
+        if (!readable)
+        {
+            for (int k = cnt_moved; k < cnt_blocks; k++)
+                put_block(run_start + k, disk_num);
+            TRACE(TR_ALLOC, "inode %d: defragment stopped after %d blocks, d-block %d could not be read", inode_num, cnt_moved, d_block_index);
+            return -EIO;
+        }
+        for (int j = 0; j < cnt_disks; j++)
+        {
+            if (raid_mode == 0 && j != disk_num)
+                continue;
+            memcpy(get_d_block_ptr(new_d_block_index, j), get_d_block_ptr(d_block_index, j), BLOCK_SIZE);
+        }
+        set_file_block(inode_num, i, new_d_block_index);
+        put_block(d_block_index, disk_num);
+        cnt_moved++;
+    }
+    TRACE(TR_ALLOC, "inode %d: %d blocks in %d extents moved to d-block %d on disk %d", inode_num, cnt_moved, cnt_extents, run_start, disk_num);
+    return cnt_moved;
+}
+
+/****************************************
+reports the fragmentation of a live file and, unless only asked for the report, defragments it
+returns 0, -EINVAL for anything but a regular file, -ENOSPC or -EIO
+*****************************************/
+int defrag_file(int inode_num, struct wfs_defrag *defrag)
+{
+    int res = 0;
+    struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, 0);
+
+    if (!S_ISREG(inode_ptr->mode))
+    {
+        res = -EINVAL;
+        return res;
+    }
+
+    defrag->score = frag_score(inode_ptr, &defrag->cnt_blocks, &defrag->cnt_extents);
+    defrag->cnt_moved = 0;
+    if (!(defrag->flags & WFS_DEFRAG_REPORT) && defrag->score > 0)
+    {
+        // a window would hold free space the runs could use
+        pa_release(inode_num);
+        int cnt_data_disks = (raid_mode == 0) ? cnt_disks : 1;
+        for (int i = 0; i < cnt_data_disks; i++)
+        {
+            res = defrag_disk(inode_num, i);
+            if (res < 0)
+                return res;
+            defrag->cnt_moved += res;
+        }
+        res = 0;
+    }
+
+    int cnt_blocks = 0;
+    defrag->new_score = frag_score(inode_ptr, &cnt_blocks, &defrag->new_cnt_extents);
+    return res;
+}
+
+// ###################################### Online grow ######################################
+
+/*
+  WFS_IOC_GROW (wfs-grow) grows a mounted volume after its image files
+  were enlarged. The data region only gets longer, block indices stay
+  put. A bitmap that outgrows its region and an inode table that gets
+  more inodes are relocated to the top of the new data blocks, marked
+  used on every disk, and the superblock pointers are switched to them;
+  a relocated region that moves again is given back as data blocks.
+  New inodes and blocks are usable as soon as the ioctl returns.
+*/
+
+// bytes a bitmap at ptr has room for, relocated bitmaps sit in whole data blocks
+size_t bitmap_room(struct wfs_sb *sb, off_t ptr, size_t len)
+{
+    if (ptr >= sb->d_blocks_ptr)
+        return (len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    if (ptr == sb->d_bitmap_ptr && sb->i_blocks_ptr > ptr)
+        return sb->i_blocks_ptr - ptr;
+    return len;
+}
+
+// sets or clears the bits of a relocated region in a data bitmap, nothing for a region of the mkfs layout
+void mark_relocated_region(struct wfs_sb *sb, __u_int *d_bitmap, off_t ptr, size_t len, int used)
+{
+    if (ptr < sb->d_blocks_ptr)
+        return;
+    int first = (ptr - sb->d_blocks_ptr) / BLOCK_SIZE;
+    for (int i = first; i < first + (len + BLOCK_SIZE - 1) / BLOCK_SIZE; i++)
+    {
+        if (used)
+        {
+            d_bitmap[i / 32] |= 1u << (i % 32);
+            sb->free_data_blocks--;
+        }
+        else
+        {
+            d_bitmap[i / 32] &= ~(1u << (i % 32));
+            sb->free_data_blocks++;
+        }
+    }
+}
+
+// maps a disk again after its image file grew, returns 0 or -errno
+int remap_disk(int disk_num)
+{
+    struct stat st;
+    if (fstat(ordered_disk_fd[disk_num], &st) != 0)
+        return -errno;
+    if (st.st_size == ordered_disk_size[disk_num])
+        return 0;
+
+    void *disk_ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, ordered_disk_fd[disk_num], 0);
+    if (disk_ptr == MAP_FAILED)
+        return -ENOMEM;
+    munmap(ordered_disk_mmap_ptr[disk_num], ordered_disk_size[disk_num]);
+    ordered_disk_mmap_ptr[disk_num] = disk_ptr;
+    ordered_disk_size[disk_num] = st.st_size;
+    return 0;
+}
+
+/****************************************
+grows one disk to new_inodes inodes and new_blocks data blocks
+builds the new bitmaps and inode table in the new blocks, then switches the superblock
+*****************************************/
+void grow_disk(int disk_num, size_t new_inodes, size_t new_blocks)
+{
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[disk_num];
+    char *base = (char *)sb;
+    size_t old_inodes = sb->num_inodes;
+    size_t old_blocks = sb->num_data_blocks;
+    int move_i_bitmap = new_inodes / 8 > bitmap_room(sb, sb->i_bitmap_ptr, old_inodes / 8);
+    int move_d_bitmap = new_blocks / 8 > bitmap_room(sb, sb->d_bitmap_ptr, old_blocks / 8);
+    int move_i_blocks = new_inodes > old_inodes;
+
+    // new places : inode table at the top of the data blocks, the bitmaps below it
+    int top = new_blocks;
+    off_t i_blocks_ptr = sb->i_blocks_ptr;
+    off_t d_bitmap_ptr = sb->d_bitmap_ptr;
+    off_t i_bitmap_ptr = sb->i_bitmap_ptr;
+    if (move_i_blocks)
+    {
+        top -= new_inodes;
+        i_blocks_ptr = sb->d_blocks_ptr + (off_t)top * BLOCK_SIZE;
+        memcpy(base + i_blocks_ptr, base + sb->i_blocks_ptr, old_inodes * BLOCK_SIZE);
+        memset(base + i_blocks_ptr + old_inodes * BLOCK_SIZE, 0, (new_inodes - old_inodes) * BLOCK_SIZE);
+    }
+    if (move_d_bitmap)
+    {
+        top -= (new_blocks / 8 + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        d_bitmap_ptr = sb->d_blocks_ptr + (off_t)top * BLOCK_SIZE;
+        memcpy(base + d_bitmap_ptr, base + sb->d_bitmap_ptr, old_blocks / 8);
+    }
+    memset(base + d_bitmap_ptr + old_blocks / 8, 0, (new_blocks - old_blocks) / 8);
+    if (move_i_bitmap)
+    {
+        top -= (new_inodes / 8 + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        i_bitmap_ptr = sb->d_blocks_ptr + (off_t)top * BLOCK_SIZE;
+        memcpy(base + i_bitmap_ptr, base + sb->i_bitmap_ptr, old_inodes / 8);
+    }
+    memset(base + i_bitmap_ptr + old_inodes / 8, 0, (new_inodes - old_inodes) / 8);
+
+    // claim : the relocated regions, give back the ones they replace
+    __u_int *d_bitmap = (__u_int *)(base + d_bitmap_ptr);
+    sb->free_data_blocks += new_blocks - old_blocks;
+    for (int i = top; i < new_blocks; i++)
+    {
+        d_bitmap[i / 32] |= 1u << (i % 32);
+        sb->free_data_blocks--;
+    }
+    if (move_i_blocks)
+        mark_relocated_region(sb, d_bitmap, sb->i_blocks_ptr, old_inodes * BLOCK_SIZE, 0);
+    if (move_d_bitmap)
+        mark_relocated_region(sb, d_bitmap, sb->d_bitmap_ptr, old_blocks / 8, 0);
+    if (move_i_bitmap)
+        mark_relocated_region(sb, d_bitmap, sb->i_bitmap_ptr, old_inodes / 8, 0);
+
+    sb->i_bitmap_ptr = i_bitmap_ptr;
+    sb->d_bitmap_ptr = d_bitmap_ptr;
+    sb->i_blocks_ptr = i_blocks_ptr;
+    sb->free_inodes += new_inodes - old_inodes;
+    sb->num_inodes = new_inodes;
+    sb->num_data_blocks = new_blocks;
+}
+
+// data blocks grow_disk() relocates regions into
+int grow_reserved_blocks(struct wfs_sb *sb, size_t new_inodes, size_t new_blocks)
+{
+    int cnt = 0;
+    if (new_inodes > sb->num_inodes)
+        cnt += new_inodes;
+    if (new_blocks / 8 > bitmap_room(sb, sb->d_bitmap_ptr, sb->num_data_blocks / 8))
+        cnt += (new_blocks / 8 + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (new_inodes / 8 > bitmap_room(sb, sb->i_bitmap_ptr, sb->num_inodes / 8))
+        cnt += (new_inodes / 8 + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    return cnt;
+}
+
+// grows an array of cnt_old elements to cnt_new, the new elements zeroed
+void *grow_array(void *ptr, size_t elem_size, size_t cnt_old, size_t cnt_new)
+{
+    char *new_ptr = realloc(ptr, elem_size * cnt_new);
+    memset(new_ptr + elem_size * cnt_old, 0, elem_size * (cnt_new - cnt_old));
+    return new_ptr;
+}
+
+/****************************************
+grows the volume to new_inodes inodes and new_blocks data blocks per disk (0 : unchanged)
+both are rounded up to a multiple of 32 like mkfs does
+returns 0, -EINVAL if a count shrinks or the RAID0 disks differ in size, -EBUSY while the disk set is changing,
+-EFBIG if an image file is too small, -ENOSPC if the new blocks cannot hold the relocated regions
+or -EOPNOTSUPP with --io-uring
+*****************************************/
+int grow_volume(size_t new_inodes, size_t new_blocks)
+{
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+    size_t old_inodes = sb->num_inodes;
+    size_t old_blocks = sb->num_data_blocks;
+    int res = 0;
+
+    new_inodes = (new_inodes == 0) ? old_inodes : (new_inodes + 31) / 32 * 32;
+    new_blocks = (new_blocks == 0) ? old_blocks : (new_blocks + 31) / 32 * 32;
+    if (new_inodes < old_inodes || new_blocks < old_blocks)
+    {
+        res = -EINVAL;
+        return res;
+    }
+    if (new_inodes == old_inodes && new_blocks == old_blocks)
+        return res;
+
+    // check : the --io-uring caches are sized at mount and cannot be mapped again
+    if (use_io_uring)
+    {
+        res = -EOPNOTSUPP;
+        return res;
+    }
+
+    // check : every disk grows by the same blocks, smaller disks would need their own layout
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        if (disk_data_blocks(i) != old_blocks)
+        {
+            res = -EINVAL;
+            return res;
+        }
+    }
+
+    // check : write-intent regions and the reshape are sized by the current counts
+    if (reshape_old_disks > 0 || resync_source != -1 || degraded)
+    {
+        res = -EBUSY;
+        return res;
+    }
+
+    // check : the relocated regions fit in the new blocks, above every block in use
+    if (grow_reserved_blocks(sb, new_inodes, new_blocks) > new_blocks - old_blocks)
+    {
+        res = -ENOSPC;
+        return res;
+    }
+
+    // check : every image file is large enough (remapping moves the superblocks)
+    off_t d_blocks_ptr = sb->d_blocks_ptr;
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        res = remap_disk(i);
+        if (res != 0)
+            return res;
+        if (ordered_disk_size[i] < d_blocks_ptr + new_blocks * BLOCK_SIZE)
+        {
+            res = -EFBIG;
+            return res;
+        }
+    }
+
+    // buffered blocks hold promises against the old free counts
+    res = flush_all_writeback();
+    if (res != 0)
+        return res;
+
+    for (int i = 0; i < cnt_disks; i++)
+        grow_disk(i, new_inodes, new_blocks);
+
+    // in-memory tables sized by the counts
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        if (pa_reserved[i] != NULL)
+            pa_reserved[i] = grow_array(pa_reserved[i], sizeof(__u_int), old_blocks / 32, new_blocks / 32);
+        if (block_refs[i] != NULL)
+            block_refs[i] = grow_array(block_refs[i], sizeof(unsigned int), old_blocks, new_blocks);
+    }
+    dir_maps = grow_array(dir_maps, sizeof(struct dir_slot_map *), old_inodes, new_inodes);
+    dir_open_cnt = grow_array(dir_open_cnt, sizeof(int), old_inodes, new_inodes);
+    file_open_cnt = grow_array(file_open_cnt, sizeof(int), old_inodes, new_inodes);
+    block_map_gen = grow_array(block_map_gen, sizeof(unsigned long), old_inodes, new_inodes);
+    wb_bufs = grow_array(wb_bufs, sizeof(struct writeback_buf *), old_inodes, new_inodes);
+    preallocs = grow_array(preallocs, sizeof(struct prealloc *), old_inodes, new_inodes);
+    for (struct snapshot *snap = snapshots; snap != NULL; snap = snap->next)
+    {
+        snap->inodes = realloc(snap->inodes, new_inodes * sizeof(struct wfs_inode));
+        for (int i = old_inodes; i < new_inodes; i++)
+            snap->inodes[i].num = -1;
+    }
+
+    TRACE(TR_ALLOC, "grown from %zu inodes, %zu blocks to %zu inodes, %zu blocks", old_inodes, old_blocks, new_inodes, new_blocks);
+    return res;
+}
+
+// ###################################### Disk addition ######################################
+
+/*
+  WFS_IOC_ADD_DISK (wfs-add-disk) adds a blank image to the mounted
+  volume as its last disk. The image takes the metadata of disk 0 and
+  the volume keeps serving I/O while the disk is filled in the
+  background: a new mirror is resynced region by region like a replaced
+  one, a RAID0 volume is reshaped inode by inode onto the new stripe
+  width. The reshape checkpoints the next inode in every superblock and
+  resumes from there at the next mount.
+*/
+
+// entries in the per disk tables
+int disk_table_cnt = 0;
+
+// grows the per disk tables to cnt disks, new entries are empty
+void grow_disk_table(int cnt)
+{
+    ordered_disk_mmap_ptr = realloc(ordered_disk_mmap_ptr, cnt * sizeof(void *));
+    ordered_disk_fd = realloc(ordered_disk_fd, cnt * sizeof(int));
+    ordered_disk_size = realloc(ordered_disk_size, cnt * sizeof(off_t));
+    resync_stale = realloc(resync_stale, cnt * sizeof(int));
+    pa_reserved = realloc(pa_reserved, cnt * sizeof(__u_int *));
+    block_refs = realloc(block_refs, cnt * sizeof(unsigned int *));
+    wb_reserved_blocks = realloc(wb_reserved_blocks, cnt * sizeof(int));
+    for (int i = disk_table_cnt; i < cnt; i++)
+    {
+        ordered_disk_mmap_ptr[i] = NULL;
+        ordered_disk_fd[i] = -1;
+        ordered_disk_size[i] = 0;
+        resync_stale[i] = 0;
+        pa_reserved[i] = NULL;
+        block_refs[i] = NULL;
+        wb_reserved_blocks[i] = 0;
+    }
+    disk_table_cnt = cnt;
+}
+
+// writes the reshape checkpoint to every disk
+void set_reshape_checkpoint()
+{
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[i];
+        sb->reshape_old_disks = reshape_old_disks;
+        sb->reshape_inode = reshape_inode;
+    }
+}
+
+/****************************************
+claims a free block on new_disk_num for a d-block of an inode that moves there
+both blocks are read first, so the move itself cannot fail
+returns the new d-block index, -1 if the disk is full, -EIO if either block could not be read
+*****************************************/
+int claim_move_block(int inode_num, int d_block_index, int old_disk_num, int new_disk_num)
+{
+    if (get_d_block_ptr(d_block_index, old_disk_num) == NULL)
+        return -EIO;
+    int new_d_block_index = get_free_d_block_near(new_disk_num, inode_num);
+    if (new_d_block_index == -1)
+        return -1;
+
+    claim_data_block(new_d_block_index, new_disk_num);
+    if (get_d_block_ptr(new_d_block_index, new_disk_num) == NULL)
+    {
+        put_block(new_d_block_index, new_disk_num);
+        return -EIO;
+    }
+    return new_d_block_index;
+}
+
+/****************************************
+moves a d-block of an inode from one disk to the block claim_move_block() took on another
+the old block loses the inode's reference
+*****************************************/
+void move_data_block(int d_block_index, int old_disk_num, int new_d_block_index, int new_disk_num)
+{
+    memcpy(get_d_block_ptr(new_d_block_index, new_disk_num), get_d_block_ptr(d_block_index, old_disk_num), BLOCK_SIZE);
+    put_block(d_block_index, old_disk_num);
+}
+
+/****************************************
+restripes the blocks of an inode from reshape_old_disks disks over cnt_disks
+the free blocks are counted and claimed first, an inode is moved whole or not at all
+returns 0, -1 if a disk has too few free blocks, or -EIO if a block could not be read
+*****************************************/
+int reshape_inode_blocks(int inode_num)
+{
+    struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, 0);
+    int cnt_needed[MAX_DISKS] = {0};
+    off_t *indirect_block_ptr = NULL;
+    int res = 0;
+
+    for (int i = 0; i < IND_BLOCK; i++)
+    {
+        int new_disk_num = stripe_block_disk(cnt_disks, inode_ptr, i);
+        if (inode_ptr->blocks[i] >= 0 && stripe_block_disk(reshape_old_disks, inode_ptr, i) != new_disk_num)
+            cnt_needed[new_disk_num]++;
+    }
+    if (inode_ptr->blocks[IND_BLOCK] >= 0)
+    {
+        indirect_block_ptr = (off_t *)get_d_block_ptr(inode_ptr->blocks[IND_BLOCK], stripe_ind_disk(reshape_old_disks));
+        // check : the indirect block is read and marked before anything moves
+        if (indirect_block_ptr == NULL || mark_block_written(inode_ptr->blocks[IND_BLOCK], stripe_ind_disk(reshape_old_disks)) != 0)
+            return -EIO;
+        for (int k = 0; k < BLOCK_SIZE / sizeof(off_t); k++)
+        {
+            int new_disk_num = stripe_data_disk(cnt_disks, k + IND_BLOCK);
+            if (indirect_block_ptr[k] >= 0 && stripe_data_disk(reshape_old_disks, k + IND_BLOCK) != new_disk_num)
+                cnt_needed[new_disk_num]++;
+        }
+        if (stripe_ind_disk(reshape_old_disks) != stripe_ind_disk(cnt_disks))
+            cnt_needed[stripe_ind_disk(cnt_disks)]++;
+    }
+
+    // check : every disk has room, blocks buffered for other files stay promised
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[i];
+        if (cnt_needed[i] > 0 && cnt_needed[i] + wb_reserved_blocks[i] > sb->free_data_blocks)
+            return -1;
+    }
+
+    // claim : the block every moving block lands in, the last entry is the indirect block
+    int new_d_blocks[MAX_FILE_BLOCKS + 1];
+    int new_disks[MAX_FILE_BLOCKS + 1];
+    for (int i = 0; i <= MAX_FILE_BLOCKS; i++)
+        new_d_blocks[i] = -1;
+    for (int i = 0; res >= 0 && i <= MAX_FILE_BLOCKS; i++)
+    {
+        int d_block_index = -1;
+        int old_disk_num = 0;
+        int new_disk_num = 0;
+        if (i < IND_BLOCK)
+        {
+            d_block_index = inode_ptr->blocks[i];
+            old_disk_num = stripe_block_disk(reshape_old_disks, inode_ptr, i);
+            new_disk_num = stripe_block_disk(cnt_disks, inode_ptr, i);
+        }
+        else if (i < MAX_FILE_BLOCKS && indirect_block_ptr != NULL)
+        {
+            d_block_index = indirect_block_ptr[i - IND_BLOCK];
+            old_disk_num = stripe_data_disk(reshape_old_disks, i);
+            new_disk_num = stripe_data_disk(cnt_disks, i);
+        }
+        else if (i == MAX_FILE_BLOCKS)
+        {
+            d_block_index = inode_ptr->blocks[IND_BLOCK];
+            old_disk_num = stripe_ind_disk(reshape_old_disks);
+            new_disk_num = stripe_ind_disk(cnt_disks);
+        }
+        if (d_block_index < 0 || old_disk_num == new_disk_num)
+            continue;
+        res = claim_move_block(inode_num, d_block_index, old_disk_num, new_disk_num);
+        new_d_blocks[i] = res;
+        new_disks[i] = new_disk_num;
+    }
+
+    // check : a disk filled up or a block could not be read, nothing has moved yet
+    if (res < 0)
+    {
+        for (int i = 0; i <= MAX_FILE_BLOCKS; i++)
+        {
+            if (new_d_blocks[i] >= 0)
+                put_block(new_d_blocks[i], new_disks[i]);
+        }
+        return res;
+    }
+
+    for (int i = 0; i < IND_BLOCK; i++)
+    {
+        if (new_d_blocks[i] < 0)
+            continue;
+        move_data_block(inode_ptr->blocks[i], stripe_block_disk(reshape_old_disks, inode_ptr, i), new_d_blocks[i], new_disks[i]);
+        for (int j = 0; j < cnt_inode_copies; j++)
+            get_inode_ptr(inode_num, j)->blocks[i] = new_d_blocks[i];
+    }
+    if (indirect_block_ptr != NULL)
+    {
+        for (int k = 0; k < BLOCK_SIZE / sizeof(off_t); k++)
+        {
+            if (new_d_blocks[k + IND_BLOCK] < 0)
+                continue;
+            move_data_block(indirect_block_ptr[k], stripe_data_disk(reshape_old_disks, k + IND_BLOCK), new_d_blocks[k + IND_BLOCK], new_disks[k + IND_BLOCK]);
+            indirect_block_ptr[k] = new_d_blocks[k + IND_BLOCK];
+        }
+
+        // the indirect block itself, its entries already point at their new blocks
+        if (new_d_blocks[MAX_FILE_BLOCKS] >= 0)
+        {
+            move_data_block(inode_ptr->blocks[IND_BLOCK], stripe_ind_disk(reshape_old_disks), new_d_blocks[MAX_FILE_BLOCKS], new_disks[MAX_FILE_BLOCKS]);
+            for (int j = 0; j < cnt_inode_copies; j++)
+                get_inode_ptr(inode_num, j)->blocks[IND_BLOCK] = new_d_blocks[MAX_FILE_BLOCKS];
+        }
+    }
+    block_map_gen[inode_num]++;
+    return 0;
+}
+
+// background thread, restripes one inode per turn of the lock and checkpoints after each
+void *reshape_worker(void *arg)
+{
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+    __u_int *i_bitmap = get_i_bitmap(0);
+
+    for (;;)
+    {
+        bg_lock(QOS_REBUILD);
+        if (shutting_down)
+        {
+            pthread_mutex_unlock(&wfs_lock);
+            return NULL;
+        }
+        if (reshape_inode >= sb->num_inodes)
+        {
+            TRACE(TR_RAID, "reshape from %d to %d disks done", reshape_old_disks, cnt_disks);
+            reshape_old_disks = 0;
+            reshape_inode = 0;
+            set_reshape_checkpoint();
+            pthread_mutex_unlock(&wfs_lock);
+            return NULL;
+        }
+
+        int inode_num = reshape_inode;
+        double bytes = 0;
+        if (i_bitmap[inode_num / 32] & (1u << (inode_num % 32)))
+        {
+            // every block is read and written once, holes are counted too
+            bytes = 2.0 * ((get_inode_ptr(inode_num, 0)->size + BLOCK_SIZE - 1) / BLOCK_SIZE) * BLOCK_SIZE;
+
+            // buffered blocks and windows belong to the old stripe width
+            pa_release(inode_num);
+            if (flush_writeback(inode_num) != 0 || reshape_inode_blocks(inode_num) != 0)
+            {
+                TRACE(TR_RAID, "reshape stopped at inode %d, no room or a block could not be read", inode_num);
+                pthread_mutex_unlock(&wfs_lock);
+                return NULL;
+            }
+        }
+        reshape_inode++;
+        set_reshape_checkpoint();
+        bg_unlock(QOS_REBUILD, bytes);
+    }
+}
+
+/****************************************
+adds the blank image at path as the last disk of the volume
+mirrors : the disk is resynced in the background
+RAID0 : the volume is reshaped over the new disk in the background, a smaller disk gets a smaller share
+returns 0, -EBUSY while the disk set is changing or (RAID0) snapshots exist,
+-EINVAL for a disk that is too small or not blank, -EOPNOTSUPP with --io-uring, or -errno
+*****************************************/
+int add_disk(const char *path)
+{
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+    int res = 0;
+
+    // check : the new disk would be mapped, not cached
+    if (use_io_uring)
+    {
+        res = -EOPNOTSUPP;
+        return res;
+    }
+
+    // check : one change to the disk set at a time
+    if (reshape_old_disks > 0 || resync_source != -1 || degraded)
+    {
+        res = -EBUSY;
+        return res;
+    }
+
+    // check : RAID0 snapshots froze block maps striped over the current disks
+    if (raid_mode == 0 && snapshots != NULL)
+    {
+        res = -EBUSY;
+        return res;
+    }
+
+    // check : RAID0 inodes kept on some disks only are placed by the disk count
+    if (cnt_disks == MAX_DISKS || (raid_mode == 0 && cnt_meta_disks == 0 && cnt_inode_copies != cnt_disks))
+    {
+        res = -EINVAL;
+        return res;
+    }
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+        res = -errno;
+        return res;
+    }
+    // check : a mirror holds every block, a RAID0 disk at least a bitmap word of them
+    // unless a grow relocated metadata into the data blocks
+    size_t min_blocks = sb->num_data_blocks;
+    if (raid_mode == 0 && sb->i_bitmap_ptr < sb->d_blocks_ptr && sb->d_bitmap_ptr < sb->d_blocks_ptr &&
+        sb->i_blocks_ptr < sb->d_blocks_ptr)
+        min_blocks = 32;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < sb->d_blocks_ptr + min_blocks * BLOCK_SIZE)
+    {
+        close(fd);
+        res = -EINVAL;
+        return res;
+    }
+    void *disk_ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (disk_ptr == MAP_FAILED)
+    {
+        close(fd);
+        res = -ENOMEM;
+        return res;
     }
-    if (index_in_blocks != 0)
+
+    // check : a blank image, never a disk of a volume
+    struct wfs_sb *new_sb = (struct wfs_sb *)disk_ptr;
+    if (new_sb->total_disks != 0)
     {
-        if (raid_mode == 0)
-        {
-            set_data_bmp_index(d_block_index, 0, index_in_blocks % cnt_disks);
-        }
-        else
-        {
-            for (int i = 0; i < cnt_disks; i++)
-            {
-                set_data_bmp_index(d_block_index, 0, i);
-            }
-        }
+        munmap(disk_ptr, st.st_size);
+        close(fd);
+        res = -EINVAL;
+        return res;
     }
-}
 
-/******************
-// ONLY called in read for RAID1V
-returns the disk which has the data-block with the correct data
-***********************/
-int get_correct_disk_num(int d_block_index, int read_size)
-{
-    int maxcount = 0;
-    int disk_num_having_max_freq = 0;
-    for (int i = 0; i < cnt_disks; i++)
+    int new_disk_num = cnt_disks;
+    grow_disk_table(cnt_disks + 1);
+    ordered_disk_mmap_ptr[new_disk_num] = disk_ptr;
+    ordered_disk_fd[new_disk_num] = fd;
+    ordered_disk_size[new_disk_num] = st.st_size;
+    pa_reserved[new_disk_num] = calloc(sb->num_data_blocks / 32, sizeof(__u_int));
+    block_refs[new_disk_num] = calloc(sb->num_data_blocks, sizeof(unsigned int));
+
+    // metadata : superblock, bitmaps and inode table of disk 0
+    resync_metadata(0, new_disk_num, new_disk_num);
+    new_sb->disk_blocks = 0;
+    if (raid_mode == 0)
     {
-        int count = 0;
-        char *curr_disk_d_block_ptr = (char *)get_d_block_ptr(d_block_index, i);
-        for (int j = 0; j < cnt_disks; j++)
+        // a smaller disk holds what fits, the blocks past its end stay used
+        size_t disk_blocks = (st.st_size - sb->d_blocks_ptr) / BLOCK_SIZE / 32 * 32;
+        memset(get_d_bitmap(new_disk_num), 0, sb->num_data_blocks / 8);
+        new_sb->free_data_blocks = sb->num_data_blocks;
+        if (disk_blocks < sb->num_data_blocks)
         {
-            char *next_disk_d_block_ptr = (char *)get_d_block_ptr(d_block_index, j);
-            if (memcmp(curr_disk_d_block_ptr, next_disk_d_block_ptr, read_size) == 0)
-                count++;
+            new_sb->disk_blocks = disk_blocks;
+            for (int i = disk_blocks; i < sb->num_data_blocks; i++)
+                set_data_bmp_index(i, 1, new_disk_num);
         }
+        mark_relocated_region(new_sb, get_d_bitmap(new_disk_num), sb->i_bitmap_ptr, sb->num_inodes / 8, 1);
+        mark_relocated_region(new_sb, get_d_bitmap(new_disk_num), sb->d_bitmap_ptr, sb->num_data_blocks / 8, 1);
+        mark_relocated_region(new_sb, get_d_bitmap(new_disk_num), sb->i_blocks_ptr, sb->num_inodes * BLOCK_SIZE, 1);
+        if (cnt_meta_disks > 0)
+            memset((char *)new_sb + sb->i_blocks_ptr, 0, sb->num_inodes * BLOCK_SIZE);
+    }
+    cnt_disks++;
+    for (int i = 0; i < cnt_disks; i++)
+        ((struct wfs_sb *)ordered_disk_mmap_ptr[i])->total_disks = cnt_disks;
+    if (cnt_meta_disks == 0)
+        cnt_inode_copies = cnt_disks;
+    build_stripe_patterns();
 
-        if (count > maxcount)
-        {
-            maxcount = count;
-            disk_num_having_max_freq = i;
-        }
+    pthread_t tid;
+    if (raid_mode == 0)
+    {
+        reshape_old_disks = cnt_disks - 1;
+        reshape_inode = 0;
+        set_reshape_checkpoint();
+        if (pthread_create(&tid, NULL, reshape_worker, NULL) == 0)
+            pthread_detach(tid);
     }
-    return disk_num_having_max_freq;
+    else
+    {
+        // a new mirror is a blank replacement : every region is copied from disk 0
+        for (int i = 0; i < cnt_disks; i++)
+            memset(((struct wfs_sb *)ordered_disk_mmap_ptr[i])->wi_bitmap, 0xff, sizeof(sb->wi_bitmap));
+        set_missing_disks(1 << new_disk_num);
+        resync_stale[new_disk_num] = 1;
+        resync_cursor = 0;
+        resync_source = 0;
+        if (pthread_create(&tid, NULL, resync_worker, NULL) == 0)
+            pthread_detach(tid);
+    }
+    TRACE(TR_RAID, "disk %d added from %s", new_disk_num, path);
+    return res;
 }
 
-// ###################################### Traversal ######################################
+// ###################################### call-back functions ######################################
 
-/********************************************************
-Function to find the inode number of the next element in path
-Takes in inode number of the parent directory & name of the
-directory to find
-return inode number of the directory if found, else -1
-**********************************************************/
-int get_child_inode_num(int inode_num, char *child_name)
+// fills the attributes wfs reports for an inode
+void fill_stat(struct wfs_inode *inode_ptr, struct stat *stbuf)
 {
-    printf("get_child_inode_num() called on inode_num %d & child_name %s\n", inode_num, child_name);
-    // ---- step-1 : get the inode pointer ----
-    struct wfs_inode *curr_inode = get_inode_ptr(inode_num, 0);
-
-    if (curr_inode->size == 0)
-        return -1;
-
-    // ---- step-2 : Search dirents on each data block ----
-    // int search_size = 0; // store the bytes of data that has been searched
-    for (int i = 0; i < 7; i++)
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = inode_ptr->num;
+    stbuf->st_uid = inode_ptr->uid;
+    stbuf->st_gid = inode_ptr->gid;
+    stbuf->st_atime = inode_ptr->atim;
+    stbuf->st_mtime = inode_ptr->mtim;
+    stbuf->st_mode = inode_ptr->mode;
+    stbuf->st_size = inode_ptr->size;
+
+    // 512-byte units, holes take no space
+    stbuf->st_blocks = count_file_blocks(inode_ptr) * (BLOCK_SIZE / 512);
+
+    // buffered writes may have grown a live file
+    struct writeback_buf *wb = get_writeback(inode_ptr);
+    if (wb != NULL)
     {
-        int d_block_index = curr_inode->blocks[i];
-        if (d_block_index == -1)
-            return -1;
-        int disk_num = (raid_mode == 0) ? i % cnt_disks : 0;
-        void *d_block_ptr = get_d_block_ptr(d_block_index, disk_num);
+        stbuf->st_size = wb->size;
+        stbuf->st_blocks += wb->cnt_reserved * (BLOCK_SIZE / 512);
+    }
+}
 
-        // check the 16 directory entries in d-block
-        // since each dentry is 32B and each d-block is 512B
-        struct wfs_dentry *dentry_ptr = (struct wfs_dentry *)d_block_ptr;
-        for (int j = 0; j < 16; j++)
-        {
-            printf("i = %d & j = %d\n", i, j);
-            if (strcmp(child_name, dentry_ptr->name) == 0)
-            {
-                // if match, then return the next inode block index;
-                return dentry_ptr->num;
-            }
-            dentry_ptr = dentry_ptr + 1;
-            // search_size += sizeof(struct wfs_dentry);
-            // if (search_size >= curr_inode->size)
-            //     return -1;
-        }
+/****************************************
+attributes in the snapshot view
+/.snapshots is a directory of the snapshot roots, everything below is read-only
+*****************************************/
+static int snap_getattr(const char *path, struct stat *stbuf)
+{
+    if (snap_path_depth(path) == 1)
+    {
+        fill_stat(get_inode_ptr(0, 0), stbuf);
+        stbuf->st_mode = S_IFDIR | 0555;
+        return 0;
     }
 
-    // search the indirect blocks
-    return -1;
-}
+    struct wfs_inode *inode_ptr = snap_path_traversal(path, NULL);
+    if (inode_ptr == NULL)
+        return -ENOENT;
 
-/*
-Returns the inode_num of the last element in path
+    fill_stat(inode_ptr, stbuf);
+    stbuf->st_mode &= ~0222;
+    return 0;
+}
 
-*/
-int path_traversal(const char *path, int token_cnt_dcr)
+// lists /.snapshots (one cookie per snapshot) or a directory inside a snapshot (slot cookies)
+static int snap_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset)
 {
-    char *copy_path = strdup(path);
-    char *token_arr[100]; // Assuming that path won't have more than 10 tokens
-    int token_cnt = 0;
-    token_cnt = path_parse(copy_path, token_arr, "/");
+    // inode number and type only, as in wfs_readdir
+    struct stat st;
+    memset(&st, 0, sizeof(struct stat));
 
-    // Algorithm to determine inode
-    int inode_num = 0;
-    int next_inode_num = 0;
-    int i = 0;
-    for (i = 0; i < (token_cnt - token_cnt_dcr); i++)
+    if (snap_path_depth(path) == 1)
     {
-        // find the inode number of the child
-        next_inode_num = get_child_inode_num(inode_num, token_arr[i]);
-        if (next_inode_num == -1)
-        {
-            return -1;
-        }
-        else
+        int cookie = 0;
+        for (struct snapshot *snap = snapshots; snap != NULL; snap = snap->next)
         {
-            inode_num = next_inode_num;
+            if (++cookie <= offset)
+                continue;
+            st.st_ino = snap->inodes[0].num;
+            st.st_mode = snap->inodes[0].mode & ~0222;
+            if (filler(buf, snap->name, &st, cookie) != 0)
+                break;
         }
+        return 0;
     }
-    return inode_num;
-}
 
-// ###################################### call-back functions ######################################
+    struct snapshot *snap = NULL;
+    struct wfs_inode *inode_ptr = snap_path_traversal(path, &snap);
+    if (inode_ptr == NULL)
+        return -ENOENT;
+    if (!S_ISDIR(inode_ptr->mode))
+        return -ENOTDIR;
+
+    int slots = inode_ptr->size / sizeof(struct wfs_dentry);
+    for (int slot = offset; slot < slots; slot++)
+    {
+        struct wfs_dentry *dentry_ptr = get_snap_dentry_ptr(inode_ptr, slot);
+        if (dentry_ptr == NULL)
+            return -EIO;
+
+        // skip : tombstoned slot
+        if (dentry_ptr->name[0] == '\0')
+            continue;
+
+        st.st_ino = dentry_ptr->num;
+        st.st_mode = snap->inodes[dentry_ptr->num].mode & ~0222;
+        if (filler(buf, dentry_ptr->name, &st, slot + 1) != 0)
+            break;
+    }
+    return 0;
+}
 
 static int wfs_getattr(const char *path, struct stat *stbuf)
 {
-    printf("wfs_getattr() called on %s\n", path);
+    TRACE(TR_LOOKUP, "getattr %s", path);
 
     // return code
     int res = 0;
 
+    // snapshot view
+    if (is_snap_path(path))
+        return snap_getattr(path, stbuf);
+
     // corner case : path = "/"
     if (strcmp(path, "/") == 0)
     {
-        struct wfs_inode *root_inode = get_inode_ptr(0, 0);
-        memset(stbuf, 0, sizeof(struct stat));
-        stbuf->st_uid = root_inode->uid;
-        stbuf->st_gid = root_inode->gid;
-        stbuf->st_atime = root_inode->atim;
-        stbuf->st_mtime = root_inode->mtim;
-        stbuf->st_mode = root_inode->mode;
-        stbuf->st_size = root_inode->size;
-        printf("root inode size = %d\n", (int)root_inode->size);
+        fill_stat(get_inode_ptr(0, 0), stbuf);
         return res;
     }
 
     // ---------------------- Path Parse -------------------------------
     int inode_num = path_traversal(path, 0);
 
-    if (inode_num == -1)
+    if (inode_num < 0)
     {
-        res = -ENOENT;
+        res = (inode_num == -1) ? -ENOENT : inode_num;
         return res;
     }
 
     // get the inode pointer
     struct wfs_inode *curr_inode = get_inode_ptr(inode_num, 0);
 
-    memset(stbuf, 0, sizeof(struct stat));
-    stbuf->st_uid = curr_inode->uid;
-    stbuf->st_gid = curr_inode->gid;
+    fill_stat(curr_inode, stbuf);
     stbuf->st_atime = time(NULL);
-    stbuf->st_mtime = curr_inode->mtim;
-    stbuf->st_mode = curr_inode->mode;
-    stbuf->st_size = curr_inode->size;
-
-    printf("returning from wfs_getattr\n");
 
     return res; // Return 0 on success
 }
@@ -655,13 +5760,32 @@ static int wfs_getattr(const char *path, struct stat *stbuf)
 ******************** */
 static int wfs_mkdir(const char *path, mode_t mode)
 {
-    printf("wfs_mkdir called on %s\n", path);
+    TRACE(TR_ALLOC, "mkdir %s", path);
     int res = 0;
 
+    // snapshot view : mkdir /.snapshots/<name> takes a snapshot
+    if (is_snap_path(path))
+    {
+        int depth = snap_path_depth(path);
+        if (depth != 2)
+        {
+            res = (depth == 1) ? -EEXIST : -EROFS;
+            return res;
+        }
+
+        // the snapshot freezes what is on disk, buffered writes go first
+        res = flush_all_writeback();
+        if (res != 0)
+            return res;
+        res = create_snapshot(get_name_from_path(path));
+        return res;
+    }
+
     // check : file exists
-    if (path_traversal(path, 0) != -1)
+    res = path_traversal(path, 0);
+    if (res != -1)
     {
-        res = -EEXIST;
+        res = (res >= 0) ? -EEXIST : res;
         return res;
     }
 
@@ -672,11 +5796,14 @@ static int wfs_mkdir(const char *path, mode_t mode)
 
     // get : parent inode number
     int parent_inode_num = path_traversal(path, 1);
-    printf("parent inode = %d\n", parent_inode_num);
+    if (parent_inode_num < 0)
+    {
+        res = (parent_inode_num == -1) ? -ENOENT : parent_inode_num;
+        return res;
+    }
 
     // get : next empty inode bitmap index
-    int inode_bmp_idx = get_next_inode_index(0);
-    printf("inode_bitmap_index = %d\n", inode_bmp_idx);
+    int inode_bmp_idx = get_next_inode_near(parent_inode_num, 1);
 
     // check : inode bitmap full
     if (inode_bmp_idx == -1)
@@ -695,8 +5822,8 @@ static int wfs_mkdir(const char *path, mode_t mode)
     uid_t process_uid = getuid();
     gid_t process_gid = getgid();
 
-    // create : new inode on each disk
-    for (int i = 0; i < cnt_disks; i++)
+    // create : new inode on each disk holding a copy
+    for (int i = 0; i < cnt_inode_copies; i++)
     {
         struct wfs_inode *curr_inode = get_inode_ptr(inode_bmp_idx, i);
         curr_inode->num = inode_bmp_idx;
@@ -711,104 +5838,25 @@ static int wfs_mkdir(const char *path, mode_t mode)
         curr_inode->ctim = seconds;
         memset(curr_inode->blocks, -1, N_BLOCKS * (sizeof(off_t)));
     }
-    printf("Inode created for the new directory\n");
-
-    // check : parent inode needs new data-block to hold new dentry
-    int d_block_index = -1;
-    int disk_num = -1;
-    int blocks_index = -1;
-
-    // check : new d-block needed for creating a dentry
-    if (alloc_d_block_to_dir(parent_inode_num))
-    {
-        // d_block_index = get_free_d_block_index(0);
-        // int blocks_index = -1;
-
-        struct wfs_inode *parent_inode = get_inode_ptr(parent_inode_num, 0);
-        // find the first index in blocks array which is empty
-        for (int i = 0; i < 7; i++)
-        {
-            if (parent_inode->blocks[i] == -1)
-            {
-                blocks_index = i;
-                break;
-            }
-        }
-        disk_num = blocks_index % cnt_disks;
-
-        d_block_index = allocate_direct_block(parent_inode_num, blocks_index, disk_num);
-
-        // check : data bitmap full
-        if (d_block_index == -1)
-        {
-            set_inode_index(inode_bmp_idx, 0);
-            res = -ENOSPC;
-            return res;
-        }
-
-        // update : parent inode
-        // for (int i = 0; i < cnt_disks; i++)
-        // {
-        //     set_data_bmp_index(d_block_index, 1, i);
-
-        //     struct wfs_inode *parent_inode = get_inode_ptr(parent_inode_num, i);
-        //     int index_in_blocks = parent_inode->size / BLOCK_SIZE;
-        //     parent_inode->blocks[index_in_blocks] = d_block_index;
-        //     printf("parent inode updated\n");
-        // }
-    }
-    else
-    {
-        // check : Parent data blocks full
-        if (get_inode_ptr(parent_inode_num, 0)->size / BLOCK_SIZE == 7)
-        {
-            set_inode_index(inode_bmp_idx, 0);
-            res = -ENOSPC;
-            return res;
-        }
-
-        // you didn't allocate a new data block for the dentry
-        // so you need the last data block which is half-filled to put the new dentry
-        struct wfs_inode *parent_inode = get_inode_ptr(parent_inode_num, 0);
-        for (int i = 0; i < 7; i++)
-        {
-            if (parent_inode->blocks[i] == -1)
-            {
-                blocks_index = i - 1;
-                break;
-            }
-        }
-        disk_num = blocks_index % cnt_disks;
-    }
+    TRACE(TR_ALLOC, "inode %d allocated for directory, parent %d", inode_bmp_idx, parent_inode_num);
 
     // create : dentry in the parent
-    if (raid_mode == 0)
-    {
-        struct wfs_dentry *dentry = get_dentry_ptr(parent_inode_num, disk_num, 0);
-        strcpy(dentry->name, get_name_from_path(path));
-        dentry->num = inode_bmp_idx;
-    }
-    else
+    res = add_dentry(parent_inode_num, get_name_from_path(path), inode_bmp_idx);
+    if (res != 0)
     {
-        for (int i = 0; i < cnt_disks; i++)
-        {
-            struct wfs_dentry *dentry = get_dentry_ptr(parent_inode_num, i, 0);
-            strcpy(dentry->name, get_name_from_path(path));
-            dentry->num = inode_bmp_idx;
-        }
+        set_inode_index(inode_bmp_idx, 0);
+        return res;
     }
 
     // update : parent inode
     seconds = time(NULL);
-    for (int i = 0; i < cnt_disks; i++)
+    for (int i = 0; i < cnt_inode_copies; i++)
     {
         struct wfs_inode *parent_inode = get_inode_ptr(parent_inode_num, i);
-        parent_inode->size += sizeof(struct wfs_dentry);
         parent_inode->mtim = seconds;
         parent_inode->ctim = seconds;
         parent_inode->atim = seconds;
         parent_inode->nlinks++;
-        printf("parent inode updated size of parent = %d\n", (int)parent_inode->size);
     }
 
     return res;
@@ -816,23 +5864,34 @@ static int wfs_mkdir(const char *path, mode_t mode)
 
 static int wfs_mknod(const char *path, mode_t mode, dev_t rdev)
 {
-    printf("wfs_mknod called on %s\n", path);
+    TRACE(TR_ALLOC, "mknod %s", path);
     int res = 0;
 
+    // check : snapshot view is read-only
+    if (is_snap_path(path))
+    {
+        res = -EROFS;
+        return res;
+    }
+
     // check : file exists
-    if (path_traversal(path, 0) != -1)
+    res = path_traversal(path, 0);
+    if (res != -1)
     {
-        res = -EEXIST;
+        res = (res >= 0) ? -EEXIST : res;
         return res;
     }
 
     // get : parent inode number
     int parent_inode_num = path_traversal(path, 1);
-    printf("parent inode = %d\n", parent_inode_num);
+    if (parent_inode_num < 0)
+    {
+        res = (parent_inode_num == -1) ? -ENOENT : parent_inode_num;
+        return res;
+    }
 
     // get : next empty inode bitmap index
-    int inode_bmp_idx = get_next_inode_index(0);
-    printf("inode_bitmap_index = %d\n", inode_bmp_idx);
+    int inode_bmp_idx = get_next_inode_near(parent_inode_num, 0);
 
     // check : inode bitmap full
     if (inode_bmp_idx == -1)
@@ -851,8 +5910,8 @@ static int wfs_mknod(const char *path, mode_t mode, dev_t rdev)
     uid_t process_uid = getuid();
     gid_t process_gid = getgid();
 
-    // create : new inode on each disk
-    for (int i = 0; i < cnt_disks; i++)
+    // create : new inode on each disk holding a copy
+    for (int i = 0; i < cnt_inode_copies; i++)
     {
         struct wfs_inode *curr_inode = get_inode_ptr(inode_bmp_idx, i);
         curr_inode->num = inode_bmp_idx;
@@ -866,107 +5925,162 @@ static int wfs_mknod(const char *path, mode_t mode, dev_t rdev)
         curr_inode->ctim = seconds;
         memset(curr_inode->blocks, -1, N_BLOCKS * (sizeof(off_t)));
     }
-    printf("Inode created for the new file\n");
+    TRACE(TR_ALLOC, "inode %d allocated for file, parent %d", inode_bmp_idx, parent_inode_num);
 
-    // check : parent inode needs new data-block to hold new dentry
-    int d_block_index = -1;
-    int disk_num = -1;
-    int blocks_index = -1;
-    if (alloc_d_block_to_dir(parent_inode_num))
+    // create : dentry in the parent
+    res = add_dentry(parent_inode_num, get_name_from_path(path), inode_bmp_idx);
+    if (res != 0)
     {
-        printf("new data block allocated for dentries\n");
-        struct wfs_inode *parent_inode = get_inode_ptr(parent_inode_num, 0);
-        for (int i = 0; i < 7; i++)
-        {
-            if (parent_inode->blocks[i] == -1)
-            {
-                blocks_index = i;
-                break;
-            }
-        }
-        disk_num = blocks_index % cnt_disks;
+        set_inode_index(inode_bmp_idx, 0);
+        return res;
+    }
+
+    seconds = time(NULL);
+    // update : parent inode
+    for (int i = 0; i < cnt_inode_copies; i++)
+    {
+        struct wfs_inode *parent_inode = get_inode_ptr(parent_inode_num, i);
+        // parent_inode->nlinks++;
+        parent_inode->mtim = seconds;
+        parent_inode->ctim = seconds;
+        parent_inode->atim = seconds;
+        parent_inode->nlinks++;
+    }
+    return res;
+}
 
-        d_block_index = allocate_direct_block(parent_inode_num, blocks_index, disk_num);
+/****************************************
+frees the blocks and the inode of a file whose last link is gone
+buffered blocks are dropped, they never got d-blocks
+*****************************************/
+void free_file_inode(int inode_num)
+{
+    free_writeback(inode_num);
+    pa_release(inode_num);
+    release_inode_blocks(inode_num);
+    set_inode_index(inode_num, 0);
+}
 
-        // check : data bitmap full
-        if (d_block_index == -1)
+// frees the files that were unlinked while open when the volume went down, called at mount
+void reclaim_orphans()
+{
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+    __u_int *i_bitmap = (__u_int *)((char *)sb + sb->i_bitmap_ptr);
+    for (int i = 1; i < sb->num_inodes; i++)
+    {
+        if (!(i_bitmap[i / 32] & (1u << (i % 32))))
+            continue;
+        struct wfs_inode *inode_ptr = get_inode_ptr(i, 0);
+        if (S_ISREG(inode_ptr->mode) && inode_ptr->nlinks == 0)
         {
-            set_inode_index(inode_bmp_idx, 0);
-            res = -ENOSPC;
-            return res;
+            TRACE(TR_ALLOC, "inode %d: unlinked while open, freed", i);
+            free_file_inode(i);
         }
-        // d_block_index = get_free_d_block_index(0);
-
-        // // check : data bitmap full
-        // if (d_block_index == -1)
-        // {
-        //     set_inode_index(inode_bmp_idx, 0);
-        //     res = -ENOSPC;
-        //     return res;
-        // }
+    }
+}
 
-        // // update : parent inode
-        // for (int i = 0; i < cnt_disks; i++)
-        // {
-        //     set_data_bmp_index(d_block_index, 1, i);
+// create = mknod + open, saves the kernel a second lookup
+static int wfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    int res = wfs_mknod(path, mode, 0);
+    if (res != 0)
+        return res;
+    return wfs_open(path, fi);
+}
 
-        //     struct wfs_inode *parent_inode = get_inode_ptr(parent_inode_num, i);
-        //     int index_in_blocks = parent_inode->size / BLOCK_SIZE;
-        //     parent_inode->blocks[index_in_blocks] = d_block_index;
-        //     printf("parent inode updated\n");
-        // }
-    }
-    else
+// the last close of a handle writes its buffered blocks out, or frees the file if it was unlinked
+static int wfs_release(const char *path, struct fuse_file_info *fi)
+{
+    int res = 0;
+    struct wfs_handle *handle = get_handle(fi);
+    if (handle != NULL && handle->snap != NULL)
+        handle->snap->open_cnt--;
+    else if (handle != NULL && get_inode_ptr(handle->inode_num, 0)->nlinks == 0)
     {
-        // check : Parent data blocks full
-        if (get_inode_ptr(parent_inode_num, 0)->size / BLOCK_SIZE == 7)
-        {
-            set_inode_index(inode_bmp_idx, 0);
-            res = -ENOSPC;
-            return res;
-        }
-        struct wfs_inode *parent_inode = get_inode_ptr(parent_inode_num, 0);
-        for (int i = 0; i < 7; i++)
+        file_open_cnt[handle->inode_num]--;
+        if (file_open_cnt[handle->inode_num] == 0)
         {
-            if (parent_inode->blocks[i] == -1)
-            {
-                blocks_index = i - 1;
-                break;
-            }
+            // queued mirror copies may still land in the blocks being freed
+            drain_mirror_writes();
+            free_file_inode(handle->inode_num);
         }
-        disk_num = blocks_index % cnt_disks;
     }
+    else if (handle != NULL)
+    {
+        file_open_cnt[handle->inode_num]--;
+        res = flush_writeback(handle->inode_num);
+        pa_release(handle->inode_num);
+    }
+    free(handle);
+    fi->fh = 0;
+    return res;
+}
 
-    // create : dentry in the parent
-    if (raid_mode == 0)
+// every close() writes the buffered blocks out, FUSE ignores what release returns but not this
+static int wfs_flush(const char *path, struct fuse_file_info *fi)
+{
+    int res = 0;
+    struct wfs_handle *handle = get_handle(fi);
+
+    // check : snapshot files are never buffered, an unlinked file is freed unwritten
+    if (handle == NULL || handle->snap != NULL || get_inode_ptr(handle->inode_num, 0)->nlinks == 0)
+        return res;
+    res = flush_writeback(handle->inode_num);
+    return res;
+}
+
+static int wfs_truncate(const char *path, off_t size)
+{
+    TRACE(TR_IO, "truncate %s size %ld", path, (long)size);
+
+    int res = 0;
+
+    // check : snapshot view is read-only
+    if (is_snap_path(path))
     {
-        struct wfs_dentry *dentry = get_dentry_ptr(parent_inode_num, disk_num, 0);
-        strcpy(dentry->name, get_name_from_path(path));
-        dentry->num = inode_bmp_idx;
+        res = -EROFS;
+        return res;
     }
-    else
+
+    int inode_num = path_traversal(path, 0);
+    if (inode_num < 0)
     {
-        for (int i = 0; i < cnt_disks; i++)
-        {
-            struct wfs_dentry *dentry = get_dentry_ptr(parent_inode_num, i, 0);
-            strcpy(dentry->name, get_name_from_path(path));
-            dentry->num = inode_bmp_idx;
-        }
+        res = (inode_num == -1) ? -ENOENT : inode_num;
+        return res;
     }
+    res = truncate_file(inode_num, size);
+    return res;
+}
+
+static int wfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    struct wfs_handle *handle = get_handle(fi);
+    if (handle == NULL)
+        return wfs_truncate(path, size);
+
+    // check : snapshot view is read-only
+    if (handle->snap != NULL)
+        return -EROFS;
+    return truncate_file(handle->inode_num, size);
+}
 
-    seconds = time(NULL);
-    // update : parent inode
-    for (int i = 0; i < cnt_disks; i++)
+static int wfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    int res = 0;
+
+    struct wfs_handle *handle = get_handle(fi);
+    if (handle != NULL && handle->snap != NULL)
+        return res;
+
+    int inode_num = (handle != NULL) ? handle->inode_num : path_traversal(path, 0);
+    if (inode_num < 0)
     {
-        struct wfs_inode *parent_inode = get_inode_ptr(parent_inode_num, i);
-        parent_inode->size += sizeof(struct wfs_dentry);
-        // parent_inode->nlinks++;
-        parent_inode->mtim = seconds;
-        parent_inode->ctim = seconds;
-        parent_inode->atim = seconds;
-        parent_inode->nlinks++;
-        printf("parent inode updated, size = %d\n", (int)parent_inode->size);
+        res = (inode_num == -1) ? -ENOENT : inode_num;
+        return res;
     }
+    res = flush_writeback(inode_num);
+    if (res == 0)
+        res = flush_disks();
     return res;
 }
 
@@ -977,224 +6091,36 @@ static int wfs_mknod(const char *path, mode_t mode, dev_t rdev)
 ******************/
 static int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    printf("wfs_write called on %s\n", path);
+    TRACE(TR_IO, "write %s size %zu offset %ld", path, size, (long)offset);
 
     int res = 0;
-    // int copy_size = size;
 
-    // check : file exists
-    int inode_num = path_traversal(path, 0);
-    if (inode_num == -1)
+    // check : snapshot view is read-only
+    struct wfs_handle *handle = get_handle(fi);
+    if ((handle != NULL) ? handle->snap != NULL : is_snap_path(path))
     {
-        res = -ENOENT;
+        res = -EROFS;
         return res;
     }
-    printf("%s exists\n", path);
-
-    // check : inode is a regular file
-    struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, 0);
-
-    // determine : data block to be written
-    int index_in_blocks = offset / BLOCK_SIZE;
-    int offset_within_block = offset % BLOCK_SIZE;
-
-    int d_block_index = -1;
-
-    // cnt of the number of d-blocks to write
-    int loop_cnt = (offset_within_block + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-
-    // loop to write the blocks
-    // 1. check if a data_block is allocated for the found index_in_blocks
-    // 2. else allocate a page
-    // 3. write to the correct offset_within_block until the end of the block or size
-    // 4. repeat
-
-    // variable to store the number of bytes written to file in 1 function call
-    int total_bytes_written = 0;
 
-    printf("Before the main for loop\n");
-
-    for (int i = 0; i < loop_cnt; i++)
+    // check : file exists (open handles skip the path walk)
+    int inode_num = (handle != NULL) ? handle->inode_num : path_traversal(path, 0);
+    if (inode_num < 0)
     {
-        // flag : set if you allocate a new d-block to write
-        // int wrote_on_a_new_block = 0;
-        if (index_in_blocks < 7)
-        {
-            d_block_index = inode_ptr->blocks[index_in_blocks];
-        }
-        else
-        {
-            // check if blocks[7] is allocated
-            int indirect_block_index = inode_ptr->blocks[7];
-            // if no then allocate it first
-            if (indirect_block_index == -1)
-            {
-                indirect_block_index = allocate_indirect_block(inode_num, 7 % cnt_disks);
-                if (indirect_block_index == -1)
-                {
-                    res = -ENOSPC;
-                    return res;
-                }
-            }
-            // then find out the correct block in the new page
-            off_t *indirect_block_ptr = (off_t *)get_d_block_ptr(indirect_block_index, 7 % cnt_disks);
-            int index_in_indirect_block = index_in_blocks - 7;
-            d_block_index = indirect_block_ptr[index_in_indirect_block];
-        }
-
-        // allocate a new page
-        if (d_block_index == -1)
-        {
-            // allocate a page
-            d_block_index = allocate_direct_block(inode_num, index_in_blocks, index_in_blocks % cnt_disks);
-
-            // check : no space to allocate new data block
-            if (d_block_index == -1)
-            {
-                res = -ENOSPC;
-                return res;
-            }
-            // wrote_on_a_new_block = 1;
-        }
-
-        // for raid1
-
-        // size to be written to the given d-block
-        int write_size = 0;
-
-        if (raid_mode == 0)
-        {
-            char *d_block_ptr = (char *)get_d_block_ptr(d_block_index, index_in_blocks % cnt_disks);
-            d_block_ptr += offset_within_block;
-            int space_in_d_block = 512 - offset_within_block;
-
-            if (size > space_in_d_block)
-            {
-                write_size = space_in_d_block;
-            }
-            else
-            {
-                write_size = size;
-            }
-            memcpy(d_block_ptr, buf, write_size);
-
-            // if (wrote_on_a_new_block)
-            // {
-            // for (int j = 0; j < cnt_disks; j++)
-            // {
-            //     inode_ptr = get_inode_ptr(inode_num, j);
-            //     inode_ptr->size += write_size;
-            // }
-            // }
-        }
-        else
-        {
-            for (int j = 0; j < cnt_disks; j++)
-            {
-                // get inode ptr for current disk
-                inode_ptr = get_inode_ptr(inode_num, j);
-
-                // put the newly allocated data-block into blocks array
-                // inode_ptr->blocks[index_in_blocks] = d_block_index;
-
-                // get pointer to the correct data-block
-                char *d_block_ptr = (char *)get_d_block_ptr(d_block_index, j);
-                d_block_ptr += offset_within_block;
-
-                // the space in the chosen d-block given it has some data already on it
-                int space_in_d_block = 512 - offset_within_block;
-
-                if (size > space_in_d_block)
-                {
-                    write_size = space_in_d_block;
-                }
-                else
-                {
-                    write_size = size;
-                }
-                memcpy(d_block_ptr, buf, write_size);
-
-                // ------------------------ handling overwriting ------------------------
-
-                printf("inode_ptr->size = %d\n", (int)inode_ptr->size);
-                printf("offset = %d\n", (int)offset);
-                printf("write_size = %d\n", write_size);
-
-                printf("size being written %d\n", write_size);
-                // if (offset < inode_ptr->size)
-                // {
-                //     printf("if case in write\n");
-                //     if (write_size + offset > inode_ptr->size)
-                //     {
-                //         // spill case
-                //         printf("spill case\n");
-                //         inode_ptr->size = (write_size + offset);
-                //     }
-                //     else if (write_size + offset < inode_ptr->size)
-                //     {
-                //         // do nothing
-                //         printf("entered else if\n");
-                //     }
-                //     else
-                //     {
-                //         printf("no spill case\n");
-                //         inode_ptr->size += write_size;
-                //     }
-                // }
-                // else
-                // {
-                //     printf("else case in write\n");
-                //     inode_ptr->size += write_size;
-                // }
-            }
-        }
-        // if(wrote_on_a_new_block)
-        // {
-        //     ino
-        // }
-        buf += write_size;
-        size -= write_size;
-        index_in_blocks++;
-
-        total_bytes_written += write_size;
-
-        // austin
-        offset_within_block = 0;
+        res = (inode_num == -1) ? -ENOENT : inode_num;
+        return res;
     }
 
-    // loop to change size within inode
-    for (int i = 0; i < cnt_disks; i++)
+    // open handles buffer, writes by path go straight to disk behind the buffer
+    if (handle != NULL)
     {
-        inode_ptr = get_inode_ptr(inode_num, i);
-        if (offset <= inode_ptr->size)
-        {
-            printf("if case in write\n");
-            if (total_bytes_written + offset > inode_ptr->size)
-            {
-                // spill case
-                printf("spill case\n");
-                inode_ptr->size = (total_bytes_written + offset);
-            }
-            // else if (total_bytes_written + offset < inode_ptr->size)
-            // {
-            //     // do nothing
-            //     printf("entered else if\n");
-            // }
-            // else
-            // {
-            //     printf("no spill case\n");
-            //     inode_ptr->size += total_bytes_written;
-            // }
-        }
-        else
-        {
-            printf("else case in write\n");
-            inode_ptr->size += total_bytes_written;
-        }
+        res = buffer_write(handle, inode_num, buf, size, offset);
+        return res;
     }
-
-    printf("after the main for loop\n");
-    res = total_bytes_written;
+    res = flush_writeback(inode_num);
+    if (res != 0)
+        return res;
+    res = write_file_range(handle, inode_num, buf, size, offset);
     return res;
 }
 
@@ -1202,646 +6128,638 @@ static int wfs_write(const char *path, const char *buf, size_t size, off_t offse
 1. free (unallocate) any data blocks associated with the file,
 2. free it's inode,
 3. remove the directory entry pointing to the file from the parent inode.
+a file with open handles only loses its link (nlinks = 0), the last close frees it
 ***********************************/
 
 static int wfs_unlink(const char *path)
 {
-    printf("wfs_unlink called on %s\n", path);
+    TRACE(TR_ALLOC, "unlink %s", path);
 
     int res = 0;
 
+    // check : snapshot view is read-only
+    if (is_snap_path(path))
+    {
+        res = -EROFS;
+        return res;
+    }
+
     // get : parent inode number
     int parent_inode_num = path_traversal(path, 1);
-    printf("parent inode = %d\n", parent_inode_num);
+    if (parent_inode_num < 0)
+    {
+        res = (parent_inode_num == -1) ? -ENOENT : parent_inode_num;
+        return res;
+    }
 
     // get : current inode number
     int curr_inode_num = path_traversal(path, 0);
-
-    // get : current inode pointer
-    struct wfs_inode *curr_inode = get_inode_ptr(curr_inode_num, 0);
-
-    // -------------------------------------- free the d-block bitmap --------------------------------------
-    if (curr_inode->size != 0)
+    if (curr_inode_num < 0)
     {
-        // loop over all the indices in blocks array
-        for (int i = 0; i < 8; i++)
-        {
-            // skip if blocks[i] == -1
-
-            // free if blocks[i] != -1
-            if (raid_mode == 0)
-            {
-                // get the inode pointer from the correct disk
-                curr_inode = get_inode_ptr(curr_inode_num, i % cnt_disks);
-
-                // handle indirect block
-                if (i == 7 && curr_inode->blocks[7] != -1)
-                {
-                    int indirect_block_index = curr_inode->blocks[7];
-                    off_t *indirect_block_ptr = (off_t *)get_d_block_ptr(indirect_block_index, 7 % cnt_disks);
-
-                    // each indirect block is a d-block =512B
-                    // each block_index entry in it is of type off_t = long (8B)
-                    // total possible entries in an indirec t block is 512/8 = 64
-                    for (int k = 0; k < BLOCK_SIZE / sizeof(off_t); k++)
-                    {
-                        if (indirect_block_ptr[k] == -1)
-                        {
-                            break;
-                        }
-                        set_data_bmp_index(indirect_block_ptr[k], 0, (k + 7) % cnt_disks);
-                        indirect_block_ptr[k] = -1;
-                    }
-                }
-                set_data_bmp_index(curr_inode->blocks[i], 0, i % cnt_disks);
-                for (int j = 0; j < cnt_disks; j++)
-                {
-                    curr_inode = get_inode_ptr(curr_inode_num, j % cnt_disks);
-                    curr_inode->blocks[i] = -1;
-                }
-            }
-            else
-            {
-                // loop over all the disks
-                for (int j = 0; j < cnt_disks; j++)
-                {
-                    curr_inode = get_inode_ptr(curr_inode_num, j);
-                    // handle indirect blocks
-                    if (i == 7)
-                    {
-                        int indirect_block_index = curr_inode->blocks[7];
-                        off_t *indirect_block_ptr = (off_t *)get_d_block_ptr(indirect_block_index, j);
-
-                        // each indirect block is a d-block =512B
-                        // each block_index entry in it is of type off_t = long (8B)
-                        // total possible entries in an indirec t block is 512/8 = 64
-                        for (int k = 0; k < BLOCK_SIZE / sizeof(off_t); k++)
-                        {
-                            if (indirect_block_ptr[k] == -1)
-                            {
-                                break;
-                            }
-                            set_data_bmp_index(indirect_block_ptr[k], 0, j);
-                            indirect_block_ptr[k] = -1;
-                        }
-                    }
-                    set_data_bmp_index(curr_inode->blocks[i], 0, j);
-                    curr_inode->blocks[i] = -1;
-                }
-            }
-            curr_inode->blocks[i] = -1;
-        }
+        res = (curr_inode_num == -1) ? -ENOENT : curr_inode_num;
+        return res;
     }
 
-    // -------------------------------------- free inode --------------------------------------
-    set_inode_index(curr_inode_num, 0);
-
     // -------------------------------------- remove the dentry --------------------------------------
+    // first, so a full disk (copying a dentry block shared with a snapshot) leaves the file intact
+    res = remove_dentry(parent_inode_num, curr_inode_num);
+    if (res != 0)
+        return res;
 
-    if (raid_mode == 0)
+    // -------------------------------------- free the d-blocks & inode --------------------------------------
+    if (file_open_cnt[curr_inode_num] > 0)
     {
-        // get : pointer to parent inode
-        struct wfs_inode *parent_inode_ptr = get_inode_ptr(parent_inode_num, 0);
-
-        for (int i = 0; i < 7; i++)
-        {
-            int d_block_index = parent_inode_ptr->blocks[i];
-
-            struct wfs_dentry *dentry_ptr = (struct wfs_dentry *)get_d_block_ptr(d_block_index, i % cnt_disks);
-            // struct wfs_dentry *last_dentry_ptr = get_dentry_ptr(parent_inode_num, 0, 1);
-
-            // loop over all possible dentrys in a d-block
-            int j = 0;
-            for (j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++)
-            {
-                // struct wfs_dentry *dentry_ptr = (struct wfs_dentry *)get_d_block_ptr(d_block_index, j);
-                if (dentry_ptr->num == curr_inode_num)
-                {
-                    // for (int k = 0; k < cnt_disks; k++)
-                    // {
-                    // dentry_ptr = get_dentry_ptr(parent_inode_num, k, j);
-                    int disk_num = 0;
-                    for (int k = 1; k < 8; k++)
-                    {
-                        if (parent_inode_ptr->blocks[i] == -1)
-                        {
-                            disk_num = (i - 1) % cnt_disks;
-                            break;
-                        }
-                    }
-
-                    struct wfs_dentry *last_dentry_ptr = get_dentry_ptr(parent_inode_num, disk_num, 1);
-                    strcpy(dentry_ptr->name, last_dentry_ptr->name);
-                    dentry_ptr->num = last_dentry_ptr->num;
-                    // parent_inode_ptr = get_inode_ptr(parent_inode_num, k);
-                    for (int k = 0; k < cnt_disks; k++)
-                    {
-                        parent_inode_ptr = get_inode_ptr(parent_inode_num, k);
-                        parent_inode_ptr->size -= sizeof(struct wfs_dentry);
-                        parent_inode_ptr->nlinks--;
-                    }
-
-                    memset(last_dentry_ptr, 0, sizeof(struct wfs_dentry));
-                    // }
-                    // return res;
-                    break;
-                }
-                dentry_ptr += 1;
-            }
-            if (j < BLOCK_SIZE / sizeof(struct wfs_dentry))
-                break;
-        }
+        for (int i = 0; i < cnt_inode_copies; i++)
+            get_inode_ptr(curr_inode_num, i)->nlinks = 0;
+        TRACE(TR_ALLOC, "inode %d: unlinked with %d handles open", curr_inode_num, file_open_cnt[curr_inode_num]);
     }
-
     else
-    {
-        for (int k = 0; k < cnt_disks; k++)
-        {
-            struct wfs_inode *parent_inode_ptr = get_inode_ptr(parent_inode_num, k);
-
-            // loop over the blocks array of the parent
-            for (int i = 0; i < 7; i++)
-            {
-                int d_block_index = parent_inode_ptr->blocks[i];
-                struct wfs_dentry *dentry_ptr = (struct wfs_dentry *)get_d_block_ptr(d_block_index, k);
-                // struct wfs_dentry *last_dentry_ptr = get_dentry_ptr(parent_inode_num, 0, 1);
+        free_file_inode(curr_inode_num);
 
-                // loop over all possible dentrys in a d-block
-                int j = 0;
-                for (j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++)
-                {
-                    // struct wfs_dentry *dentry_ptr = (struct wfs_dentry *)get_d_block_ptr(d_block_index, j);
-                    if (dentry_ptr->num == curr_inode_num)
-                    {
-                        // for (int k = 0; k < cnt_disks; k++)
-                        // {
-                        // dentry_ptr = get_dentry_ptr(parent_inode_num, k, j);
-                        struct wfs_dentry *last_dentry_ptr = get_dentry_ptr(parent_inode_num, k, 1);
-                        strcpy(dentry_ptr->name, last_dentry_ptr->name);
-                        dentry_ptr->num = last_dentry_ptr->num;
-                        // parent_inode_ptr = get_inode_ptr(parent_inode_num, k);
-                        parent_inode_ptr->size -= sizeof(struct wfs_dentry);
-                        parent_inode_ptr->nlinks--;
-                        memset(last_dentry_ptr, 0, sizeof(struct wfs_dentry));
-                        // }
-                        // return res;
-                        break;
-                    }
-                    dentry_ptr += 1;
-                }
-                if (j < BLOCK_SIZE / sizeof(struct wfs_dentry))
-                    break;
-            }
-        }
+    // update : parent inode
+    for (int i = 0; i < cnt_inode_copies; i++)
+    {
+        struct wfs_inode *parent_inode_ptr = get_inode_ptr(parent_inode_num, i);
+        parent_inode_ptr->nlinks--;
     }
-
-    // struct wfs_inode *parent_inode_ptr = get_inode_ptr(parent_inode_num, 0);
-    // if (parent_inode_ptr->size % BLOCK_SIZE == 0)
-    // {
-    //     // remove the last d-block allocated for dentrys/ dentry block
-
-    //     remove_dentry_block(parent_inode_num);
-    // }
-
-    // loop over the blocks array of the parent
-    // for (int i = 0; i < 7; i++)
-    // {
-    //     int d_block_index = parent_inode_ptr->blocks[i];
-    //     struct wfs_dentry *dentry_ptr = (struct wfs_dentry *)get_d_block_ptr(d_block_index, 0);
-    //     // struct wfs_dentry *last_dentry_ptr = get_dentry_ptr(parent_inode_num, 0, 1);
-
-    //     // loop over all possible dentrys in a d-block
-    //     for(int j=0; j<BLOCK_SIZE/sizeof(struct wfs_dentry); j++)
-    //     {
-    //         struct wfs_dentry *dentry_ptr = (struct wfs_dentry *)get_d_block_ptr(d_block_index, j);
-    //         if(dentry_ptr->num == curr_inode_num)
-    //         {
-    //             for(int k=0; k<cnt_disks; k++)
-    //             {
-    //                 // dentry_ptr = get_dentry_ptr(parent_inode_num, k, j);
-    //                 struct wfs_dentry *last_dentry_ptr = get_dentry_ptr(parent_inode_num, 0, 1);
-    //                 strcpy(dentry_ptr->name, last_dentry_ptr->name);
-    //                 dentry_ptr->num = last_dentry_ptr->num;
-    //                 parent_inode_ptr = get_inode_ptr(parent_inode_num, k);
-    //                 parent_inode_ptr->size -= sizeof(struct wfs_dentry);
-    //             }
-    //             return res;
-    //         }
-    //         dentry_ptr += 1;
-    //     }
-    // }
     return res;
 }
 
 static int wfs_rmdir(const char *path)
 {
-    printf("wfs_rmdir called on %s\n", path);
+    TRACE(TR_ALLOC, "rmdir %s", path);
 
     int res = 0;
 
+    // snapshot view : rmdir /.snapshots/<name> drops a snapshot
+    if (is_snap_path(path))
+    {
+        int depth = snap_path_depth(path);
+        res = (depth == 2) ? delete_snapshot(get_name_from_path(path)) : (depth == 1) ? -EBUSY : -EROFS;
+        return res;
+    }
+
     // get : parent inode number
     int parent_inode_num = path_traversal(path, 1);
-    printf("parent inode = %d\n", parent_inode_num);
+    if (parent_inode_num < 0)
+    {
+        res = (parent_inode_num == -1) ? -ENOENT : parent_inode_num;
+        return res;
+    }
 
     // get : current inode number
     int curr_inode_num = path_traversal(path, 0);
-
-    // get : current inode pointer
-    struct wfs_inode *curr_inode = get_inode_ptr(curr_inode_num, 0);
+    if (curr_inode_num < 0)
+    {
+        res = (curr_inode_num == -1) ? -ENOENT : curr_inode_num;
+        return res;
+    }
 
     // rmdir should succeed only if the directory is empty
-    if (curr_inode->size != 0)
+    struct dir_slot_map *map = get_dir_slot_map(curr_inode_num);
+    if (map == NULL)
     {
-        res = -1;
+        res = -EIO;
         return res;
     }
-
-    // -------------------------------------- free the d-block bitmap --------------------------------------
-    if (curr_inode->size != 0)
+    if (map->live != 0)
     {
-        for (int i = 0; i < 7; i++)
-        {
-            if (raid_mode == 0)
-            {
-                if (i == 7)
-                {
-                    int indirect_block_index = curr_inode->blocks[7];
-                    off_t *indirect_block_ptr = (off_t *)get_d_block_ptr(indirect_block_index, 7 % cnt_disks);
-
-                    // each indirect block is a d-block =512B
-                    // each block_index entry in it is of type off_t = long (8B)
-                    // total possible entries in an indirec t block is 512/8 = 64
-                    for (int k = 0; k < BLOCK_SIZE / sizeof(off_t); k++)
-                    {
-                        if (indirect_block_ptr[k] == -1)
-                        {
-                            break;
-                        }
-                        set_data_bmp_index(indirect_block_ptr[k], 0, (k + 7) % cnt_disks);
-                        indirect_block_ptr[k] = -1;
-                    }
-                }
-                set_data_bmp_index(curr_inode->blocks[i], 0, i % cnt_disks);
-            }
-            else
-            {
-                for (int j = 0; j < cnt_disks; j++)
-                {
-                    curr_inode = get_inode_ptr(curr_inode_num, j);
-                    if (i == 7)
-                    {
-                        int indirect_block_index = curr_inode->blocks[7];
-                        off_t *indirect_block_ptr = (off_t *)get_d_block_ptr(indirect_block_index, j);
-
-                        // each indirect block is a d-block =512B
-                        // each block_index entry in it is of type off_t = long (8B)
-                        // total possible entries in an indirec t block is 512/8 = 64
-                        for (int k = 0; k < BLOCK_SIZE / sizeof(off_t); k++)
-                        {
-                            if (indirect_block_ptr[k] == -1)
-                            {
-                                break;
-                            }
-                            set_data_bmp_index(indirect_block_ptr[k], 0, j);
-                            indirect_block_ptr[i] = -1;
-                        }
-                    }
-                    set_data_bmp_index(curr_inode->blocks[i], 0, j);
-                    curr_inode->blocks[i] = -1;
-                }
-            }
-            curr_inode->blocks[i] = -1;
-        }
+        res = -ENOTEMPTY;
+        return res;
     }
 
+    // -------------------------------------- remove the dentry --------------------------------------
+    res = remove_dentry(parent_inode_num, curr_inode_num);
+    if (res != 0)
+        return res;
+
+    // -------------------------------------- free the dentry blocks --------------------------------------
+    // an emptied directory keeps its tombstoned blocks until it is removed
+    free_dir_blocks(curr_inode_num, 0);
+    drop_dir_slot_map(curr_inode_num);
+
     // -------------------------------------- free inode --------------------------------------
     set_inode_index(curr_inode_num, 0);
 
-    // -------------------------------------- remove the dentry --------------------------------------
-
-    if (raid_mode == 0)
+    // update : parent inode
+    for (int i = 0; i < cnt_inode_copies; i++)
     {
-        // get : pointer to parent inode
-        struct wfs_inode *parent_inode_ptr = get_inode_ptr(parent_inode_num, 0);
+        struct wfs_inode *parent_inode_ptr = get_inode_ptr(parent_inode_num, i);
+        parent_inode_ptr->nlinks--;
+    }
+    return res;
+}
 
-        for (int i = 0; i < 7; i++)
-        {
-            int d_block_index = parent_inode_ptr->blocks[i];
+/*******************************
+1. find the data block corresponding to the offset being read from, and
+2. copy data from the data block(s) to the read buffer.
+3. As with writes, reads may be split across data blocks, or span multiple data blocks.
+*******************************/
+static int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    TRACE(TR_IO, "read %s size %zu offset %ld", path, size, (long)offset);
+
+    int res = 0;
 
-            struct wfs_dentry *dentry_ptr = (struct wfs_dentry *)get_d_block_ptr(d_block_index, i % cnt_disks);
-            // struct wfs_dentry *last_dentry_ptr = get_dentry_ptr(parent_inode_num, 0, 1);
+    // check : file exists (open handles skip the path walk)
+    struct wfs_handle *handle = get_handle(fi);
+    struct wfs_inode *inode_ptr = (handle != NULL) ? get_handle_inode(handle) : resolve_inode(path, &res);
+    if (inode_ptr == NULL)
+        return res;
 
-            // loop over all possible dentrys in a d-block
-            int j = 0;
-            for (j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++)
-            {
-                // struct wfs_dentry *dentry_ptr = (struct wfs_dentry *)get_d_block_ptr(d_block_index, j);
-                if (dentry_ptr->num == curr_inode_num)
-                {
-                    // for (int k = 0; k < cnt_disks; k++)
-                    // {
-                    // dentry_ptr = get_dentry_ptr(parent_inode_num, k, j);
-                    int disk_num = 0;
-                    for (int k = 1; k < 8; k++)
-                    {
-                        if (parent_inode_ptr->blocks[i] == -1)
-                        {
-                            disk_num = (i - 1) % cnt_disks;
-                            break;
-                        }
-                    }
-
-                    struct wfs_dentry *last_dentry_ptr = get_dentry_ptr(parent_inode_num, disk_num, 1);
-                    strcpy(dentry_ptr->name, last_dentry_ptr->name);
-                    dentry_ptr->num = last_dentry_ptr->num;
-                    // parent_inode_ptr = get_inode_ptr(parent_inode_num, k);
-                    for (int k = 0; k < cnt_disks; k++)
-                    {
-                        parent_inode_ptr = get_inode_ptr(parent_inode_num, k);
-                        parent_inode_ptr->size -= sizeof(struct wfs_dentry);
-                        parent_inode_ptr->nlinks--;
-                    }
-
-                    memset(last_dentry_ptr, 0, sizeof(struct wfs_dentry));
-                    // }
-                    // return res;
-                    break;
-                }
-                dentry_ptr += 1;
-            }
-            if (j < BLOCK_SIZE / sizeof(struct wfs_dentry))
-                break;
-        }
+    struct writeback_buf *wb = get_writeback(inode_ptr);
+    if (wb != NULL)
+    {
+        res = read_buffered(handle, inode_ptr, wb, buf, size, offset);
+        return res;
     }
+    res = read_file_range(handle, inode_ptr, buf, size, offset);
+    return res;
+}
 
-    else
+/****************************************
+opendir resolves the path once and keeps the inode number in fi->fh
+an open directory is never compacted, so slot cookies stay valid
+*****************************************/
+static int wfs_opendir(const char *path, struct fuse_file_info *fi)
+{
+    // snapshot view : frozen directories are never compacted, list them by path
+    if (is_snap_path(path))
     {
-        for (int k = 0; k < cnt_disks; k++)
-        {
-            struct wfs_inode *parent_inode_ptr = get_inode_ptr(parent_inode_num, k);
+        if (snap_path_depth(path) > 1 && snap_path_traversal(path, NULL) == NULL)
+            return -ENOENT;
+        fi->fh = 0;
+        return 0;
+    }
 
-            // loop over the blocks array of the parent
-            for (int i = 0; i < 7; i++)
-            {
-                int d_block_index = parent_inode_ptr->blocks[i];
-                struct wfs_dentry *dentry_ptr = (struct wfs_dentry *)get_d_block_ptr(d_block_index, k);
-                // struct wfs_dentry *last_dentry_ptr = get_dentry_ptr(parent_inode_num, 0, 1);
+    int inode_num = path_traversal(path, 0);
+    if (inode_num < 0)
+        return (inode_num == -1) ? -ENOENT : inode_num;
 
-                // loop over all possible dentrys in a d-block
-                int j = 0;
-                for (j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++)
-                {
-                    // struct wfs_dentry *dentry_ptr = (struct wfs_dentry *)get_d_block_ptr(d_block_index, j);
-                    if (dentry_ptr->num == curr_inode_num)
-                    {
-                        // for (int k = 0; k < cnt_disks; k++)
-                        // {
-                        // dentry_ptr = get_dentry_ptr(parent_inode_num, k, j);
-                        struct wfs_dentry *last_dentry_ptr = get_dentry_ptr(parent_inode_num, k, 1);
-                        strcpy(dentry_ptr->name, last_dentry_ptr->name);
-                        dentry_ptr->num = last_dentry_ptr->num;
-                        // parent_inode_ptr = get_inode_ptr(parent_inode_num, k);
-                        parent_inode_ptr->size -= sizeof(struct wfs_dentry);
-                        parent_inode_ptr->nlinks--;
-                        memset(last_dentry_ptr, 0, sizeof(struct wfs_dentry));
-                        // }
-                        // return res;
-                        break;
-                    }
-                    dentry_ptr += 1;
-                }
-                if (j < BLOCK_SIZE / sizeof(struct wfs_dentry))
-                    break;
-            }
+    fi->fh = inode_num + 1;
+    dir_open_cnt[inode_num]++;
+    return 0;
+}
+
+static int wfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    if (fi->fh != 0)
+        dir_open_cnt[fi->fh - 1]--;
+    return 0;
+}
+
+/****************************************
+lists a directory from the slot given by the offset cookie
+each entry carries its inode number and type, the only attributes FUSE
+passes on from readdir, and the cookie of the next slot (slot + 1), so the
+kernel can resume a listing; ls -l still calls getattr per entry
+stops as soon as filler reports a full buffer
+*****************************************/
+static int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+    TRACE(TR_IO, "readdir %s offset %ld", path, (long)offset);
+    int res = 0;
+
+    // snapshot view, opendir leaves fh at 0 there
+    if ((fi == NULL || fi->fh == 0) && is_snap_path(path))
+        return snap_readdir(path, buf, filler, offset);
+
+    int inode_num = (fi != NULL && fi->fh != 0) ? (int)fi->fh - 1 : path_traversal(path, 0);
+    if (inode_num < 0)
+    {
+        res = (inode_num == -1) ? -ENOENT : inode_num;
+        return res;
+    }
+
+    struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, 0);
+    int slots = inode_ptr->size / sizeof(struct wfs_dentry);
+    struct stat st;
+    memset(&st, 0, sizeof(struct stat));
+
+    for (int slot = offset; slot < slots; slot++)
+    {
+        struct wfs_dentry *dentry_ptr = get_dentry_slot_ptr(inode_num, slot, dentry_disk(inode_num, slot));
+        if (dentry_ptr == NULL)
+        {
+            res = -EIO;
+            return res;
         }
+
+        // skip : tombstoned slot
+        if (dentry_ptr->name[0] == '\0')
+            continue;
+
+        st.st_ino = dentry_ptr->num;
+        st.st_mode = get_inode_ptr(dentry_ptr->num, 0)->mode;
+        if (filler(buf, dentry_ptr->name, &st, slot + 1) != 0)
+            break;
     }
 
-    // loop over the blocks array of the parent
-    // for (int i = 0; i < 7; i++)
-    // {
-    //     int d_block_index = parent_inode_ptr->blocks[i];
-    //     struct wfs_dentry *dentry_ptr = (struct wfs_dentry *)get_d_block_ptr(d_block_index, 0);
-    //     // struct wfs_dentry *last_dentry_ptr = get_dentry_ptr(parent_inode_num, 0, 1);
-
-    //     // loop over all possible dentrys in a d-block
-    //     for(int j=0; j<BLOCK_SIZE/sizeof(struct wfs_dentry); j++)
-    //     {
-    //         struct wfs_dentry *dentry_ptr = (struct wfs_dentry *)get_d_block_ptr(d_block_index, j);
-    //         if(dentry_ptr->num == curr_inode_num)
-    //         {
-    //             for(int k=0; k<cnt_disks; k++)
-    //             {
-    //                 // dentry_ptr = get_dentry_ptr(parent_inode_num, k, j);
-    //                 struct wfs_dentry *last_dentry_ptr = get_dentry_ptr(parent_inode_num, 0, 1);
-    //                 strcpy(dentry_ptr->name, last_dentry_ptr->name);
-    //                 dentry_ptr->num = last_dentry_ptr->num;
-    //                 parent_inode_ptr = get_inode_ptr(parent_inode_num, k);
-    //                 parent_inode_ptr->size -= sizeof(struct wfs_dentry);
-    //             }
-    //             return res;
-    //         }
-    //         dentry_ptr += 1;
-    //     }
-    // }
     return res;
 }
 
-/*******************************
-1. find the data block corresponding to the offset being read from, and
-2. copy data from the data block(s) to the read buffer.
-3. As with writes, reads may be split across data blocks, or span multiple data blocks.
-*******************************/
-static int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+/****************************************
+reports capacity from the superblock free counters, no bitmap scan
+RAID0 sums the per-disk counters, mirrors report one copy
+*****************************************/
+static int wfs_statfs(const char *path, struct statvfs *stbuf)
 {
-    printf("wfs_read called on %s\n", path);
-    printf("offset is %d\n", (int)offset);
+    struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
 
-    int res = 0;
-
-    // check : file exists
-    int curr_inode_num = path_traversal(path, 0);
+    memset(stbuf, 0, sizeof(struct statvfs));
+    stbuf->f_bsize = BLOCK_SIZE;
+    stbuf->f_frsize = BLOCK_SIZE;
+    stbuf->f_namemax = MAX_NAME - 1;
 
-    // check : inode is a regular file
-    struct wfs_inode *inode_ptr = get_inode_ptr(curr_inode_num, 0);
+    stbuf->f_files = sb->num_inodes;
+    stbuf->f_ffree = sb->free_inodes;
+    stbuf->f_favail = sb->free_inodes;
 
-    int size_to_read = inode_ptr->size - offset + 1;
-    if (size < size_to_read)
+    stbuf->f_blocks = sb->num_data_blocks;
+    if (raid_mode == 0)
     {
-        size_to_read = size;
+        stbuf->f_blocks = 0;
+        for (int i = 0; i < cnt_disks; i++)
+            stbuf->f_blocks += disk_data_blocks(i);
     }
 
-    int read_bytes = size_to_read;
+    // blocks reserved by buffered writes count as used
+    stbuf->f_bfree = free_data_blocks_unreserved();
+    stbuf->f_bavail = stbuf->f_bfree;
 
-    // check : offset is greater than size
-    if (offset >= inode_ptr->size)
+    return 0;
+}
+
+/****************************************
+wfs ioctls on open files, see wfs_ioctl.h
+WFS_IOC_CLONE_RANGE stands in for copy_file_range / reflink
+WFS_IOC_DEFRAG reports and defragments the file
+*****************************************/
+static int wfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+    int res = 0;
+
+    struct wfs_handle *handle = get_handle(fi);
+    if (handle == NULL)
     {
-        // return error
-        res = 0;
+        res = -EBADF;
         return res;
     }
 
-    // determine : data block to be written
-    int index_in_blocks = offset / BLOCK_SIZE;
-    int offset_within_block = offset % BLOCK_SIZE;
-
-    int d_block_index = -1;
+    switch ((unsigned int)cmd)
+    {
+    case WFS_IOC_CLONE_RANGE:
+    {
+        struct wfs_clone_range *range = (struct wfs_clone_range *)data;
 
-    // cnt of the number of d-blocks to write
-    int loop_cnt = (offset_within_block + size_to_read + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        // check : snapshot view is read-only
+        if (handle->snap != NULL)
+        {
+            res = -EROFS;
+            return res;
+        }
 
-    printf("Before the main for loop\n");
+        range->src_path[WFS_PATH_MAX - 1] = '\0';
+        struct wfs_inode *src_inode_ptr = resolve_inode(range->src_path, &res);
+        if (src_inode_ptr == NULL)
+            return res;
 
-    // loop for number of pages to be read
-    for (int i = 0; (i < loop_cnt) && (size_to_read > 0); i++)
+        // the clone works on the block maps, so both files go to disk first
+        res = flush_writeback(handle->inode_num);
+        if (res == 0 && get_writeback(src_inode_ptr) != NULL)
+            res = flush_writeback(src_inode_ptr->num);
+        if (res != 0)
+            return res;
+        res = clone_range(src_inode_ptr, range->src_offset, handle->inode_num, range->dst_offset, range->length);
+        return res;
+    }
+    case WFS_IOC_SEEK:
     {
-        if (index_in_blocks < 7)
+        struct wfs_seek *seek = (struct wfs_seek *)data;
+        if (seek->whence != SEEK_DATA && seek->whence != SEEK_HOLE)
         {
-            inode_ptr = get_inode_ptr(curr_inode_num, i % cnt_disks);
-            d_block_index = inode_ptr->blocks[index_in_blocks];
+            res = -EINVAL;
+            return res;
         }
-        else
+        off_t pos = seek_data_hole(handle, get_handle_inode(handle), seek->offset, seek->whence);
+        if (pos < 0)
         {
-            // check if blocks[7] is allocated
-            int indirect_block_index = inode_ptr->blocks[7];
-            // check : indirect block is allocated
-            // if (indirect_block_index == -1)
-            // {
-            // indirect_block_index = allocate_indirect_block(inode_num, 0);
-            if (indirect_block_index == -1)
-            {
-                // return the size of bytes read
-                res = read_bytes;
-                return res;
-            }
-            // }
-            // then find out the correct block in the new page
-            off_t *indirect_block_ptr = (off_t *)get_d_block_ptr(indirect_block_index, 7 % cnt_disks);
-            int index_in_indirect_block = index_in_blocks - 7;
-            d_block_index = indirect_block_ptr[index_in_indirect_block];
+            res = pos;
+            return res;
         }
+        seek->offset = pos;
+        return res;
+    }
+    case WFS_IOC_DEFRAG:
+    {
+        struct wfs_defrag *defrag = (struct wfs_defrag *)data;
 
-        if (d_block_index == -1)
+        // check : snapshot view is read-only
+        if (handle->snap != NULL)
         {
-            // return the size of bytes read
-            res = read_bytes;
+            res = -EROFS;
             return res;
         }
 
-        int read_size = 0;
-        // for (int j = 0; j < cnt_disks; j++)
-        // {
-        // get inode ptr for current disk
-        // inode_ptr = get_inode_ptr(inode_num, j);
-
-        // put the newly allocated data-block into blocks array
-        // inode_ptr->blocks[index_in_blocks] = d_block_index;
-
-        // get pointer to the correct data-block
-        char *d_block_ptr = (char *)get_d_block_ptr(d_block_index, index_in_blocks % cnt_disks);
-        d_block_ptr += offset_within_block;
-
-        // the space in the chosen d-block given it has some data already on it
-        int space_in_d_block = BLOCK_SIZE - offset_within_block;
+        // buffered blocks are placed in runs when they are flushed
+        res = flush_writeback(handle->inode_num);
+        if (res != 0)
+            return res;
+        res = defrag_file(handle->inode_num, defrag);
+        return res;
+    }
+    case WFS_IOC_GROW:
+    {
+        struct wfs_grow *grow = (struct wfs_grow *)data;
+        res = grow_volume(grow->num_inodes, grow->num_data_blocks);
+        struct wfs_sb *sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+        grow->num_inodes = sb->num_inodes;
+        grow->num_data_blocks = sb->num_data_blocks;
+        return res;
+    }
+    case WFS_IOC_SCRUB:
+    {
+        struct wfs_scrub *scrub = (struct wfs_scrub *)data;
 
-        if (size_to_read > space_in_d_block)
+        // check : only mirrors have copies to compare
+        if (raid_mode == 0 || scrub_rate == 0)
         {
-            read_size = space_in_d_block;
+            res = -EOPNOTSUPP;
+            return res;
         }
-        else
+        if (scrub->flags & WFS_SCRUB_START)
         {
-            read_size = size_to_read;
+            scrub_requested = 1;
+            pthread_cond_broadcast(&scrub_cond);
         }
+        *scrub = scrub_stats;
+        scrub->rate = scrub_rate;
+        scrub->running = scrub_stats.running || scrub_requested;
+        return res;
+    }
+    case WFS_IOC_ADD_DISK:
+    {
+        struct wfs_add_disk *add = (struct wfs_add_disk *)data;
+        add->path[WFS_PATH_MAX - 1] = '\0';
+        res = add_disk(add->path);
+        if (res == 0)
+            add->disk_order = cnt_disks - 1;
+        return res;
+    }
+    default:
+        res = -ENOTTY;
+        return res;
+    }
+}
 
-        ///////////////////////////////
-        // RAID1v
-        //////////////////////////////
-        int disk_num = 0;
-        if (raid_mode == 2)
-        {
-            disk_num = get_correct_disk_num(d_block_index, read_bytes);
-            d_block_ptr = get_d_block_ptr(d_block_index, disk_num);
-        }
-        memcpy(buf, d_block_ptr, read_size);
+// called once FUSE is up (after daemonizing), starts the helper threads
+static void *wfs_init(struct fuse_conn_info *conn)
+{
+    pthread_t tid;
+
+    trace_start_dumper();
+    if (pthread_create(&tid, NULL, compaction_worker, NULL) == 0)
+        pthread_detach(tid);
+    if (resync_source != -1 && pthread_create(&tid, NULL, resync_worker, NULL) == 0)
+        pthread_detach(tid);
+    if (reshape_old_disks > 0 && pthread_create(&tid, NULL, reshape_worker, NULL) == 0)
+        pthread_detach(tid);
+    if (raid_mode != 0 && scrub_rate > 0 && pthread_create(&tid, NULL, scrub_worker, NULL) == 0)
+        pthread_detach(tid);
+    if (use_io_uring && pthread_create(&tid, NULL, flush_worker, NULL) == 0)
+        pthread_detach(tid);
+    return NULL;
+}
 
-        // // austin
-        // offset_within_block = 0;
-        // if (wrote_on_a_new_block)
-        // {
-        //     inode_ptr->size += write_size;
-        // }
-        // }
-        // if(wrote_on_a_new_block)
-        // {
-        //     ino
-        // }
-        buf += read_size;
-        size_to_read = size_to_read - read_size;
-        index_in_blocks++;
+// called on unmount, stops the background threads from touching the disks
+static void wfs_destroy(void *private_data)
+{
+    pthread_mutex_lock(&wfs_lock);
+    flush_all_writeback();
+    drain_mirror_writes();
+    flush_disks();
+    shutting_down = 1;
+    pthread_cond_broadcast(&compact_cond);
+    pthread_cond_broadcast(&flush_cond);
+    pthread_cond_broadcast(&scrub_cond);
+    pthread_mutex_lock(&qos_lock);
+    pthread_cond_broadcast(&qos_cond);
+    pthread_mutex_unlock(&qos_lock);
+    pthread_mutex_lock(&mirror_lock);
+    pthread_cond_broadcast(&mirror_work);
+    pthread_mutex_unlock(&mirror_lock);
+    pthread_mutex_unlock(&wfs_lock);
+}
 
-        // austin
-        offset_within_block = 0;
-    }
+// ###################################### locked entry points ######################################
 
-    printf("after the main for loop\n");
-    res = read_bytes;
+/*
+  FUSE callbacks run under wfs_lock so the background threads
+  never see a half-done operation.
+*/
+
+static int locked_getattr(const char *path, struct stat *stbuf)
+{
+    struct timespec start = fg_lock();
+    int res = wfs_getattr(path, stbuf);
+    fg_unlock(start);
     return res;
 }
 
-static int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+static int locked_mknod(const char *path, mode_t mode, dev_t rdev)
 {
-    printf("wfs_readdir called on %s\n", path);
-    int res = 0;
+    struct timespec start = fg_lock();
+    drain_mirror_writes();
+    int res = wfs_mknod(path, mode, rdev);
+    fg_unlock(start);
+    return res;
+}
 
-    int inode_num = path_traversal(path, 0);
+static int locked_mkdir(const char *path, mode_t mode)
+{
+    struct timespec start = fg_lock();
+    drain_mirror_writes();
+    int res = wfs_mkdir(path, mode);
+    fg_unlock(start);
+    return res;
+}
 
-    struct wfs_inode *inode_ptr = get_inode_ptr(inode_num, 0);
-    int size_read = 0;
+static int locked_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct timespec start = fg_lock();
+    int res = wfs_write(path, buf, size, offset, fi);
+    fg_unlock(start);
+    return res;
+}
 
-    for (int i = 0; i < 7; i++)
-    {
-        int d_block_index = inode_ptr->blocks[i];
-        if (d_block_index == -1)
-            break;
+static int locked_unlink(const char *path)
+{
+    struct timespec start = fg_lock();
+    drain_mirror_writes();
+    int res = wfs_unlink(path);
+    fg_unlock(start);
+    return res;
+}
 
-        int disk_num = i % cnt_disks;
-
-        ///////////////////////////////
-        // RAID1v
-        //////////////////////////////
-        // if(raid_mode == 2)
-        // {
-        //     disk_num = get_correct_disk_num(d_block_index, BLOCK_SIZE);
-        //     // d_block_ptr = get_d_block_ptr(d_block_index, disk_num);
-        
-        // }
-        struct wfs_dentry *d_block_ptr = (struct wfs_dentry *)get_d_block_ptr(d_block_index, disk_num);
-        for (int j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++)
-        {
-            if (size_read == inode_ptr->size)
-            {
-                // exit
-                return res;
-            }
-            filler(buf, d_block_ptr->name, NULL, 0);
-            d_block_ptr += 1;
-            size_read += sizeof(struct wfs_dentry);
-        }
-    }
+static int locked_rmdir(const char *path)
+{
+    struct timespec start = fg_lock();
+    drain_mirror_writes();
+    int res = wfs_rmdir(path);
+    fg_unlock(start);
+    return res;
+}
+
+static int locked_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct timespec start = fg_lock();
+    int res = wfs_read(path, buf, size, offset, fi);
+    fg_unlock(start);
+    return res;
+}
+
+static int locked_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+    struct timespec start = fg_lock();
+    int res = wfs_readdir(path, buf, filler, offset, fi);
+    fg_unlock(start);
+    return res;
+}
 
+static int locked_open(const char *path, struct fuse_file_info *fi)
+{
+    struct timespec start = fg_lock();
+    int res = wfs_open(path, fi);
+    fg_unlock(start);
+    return res;
+}
+
+static int locked_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    struct timespec start = fg_lock();
+    drain_mirror_writes();
+    int res = wfs_create(path, mode, fi);
+    fg_unlock(start);
+    return res;
+}
+
+static int locked_release(const char *path, struct fuse_file_info *fi)
+{
+    struct timespec start = fg_lock();
+    int res = wfs_release(path, fi);
+    fg_unlock(start);
+    return res;
+}
+
+static int locked_flush(const char *path, struct fuse_file_info *fi)
+{
+    struct timespec start = fg_lock();
+    int res = wfs_flush(path, fi);
+    fg_unlock(start);
+    return res;
+}
+
+static int locked_truncate(const char *path, off_t size)
+{
+    struct timespec start = fg_lock();
+    drain_mirror_writes();
+    int res = wfs_truncate(path, size);
+    fg_unlock(start);
+    return res;
+}
+
+static int locked_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    struct timespec start = fg_lock();
+    drain_mirror_writes();
+    int res = wfs_ftruncate(path, size, fi);
+    fg_unlock(start);
+    return res;
+}
+
+static int locked_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    struct timespec start = fg_lock();
+    drain_mirror_writes();
+    int res = wfs_fsync(path, datasync, fi);
+    fg_unlock(start);
+    return res;
+}
+
+static int locked_opendir(const char *path, struct fuse_file_info *fi)
+{
+    struct timespec start = fg_lock();
+    int res = wfs_opendir(path, fi);
+    fg_unlock(start);
+    return res;
+}
+
+static int locked_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    struct timespec start = fg_lock();
+    int res = wfs_releasedir(path, fi);
+    fg_unlock(start);
+    return res;
+}
+
+static int locked_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+    struct timespec start = fg_lock();
+    drain_mirror_writes();
+    int res = wfs_ioctl(path, cmd, arg, fi, flags, data);
+    fg_unlock(start);
+    return res;
+}
+
+static int locked_statfs(const char *path, struct statvfs *stbuf)
+{
+    struct timespec start = fg_lock();
+    int res = wfs_statfs(path, stbuf);
+    fg_unlock(start);
     return res;
 }
 
 static struct fuse_operations ops = {
-    .getattr = wfs_getattr,
-    .mknod = wfs_mknod,
-    .mkdir = wfs_mkdir,
-    .write = wfs_write,
-    .unlink = wfs_unlink,
-    .rmdir = wfs_rmdir,
-    .read = wfs_read,
-    .readdir = wfs_readdir,
+    .init = wfs_init,
+    .destroy = wfs_destroy,
+    .getattr = locked_getattr,
+    .mknod = locked_mknod,
+    .mkdir = locked_mkdir,
+    .create = locked_create,
+    .open = locked_open,
+    .release = locked_release,
+    .flush = locked_flush,
+    .fsync = locked_fsync,
+    .truncate = locked_truncate,
+    .ftruncate = locked_ftruncate,
+    .write = locked_write,
+    .unlink = locked_unlink,
+    .rmdir = locked_rmdir,
+    .read = locked_read,
+    .opendir = locked_opendir,
+    .readdir = locked_readdir,
+    .releasedir = locked_releasedir,
+    .statfs = locked_statfs,
+    .ioctl = locked_ioctl,
 };
 
+// prints the command line, on an unknown option or when no disk is given
+void print_usage()
+{
+    printf("Usage: ./wfs disk1 [disk2 ...] [options] [FUSE options] mount_point\n"
+           "  --compress                  compress file data in clusters\n"
+           "  --io-uring                  keep the disks in memory and write them back with io_uring\n"
+           "                              every %d s, on fsync and at unmount: a crash loses up to\n"
+           "                              %d s of writes that were already acknowledged\n"
+           "  --cache-size=N              MiB of data blocks --io-uring keeps in memory (default %d)\n"
+           "  --mirror-quorum=N|majority  disks a mirror write reaches before it returns (default all)\n"
+           "  --scrub-rate=N              KiB/s the background scrub reads, 0 : off (default %d)\n"
+           "  --rebuild-rate=N            KiB/s a resync or reshape copies, 0 : unlimited (default)\n"
+           "  --qos-latency=N             callback latency in microseconds the background work\n"
+           "                              backs off above (default %d)\n",
+           FLUSH_INTERVAL, FLUSH_INTERVAL, URING_CACHE_SIZE / (1024 * 1024), scrub_rate, qos_target_us);
+}
+
 int main(int argc, char *argv[])
 {
     // ###################################### parse command line arguments ######################################
@@ -1849,14 +6767,20 @@ int main(int argc, char *argv[])
     // int cnt_data_blocks = 0;
     // int cnt_inodes = 0;
     // int cnt_disks = 0;
-    int disk_size = 0;
-    char *disk_name[10] = {NULL};
-    void *disk_mmap_ptr[10] = {NULL};
-    int disk_fd[10] = {0};
+    off_t disk_size[MAX_DISKS] = {0};
+    char *disk_name[MAX_DISKS] = {NULL};
+    void *disk_mmap_ptr[MAX_DISKS] = {NULL};
+    int disk_fd[MAX_DISKS] = {0};
 
     // assuming the order is maintained in the cmd-line args
-    // ./wfs disk1 disk2 [FUSE options] mount_point
+    // ./wfs disk1 disk2 [--compress] [--io-uring] [--cache-size=N] [--mirror-quorum=N|majority] [--scrub-rate=N]
+    //        [--rebuild-rate=N] [--qos-latency=N]
+    //        [FUSE options] mount_point
     int fuse_options_flag = 0; // flag indicates FUSE options have been parsed
+    int cnt_wfs_options = 0;
+
+    // tracing is off unless WFS_TRACE names subsystems to record
+    trace_init();
 
     for (int i = 0; i < argc; i++)
     {
@@ -1865,70 +6789,238 @@ int main(int argc, char *argv[])
             fuse_options_flag = 1;
         }
 
-        if (fuse_options_flag == 0 && i != 0)
+        // wfs options start with "--" and sit before the FUSE options
+        if (fuse_options_flag == 0 && i != 0 && strncmp(argv[i], "--", 2) == 0)
+        {
+            if (strcmp(argv[i], "--compress") == 0)
+                compress_writes = 1;
+            else if (strcmp(argv[i], "--io-uring") == 0)
+                use_io_uring = 1;
+            else if (strncmp(argv[i], "--cache-size=", 13) == 0)
+            {
+                int cache_size = atoi(argv[i] + 13);
+                if (cache_size < 1)
+                {
+                    printf("Error: --cache-size needs a size in MiB.\n");
+                    return -1;
+                }
+                uring_set_cache_size((size_t)cache_size * 1024 * 1024);
+            }
+            else if (strncmp(argv[i], "--scrub-rate=", 13) == 0)
+            {
+                scrub_rate = atoi(argv[i] + 13);
+                if (scrub_rate < 0)
+                {
+                    printf("Error: --scrub-rate needs a rate in KiB/s, 0 turns scrubbing off.\n");
+                    return -1;
+                }
+            }
+            else if (strncmp(argv[i], "--rebuild-rate=", 15) == 0)
+            {
+                rebuild_rate = atoi(argv[i] + 15);
+                if (rebuild_rate < 0)
+                {
+                    printf("Error: --rebuild-rate needs a rate in KiB/s, 0 : unlimited.\n");
+                    return -1;
+                }
+            }
+            else if (strncmp(argv[i], "--qos-latency=", 14) == 0)
+            {
+                qos_target_us = atoi(argv[i] + 14);
+                if (qos_target_us < 1)
+                {
+                    printf("Error: --qos-latency needs a latency in microseconds.\n");
+                    return -1;
+                }
+            }
+            else if (strcmp(argv[i], "--mirror-quorum=majority") == 0)
+                mirror_quorum = MIRROR_QUORUM_MAJORITY;
+            else if (strncmp(argv[i], "--mirror-quorum=", 16) == 0)
+            {
+                mirror_quorum = atoi(argv[i] + 16);
+                if (mirror_quorum < 1)
+                {
+                    printf("Error: --mirror-quorum needs at least 1 disk.\n");
+                    return -1;
+                }
+            }
+            else
+            {
+                printf("Error: unknown option %s.\n", argv[i]);
+                print_usage();
+                return -1;
+            }
+            cnt_wfs_options++;
+        }
+        else if (fuse_options_flag == 0 && i != 0)
         {
+            if (cnt_disks == MAX_DISKS)
+            {
+                printf("Error: too many disks.\n");
+                return -1;
+            }
             disk_name[cnt_disks] = argv[i];
-            printf("%s\n", disk_name[cnt_disks]);
+            TRACE(TR_RAID, "disk %d: %s", cnt_disks, disk_name[cnt_disks]);
             cnt_disks++;
         }
     }
 
+    qos_set_rate(QOS_REBUILD, rebuild_rate);
+    qos_set_rate(QOS_SCRUB, scrub_rate);
+    qos_set_rate(QOS_COMPACT, QOS_COMPACT_RATE);
+    qos_set_rate(QOS_FLUSH, 0);
+
     // #################################### Validate the cmd line args ####################################
 
     if (cnt_disks == 0)
     {
+        print_usage();
         return -1;
     }
 
-    struct stat file_stat;
-    // long disk_size = 0;
-    if (stat(disk_name[0], &file_stat) == 0)
+    // --------------------------------- mmap disks & reorder them ---------------------------------
+
+    create_disk_mmap(disk_name, cnt_disks, disk_mmap_ptr, disk_size, disk_fd);
+    for (int i = 0; use_io_uring && i < cnt_disks; i++)
     {
-        disk_size = file_stat.st_size;
+        if (disk_mmap_ptr[i] == NULL)
+        {
+            printf("Error: cannot read %s: %s.\n", disk_name[i], strerror(errno));
+            remove_disk_mmap(cnt_disks, disk_size, disk_fd, disk_mmap_ptr);
+            return -1;
+        }
     }
-    else
+
+    // check : the extended superblock on every disk but blank ones, the original layout keeps its inode bitmap there
+    for (int i = 0; i < cnt_disks; i++)
     {
-        perror("stat");
+        struct wfs_sb *disk_sb = (struct wfs_sb *)disk_mmap_ptr[i];
+        if (disk_sb->total_disks == 0)
+            continue;
+        if (disk_sb->magic != WFS_MAGIC)
+        {
+            printf("Error: %s has the original wfs layout, upgrade it with wfs-convert -u first.\n", disk_name[i]);
+            remove_disk_mmap(cnt_disks, disk_size, disk_fd, disk_mmap_ptr);
+            return -1;
+        }
+        if (disk_sb->version != WFS_VERSION)
+        {
+            printf("Error: %s has layout version %d, this wfs reads version %d.\n", disk_name[i], disk_sb->version, WFS_VERSION);
+            remove_disk_mmap(cnt_disks, disk_size, disk_fd, disk_mmap_ptr);
+            return -1;
+        }
+        if (disk_sb->cnt_groups < 1 || disk_sb->cnt_groups > disk_sb->num_inodes / 32 ||
+            disk_sb->cnt_groups > disk_sb->num_data_blocks / 32)
+        {
+            printf("Error: %s has an invalid number of allocation groups (%d).\n", disk_name[i], disk_sb->cnt_groups);
+            remove_disk_mmap(cnt_disks, disk_size, disk_fd, disk_mmap_ptr);
+            return -1;
+        }
+        if (disk_sb->inode_copies < 0 || disk_sb->inode_copies > disk_sb->total_disks ||
+            (disk_sb->raid_mode != 0 && disk_sb->inode_copies != 0))
+        {
+            printf("Error: %s has an invalid number of inode copies (%d).\n", disk_name[i], disk_sb->inode_copies);
+            remove_disk_mmap(cnt_disks, disk_size, disk_fd, disk_mmap_ptr);
+            return -1;
+        }
+        if (disk_sb->cnt_meta_disks < 0 || disk_sb->cnt_meta_disks >= disk_sb->total_disks ||
+            (disk_sb->raid_mode != 0 && disk_sb->cnt_meta_disks != 0) ||
+            (disk_sb->cnt_meta_disks > 0 && disk_sb->inode_copies != disk_sb->cnt_meta_disks))
+        {
+            printf("Error: %s has an invalid number of metadata disks (%d).\n", disk_name[i], disk_sb->cnt_meta_disks);
+            remove_disk_mmap(cnt_disks, disk_size, disk_fd, disk_mmap_ptr);
+            return -1;
+        }
+        int res = pin_disk_metadata(disk_mmap_ptr[i], disk_sb);
+        if (res != 0)
+        {
+            printf("Error: cannot read %s: %s.\n", disk_name[i], strerror(-res));
+            remove_disk_mmap(cnt_disks, disk_size, disk_fd, disk_mmap_ptr);
+            return -1;
+        }
     }
 
-    // --------------------------------- mmap disks & reorder them ---------------------------------
-
-    create_disk_mmap(disk_name, cnt_disks, disk_mmap_ptr, disk_size, disk_fd);
-
+    // mirrors can mount with disks missing (degraded) or replaced by blank images
+    int cnt_disk_args = cnt_disks;
+    grow_disk_table(cnt_disks);
     struct wfs_sb *sb = (struct wfs_sb *)disk_mmap_ptr[0];
-    if (sb->total_disks != cnt_disks)
+    for (int i = 0; i < cnt_disk_args && sb->total_disks == 0; i++)
+        sb = (struct wfs_sb *)disk_mmap_ptr[i];
+    if (sb->raid_mode != 0 && sb->total_disks > 0)
+    {
+        if (assemble_mirrors(cnt_disk_args, disk_mmap_ptr, disk_size) == -1)
+        {
+            remove_disk_mmap(cnt_disk_args, disk_size, disk_fd, disk_mmap_ptr);
+            return -1;
+        }
+    }
+    else if (sb->total_disks != cnt_disks)
     {
         printf("Error: not enough disks.\n");
         remove_disk_mmap(cnt_disks, disk_size, disk_fd, disk_mmap_ptr);
         return -1;
     }
-    raid_mode = sb->raid_mode;
-    reorder_disk_mmap(cnt_disks, disk_mmap_ptr, ordered_disk_mmap_ptr);
+    else
+    {
+        reorder_disk_mmap(cnt_disks, disk_mmap_ptr, ordered_disk_mmap_ptr);
+    }
+    sb = (struct wfs_sb *)ordered_disk_mmap_ptr[0];
+
+    // the image files stay open, a grown image is mapped again
+    for (int i = 0; i < cnt_disks; i++)
+    {
+        for (int j = 0; j < cnt_disk_args; j++)
+        {
+            if (disk_mmap_ptr[j] == ordered_disk_mmap_ptr[i])
+            {
+                ordered_disk_fd[i] = disk_fd[j];
+                ordered_disk_size[i] = disk_size[j];
+            }
+        }
+    }
 
     raid_mode = get_raid_mode(ordered_disk_mmap_ptr[0]);
+    cnt_groups = sb->cnt_groups;
+    cnt_inode_copies = (sb->inode_copies > 0) ? sb->inode_copies : cnt_disks;
+    cnt_meta_disks = sb->cnt_meta_disks;
+    if (cnt_meta_disks > 0)
+        cnt_inode_copies = cnt_meta_disks;
+    reshape_old_disks = (raid_mode == 0) ? sb->reshape_old_disks : 0;
+    reshape_inode = sb->reshape_inode;
+    build_stripe_patterns();
+    verify_free_counters();
+    if (load_snapshots() != 0)
+    {
+        printf("Error: cannot read the snapshots and block maps.\n");
+        remove_disk_mmap(cnt_disk_args, disk_size, disk_fd, disk_mmap_ptr);
+        return -1;
+    }
+    dir_maps = calloc(sb->num_inodes, sizeof(struct dir_slot_map *));
+    dir_open_cnt = calloc(sb->num_inodes, sizeof(int));
+    file_open_cnt = calloc(sb->num_inodes, sizeof(int));
+    block_map_gen = calloc(sb->num_inodes, sizeof(unsigned long));
+    wb_bufs = calloc(sb->num_inodes, sizeof(struct writeback_buf *));
+    preallocs = calloc(sb->num_inodes, sizeof(struct prealloc *));
+    for (int i = 0; i < cnt_disks; i++)
+        pa_reserved[i] = calloc(sb->num_data_blocks / 32, sizeof(__u_int));
+    reclaim_orphans();
 
     // #################################### modify argc & argv ########################################
 
     // decrement argc
-    argc = argc - cnt_disks - 1;
+    argc = argc - cnt_disk_args - cnt_wfs_options - 1;
     // printf("%d\n", argc);
 
     // increment argv
-    for (int i = 0; i < (cnt_disks + 1); i++)
+    for (int i = 0; i < (cnt_disk_args + cnt_wfs_options + 1); i++)
     {
         argv++;
     }
 
-    for (int i = 0; i < argc; i++)
-    {
-        printf("%s\n", argv[i]);
-    }
-
     // return 0;
 
     // ######################################## call fuse_main ########################################
 
-    printf("started\n");
     // Initialize FUSE with specified operations
     // Filter argc and argv here and then pass it to fuse_main
     return fuse_main(argc, argv, &ops, NULL);
@@ -21,8 +21,55 @@
 0    ^                   ^
 i_bitmap_ptr        i_blocks_ptr
 
+  The superblock of the original layout ended at total_disks and its
+  inode bitmap started right after it. Every field past total_disks is
+  only valid when magic holds WFS_MAGIC (it sits in the padding the
+  original superblock left zero) and version is WFS_VERSION; wfs refuses
+  other images and wfs-convert -u moves an original volume's bitmaps out
+  of the way of the extended superblock.
+
+  Allocation groups split both bitmaps into cnt_groups runs of whole
+  bitmap words; group g owns the inodes and data blocks its words cover.
+  Groups only steer allocation, the layout above stays the same.
+
+  In RAID0 an inode can be kept on fewer than all disks (inode_copies):
+  inode n lives on its home disk n % total_disks and the inode_copies - 1
+  disks after it. Its slot on the other disks is left unused. The inode
+  bitmap is still kept on every disk and tells which inodes exist.
+
+  RAID0 can also reserve its first cnt_meta_disks disks for metadata:
+  they hold every inode, the directory blocks and the indirect blocks,
+  and file data goes to the other disks only. Every disk keeps the full
+  layout; the regions a disk does not use stay empty.
+
+  A mirror mounted with disks missing records them in missing_disks and
+  marks each data region it writes in wi_bitmap (the data blocks split
+  into WI_REGIONS equal runs), so a returning disk only needs those
+  regions and the metadata copied back. Writes that return before every
+  mirror holds them are logged the same way until the disks catch up.
+
+  Disks can be added to a mounted volume. A RAID0 volume is then
+  restriped inode by inode in the background; reshape_old_disks is the
+  disk count before the addition and every inode below reshape_inode is
+  striped over all disks already.
+
+  RAID0 disks can differ in size. num_data_blocks and the layout are
+  those of the largest disk; a smaller disk only uses its first
+  disk_blocks data blocks and keeps the rest marked used in its data
+  bitmap. File blocks are striped in proportion to disk_blocks.
 */
 
+// identifies the extended superblock, and the version of its layout
+#define WFS_MAGIC   (0x32534657)   // "WFS2"
+#define WFS_VERSION (1)
+
+// disks a volume can grow to, one bit each in missing_disks
+#define MAX_DISKS (32)
+
+// write-intent bitmap, one bit per region of the data blocks
+#define WI_BITMAP_WORDS (32)
+#define WI_REGIONS      (WI_BITMAP_WORDS * 32)
+
 // Superblock
 struct wfs_sb {
     size_t num_inodes;
@@ -36,6 +83,27 @@ struct wfs_sb {
     int raid_mode;
     int disk_order;   // disk order for RAID0
     int total_disks;
+
+    unsigned int magic;       // WFS_MAGIC, 0 on images of the original layout
+    int version;              // WFS_VERSION, the fields below are only read when both match
+
+    size_t free_inodes;       // unset bits in the inode bitmap
+    size_t free_data_blocks;  // unset bits in this disk's data bitmap
+
+    off_t snap_head;          // d-block of the newest snapshot header, -1 if none
+
+    int cnt_groups;           // allocation groups the bitmaps are split into, at least 1
+
+    int inode_copies;         // RAID0 : disks each inode is stored on, 0 : every disk
+    int cnt_meta_disks;       // RAID0 : leading disks holding only metadata, 0 : none
+
+    int missing_disks;        // mirrors : bit per disk_order not up to date since a degraded mount
+    unsigned int wi_bitmap[WI_BITMAP_WORDS];  // mirrors : data regions written while disks were missing
+
+    int reshape_old_disks;    // RAID0 : disks before the addition being restriped, 0 : no reshape
+    int reshape_inode;        // RAID0 : inodes below this one are restriped
+
+    int disk_blocks;          // RAID0 : data blocks this disk holds, 0 : num_data_blocks
 };
 
 // Inode
@@ -59,3 +127,43 @@ struct wfs_dentry {
     char name[MAX_NAME];        /* File/Directory Name */ 
     int num;                    /* Inode number */
 };
+
+/*
+  Snapshots freeze the inode table: each one is a header block chained
+  from sb->snap_head and a chain of table blocks holding copies of every
+  inode allocated when it was taken. Snapshot blocks are metadata and sit
+  at the same index on every disk. Data blocks are shared with the live
+  tree and only copied when the live tree writes to them.
+*/
+
+// Snapshot header
+struct wfs_snap {
+    char name[MAX_NAME];        /* Name under /.snapshots */
+    time_t ctim;                /* Time the snapshot was taken */
+    int cnt_inodes;             /* Inode copies in the table */
+    off_t table;                /* First table block, -1 if none */
+    off_t next;                 /* Next (older) snapshot header, -1 if last */
+};
+
+#define SNAP_INODES_PER_BLOCK ((BLOCK_SIZE - sizeof(off_t)) / sizeof(struct wfs_inode))
+
+// Snapshot table block
+struct wfs_snap_table {
+    struct wfs_inode inodes[SNAP_INODES_PER_BLOCK];
+    off_t next;                 /* Next table block, -1 if last */
+};
+
+/*
+  Compressed files store their data in clusters of 4 blocks. A cluster
+  that compresses into fewer blocks is one extent in its first blocks,
+  starting with this header; the cluster's remaining block pointers
+  hold -2. Clusters that do not shrink are stored raw.
+*/
+
+#define WFS_CMP_MAGIC (0x5a43)
+
+// Compressed extent header
+struct wfs_cmp_extent {
+    unsigned short magic;       /* WFS_CMP_MAGIC */
+    unsigned short len;         /* Compressed bytes following the header */
+};
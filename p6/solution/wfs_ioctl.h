@@ -0,0 +1,91 @@
+#ifndef WFS_IOCTL_H
+#define WFS_IOCTL_H
+
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+/*
+  ioctls understood by files in a mounted wfs.
+  FUSE 2 has no copy_file_range, reflink or lseek operation,
+  so server-side copies and hole lookups are requested through these,
+  as are online defragmentation, disk addition, growing and scrubbing.
+*/
+
+#define WFS_PATH_MAX (256)
+
+// clones a byte range of another file into the file the ioctl is issued on
+struct wfs_clone_range {
+    char src_path[WFS_PATH_MAX];  /* Source path inside the mount, may be under /.snapshots */
+    off_t src_offset;
+    off_t dst_offset;
+    off_t length;                 /* 0 : up to the end of the source */
+};
+
+#define WFS_IOC_CLONE_RANGE _IOW('W', 1, struct wfs_clone_range)
+
+#ifndef SEEK_DATA
+#define SEEK_DATA (3)
+#define SEEK_HOLE (4)
+#endif
+
+// lseek(SEEK_DATA / SEEK_HOLE) on the file, FUSE 2 does not forward lseek
+struct wfs_seek {
+    off_t offset;                 /* In : where to start, out : the data or hole found */
+    int whence;                   /* SEEK_DATA or SEEK_HOLE */
+};
+
+#define WFS_IOC_SEEK _IOWR('W', 2, struct wfs_seek)
+
+#define WFS_DEFRAG_REPORT (1 << 0)
+
+/*
+  fragmentation of the file and, unless WFS_DEFRAG_REPORT is set, its defragmentation
+  score : 0 every disk holds the file's blocks in one run, 100 no two of them are adjacent
+*/
+struct wfs_defrag {
+    int flags;                    /* In : WFS_DEFRAG_REPORT only reports */
+    int cnt_blocks;               /* Out : data blocks the file holds */
+    int cnt_extents;              /* Out : runs of adjacent blocks before */
+    int score;                    /* Out : score before */
+    int cnt_moved;                /* Out : blocks relocated */
+    int new_cnt_extents;          /* Out : runs after */
+    int new_score;                /* Out : score after */
+};
+
+#define WFS_IOC_DEFRAG _IOWR('W', 3, struct wfs_defrag)
+
+// adds a blank disk image to the mounted volume, the file the ioctl is issued on can be any
+struct wfs_add_disk {
+    char path[WFS_PATH_MAX];      /* In : absolute path of the image, as large as the other disks */
+    int disk_order;               /* Out : order of the new disk */
+};
+
+#define WFS_IOC_ADD_DISK _IOWR('W', 4, struct wfs_add_disk)
+
+// grows the mounted volume after its image files were enlarged
+struct wfs_grow {
+    size_t num_inodes;            /* In : new inode count, 0 unchanged, out : the count after */
+    size_t num_data_blocks;       /* In : new data blocks per disk, 0 unchanged, out : the count after */
+};
+
+#define WFS_IOC_GROW _IOWR('W', 5, struct wfs_grow)
+
+#define WFS_SCRUB_START (1 << 0)
+
+// progress of the background scrub of a mirror, positions count inodes then data blocks
+struct wfs_scrub {
+    int flags;                    /* In : WFS_SCRUB_START starts a pass now */
+    int rate;                     /* Out : pacing in KiB/s */
+    int running;                  /* Out : 1 while a pass is under way */
+    int cnt_passes;               /* Out : passes completed since mount */
+    size_t cursor;                /* Out : positions covered by the current or last pass */
+    size_t total;                 /* Out : positions in a pass */
+    size_t cnt_scrubbed;          /* Out : allocated inodes and blocks compared since mount */
+    size_t cnt_repaired;          /* Out : copies rewritten from the majority */
+    size_t cnt_conflicts;         /* Out : inodes and blocks whose copies have no majority */
+    time_t last_pass;             /* Out : end of the last complete pass, 0 : none */
+};
+
+#define WFS_IOC_SCRUB _IOWR('W', 6, struct wfs_scrub)
+
+#endif
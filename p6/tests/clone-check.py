@@ -0,0 +1,50 @@
+#!/usr/bin/python3
+
+# wfs-clone shares the blocks of the source instead of copying them,
+# a write to the clone copies the block it lands in first
+
+import os
+import subprocess
+
+data = os.urandom(2048)
+newdata = os.urandom(100)
+
+def free_blocks():
+    return os.statvfs("mnt").f_bfree
+
+with open("mnt/file1", "wb") as f:
+    f.write(data)
+
+blocks = free_blocks()
+clone = subprocess.run(["../solution/wfs-clone", "mnt", "/file1", "file2"])
+if clone.returncode != 0:
+    exit(1)
+
+if free_blocks() != blocks:
+    print(f"free blocks {free_blocks()} expected {blocks}: clone copied blocks")
+    exit(1)
+
+with open("mnt/file2", "rb") as f:
+    if f.read() != data:
+        print("file2 does not match the file it was cloned from")
+        exit(1)
+
+with open("mnt/file2", "r+b") as f:
+    f.write(newdata)
+
+if free_blocks() != blocks - 1:
+    print(f"free blocks {free_blocks()} expected {blocks - 1}: write to a shared block")
+    exit(1)
+
+with open("mnt/file1", "rb") as f:
+    if f.read() != data:
+        print("file1 changed with its clone")
+        exit(1)
+
+with open("mnt/file2", "rb") as f:
+    if f.read() != newdata + data[100:]:
+        print("file2 readback does not match data written")
+        exit(1)
+
+print("Correct")
+exit(0)
@@ -0,0 +1,60 @@
+#!/usr/bin/python3
+
+# a write to a block shared with a clone needs a new block for the copy,
+# on a full disk the write or the close must fail and the clone keep its
+# old contents, the data must not be dropped silently at write-back
+
+import errno
+import os
+import subprocess
+
+data = os.urandom(2048)
+newdata = os.urandom(100)
+
+with open("mnt/file1", "wb") as f:
+    f.write(data)
+
+clone = subprocess.run(["../solution/wfs-clone", "mnt", "/file1", "file2"])
+if clone.returncode != 0:
+    exit(1)
+
+# fill the disk, a file holds at most 71 blocks
+fills = []
+full = False
+while not full:
+    name = f"mnt/fill{len(fills)}"
+    fills.append(name)
+    fd = os.open(name, os.O_WRONLY | os.O_CREAT)
+    try:
+        while True:
+            os.write(fd, bytes(512))
+    except OSError as e:
+        full = e.errno == errno.ENOSPC
+    try:
+        os.close(fd)
+    except OSError:
+        pass
+
+err = 0
+try:
+    fd = os.open("mnt/file2", os.O_WRONLY)
+    try:
+        os.write(fd, newdata)
+    finally:
+        os.close(fd)
+except OSError as e:
+    err = e.errno
+
+if err != errno.ENOSPC:
+    print(f"write to a shared block on a full disk returned {os.strerror(err) if err else 'success'}, expected ENOSPC")
+    exit(1)
+
+for name in fills:
+    os.unlink(name)
+
+with open("mnt/file2", "rb") as f:
+    if f.read() != data:
+        print("file2 changed by a write that failed")
+        exit(1)
+
+print("Correct")
@@ -0,0 +1,37 @@
+#!/usr/bin/python3
+
+# usage: compress-check.py write|read
+# write: on a --compress mount, a compressible file takes fewer blocks
+#        than its raw size, an incompressible one is stored raw
+# read: both files read back, also on a mount without --compress
+
+import os
+import random
+import sys
+
+compressible = (b"wfs compresses clusters " * 334)[:8000]
+rng = random.Random(7)
+incompressible = bytes(rng.getrandbits(8) for _ in range(3000))
+
+os.chdir("mnt")
+
+if sys.argv[1] == "write":
+    blocks = os.statvfs(".").f_bfree
+    with open("file1", "wb") as f:
+        f.write(compressible)
+    used = blocks - os.statvfs(".").f_bfree
+    if used >= len(compressible) // 512:
+        print(f"file1 takes {used} blocks, expected fewer than {len(compressible) // 512}")
+        exit(1)
+
+    with open("file2", "wb") as f:
+        f.write(incompressible)
+
+for (name, data) in [("file1", compressible), ("file2", incompressible)]:
+    with open(name, "rb") as file:
+        if file.read() != data:
+            print(f"{name} readback does not match data written")
+            exit(1)
+
+print("Correct")
+exit(0)
@@ -0,0 +1,41 @@
+#!/usr/bin/python3
+
+# removing entries tombstones their slots, a sparse directory is compacted
+# in the background and gives back its second dentry block
+# expects file1 .. file20 in mnt, file20 in the first slot
+
+import os
+import time
+
+def free_blocks():
+    return os.statvfs("mnt").f_bfree
+
+blocks = free_blocks()
+
+# empty the first 15 slots, the live entries stay at the end
+for n in range(20, 5, -1):
+    os.remove(f"mnt/file{n}")
+
+# compaction runs on its own thread, give it a few seconds
+for tries in range(100):
+    if free_blocks() == blocks + 1:
+        break
+    time.sleep(0.1)
+
+if free_blocks() != blocks + 1:
+    print(f"free blocks {free_blocks()} expected {blocks + 1}: directory not compacted")
+    exit(1)
+
+filelist = ["file" + str(n + 1) for n in range(5)]
+if sorted(os.listdir("mnt")) != sorted(filelist):
+    print("readdir files don't match expectation")
+    exit(1)
+
+# a new entry reuses a free slot of the first block
+os.mknod("mnt/file6")
+if free_blocks() != blocks + 1:
+    print(f"free blocks {free_blocks()} expected {blocks + 1}: new entry took a block")
+    exit(1)
+
+print("Correct")
+exit(0)
@@ -212,16 +212,18 @@ FS-STATE the state of the filesystem."
 	num
       (+ num (- k remain)))))
 
-(defun setup-cmd (numdisks raid)
+(defun setup-cmd (numdisks raid &optional mkfs-args mount-opts)
   "This is always the pre command for filesystem tests.
 
-It creates disks, runs mkfs on them, and mounts with FUSE."
+It creates disks, runs mkfs on them, and mounts with FUSE.
+MKFS-ARGS replace the default fs image arguments, MOUNT-OPTS are
+passed to wfs (see `mount-cmd')."
   (string-join
    (list
     "mkdir -p mnt; mkdir -p /tmp/$(whoami)"
     (create-disk-cmd numdisks "1M")
-    (concat "../solution/mkfs " (default-fs-mkfs-args raid numdisks))
-    (mount-cmd numdisks "mnt"))
+    (concat "../solution/mkfs " (or mkfs-args (default-fs-mkfs-args raid numdisks)))
+    (mount-cmd numdisks "mnt" mount-opts))
    " && ")) ; will stop and return pre-rc if anything goes wrong
 
 (defun teardown-cmd ()
@@ -231,15 +233,17 @@ It removes the test disks."
   (format "fusermount -uq mnt; rm -f %s"
 	  (disk-path "test-disk*")))
 
-(defun mount-cmd (numdisks dir)
+(defun mount-cmd (numdisks dir &optional opts)
   "Mount wfs using NUMDISKS disks in single-threaded mode on DIR.
 
 NUMDISKS the number of disks used for testing
-DIR the mount directory"
+DIR the mount directory
+OPTS wfs options such as \"--compress\", nil for none"
   (make-directory dir :parents)
   (format
-   "../solution/wfs %s -s %s"
+   "../solution/wfs %s%s -s %s"
    (string-join (gen-disks numdisks) " ")
+   (if opts (concat " " opts) "")
    dir))
 
 (defun umount-cmd (dir)
@@ -344,6 +348,49 @@ OUTPUT the expected output. Generally \"Correct\" or an error."
    output
    "0" rc "")) ; pre-rc should always be 0
 
+(defun filesystem-custom-workload
+    (desc mkfs-args mount-opts fs-state op post-state post-extra-blocks raid numdisks output rc)
+  "Test template for a workload on a filesystem made or mounted with options.
+
+Same as `filesystem-init-and-workload', with two more arguments.
+
+MKFS-ARGS the mkfs arguments, nil for the default fs image.
+MOUNT-OPTS the wfs options, nil for none."
+  (define-test
+   desc
+   (setup-cmd numdisks raid mkfs-args mount-opts)
+   (teardown-cmd)
+   (string-join
+    (list
+     (fs-state-cmds fs-state "d")
+     op
+     (umount-cmd "mnt")
+     (verify-metadata-cmd post-state post-extra-blocks numdisks))
+    " && ")
+   output
+   "0" rc "")) ; pre-rc should always be 0
+
+(defun filesystem-add-disk-workload
+    (desc fs-state op post-state post-extra-blocks raid numdisks newdisks output rc)
+  "Test template for a workload that adds disks to the mounted volume.
+
+Same as `filesystem-init-and-workload', the metadata is verified on
+the NUMDISKS disks the volume was made with and the NEWDISKS disks
+OP added after them."
+  (define-test
+   desc
+   (setup-cmd numdisks raid)
+   (teardown-cmd)
+   (string-join
+    (list
+     (fs-state-cmds fs-state "d")
+     op
+     (umount-cmd "mnt")
+     (verify-metadata-cmd post-state post-extra-blocks (+ numdisks newdisks)))
+    " && ")
+   output
+   "0" rc "")) ; pre-rc should always be 0
+
 (defun n-file-directory (n sz)
   (if (= n 0)
       nil
@@ -504,4 +551,191 @@ POST-BLOCKS additional blocks we should expect (e.g. no cleaning dir blocks)"
 			  (mount-cmd 3 "mnt")
 			  "diff mnt/file1 file1.test")
 		    "; ")
-		  ,'(("file1" . 1000)) 0 "1v" 3 "Correct\nCorrect\nCorrect" 0))))))
+		  ,'(("file1" . 1000)) 0 "1v" 3 "Correct\nCorrect\nCorrect" 0))))
+   ((testcase . ,#'filesystem-init-and-workload)
+    (configs . ,(gen-raid-test-with-fn
+		 #'filesystem-workload-success
+		 `(("statfs: free counts after create and rm" ,'()
+		    "./statfs-check.py" ; create a 1024-byte file and remove it
+		    ,'() 1 "Correct\nCorrect\nCorrect")) ; the dentry block stays
+		 `(("1" 2) ("0" 3)))))
+   ((testcase . ,#'filesystem-init-and-workload)
+    (configs . ,(gen-raid-test-with-fn
+		 #'filesystem-workload-success
+		 `(("rm: sparse directory is compacted" ,(n-file-directory 20 0)
+		    "./dentry-compact-check.py" ; rm file20 .. file6, wait, create file6
+		    ,(n-file-directory 6 0) 0 "Correct\nCorrect\nCorrect"))
+		 `(("1" 2) ("0" 3)))))
+   ((testcase . ,#'filesystem-custom-workload)
+;;    (desc mkfs-args mount-opts fs-state op post-state post-extra-blocks raid numdisks output rc)
+    (configs . (("raid1 -- readdir: resume across unlink" ,(make-mkfs-args "1" 2 128 200) nil
+		 ,'() "./readdir-resume.py" ; 100 entries, too many for one request
+		 ,(n-file-directory 90 0) 1 "1" 2 "Correct\nCorrect\nCorrect" 0) ; 7 dentry blocks
+		("raid0 -- readdir: resume across unlink" ,(make-mkfs-args "0" 3 128 200) nil
+		 ,'() "./readdir-resume.py"
+		 ,(n-file-directory 90 0) 1 "0" 3 "Correct\nCorrect\nCorrect" 0))))
+   ((testcase . ,#'filesystem-init-and-workload)
+    (configs . ,(gen-raid-test-with-fn
+		 #'filesystem-workload-success
+		 `(("snapshot: create, read and copy on write" ,'()
+		    "./snapshot-check.py" ; snapshot blocks are freed with the snapshot
+		    ,'(("file1" . 1000)) 0 "Correct\nCorrect\nCorrect"))
+		 `(("1" 2) ("0" 3)))))
+   ((testcase . ,#'filesystem-init-and-workload)
+    (configs . ,(gen-raid-test-with-fn
+		 #'filesystem-workload-success
+		 `(("clone: shared blocks and copy on write" ,'()
+		    "./clone-check.py" ; clone a 2048-byte file, write 100 bytes to the clone
+		    ,'(("file1" . 2048) ("file2" . 2048)) -3 "Correct\nCorrect\nCorrect")) ; 3 blocks still shared
+		 `(("1" 2) ("0" 3)))))
+   ((testcase . ,#'filesystem-custom-workload)
+;;    (desc mkfs-args mount-opts fs-state op post-state post-extra-blocks raid numdisks output rc)
+    (configs . (("raid1 -- compress: readback with and without --compress" nil "--compress"
+		 ,'() ,(string-join
+			(list "./compress-check.py write" ; an 8000-byte compressible file, 3000 random bytes
+			      "fusermount -u mnt"
+			      (mount-cmd 2 "mnt")
+			      "./compress-check.py read")
+			" && ")
+		 ,'(("file1" . 8000) ("file2" . 3000)) -12 "1" 2 "Correct\nCorrect\nCorrect\nCorrect" 0) ; file1 in 5 blocks, not 17
+		("raid0 -- compress: readback with and without --compress" nil "--compress"
+		 ,'() ,(string-join
+			(list "./compress-check.py write"
+			      "fusermount -u mnt"
+			      (mount-cmd 3 "mnt")
+			      "./compress-check.py read")
+			" && ")
+		 ,'(("file1" . 8000) ("file2" . 3000)) -12 "0" 3 "Correct\nCorrect\nCorrect\nCorrect" 0))))
+   ((testcase . ,#'filesystem-init-and-workload)
+    (configs . ,(gen-raid-test-with-fn
+		 #'filesystem-workload-success
+		 `(("sparse: SEEK_DATA, SEEK_HOLE and truncate holes" ,'()
+		    "./sparse-check.py" ; ends as a 3000-byte file holding its first block
+		    ,'(("file1" . 3000)) -5 "Correct\nCorrect\nCorrect"))
+		 `(("1" 2) ("0" 3)))))
+   ((testcase . ,#'filesystem-init-and-workload)
+;;    (desc fs-state op post-state post-extra-blocks raid numdisks output rc)
+    (configs . (("raid1 -- degraded mount and resync" ,'()
+		 ,(string-join
+		   (list "./read-write.py 1 10"
+			 "fusermount -u mnt"
+			 (format "../solution/wfs %s -s mnt" (disk-path "test-disk1")) ; disk2 is missing
+			 "./read-write.py 1 20" ; rewrite file1 while degraded
+			 "cat mnt/file1 > file1.test"
+			 "fusermount -u mnt"
+			 (format "./resync-check.py degraded --disks %s" (string-join (gen-disks 2) " "))
+			 (mount-cmd 2 "mnt") ; disk2 is back, its dirty regions are copied
+			 (format "./resync-check.py clean --disks %s" (string-join (gen-disks 2) " "))
+			 "diff mnt/file1 file1.test")
+		   " && ")
+		 ,'(("file1" . 2000)) 0 "1" 2
+		 "Correct\nCorrect\nWarning: mounting degraded, 1 of 2 disks present.\nCorrect\nCorrect\nCorrect\nCorrect" 0))))
+   ((testcase . ,#'filesystem-add-disk-workload)
+;;    (desc fs-state op post-state post-extra-blocks raid numdisks newdisks output rc)
+    (configs . (("raid1 -- add a disk and resync" ,'()
+		 ,(string-join
+		   (list "./read-write.py 1 50"
+			 "cat mnt/file1 > file1.test"
+			 (format "truncate -s 1M %s" (disk-path "test-disk3")) ; a blank image
+			 (format "../solution/wfs-add-disk mnt/file1 %s > /dev/null" (disk-path "test-disk3"))
+			 (format "./resync-check.py clean --disks %s" (string-join (gen-disks 3) " "))
+			 "fusermount -u mnt"
+			 (mount-cmd 3 "mnt")
+			 "diff mnt/file1 file1.test")
+		   " && ")
+		 ,'(("file1" . 5000)) 0 "1" 2 1 "Correct\nCorrect\nCorrect\nCorrect" 0)
+		("raid0 -- add a disk and reshape" ,'()
+		 ,(string-join
+		   (list "./read-write.py 1 50"
+			 "cat mnt/file1 > file1.test"
+			 (format "truncate -s 1M %s" (disk-path "test-disk4"))
+			 (format "../solution/wfs-add-disk mnt/file1 %s > /dev/null" (disk-path "test-disk4"))
+			 (format "./resync-check.py clean --disks %s" (string-join (gen-disks 4) " "))
+			 "fusermount -u mnt"
+			 (mount-cmd 4 "mnt")
+			 "diff mnt/file1 file1.test")
+		   " && ")
+		 ,'(("file1" . 5000)) 0 "0" 3 1 "Correct\nCorrect\nCorrect\nCorrect" 0))))
+   ((testcase . ,#'filesystem-init-and-workload)
+;;    (desc fs-state op post-state post-extra-blocks raid numdisks output rc)
+    (configs . (("raid1 -- grow to 64 inodes and 416 blocks" ,'()
+		 ,(string-join
+		   (list "./read-write.py 1 10"
+			 (create-disk-cmd 2 "2M")
+			 "../solution/wfs-grow -i 64 -b 400 mnt/file1"
+			 "./read-write.py 41 30" ; past the 32 inodes and 224 blocks of mkfs
+			 "cat mnt/file41 > file41.test"
+			 "fusermount -u mnt"
+			 (mount-cmd 2 "mnt")
+			 "diff mnt/file41 file41.test")
+		   " && ")
+		 ,(n-file-directory 41 3000) 65 "1" 2
+		 "Correct\nCorrect\n64 inodes, 416 data blocks per disk\nCorrect" 0) ; 65 blocks per disk hold the moved inode table and bitmap
+		("raid0 -- grow to 64 inodes and 416 blocks" ,'()
+		 ,(string-join
+		   (list "./read-write.py 1 10"
+			 (create-disk-cmd 3 "2M")
+			 "../solution/wfs-grow -i 64 -b 400 mnt/file1"
+			 "./read-write.py 41 30"
+			 "cat mnt/file41 > file41.test"
+			 "fusermount -u mnt"
+			 (mount-cmd 3 "mnt")
+			 "diff mnt/file41 file41.test")
+		   " && ")
+		 ,(n-file-directory 41 3000) 195 "0" 3
+		 "Correct\nCorrect\n64 inodes, 416 data blocks per disk\nCorrect" 0))))
+   ((testcase . ,#'filesystem-init-and-workload)
+;;    (desc fs-state op post-state post-extra-blocks raid numdisks output rc)
+    (configs . (("raid1 -- convert to raid0 and back" ,'()
+		 ,(string-join
+		   (list "./read-write.py 3 20"
+			 "cat mnt/file2 > file2.test"
+			 "fusermount -u mnt"
+			 (format "../solution/wfs-convert -r 0 %s | cut -d, -f1" (string-join (gen-disks 2) " ")) ; the blocks moved depend on placement
+			 (mount-cmd 2 "mnt")
+			 "diff mnt/file2 file2.test"
+			 "fusermount -u mnt"
+			 (let ((raid "0")) (verify-metadata-cmd (n-file-directory 3 2000) 0 2))
+			 (format "../solution/wfs-convert -r 1 %s | cut -d, -f1" (string-join (gen-disks 2) " "))
+			 (mount-cmd 2 "mnt")
+			 "diff mnt/file2 file2.test")
+		   " && ")
+		 ,(n-file-directory 3 2000) 0 "1" 2
+		 "Correct\nCorrect\nconverted RAID1 -> RAID0\nCorrect\nconverted RAID0 -> RAID1\nCorrect" 0)
+		("raid0 -- convert to raid1 and back" ,'()
+		 ,(string-join
+		   (list "./read-write.py 3 20"
+			 "cat mnt/file2 > file2.test"
+			 "fusermount -u mnt"
+			 (format "../solution/wfs-convert -r 1 %s | cut -d, -f1" (string-join (gen-disks 3) " "))
+			 (mount-cmd 3 "mnt")
+			 "diff mnt/file2 file2.test"
+			 "fusermount -u mnt"
+			 (let ((raid "1")) (verify-metadata-cmd (n-file-directory 3 2000) 0 3))
+			 (format "../solution/wfs-convert -r 0 %s | cut -d, -f1" (string-join (gen-disks 3) " "))
+			 (mount-cmd 3 "mnt")
+			 "diff mnt/file2 file2.test")
+		   " && ")
+		 ,(n-file-directory 3 2000) 0 "0" 3
+		 "Correct\nCorrect\nconverted RAID0 -> RAID1\nCorrect\nconverted RAID1 -> RAID0\nCorrect" 0))))
+   ((testcase . ,#'filesystem-custom-workload)
+;;    (desc mkfs-args mount-opts fs-state op post-state post-extra-blocks raid numdisks output rc)
+    (configs . (("raid1v -- quorum writes, then a scrub repairs a cleared disk" nil "--mirror-quorum=majority"
+		 ,'() ,(string-join
+			(list "./read-write.py 2 100" ; 8192-byte writes fan out to the mirrors
+			      "cat mnt/file1 > file1.test"
+			      "fusermount -u mnt"
+			      (format "./corrupt-disk.py --disks %s" (disk-path "test-disk1"))
+			      (mount-cmd 3 "mnt" "--mirror-quorum=majority")
+			      "./scrub-check.py mnt/file1"
+			      "fusermount -u mnt"
+			      (let ((raid "1")) (verify-metadata-cmd (n-file-directory 2 10000) 0 3)) ; the copies are identical again
+			      (mount-cmd 3 "mnt" "--mirror-quorum=majority")
+			      "diff mnt/file1 file1.test")
+			" && ")
+		 ,(n-file-directory 2 10000) 0 "1v" 3 "Correct\nCorrect\nCorrect\nCorrect\nCorrect" 0))))
+   ((testcase . ,#'filesystem-init-and-workload)
+;;    (desc fs-state op post-state post-extra-blocks raid numdisks output rc)
+    (configs . (("raid1 -- clone: a write to a shared block on a full disk fails" ,'()
+		 "./clone-enospc-check.py" ; raid0 may still have room on the disk the block is on
+		 ,'(("file1" . 2048) ("file2" . 2048)) -4 "1" 2 "Correct\nCorrect\nCorrect" 0))))))
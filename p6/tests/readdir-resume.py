@@ -0,0 +1,42 @@
+#!/usr/bin/python3
+
+# list a directory too large for one readdir request and remove entries
+# while the listing is under way, the kernel resumes it from the offset
+# of the last entry it got: no entry may be skipped or returned twice
+
+import os
+
+numfiles = 100
+filelist = [f"readdir-resume-entry-{n:03d}" for n in range(numfiles)]
+removelist = [name for n, name in enumerate(filelist) if n % 10 == 5]
+keeplist = [name for name in filelist if name not in removelist]
+
+os.chdir("mnt")
+
+for name in filelist:
+    os.mknod(name)
+
+foundfiles = []
+with os.scandir(".") as entries:
+    for entry in entries:
+        # the first request returned a batch, the rest comes after the removes
+        if not foundfiles:
+            for name in removelist:
+                os.remove(name)
+        foundfiles.append(entry.name)
+
+if len(foundfiles) != len(set(foundfiles)):
+    print("readdir returned an entry twice")
+    exit(1)
+
+missing = [name for name in keeplist if name not in foundfiles]
+if missing:
+    print(f"readdir skipped {missing}")
+    exit(1)
+
+if sorted(os.listdir(".")) != sorted(keeplist):
+    print("readdir files don't match expectation")
+    exit(1)
+
+print("Correct")
+exit(0)
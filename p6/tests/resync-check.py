@@ -0,0 +1,58 @@
+#!/usr/bin/python3
+
+# usage: resync-check.py degraded|clean --disks disk ...
+# degraded: the first disk was mounted alone, it records the others as
+#           missing and marks only the regions written meanwhile in its
+#           write-intent bitmap, the others are untouched
+# clean: waits for the resync of a mirror or the reshape of a RAID0
+#        volume to bring every disk up to date
+
+import argparse
+import time
+import wfsverify
+
+WI_REGIONS = 1024
+
+def raid_fields(disk):
+    return wfsverify.WfsState(disk).read_superblock_ext()
+
+def dirty_regions(fields):
+    return bin(fields['wi_bitmap']).count("1")
+
+def check_degraded(disks):
+    present = raid_fields(disks[0])
+    missing = sum(1 << raid_fields(disk)['disk_order'] for disk in disks[1:])
+    if present['missing_disks'] != missing:
+        print(f"missing disks {present['missing_disks']:#x} expected {missing:#x} [{disks[0]}]")
+        exit(1)
+    if not 0 < dirty_regions(present) < WI_REGIONS:
+        print(f"{dirty_regions(present)} dirty regions, expected only the ones written [{disks[0]}]")
+        exit(1)
+    for disk in disks[1:]:
+        fields = raid_fields(disk)
+        if fields['missing_disks'] != 0 or dirty_regions(fields) != 0:
+            print(f"missing disk changed while it was away [{disk}]")
+            exit(1)
+
+def check_clean(disks):
+    # the resync and the reshape run on their own thread, give them a few seconds
+    for tries in range(100):
+        fields = [raid_fields(disk) for disk in disks]
+        if all(f['missing_disks'] == 0 and dirty_regions(f) == 0 and f['reshape_old_disks'] == 0 for f in fields):
+            return
+        time.sleep(0.1)
+    print("resync or reshape did not finish")
+    exit(1)
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument("mode", help="degraded or clean")
+    parser.add_argument("--disks", nargs="+", help="list of disks")
+
+    args = parser.parse_args()
+
+    if args.mode == 'degraded':
+        check_degraded(args.disks)
+    else:
+        check_clean(args.disks)
+    print("Correct")
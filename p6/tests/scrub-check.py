@@ -0,0 +1,43 @@
+#!/usr/bin/python3
+
+# usage: scrub-check.py <file in the mount>
+# starts a scrub pass with wfs-scrub -s and waits for it, the data blocks
+# of one disk were cleared while unmounted, so the pass must rewrite them
+# from the majority of the mirrors and find no block without one
+
+import re
+import subprocess
+import sys
+import time
+
+def scrub(path, start=False):
+    cmd = ["../solution/wfs-scrub"] + (["-s"] if start else []) + [path]
+    res = subprocess.run(cmd, capture_output=True, text=True)
+    if res.returncode != 0:
+        print(res.stdout + res.stderr, end="")
+        exit(1)
+    return res.stdout
+
+path = sys.argv[1]
+report = scrub(path, start=True)
+
+# the pass runs on its own thread, give it a few seconds
+for tries in range(100):
+    if report.startswith("idle"):
+        break
+    time.sleep(0.1)
+    report = scrub(path)
+else:
+    print("scrub pass did not finish")
+    exit(1)
+
+m = re.search(r"(\d+) passes, (\d+) scrubbed, (\d+) repaired, (\d+) without majority", report)
+(passes, scrubbed, repaired, conflicts) = (int(n) for n in m.groups())
+if passes == 0 or repaired == 0:
+    print(f"{passes} passes repaired {repaired} copies, expected the cleared disk to be rewritten")
+    exit(1)
+if conflicts != 0:
+    print(f"{conflicts} blocks without majority, expected none")
+    exit(1)
+
+print("Correct")
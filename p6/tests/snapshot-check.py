@@ -0,0 +1,54 @@
+#!/usr/bin/python3
+
+# a snapshot keeps the contents a file had when it was taken,
+# a write to the live file copies the shared blocks first
+
+import errno
+import os
+
+data = os.urandom(1000)
+newdata = os.urandom(600)
+
+os.chdir("mnt")
+
+with open("file1", "wb") as f:
+    f.write(data)
+
+os.mkdir(".snapshots/s1")
+
+with open(".snapshots/s1/file1", "rb") as f:
+    if f.read() != data:
+        print("snapshot does not match the file it was taken from")
+        exit(1)
+
+# overwrite the first two blocks of the live file
+with open("file1", "r+b") as f:
+    f.write(newdata)
+
+with open("file1", "rb") as f:
+    if f.read() != newdata + data[600:]:
+        print("file1 readback does not match data written")
+        exit(1)
+
+with open(".snapshots/s1/file1", "rb") as f:
+    if f.read() != data:
+        print("snapshot changed with the live file")
+        exit(1)
+
+# the snapshot is read-only
+try:
+    open(".snapshots/s1/file1", "r+b")
+    print("snapshot file opened for writing")
+    exit(1)
+except OSError as e:
+    if e.errno != errno.EROFS:
+        print(e)
+        exit(1)
+
+os.rmdir(".snapshots/s1")
+if os.path.exists(".snapshots/s1"):
+    print("snapshot not dropped")
+    exit(1)
+
+print("Correct")
+exit(0)
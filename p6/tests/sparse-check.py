@@ -0,0 +1,68 @@
+#!/usr/bin/python3
+
+# holes read as zeros and take no blocks, SEEK_DATA / SEEK_HOLE find them
+# FUSE 2 does not forward lseek, wfs takes it as the WFS_IOC_SEEK ioctl
+
+import errno
+import fcntl
+import os
+import struct
+
+SEEK_DATA = 3
+SEEK_HOLE = 4
+WFS_IOC_SEEK = 0xC0105702 # _IOWR('W', 2, struct wfs_seek)
+
+def seek(f, offset, whence):
+    """Return the data or hole found from offset, -1 for ENXIO."""
+    buf = bytearray(struct.pack("qi4x", offset, whence))
+    try:
+        fcntl.ioctl(f.fileno(), WFS_IOC_SEEK, buf)
+    except OSError as e:
+        if e.errno == errno.ENXIO:
+            return -1
+        raise
+    return struct.unpack("qi4x", buf)[0]
+
+def expect(what, found, expected):
+    if found != expected:
+        print(f"{what}: found {found} expected {expected}")
+        exit(1)
+
+os.chdir("mnt")
+
+# data in blocks 0 and 11, the extending truncate leaves the rest a hole
+with open("file1", "wb") as f:
+    f.write(b'x' * 100)
+    f.truncate(8192)
+    f.seek(6000)
+    f.write(b'y' * 100)
+
+expect("st_size", os.stat("file1").st_size, 8192)
+expect("st_blocks", os.stat("file1").st_blocks, 3) # the indirect block too
+
+with open("file1", "rb") as f:
+    expect("SEEK_DATA from 0", seek(f, 0, SEEK_DATA), 0)
+    expect("SEEK_HOLE from 0", seek(f, 0, SEEK_HOLE), 512)
+    expect("SEEK_DATA from 512", seek(f, 512, SEEK_DATA), 5632)
+    expect("SEEK_HOLE from 5632", seek(f, 5632, SEEK_HOLE), 6144)
+    expect("SEEK_DATA from 6144", seek(f, 6144, SEEK_DATA), -1)
+    expect("SEEK_HOLE from 7000", seek(f, 7000, SEEK_HOLE), 7000)
+    if f.read() != b'x' * 100 + bytes(5900) + b'y' * 100 + bytes(2092):
+        print("file1 readback does not match data written")
+        exit(1)
+
+# shrinking zeros the tail of the last block, growing again reads zeros
+os.truncate("file1", 50)
+os.truncate("file1", 3000)
+
+expect("st_blocks", os.stat("file1").st_blocks, 1)
+
+with open("file1", "rb") as f:
+    expect("SEEK_HOLE from 0", seek(f, 0, SEEK_HOLE), 512)
+    expect("SEEK_DATA from 512", seek(f, 512, SEEK_DATA), -1)
+    if f.read() != b'x' * 50 + bytes(2950):
+        print("file1 readback after truncate does not match")
+        exit(1)
+
+print("Correct")
+exit(0)
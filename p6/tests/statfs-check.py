@@ -0,0 +1,31 @@
+#!/usr/bin/python3
+
+# statfs free counts follow a create and a remove
+# the file takes an inode and two data blocks, the first entry of the
+# root directory a dentry block that stays allocated after the remove
+
+import os
+
+def free_counts():
+    st = os.statvfs("mnt")
+    return (st.f_ffree, st.f_bfree)
+
+(inodes, blocks) = free_counts()
+
+with open("mnt/file1", "wb") as f:
+    f.write(b'a' * 1024)
+
+(created_inodes, created_blocks) = free_counts()
+if created_inodes != inodes - 1 or created_blocks != blocks - 3:
+    print(f"after create: free inodes {created_inodes} blocks {created_blocks}, expected {inodes - 1} and {blocks - 3}")
+    exit(1)
+
+os.remove("mnt/file1")
+
+(removed_inodes, removed_blocks) = free_counts()
+if removed_inodes != inodes or removed_blocks != blocks - 1:
+    print(f"after remove: free inodes {removed_inodes} blocks {removed_blocks}, expected {inodes} and {blocks - 1}")
+    exit(1)
+
+print("Correct")
+exit(0)
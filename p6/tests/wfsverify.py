@@ -4,6 +4,13 @@ class WfsState:
     blksize = 512
     superblock = [('inodes', 8), ('datablocks', 8), ('ibit', 8), ('dbit', 8),
                   ('iblocks', 8), ('dblocks', 8)]
+    # fields after the ones above, see struct wfs_sb (pad aligns free_inodes)
+    superblock_ext = [('raid_mode', 4), ('disk_order', 4), ('total_disks', 4),
+                      ('magic', 4), ('version', 4), ('pad', 4),
+                      ('free_inodes', 8), ('free_datablocks', 8), ('snap_head', 8),
+                      ('groups', 4), ('inode_copies', 4), ('meta_disks', 4),
+                      ('missing_disks', 4), ('wi_bitmap', 128),
+                      ('reshape_old_disks', 4), ('reshape_inode', 4), ('disk_blocks', 4)]
     inode = [('num', 4), ('mode', 4), ('uid', 4), ('gid', 4), ('size', 8),
              ('nlinks', 8), ('atim', 8), ('mtim', 8), ('ctim', 8), ('blocks', 64)]
 
@@ -54,6 +61,10 @@ class WfsState:
         """Read a superblock from disk and return a dict of its fields."""
         return self.read_struct(0, self.superblock)
 
+    def read_superblock_ext(self):
+        """Read the superblock fields that follow the layout ones."""
+        return self.read_struct(self.get_sb_size(), self.superblock_ext)
+
     def read_inode_region(self):
         """Read and return the entire inode region of the disk."""
         with open(self.disk, "rb") as diskf: